@@ -216,16 +216,25 @@ static struct entry_filter_s {
 
 // globals
 extern uint32_t	twin_first, twin_last;
+extern char	*CurrentIdent;
 
 static char		*first_file, *last_file;
 static char		*current_file = NULL;
 static stringlist_t source_dirs, file_list;
+static int			file_cnt;
+
+// next file in list, opened ahead, if read ahead is enabled
+static nffile_t		*next_nffile = NULL;
+static char			*next_file	 = NULL;
+static int			next_open	 = 0;
 
 /* Function prototypes */
 static inline int CheckTimeWindow(uint32_t t_start, uint32_t t_end, stat_record_t *stat_record);
 
 static void GetFileList(char *path);
 
+static int OpenNextFile(nffile_t **nffile, char **filename, time_t twin_start, time_t twin_end);
+
 static void CleanPath(char *entry);
 
 static void Getsource_dirs(char *dirs);
@@ -992,8 +1001,41 @@ char *GetCurrentFilename(void) {
 	return current_file;
 } // End of GetCurrentFilename
 
+static int OpenNextFile(nffile_t **nffile, char **filename, time_t twin_start, time_t twin_end) {
+nffile_t *next;
+
+	while ( file_cnt < file_list.num_strings ) {
+#ifdef DEVEL
+		printf("Process: '%s'\n", file_list.list[file_cnt] ? file_list.list[file_cnt] : "<stdin>");
+#endif
+		next = OpenFile(file_list.list[file_cnt], *nffile);	// Open the file
+		if ( !next ) {
+			return -1;
+		}
+		*nffile = next;
+		*filename = file_list.list[file_cnt];
+		file_cnt++;
+
+		// stdin
+		if ( next->fd == STDIN_FILENO ) {
+			*filename = NULL;
+			return 1;
+		}
+
+		if ( CheckTimeWindow(twin_start, twin_end, next->stat_record) ) {
+			// printf("Return file: %s\n", string);
+			return 1;
+		} 
+		CloseFile(next);
+	}
+
+	*filename = NULL;
+	return 0;
+
+} // End of OpenNextFile
+
 nffile_t *GetNextFile(nffile_t *nffile, time_t twin_start, time_t twin_end) {
-static int cnt;
+int ret;
 
 	// close current file before open the next one
 	// stdin ( current = 0 ) is not closed
@@ -1001,46 +1043,74 @@ static int cnt;
 		CloseFile(nffile);
 		current_file = NULL;
 	} else {
-		// is it first time init ?
-		cnt  = 0;
+		// is it first time init ? A file opened ahead of a previous list is left over
+		file_cnt  = 0;
+		if ( next_nffile ) {
+			if ( next_open > 0 ) 
+				CloseFile(next_nffile);
+			DisposeFile(next_nffile);
+			next_nffile = NULL;
+		}
+		next_open = 0;
 	}
 
-	// no or no more files available
-	if ( file_list.num_strings == cnt ) {
-		current_file = NULL;
-		return EMPTY_LIST;
+	if ( next_open > 0 ) {
+		// the next file is already open and read ahead - take it over
+		nffile_t tmp = *nffile;
+		*nffile 	 = *next_nffile;
+		*next_nffile = tmp;
+		current_file = next_file;
+		CurrentIdent = nffile->file_header->ident;
+		ret = 1;
+	} else if ( next_open < 0 ) {
+		// opening the next file ahead failed
+		ret = -1;
+	} else {
+		ret = OpenNextFile(&nffile, &current_file, twin_start, twin_end);
 	}
-	
+	next_open = 0;
 
-	while ( cnt < file_list.num_strings ) {
-#ifdef DEVEL
-		printf("Process: '%s'\n", file_list.list[cnt] ? file_list.list[cnt] : "<stdin>");
-#endif
-		nffile = OpenFile(file_list.list[cnt], nffile);	// Open the file
-		if ( !nffile ) {
-			return NULL;
-		}
-		current_file = file_list.list[cnt];
-		cnt++;
-
-		// stdin
-		if ( nffile->fd == STDIN_FILENO ) {
-			current_file = NULL;
-			return nffile;
+	if ( ret <= 0 ) {
+		// no or no more files available
+		current_file = NULL;
+		if ( next_nffile ) {
+			DisposeFile(next_nffile);
+			next_nffile = NULL;
 		}
+		return ret == 0 ? EMPTY_LIST : NULL;
+	}
 
-		if ( CheckTimeWindow(twin_start, twin_end, nffile->stat_record) ) {
-			// printf("Return file: %s\n", string);
-			return nffile;
-		} 
-		CloseFile(nffile);
+	// with read ahead enabled, open the following file already now, 
+	// so reading its blocks overlaps with processing the current file
+	if ( GetReadAhead() && nffile->fd != STDIN_FILENO ) {
+		next_open = OpenNextFile(&next_nffile, &next_file, twin_start, twin_end);
+		// OpenFile() sets the ident of the file opened last
+		CurrentIdent = nffile->file_header->ident;
 	}
 
-	current_file = NULL;
-	return EMPTY_LIST;
+	return nffile;
 
 } // End of GetNextFile
 
+nffile_t *OpenNextInputFile(char **filename, time_t twin_start, time_t twin_end) {
+nffile_t *nffile;
+int ret;
+
+	// each file gets its own nffile, as the files of the list are processed in parallel
+	nffile = NULL;
+	ret = OpenNextFile(&nffile, filename, twin_start, twin_end);
+	if ( ret <= 0 ) {
+		// a file struct of files outside the time window is left over
+		if ( nffile )
+			DisposeFile(nffile);
+		*filename = NULL;
+		return ret == 0 ? EMPTY_LIST : NULL;
+	}
+
+	return nffile;
+
+} // End of OpenNextInputFile
+
 
 int InitHierPath(int num) {
 int i;
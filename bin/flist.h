@@ -48,4 +48,6 @@ int SetupSubDir(char *dir, char *subdir, char *error, size_t errlen );
 
 nffile_t *GetNextFile(nffile_t *nffile, time_t twin_start, time_t twin_end);
 
+nffile_t *OpenNextInputFile(char **filename, time_t twin_start, time_t twin_end);
+
 #endif //_FLIST_H
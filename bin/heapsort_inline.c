@@ -37,6 +37,25 @@ static inline void siftDown(SortElement_t *SortElement, uint32_t root, uint32_t
 
 static inline void siftUp(SortElement_t *SortElement, uint32_t numbersSize, uint32_t node);
 
+/*
+ * Streaming top N selection: with size < number of elements, the list holds at most size 
+ * elements as a heap with the element, which drops out next, at the root. Only the
+ * remaining elements get sorted by topNSort().
+ */
+typedef struct topN_s {
+	SortElement_t	*list;
+	uint32_t		num;		// number of elements in list
+	uint32_t		size;		// max number of elements in list
+	int				direction;
+	int				heap;		// list is a heap
+} topN_t;
+
+static inline int topNInit(topN_t *topN, uint32_t size, uint32_t maxnum, int direction);
+
+static inline void topNAdd(topN_t *topN, uint64_t count, void *record);
+
+static inline void topNSort(topN_t *topN);
+
 static void heapSort(SortElement_t *SortElement, uint32_t array_size, int topN, int direction) {
 int32_t	i, maxindex;
 
@@ -115,3 +134,65 @@ uint32_t i, parent, child;
         }
     }
 } // End of siftUp
+
+static inline int topNInit(topN_t *topN, uint32_t size, uint32_t maxnum, int direction) {
+
+	// size == 0 -> keep all elements
+	if ( size == 0 || size > maxnum )
+		size = maxnum;
+
+	topN->num		= 0;
+	topN->size		= size;
+	topN->direction = direction;
+	topN->heap		= 0;
+	topN->list = (SortElement_t *)calloc(size ? size : 1, sizeof(SortElement_t));
+
+	return topN->list != NULL;
+
+} // End of topNInit
+
+static inline void topNAdd(topN_t *topN, uint64_t count, void *record) {
+SortElement_t *list = topN->list;
+int32_t	i;
+
+	if ( topN->num < topN->size ) {
+		list[topN->num].count  = count;
+		list[topN->num].record = record;
+		topN->num++;
+		return;
+	}
+
+	// list full: DESCENDING keeps the largest elements in a min heap, ASCENDING the smallest in a max heap
+	if ( topN->direction == DESCENDING ) {
+		if ( !topN->heap ) {
+			for ( i = topN->size - 1; i >= 0; i-- )
+				siftUp(list, topN->size, i);
+			topN->heap = 1;
+		}
+		if ( count > list[0].count ) {
+			list[0].count  = count;
+			list[0].record = record;
+			siftUp(list, topN->size, 0);
+		}
+	} else {
+		if ( !topN->heap ) {
+			for ( i = topN->size - 1; i >= 0; i-- )
+				siftDown(list, topN->size, i);
+			topN->heap = 1;
+		}
+		if ( count < list[0].count ) {
+			list[0].count  = count;
+			list[0].record = record;
+			siftDown(list, topN->size, 0);
+		}
+	}
+
+} // End of topNAdd
+
+static inline void topNSort(topN_t *topN) {
+
+	// Sorting makes only sense, when 2 or more elements are left
+	if ( topN->num >= 2 )
+		heapSort(topN->list, topN->num, 0, topN->direction);
+
+} // End of topNSort
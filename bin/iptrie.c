@@ -0,0 +1,324 @@
+/*
+ *  Copyright (c) 2026, The nfdump contributors
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without 
+ *  modification, are permitted provided that the following conditions are met:
+ *  
+ *   * Redistributions of source code must retain the above copyright notice, 
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright notice, 
+ *     this list of conditions and the following disclaimer in the documentation 
+ *     and/or other materials provided with the distribution.
+ *   * Neither the name of the author nor the names of its contributors may be 
+ *     used to endorse or promote products derived from this software without 
+ *     specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *  
+ */
+
+/*
+ * Compiled IP lists for the filter engine.
+ * An IP list of the filter may hold several 100k addresses and prefixes. The list is
+ * compiled into a multibit trie with bitmap nodes ( see Poptrie, Asai et al. 2015 ):
+ * each node covers TRIE_STRIDE bits of the address and is 24 bytes, the children of a
+ * node are stored in a row and are found by counting the child bits below the index.
+ * A lookup is at most 6 nodes for IPv4 and 22 nodes for IPv6, independant of the 
+ * number of prefixes. Prefixes are expanded into the leaf bits of the node, where they 
+ * end, so no backtracking is needed. Large tries start with a table for the first 16 
+ * bits, which saves the upper levels. IPv4 addresses are kept in a trie of their own.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "util.h"
+#include "iptrie.h"
+
+typedef struct prefix_s {
+	uint64_t	key[2];		// prefix left aligned in 128 bits
+	uint32_t	len;		// prefix length
+} prefix_t;
+
+typedef struct trie_build_s {
+	trie_node_t	*node;
+	uint32_t	numnodes;
+	uint32_t	maxnodes;
+} trie_build_t;
+
+#if defined(__GNUC__)
+#define PopCount(x) __builtin_popcountll(x)
+#else
+static inline uint32_t PopCount(uint64_t x) {
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (uint32_t)((x * 0x0101010101010101ULL) >> 56);
+} // End of PopCount
+#endif
+
+/* TRIE_STRIDE bits of the key at bit pos - beyond bit 127 the key is 0 */
+static inline uint32_t KeyChunk(const uint64_t *key, uint32_t pos) {
+
+	if ( pos <= 58 )
+		return (key[0] >> (58 - pos)) & 0x3f;
+	if ( pos < 64 ) 
+		return ((key[0] << (pos - 58)) | (key[1] >> (122 - pos))) & 0x3f;
+	if ( pos <= 122 )
+		return (key[1] >> (122 - pos)) & 0x3f;
+	return (key[1] << (pos - 122)) & 0x3f;
+
+} // End of KeyChunk
+
+static int PrefixCMP(const void *p1, const void *p2) {
+const prefix_t *e1 = (const prefix_t *)p1;
+const prefix_t *e2 = (const prefix_t *)p2;
+
+	if ( e1->key[0] != e2->key[0] ) 
+		return e1->key[0] < e2->key[0] ? -1 : 1;
+	if ( e1->key[1] != e2->key[1] ) 
+		return e1->key[1] < e2->key[1] ? -1 : 1;
+	if ( e1->len != e2->len ) 
+		return e1->len < e2->len ? -1 : 1;
+	return 0;
+
+} // End of PrefixCMP
+
+static uint32_t NewNodes(trie_build_t *build, uint32_t num) {
+uint32_t base = build->numnodes;
+
+	if ( (build->numnodes + num) > build->maxnodes ) {
+		trie_node_t *node;
+		uint32_t maxnodes = build->maxnodes ? 2 * build->maxnodes : 64;
+		while ( (build->numnodes + num) > maxnodes ) 
+			maxnodes *= 2;
+		node = (trie_node_t *)realloc(build->node, maxnodes * sizeof(trie_node_t));
+		if ( !node ) {
+			LogError("realloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		build->node 	= node;
+		build->maxnodes = maxnodes;
+	}
+	memset((void *)&build->node[base], 0, num * sizeof(trie_node_t));
+	build->numnodes += num;
+
+	return base;
+
+} // End of NewNodes
+
+/*
+ * Build node index from the sorted prefixes, which share the first pos bits. 
+ * The children of the node are allocated at once, before any of them is built.
+ */
+static void BuildNode(trie_build_t *build, uint32_t index, prefix_t *prefix, uint32_t num, uint32_t pos) {
+uint64_t leaf, child;
+uint32_t i, base;
+
+	leaf  = 0;
+	child = 0;
+	for ( i=0; i<num; i++ ) {
+		uint32_t chunk = KeyChunk(prefix[i].key, pos);
+		if ( prefix[i].len <= (pos + TRIE_STRIDE) ) {
+			// prefix ends in this node - expand it
+			uint32_t span = 1 << (pos + TRIE_STRIDE - prefix[i].len);
+			leaf |= (span == 64 ? 0xffffffffffffffffULL : ((1ULL << span) - 1) << (chunk & ~(span - 1)));
+		} else {
+			child |= 1ULL << chunk;
+		}
+	}
+	// a longer prefix below a leaf adds nothing
+	child &= ~leaf;
+
+	base = NewNodes(build, PopCount(child));
+	// build->node may be moved
+	build->node[index].leaf  = leaf;
+	build->node[index].child = child;
+	build->node[index].base  = base;
+
+	// the prefixes of a child are in a row, as the prefixes are sorted
+	i = 0;
+	while ( i < num ) {
+		uint32_t chunk = KeyChunk(prefix[i].key, pos);
+		uint32_t first = i;
+		while ( i < num && KeyChunk(prefix[i].key, pos) == chunk ) 
+			i++;
+		if ( child & (1ULL << chunk) ) {
+			uint32_t node = base + PopCount(child & ((1ULL << chunk) - 1));
+			BuildNode(build, node, &prefix[first], i - first, pos + TRIE_STRIDE);
+		}
+	}
+
+} // End of BuildNode
+
+static void BuildTrie(trie_t *trie, prefix_t *prefix, uint32_t num) {
+trie_build_t build;
+uint32_t i;
+
+	memset((void *)&build, 0, sizeof(build));
+	qsort(prefix, num, sizeof(prefix_t), PrefixCMP);
+	trie->numprefixes = num;
+
+	if ( num < TRIE_DIRECT_MIN ) {
+		NewNodes(&build, 1);
+		BuildNode(&build, 0, prefix, num, 0);
+		trie->direct   = NULL;
+		trie->node	   = build.node;
+		trie->numnodes = build.numnodes;
+		return;
+	}
+
+	// table for the first TRIE_DIRECT_BITS bits, the nodes start below
+	trie->direct = (uint32_t *)calloc(1 << TRIE_DIRECT_BITS, sizeof(uint32_t));
+	if ( !trie->direct ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	i = 0;
+	while ( i < num ) {
+		uint32_t index = prefix[i].key[0] >> (64 - TRIE_DIRECT_BITS);
+		uint32_t first = i;
+		if ( prefix[i].len <= TRIE_DIRECT_BITS ) {
+			// prefix ends in the table - expand it
+			uint32_t span = 1 << (TRIE_DIRECT_BITS - prefix[i].len);
+			uint32_t j;
+			for ( j=0; j<span; j++ ) 
+				trie->direct[index + j] = TRIE_LEAF;
+			i++;
+			continue;
+		}
+		while ( i < num && (prefix[i].key[0] >> (64 - TRIE_DIRECT_BITS)) == index ) 
+			i++;
+		if ( trie->direct[index] == 0 ) {
+			uint32_t node = NewNodes(&build, 1);
+			trie->direct[index] = node + 1;
+			BuildNode(&build, node, &prefix[first], i - first, TRIE_DIRECT_BITS);
+		}
+	}
+	trie->node	   = build.node;
+	trie->numnodes = build.numnodes;
+
+} // End of BuildTrie
+
+/*
+ * Compile num addresses with masks into a trie. The 128 bit addresses and masks
+ * are given as pairs of uint64_t, as in the IP list of the filter. An IPv4 address 
+ * is ::a.b.c.d with a mask of at least 96 bits.
+ */
+iptrie_t *NewIPTrie(uint64_t *ip, uint64_t *mask, uint32_t num) {
+iptrie_t *trie;
+prefix_t *v4, *v6;
+uint32_t i, numv4, numv6;
+
+	trie = (iptrie_t *)calloc(1, sizeof(iptrie_t));
+	v4	 = (prefix_t *)malloc((num + 1) * sizeof(prefix_t));
+	v6	 = (prefix_t *)malloc((num + 1) * sizeof(prefix_t));
+	if ( !trie || !v4 || !v6 ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	numv4 = 0;
+	numv6 = 0;
+	for ( i=0; i<num; i++ ) {
+		uint64_t hi = ip[2*i]   & mask[2*i];
+		uint64_t lo = ip[2*i+1] & mask[2*i+1];
+		uint32_t len = PopCount(mask[2*i]) + PopCount(mask[2*i+1]);
+		if ( len >= 96 && hi == 0 && (lo >> 32) == 0 ) {
+			v4[numv4].key[0] = lo << 32;
+			v4[numv4].key[1] = 0;
+			v4[numv4].len	 = len - 96;
+			numv4++;
+		} else {
+			v6[numv6].key[0] = hi;
+			v6[numv6].key[1] = lo;
+			v6[numv6].len	 = len;
+			numv6++;
+		}
+	}
+
+	BuildTrie(&trie->v4, v4, numv4);
+	BuildTrie(&trie->v6, v6, numv6);
+
+	free(v4);
+	free(v6);
+
+	return trie;
+
+} // End of NewIPTrie
+
+void DisposeIPTrie(iptrie_t *trie) {
+
+	if ( !trie ) 
+		return;
+	free(trie->v4.direct);
+	free(trie->v4.node);
+	free(trie->v6.direct);
+	free(trie->v6.node);
+	free(trie);
+
+} // End of DisposeIPTrie
+
+static inline int TrieLookup(trie_t *trie, const uint64_t *key) {
+trie_node_t *node = trie->node;
+uint32_t pos = 0;
+
+	if ( trie->direct ) {
+		uint32_t entry = trie->direct[key[0] >> (64 - TRIE_DIRECT_BITS)];
+		if ( entry & TRIE_LEAF ) 
+			return 1;
+		if ( entry == 0 ) 
+			return 0;
+		node = &trie->node[entry - 1];
+		pos  = TRIE_DIRECT_BITS;
+	}
+
+	for (;;) {
+		uint64_t bit = 1ULL << KeyChunk(key, pos);
+		if ( node->leaf & bit ) 
+			return 1;
+		if ( (node->child & bit) == 0 ) 
+			return 0;
+		node = &trie->node[node->base + PopCount(node->child & (bit - 1))];
+		pos += TRIE_STRIDE;
+	}
+
+	/* not reached */
+
+} // End of TrieLookup
+
+int IPTrieLookup(iptrie_t *trie, uint64_t *ip) {
+
+	if ( ip[0] == 0 && (ip[1] >> 32) == 0 ) {
+		uint64_t key[2];
+		key[0] = ip[1] << 32;
+		key[1] = 0;
+		if ( TrieLookup(&trie->v4, key) ) 
+			return 1;
+		// an IPv6 prefix may cover IPv4 addresses
+		if ( trie->v6.numprefixes == 0 ) 
+			return 0;
+	}
+	return TrieLookup(&trie->v6, ip);
+
+} // End of IPTrieLookup
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (c) 2026, The nfdump contributors
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without 
+ *  modification, are permitted provided that the following conditions are met:
+ *  
+ *   * Redistributions of source code must retain the above copyright notice, 
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright notice, 
+ *     this list of conditions and the following disclaimer in the documentation 
+ *     and/or other materials provided with the distribution.
+ *   * Neither the name of the author nor the names of its contributors may be 
+ *     used to endorse or promote products derived from this software without 
+ *     specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *  
+ */
+
+#ifndef _IPTRIE_H
+#define _IPTRIE_H 1
+
+#include "config.h"
+
+#include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+/*
+ * Longest prefix match of IP lists - see iptrie.c
+ * A trie node covers 6 bits of the address. Bit n of leaf is set, if the 
+ * addresses with n as the next 6 bits are in the list. Bit n of child is set,
+ * if the node has a child node for n. The children of a node follow each 
+ * other in the node array, starting at base.
+ */
+#define TRIE_STRIDE	6
+
+// direct pointing: a table for the first 16 bits, if a trie has many prefixes
+#define TRIE_DIRECT_BITS	16
+#define TRIE_DIRECT_MIN		1024
+#define TRIE_LEAF			0x80000000
+
+typedef struct trie_node_s {
+	uint64_t	leaf;
+	uint64_t	child;
+	uint32_t	base;
+} trie_node_t;
+
+typedef struct trie_s {
+	uint32_t	*direct;		// TRIE_LEAF or node index + 1, 0 = no match
+	trie_node_t	*node;
+	uint32_t	numnodes;
+	uint32_t	numprefixes;
+} trie_t;
+
+typedef struct iptrie_s {
+	trie_t	v4;		// IPv4 addresses, 32 bit key
+	trie_t	v6;		// any other prefix, 128 bit key
+} iptrie_t;
+
+iptrie_t *NewIPTrie(uint64_t *ip, uint64_t *mask, uint32_t num);
+
+void DisposeIPTrie(iptrie_t *trie);
+
+int IPTrieLookup(iptrie_t *trie, uint64_t *ip);
+
+#endif //_IPTRIE_H
@@ -157,6 +157,10 @@ static void usage(char *name) {
 					"-z\t\tLZO compress flows in output file.\n"
 					"-y\t\tLZ4 compress flows in output file.\n"
 					"-j\t\tBZ2 compress flows in output file.\n"
+					"-G <level>[:<dict>]\tzstd compress flows in output file with <level> and optional dictionary file <dict>.\n"
+					"-W <num>\tCompress output blocks with <num> worker threads.\n"
+					"-k\t\tAppend a block index to each file.\n"
+					"-U\t\tStore blocks uncompressed, which do not compress. Older nfdump versions can not read such files.\n"
 					"-B bufflen\tSet socket buffer to bufflen bytes\n"
 					"-e\t\tExpire data at each cycle.\n"
 					"-D\t\tFork to background\n"
@@ -788,7 +792,7 @@ char	*pcap_file = NULL;
 	extension_tags	= DefaultExtensions;
 	dynsrcdir		= NULL;
 
-	while ((c = getopt(argc, argv, "46ef:whEVI:DB:b:jl:J:M:n:N:p:P:R:S:s:T:t:x:Xru:g:yzZ")) != EOF) {
+	while ((c = getopt(argc, argv, "46ef:whEVI:DB:b:jkl:G:J:M:n:N:p:P:R:S:s:T:t:UW:x:Xru:g:yzZ")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(argv[0]);
@@ -974,25 +978,53 @@ char	*pcap_file = NULL;
 				break;
 			case 'j':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = BZ2_COMPRESSED;
 				break;
 			case 'y':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = LZ4_COMPRESSED;
 				break;
 			case 'z':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = LZO_COMPRESSED;
 				break;
+			case 'G': {
+				char *dict;
+				if ( compress ) {
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
+					exit(255);
+				}
+				// <level>[:<dictfile>]
+				dict = strchr(optarg, ':');
+				if ( dict ) 
+					*dict++ = '\0';
+				if ( !SetZstdCompression(atoi(optarg), dict) ) 
+					exit(255);
+				compress = ZSTD_COMPRESSED;
+				} break;
+			case 'W': {
+				int num_workers = atoi(optarg);
+				if ( num_workers < 0 || num_workers > MAX_COMPRESS_WORKERS ) {
+					LogError("Number of compression workers %i out of range 0..%i", num_workers, MAX_COMPRESS_WORKERS);
+					exit(255);
+				}
+				SetCompressWorkers(num_workers);
+				} break;
+			case 'k':
+				SetBlockIndex(1);
+				break;
+			case 'U':
+				SetRawBlocks(1);
+				break;
 			case 'Z':
 				time_extension	= "%Y%m%d%H%M%z";
 				spec_time_extension = 1;
@@ -47,6 +47,7 @@
 #include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -80,6 +81,9 @@
 
 #define AGGR_SIZE 7
 
+// see -P
+#define MAX_QUERY_WORKERS	64
+
 /* Global Variables */
 FilterEngine_t	*Engine;
 
@@ -96,6 +100,15 @@ static uint32_t	is_anonymized;
 static time_t 	t_first_flow, t_last_flow;
 static char		Ident[IDENTLEN];
 
+// time window for the block filter
+static time_t	twin_first, twin_last;
+
+// number of threads to process the input files in parallel
+static int		QueryWorkers;
+
+// memory limit of the flow table, 0 = no limit
+static uint64_t	FlowTableLimit;
+
 
 int hash_hit = 0; 
 int hash_miss = 0;
@@ -245,14 +258,21 @@ static void usage(char *name);
 
 static void PrintSummary(stat_record_t *stat_record, outputParams_t *outputParams);
 
+static int BlockFilter(block_index_t *entry);
+
 static stat_record_t process_data(char *wfile, int element_stat, int flow_stat, int sort_flows,
 	printer_t print_record, time_t twin_start, time_t twin_end, 
 	uint64_t limitRecords, outputParams_t *outputParams, int compress);
 
+static stat_record_t process_data_parallel(int element_stat, int flow_stat, int sort_flows,
+	printer_t print_record, time_t twin_start, time_t twin_end, outputParams_t *outputParams);
+
 /* Functions */
 
+#define NEED_FLOWBATCH 1
 #include "nfdump_inline.c"
 #include "nffile_inline.c"
+#undef NEED_FLOWBATCH
 
 static void usage(char *name) {
 		printf("usage %s [options] [\"filter\"]\n"
@@ -268,16 +288,24 @@ static void usage(char *name) {
 					"-f\t\tread netflow filter from file\n"
 					"-n\t\tDefine number of top N for stat or sorted output.\n"
 					"-c\t\tLimit number of matching records\n"
+					"-C <size>\tSpill aggregated flows to disk, if they need more memory than <size>[KMG].\n"
 					"-D <dns>\tUse nameserver <dns> for host lookup.\n"
 					"-N\t\tPrint plain numbers\n"
 					"-s <expr>[/<order>]\tGenerate statistics for <expr> any valid record element.\n"
 					"\t\tand ordered by <order>: packets, bytes, flows, bps pps and bpp.\n"
+					"-e <num>\tApproximate the statistics of -s with <num> counters per statistic.\n"
 					"-q\t\tQuiet: Do not print the header and bottom stat lines.\n"
 					"-i <ident>\tChange Ident to <ident> in file given by -r.\n"
-					"-J <num>\tModify file compression: 0: uncompressed - 1: LZO - 2: BZ2 - 3: LZ4 compressed.\n"
+					"-J <num>\tModify file compression: 0: uncompressed - 1: LZO - 2: BZ2 - 3: LZ4 - 4: zstd compressed.\n"
 					"-z\t\tLZO compress flows in output file. Used in combination with -w.\n"
 					"-y\t\tLZ4 compress flows in output file. Used in combination with -w.\n"
 					"-j\t\tBZ2 compress flows in output file. Used in combination with -w.\n"
+					"-G <level>[:<dict>]\tzstd compress flows in output file with <level> and optional dictionary file <dict>.\n"
+					"\t\tUsed in combination with -w or -J 4.\n"
+					"-g <dict>\tTrain a zstd dictionary with the flows of the files given by -r or -R and save it in <dict>.\n"
+					"-W <num>\tCompress output blocks with <num> worker threads. Used in combination with -w.\n"
+					"-k\t\tAppend a block index to the output file. Used in combination with -w.\n"
+					"-U\t\tStore blocks uncompressed, which do not compress. Older nfdump versions can not read such files.\n"
 					"-l <expr>\tSet limit on packets for line and packed output format.\n"
 					"\t\tkey: 32 character string or 64 digit hex string starting with 0x.\n"
 					"-L <expr>\tSet limit on bytes for line and packed output format.\n"
@@ -287,6 +315,9 @@ static void usage(char *name) {
 					"\t\trequests either -r filename or -R firstfile:lastfile without pathnames\n"
 					"-m\t\tdeprecated\n"
 					"-O <order> Sort order for aggregated flows - tstart, tend, flows, packets bps pps bbp etc.\n"
+					"-P <num>\tProcess the input files in parallel with <num> worker threads.\n"
+					"-Q <num>\tRead ahead and decompress <num> data blocks in a background thread, at least 2.\n"
+					"-Y\t\tMap uncompressed and LZ4 compressed input files into memory.\n"
 					"-R <expr>\tRead input from sequence of files.\n"
 					"\t\t/any/dir  Read all files in that directory.\n"
 					"\t\t/dir/file Read all files beginning with 'file'.\n"
@@ -314,6 +345,16 @@ static void flow_record_to_null(void *record, char ** s, int tag) {
 	// empty - do not list any flows
 } // End of flow_record_to_null
 
+static int BlockFilter(block_index_t *entry) {
+
+	// no flow of this block is within the time window
+	if ( twin_first && (entry->first_max < twin_first || entry->last_min > twin_last) ) 
+		return 0;
+
+	return BlockMayMatch(Engine, entry);
+
+} // End of BlockFilter
+
 static void PrintSummary(stat_record_t *stat_record, outputParams_t *outputParams) {
 static double	duration;
 uint64_t	bps, pps, bpp;
@@ -352,12 +393,790 @@ char 		bps_str[NUMBER_STRING_SIZE], pps_str[NUMBER_STRING_SIZE], bpp_str[NUMBER_
 
 } // End of PrintSummary
 
+static inline void ProcessFlow(stat_record_t *stat_record, common_record_t *flow_record, master_record_t *master_record, 
+	extension_info_t *extension_info, int element_stat, int flow_stat, int sort_flows, nffile_t *nffile_w, 
+	printer_t print_record, outputParams_t *outputParams) {
+
+	recordCount++;
+
+	// Update statistics
+	UpdateStat(stat_record, master_record);
+
+	// update number of flows matching a given map
+	extension_info->ref_count++;
+
+	if ( flow_stat ) {
+		AddFlow(flow_record, master_record, extension_info);
+		if ( element_stat ) {
+			AddStat(flow_record, master_record);
+		} 
+	} else if ( element_stat ) {
+		AddStat(flow_record, master_record);
+	} else if ( sort_flows ) {
+		InsertFlow(flow_record, master_record, extension_info);
+	} else {
+		if ( nffile_w ) {
+			AppendToBuffer(nffile_w, (void *)flow_record, flow_record->size);
+		} else if ( print_record ) {
+			char *string;
+			// if we need to print out this record
+			print_record(master_record, &string, outputParams->doTag);
+			if ( string ) {
+				printf("%s\n", string);
+			}
+		} else { 
+			// mutually exclusive conditions should prevent executing this code
+			// this is buggy!
+			printf("Bug! - this code should never get executed in file %s line %d\n", __FILE__, __LINE__);
+		}
+	} // sort_flows - else
+
+} // End of ProcessFlow
+
+/*
+ * Filter the flows of the batch and process the matched flows in order.
+ * Returns 1, if the -c limit is reached.
+ */
+static int ProcessFlowBatch(flow_batch_t *batch, stat_record_t *stat_record, int element_stat, int flow_stat, 
+	int sort_flows, nffile_t *nffile_w, printer_t print_record, outputParams_t *outputParams, uint64_t limitRecords) {
+uint32_t i;
+int done;
+
+	if ( batch->num == 0 ) 
+		return 0;
+
+	RunFilterBatch(Engine, batch->nfrecord, batch->num, batch->match, batch->label);
+
+	done = 0;
+	for ( i=0; i<batch->num && !done; i++ ) {
+		master_record_t *master_record;
+
+		if ( !BatchMatch(batch->match, i) ) 
+			continue;
+
+		// -c also limits the number of flows of the records
+		if ( limitRecords && stat_record->numflows >= limitRecords ) 
+			continue;
+
+		// Records passed filter -> continue record processing
+		master_record = BatchMatchedRecord(batch, i);
+		master_record->label = batch->label[i];
+#ifdef DEVEL
+		if ( master_record->label )
+			printf("Flow has label: %s\n", master_record->label);
+#endif
+		ProcessFlow(stat_record, batch->flow_record[i], master_record, batch->extension_info[i], 
+			element_stat, flow_stat, sort_flows, nffile_w, print_record, outputParams);
+
+		// check if we are done, due to -c option 
+		if ( limitRecords ) 
+			done = recordCount >= limitRecords;
+	}
+	batch->num = 0;
+
+	return done;
+
+} // End of ProcessFlowBatch
+
+/*
+ * Parallel query:
+ * The files of the file list are distributed over QueryWorkers threads. Each worker
+ * reads, expands and filters the flows of one file at a time with its own clone of the 
+ * filter engine and its own master records. The matched flows are queued per data block.
+ * The main thread takes the queued flows in the order of the file list and processes
+ * them as in process_data(), so printed flows, aggregations and statistics are the 
+ * same as without workers.
+ *
+ * Partitioned aggregation:
+ * When the flows are only aggregated, the flow table is split into QueryWorkers partitions
+ * by the aggregation key - see Init_FlowPartitions(). The workers split the matched flows
+ * of a data block by partition and the main thread only passes the blocks in the order 
+ * of the file list on to the partition threads, which aggregate the flows of their partition 
+ * without any locking. The records of the partitions are merged back into the order of 
+ * the flow table of a sequential aggregation at the end.
+ */
+
+// max number of blocks queued by a worker ahead of the file processed by the main thread
+#define MAX_QUEUED_BLOCKS	16
+
+// initial buffer size of a match block
+#define MATCH_BUFFSIZE	(1024 * 1024)
+
+// exporter sysid is a 16 bit value
+#define NUM_SYSIDS		65536
+
+// exporter looked up, but not known
+#define NO_EXPORTER ((exporter_t *)-1)
+
+// matched flow: master record, followed by the flow record, 8 byte aligned
+typedef struct match_record_s {
+	extension_info_t	*extension_info;
+	uint32_t			size;			// size of the match record including the flow record
+	uint32_t			index;			// number of the matched flow in the data block
+	master_record_t		master_record;
+} match_record_t;
+
+typedef struct match_block_s {
+	struct match_block_s	*next;
+	uint32_t				NumRecords;
+	uint32_t				seq;		// partitioned aggregation: number of the data block
+	size_t					size;		// bytes used in buff
+	size_t					buffsize;
+	void					*buff;
+	struct match_block_s	**part;		// partitioned aggregation: flows of each partition
+} match_block_t;
+
+// partition of the partitioned aggregation
+typedef struct flow_part_s {
+	pthread_t			tid;
+	uint32_t			id;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		queue_cond;		// main thread waits for the partition to catch up
+	pthread_cond_t		process_cond;	// partition waits for queued blocks
+	match_block_t		*first_block;
+	match_block_t		**last_block;
+	uint32_t			num_blocks;		// blocks queued
+	int					done;
+	stat_record_t		stat_record;
+	uint32_t			recordCount;
+} flow_part_t;
+
+typedef struct query_file_s {
+	struct query_file_s	*next;
+	char				*filename;
+	match_block_t		*first_block;
+	match_block_t		**last_block;
+	uint32_t			num_blocks;		// blocks queued
+	int					done;
+	uint64_t			total_bytes;
+	uint32_t			skipped_blocks;
+} query_file_t;
+
+typedef struct query_s {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	queue_cond;		// workers wait for the main thread to catch up
+	pthread_cond_t	process_cond;	// main thread waits for queued blocks or finished files
+	query_file_t	*first_file;	// next file to process by the main thread
+	query_file_t	**last_file;
+	uint32_t		num_files;
+	int				list_done;
+	int				list_error;
+	time_t			twin_start, twin_end;
+	uint32_t		num_parts;		// number of partitions, 0 = no partitioned aggregation
+} query_t;
+
+typedef struct query_worker_s {
+	pthread_t			tid;
+	query_t				*query;
+	FilterEngine_t		*engine;
+	// file map id -> extension info of the global map list
+	extension_info_t	*slot[MAX_EXTENSION_MAPS];
+	exporter_t			*exporter[NUM_SYSIDS];
+	flow_batch_t		*batch;
+	uint32_t			matched;		// flows matched in the current data block
+	size_t				buffsize;		// initial buffer size of a match block
+	void				*flowkey;		// partitioned aggregation: key to select the partition
+} query_worker_t;
+
+static match_record_t *NewMatchRecord(match_block_t **match_block, uint32_t flow_size, size_t initsize) {
+match_block_t *block = *match_block;
+match_record_t *match_record;
+size_t size;
+
+	size = (sizeof(match_record_t) + flow_size + 7) & ~(size_t)7;
+
+	if ( block == NULL ) {
+		block = (match_block_t *)calloc(1, sizeof(match_block_t));
+		if ( !block ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		*match_block = block;
+	}
+
+	if ( (block->size + size) > block->buffsize ) {
+		size_t buffsize = block->buffsize ? 2 * block->buffsize : initsize;
+		void *buff;
+		while ( (block->size + size) > buffsize ) 
+			buffsize *= 2;
+		buff = realloc(block->buff, buffsize);
+		if ( !buff ) {
+			LogError("realloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		block->buff 	= buff;
+		block->buffsize = buffsize;
+	}
+
+	match_record = (match_record_t *)((pointer_addr_t)block->buff + block->size);
+	match_record->size = size;
+	block->size += size;
+	block->NumRecords++;
+
+	return match_record;
+
+} // End of NewMatchRecord
+
+static void QueueMatchBlock(query_t *query, query_file_t *file, match_block_t *block) {
+
+	pthread_mutex_lock(&query->mutex);
+	// do not run too far ahead of the main thread
+	while ( file != query->first_file && file->num_blocks >= MAX_QUEUED_BLOCKS )
+		pthread_cond_wait(&query->queue_cond, &query->mutex);
+
+	*file->last_block = block;
+	file->last_block  = &block->next;
+	file->num_blocks++;
+	pthread_cond_signal(&query->process_cond);
+	pthread_mutex_unlock(&query->mutex);
+
+} // End of QueueMatchBlock
+
+static void FilterFlowBatch(query_worker_t *worker, match_block_t **match_block) {
+flow_batch_t *batch = worker->batch;
+uint32_t num_parts = worker->query->num_parts;
+uint32_t i;
+
+	if ( num_parts && *match_block == NULL ) {
+		match_block_t *block = (match_block_t *)calloc(1, sizeof(match_block_t));
+		if ( block ) 
+			block->part = (match_block_t **)calloc(num_parts, sizeof(match_block_t *));
+		if ( !block || !block->part ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		*match_block = block;
+	}
+
+	RunFilterBatch(worker->engine, batch->nfrecord, batch->num, batch->match, batch->label);
+	for ( i=0; i<batch->num; i++ ) {
+		common_record_t *flow_record = batch->flow_record[i];
+		master_record_t *master_record;
+		match_record_t *match_record;
+
+		if ( !BatchMatch(batch->match, i) ) 
+			continue;
+
+		master_record = BatchMatchedRecord(batch, i);
+		if ( num_parts ) {
+			uint32_t part = FlowPartitionKey(worker->flowkey, master_record);
+			match_record = NewMatchRecord(&(*match_block)->part[part], flow_record->size, worker->buffsize);
+			(*match_block)->NumRecords++;
+		} else {
+			match_record = NewMatchRecord(match_block, flow_record->size, worker->buffsize);
+		}
+		match_record->index			 = worker->matched++;
+		match_record->extension_info = batch->extension_info[i];
+		memcpy((void *)&match_record->master_record, (void *)master_record, sizeof(master_record_t));
+		match_record->master_record.label = batch->label[i];
+		memcpy((void *)&match_record[1], (void *)flow_record, flow_record->size);
+	}
+	batch->num = 0;
+
+} // End of FilterFlowBatch
+
+static void ProcessFile(query_worker_t *worker, nffile_t *nffile, query_file_t *file) {
+query_t *query = worker->query;
+time_t twin_start = query->twin_start;
+time_t twin_end   = query->twin_end;
+common_record_t *flow_record, *record_ptr;
+int i, ret;
+
+	// map ids and sysids are local to a file
+	memset((void *)worker->slot, 0, sizeof(worker->slot));
+	memset((void *)worker->exporter, 0, sizeof(worker->exporter));
+	worker->engine->ident = nffile->file_header->ident;
+
+	for (;;) {
+		match_block_t *match_block;
+		uint32_t sumSize;
+
+		ret = ReadBlock(nffile);
+		switch (ret) {
+			case NF_CORRUPT:
+				LogError("Skip corrupt data file '%s'\n", file->filename);
+				return;
+			case NF_ERROR:
+				LogError("Read error in file '%s': %s\n", file->filename, strerror(errno) );
+				return;
+			case NF_EOF:
+				// blocks skipped by the block index
+				file->skipped_blocks += nffile->blocks_skipped;
+				return;
+			default:
+				// successfully read block
+				file->total_bytes += ret;
+		}
+
+		if ( nffile->block_header->id != DATA_BLOCK_TYPE_2 ) {
+			if ( nffile->block_header->id == DATA_BLOCK_TYPE_1 ) {
+				LogError("nfdump 1.5.x block type 1 no longer supported. Skip block.\n");
+			} else {
+				LogError("Can't process block type %u. Skip block.\n", nffile->block_header->id);
+			}
+			file->skipped_blocks++;
+			continue;
+		}
+
+		match_block = NULL;
+		worker->matched = 0;
+		sumSize = 0;
+		record_ptr = nffile->buff_ptr;
+		for ( i=0; i < nffile->block_header->NumRecords; i++ ) {
+			flow_record = record_ptr;
+			if ( (sumSize + record_ptr->size) > ret || (record_ptr->size < sizeof(record_header_t)) ) {
+				LogError("Corrupt data file. Inconsistent block size in %s line %d\n", __FILE__, __LINE__);
+				exit(255);
+			}
+			sumSize += record_ptr->size;
+
+			// any other record is processed after the pending flows
+			if ( record_ptr->type != CommonRecordType && worker->batch->num ) 
+				FilterFlowBatch(worker, &match_block);
+
+			switch ( record_ptr->type ) {
+				case CommonRecordV0Type: 
+					LogError("Old common v0 records no longer supported - skipped");
+					break;
+				case CommonRecordType: {
+					master_record_t *master_record;
+					exporter_t *exp_info;
+					uint32_t map_id, sysid;
+
+					map_id = flow_record->ext_map;
+					if ( map_id >= MAX_EXTENSION_MAPS ) {
+						LogError("Corrupt data file. Extension map id %u too big.\n", flow_record->ext_map);
+						exit(255);
+					}
+					if ( worker->slot[map_id] == NULL ) {
+						LogError("Corrupt data file. Missing extension map %u. Skip record.\n", flow_record->ext_map);
+						break;
+					} 
+
+					sysid = flow_record->exporter_sysid;
+					exp_info = worker->exporter[sysid];
+					if ( exp_info == NULL ) {
+						// no exporter record in this file so far - use the one known globally
+						pthread_mutex_lock(&query->mutex);
+						exp_info = exporter_list[sysid] ? exporter_list[sysid] : NO_EXPORTER;
+						pthread_mutex_unlock(&query->mutex);
+						worker->exporter[sysid] = exp_info;
+					}
+					if ( exp_info == NO_EXPORTER )
+						exp_info = NULL;
+
+					master_record = BatchExpandRecord(worker->batch, flow_record, worker->slot[map_id], 
+						exp_info ? &(exp_info->info) : NULL);
+
+					// Time based filter
+					// if no time filter is given, the result is always true
+					if ( twin_start && (master_record->first < twin_start || master_record->last > twin_end) ) 
+						break;
+
+					worker->batch->num++;
+					if ( worker->batch->num == FILTER_BATCH ) 
+						FilterFlowBatch(worker, &match_block);
+					} break; 
+				case ExtensionMapType: {
+					extension_map_t *map = (extension_map_t *)record_ptr;
+					extension_info_t *extension_info;
+					uint32_t map_id;
+					int ret;
+
+					pthread_mutex_lock(&query->mutex);
+					ret = Insert_Extension_Map(extension_map_list, map);
+					extension_info = ret >= 0 ? extension_map_list->slot[map->map_id] : NULL;
+					pthread_mutex_unlock(&query->mutex);
+					if ( ret < 0 ) {
+						LogError("Corrupt data file. Unable to decode at %s line %d\n", __FILE__, __LINE__);
+						exit(255);
+					}
+
+					map_id = map->map_id;
+					worker->slot[map_id] = extension_info;
+					} break;
+				case LegacyRecordType1:
+				case LegacyRecordType2:
+						// Silently skip legacy records
+					break;
+				case ExporterInfoRecordType: {
+					exporter_info_record_t *exporter_record = (exporter_info_record_t *)record_ptr;
+					uint32_t sysid = exporter_record->sysid;
+
+					pthread_mutex_lock(&query->mutex);
+					if ( AddExporterInfo(exporter_record) != 0 ) {
+						worker->exporter[sysid] = exporter_list[sysid];
+					} else {
+						LogError("Failed to add Exporter Record\n");
+					}
+					pthread_mutex_unlock(&query->mutex);
+					} break;
+				case ExporterStatRecordType:
+					pthread_mutex_lock(&query->mutex);
+					AddExporterStat((exporter_stats_record_t *)record_ptr);
+					pthread_mutex_unlock(&query->mutex);
+					break;
+				case SamplerInfoRecordype: 
+					pthread_mutex_lock(&query->mutex);
+					if ( AddSamplerInfo((sampler_info_record_t *)record_ptr) == 0 ) 
+						LogError("Failed to add Sampler Record\n");
+					pthread_mutex_unlock(&query->mutex);
+					break;
+				default: {
+					LogError("Skip unknown record type %i\n", record_ptr->type);
+				}
+			}
+
+			// Advance pointer by number of bytes for netflow record
+			record_ptr = (common_record_t *)((pointer_addr_t)record_ptr + record_ptr->size);	
+
+		} // for all records
+
+		if ( worker->batch->num ) 
+			FilterFlowBatch(worker, &match_block);
+
+		if ( match_block ) 
+			QueueMatchBlock(query, file, match_block);
+
+	} // for all blocks
+
+	/* not reached */
+
+} // End of ProcessFile
+
+static void *QueryWorker(void *arg) {
+query_worker_t *worker = (query_worker_t *)arg;
+query_t *query = worker->query;
+
+	for (;;) {
+		query_file_t *file;
+		nffile_t *nffile;
+		char *filename;
+
+		pthread_mutex_lock(&query->mutex);
+		if ( query->list_done ) {
+			pthread_mutex_unlock(&query->mutex);
+			break;
+		}
+
+		// files are opened in the order of the file list
+		nffile = OpenNextInputFile(&filename, query->twin_start, query->twin_end);
+		if ( nffile == NULL || nffile == EMPTY_LIST ) {
+			query->list_done  = 1;
+			query->list_error = nffile == NULL;
+			pthread_cond_signal(&query->process_cond);
+			pthread_mutex_unlock(&query->mutex);
+			break;
+		}
+
+		file = (query_file_t *)calloc(1, sizeof(query_file_t));
+		if ( !file ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		file->filename	 = filename ? filename : "<stdin>";
+		file->last_block = &file->first_block;
+
+		if ( query->num_files == 0 ) {
+			// preset time window of all processed flows to the stat record in first flow file
+			t_first_flow = nffile->stat_record->first_seen;
+			t_last_flow  = nffile->stat_record->last_seen;
+
+			// store infos away for later use
+			is_anonymized = IP_ANONYMIZED(nffile);
+			strncpy(Ident, nffile->file_header->ident, IDENTLEN);
+			Ident[IDENTLEN-1] = '\0';
+		} else {
+			// Update global time span window
+			if ( nffile->stat_record->first_seen < t_first_flow )
+				t_first_flow = nffile->stat_record->first_seen;
+			if ( nffile->stat_record->last_seen > t_last_flow ) 
+				t_last_flow = nffile->stat_record->last_seen;
+		}
+		query->num_files++;
+
+		*query->last_file = file;
+		query->last_file  = &file->next;
+		pthread_mutex_unlock(&query->mutex);
+
+		ProcessFile(worker, nffile, file);
+
+		CloseFile(nffile);
+		DisposeFile(nffile);
+
+		pthread_mutex_lock(&query->mutex);
+		file->done = 1;
+		pthread_cond_signal(&query->process_cond);
+		pthread_mutex_unlock(&query->mutex);
+	}
+
+	pthread_exit(NULL);
+
+} // End of QueryWorker
+
+static void QueuePartBlock(flow_part_t *part, match_block_t *block) {
+
+	pthread_mutex_lock(&part->mutex);
+	while ( part->num_blocks >= MAX_QUEUED_BLOCKS )
+		pthread_cond_wait(&part->queue_cond, &part->mutex);
+
+	*part->last_block = block;
+	part->last_block  = &block->next;
+	part->num_blocks++;
+	pthread_cond_signal(&part->process_cond);
+	pthread_mutex_unlock(&part->mutex);
+
+} // End of QueuePartBlock
+
+static void *FlowPartWorker(void *arg) {
+flow_part_t *part = (flow_part_t *)arg;
+extension_info_t *extension_info = NULL;
+uint32_t i, ref_count = 0;
+
+	for (;;) {
+		match_block_t *block;
+		match_record_t *match_record;
+
+		pthread_mutex_lock(&part->mutex);
+		while ( part->first_block == NULL && !part->done )
+			pthread_cond_wait(&part->process_cond, &part->mutex);
+
+		block = part->first_block;
+		if ( block == NULL ) {
+			pthread_mutex_unlock(&part->mutex);
+			break;
+		}
+		part->first_block = block->next;
+		if ( part->first_block == NULL ) 
+			part->last_block = &part->first_block;
+		part->num_blocks--;
+		pthread_cond_signal(&part->queue_cond);
+		pthread_mutex_unlock(&part->mutex);
+
+		match_record = (match_record_t *)block->buff;
+		for ( i=0; i < block->NumRecords; i++ ) {
+			part->recordCount++;
+			UpdateStat(&part->stat_record, &match_record->master_record);
+
+			// the maps are shared by all partitions - count the flows of a map in one go
+			if ( match_record->extension_info != extension_info ) {
+				if ( ref_count ) 
+					__sync_fetch_and_add(&extension_info->ref_count, ref_count);
+				extension_info = match_record->extension_info;
+				ref_count = 0;
+			}
+			ref_count++;
+
+			AddFlowPartition(part->id, ((uint64_t)block->seq << 32) | match_record->index, 
+				(common_record_t *)&match_record[1], &match_record->master_record, match_record->extension_info);
+			match_record = (match_record_t *)((pointer_addr_t)match_record + match_record->size);	
+		}
+		free(block->buff);
+		free(block);
+	}
+	if ( ref_count ) 
+		__sync_fetch_and_add(&extension_info->ref_count, ref_count);
+
+	pthread_exit(NULL);
+
+} // End of FlowPartWorker
+
+static stat_record_t process_data_parallel(int element_stat, int flow_stat, int sort_flows,
+	printer_t print_record, time_t twin_start, time_t twin_end, outputParams_t *outputParams) {
+query_worker_t	*worker[MAX_QUERY_WORKERS];
+flow_part_t		*part;
+query_t			query;
+stat_record_t 	stat_record;
+uint32_t		seq;
+int 			i, err, num_workers;
+
+	// time window of all matched flows
+	memset((void *)&stat_record, 0, sizeof(stat_record_t));
+	stat_record.first_seen = 0x7fffffff;
+	stat_record.msec_first = 999;
+
+	// do not print flows when doing any stats are sorting
+	if ( sort_flows || flow_stat || element_stat ) {
+		print_record = NULL;
+	}
+
+	memset((void *)&query, 0, sizeof(query_t));
+	pthread_mutex_init(&query.mutex, NULL);
+	pthread_cond_init(&query.queue_cond, NULL);
+	pthread_cond_init(&query.process_cond, NULL);
+	query.last_file  = &query.first_file;
+	query.twin_start = twin_start;
+	query.twin_end	 = twin_end;
+
+	// aggregate the flows in partitions, unless the flows are also needed for the element statistics
+	// or the flow table may be spilled to disk
+	part = NULL;
+	if ( flow_stat && !element_stat && !FlowTableLimit ) {
+		if ( !Init_FlowPartitions(QueryWorkers) ) 
+			exit(255);
+		query.num_parts = QueryWorkers;
+		part = (flow_part_t *)calloc(QueryWorkers, sizeof(flow_part_t));
+		if ( !part ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		for ( i=0; i<QueryWorkers; i++ ) {
+			part[i].id = i;
+			pthread_mutex_init(&part[i].mutex, NULL);
+			pthread_cond_init(&part[i].queue_cond, NULL);
+			pthread_cond_init(&part[i].process_cond, NULL);
+			part[i].last_block = &part[i].first_block;
+			part[i].stat_record.first_seen = 0x7fffffff;
+			part[i].stat_record.msec_first = 999;
+			err = pthread_create(&part[i].tid, NULL, FlowPartWorker, (void *)&part[i]);
+			if ( err ) {
+				LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+				exit(255);
+			}
+		}
+	}
+
+	num_workers = 0;
+	for ( i=0; i<QueryWorkers; i++ ) {
+		worker[i] = (query_worker_t *)calloc(1, sizeof(query_worker_t));
+		if ( !worker[i] ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		worker[i]->query  = &query;
+		worker[i]->engine = CloneFilterEngine(Engine);
+		worker[i]->batch  = NewFlowBatch();
+		worker[i]->buffsize = MATCH_BUFFSIZE;
+		if ( query.num_parts ) {
+			worker[i]->buffsize = MATCH_BUFFSIZE / query.num_parts;
+			worker[i]->flowkey	= NewFlowKey();
+		}
+		err = pthread_create(&worker[i]->tid, NULL, QueryWorker, (void *)worker[i]);
+		if ( err ) {
+			LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+			exit(255);
+		}
+		num_workers++;
+	}
+
+	seq = 0;
+	pthread_mutex_lock(&query.mutex);
+	for (;;) {
+		query_file_t *file = query.first_file;
+		match_block_t *block;
+
+		if ( file == NULL ) {
+			if ( query.list_done ) 
+				break;
+			pthread_cond_wait(&query.process_cond, &query.mutex);
+			continue;
+		}
+
+		block = file->first_block;
+		if ( block == NULL ) {
+			if ( file->done ) {
+				// all blocks of this file processed - continue with next file
+				total_bytes	   += file->total_bytes;
+				skipped_blocks += file->skipped_blocks;
+				query.first_file = file->next;
+				if ( query.first_file == NULL ) 
+					query.last_file = &query.first_file;
+				free(file);
+				pthread_cond_broadcast(&query.queue_cond);
+			} else {
+				pthread_cond_wait(&query.process_cond, &query.mutex);
+			}
+			continue;
+		}
+
+		file->first_block = block->next;
+		if ( file->first_block == NULL ) 
+			file->last_block = &file->first_block;
+		file->num_blocks--;
+		pthread_cond_broadcast(&query.queue_cond);
+		pthread_mutex_unlock(&query.mutex);
+
+		if ( block->part ) {
+			// pass the flows on to their partitions
+			for ( i=0; i<query.num_parts; i++ ) {
+				if ( block->part[i] ) {
+					block->part[i]->seq = seq;
+					QueuePartBlock(&part[i], block->part[i]);
+				}
+			}
+			seq++;
+			free(block->part);
+			free(block);
+			pthread_mutex_lock(&query.mutex);
+			continue;
+		}
+
+		match_record_t *match_record = (match_record_t *)block->buff;
+		for ( i=0; i < block->NumRecords; i++ ) {
+			ProcessFlow(&stat_record, (common_record_t *)&match_record[1], &match_record->master_record, 
+				match_record->extension_info, element_stat, flow_stat, sort_flows, NULL, print_record, outputParams);
+			match_record = (match_record_t *)((pointer_addr_t)match_record + match_record->size);	
+		}
+		free(block->buff);
+		free(block);
+
+		pthread_mutex_lock(&query.mutex);
+	}
+	pthread_mutex_unlock(&query.mutex);
+
+	for ( i=0; i<num_workers; i++ ) {
+		pthread_join(worker[i]->tid, NULL);
+		DisposeFilterEngine(worker[i]->engine);
+		free(worker[i]->batch);
+		free(worker[i]->flowkey);
+		free(worker[i]);
+	}
+
+	if ( part ) {
+		for ( i=0; i<query.num_parts; i++ ) {
+			pthread_mutex_lock(&part[i].mutex);
+			part[i].done = 1;
+			pthread_cond_signal(&part[i].process_cond);
+			pthread_mutex_unlock(&part[i].mutex);
+		}
+		for ( i=0; i<query.num_parts; i++ ) {
+			pthread_join(part[i].tid, NULL);
+			SumStatRecords(&stat_record, &part[i].stat_record);
+			recordCount += part[i].recordCount;
+			pthread_mutex_destroy(&part[i].mutex);
+			pthread_cond_destroy(&part[i].queue_cond);
+			pthread_cond_destroy(&part[i].process_cond);
+		}
+		free(part);
+		MergeFlowPartitions();
+	}
+
+	pthread_mutex_destroy(&query.mutex);
+	pthread_cond_destroy(&query.queue_cond);
+	pthread_cond_destroy(&query.process_cond);
+
+	if ( query.num_files == 0 ) {
+		if ( query.list_error ) 
+			LogError("OpenNextInputFile() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		else
+			LogError("Empty file list. No files to process\n");
+	} else if ( query.list_error ) {
+		LogError("Unexpected end of file list\n");
+	}
+
+	PackExtensionMapList(extension_map_list);
+
+	return stat_record;
+
+} // End of process_data_parallel
+
 stat_record_t process_data(char *wfile, int element_stat, int flow_stat, int sort_flows,
 	printer_t print_record, time_t twin_start, time_t twin_end, 
 	uint64_t limitRecords, outputParams_t *outputParams, int compress) {
 common_record_t 	*flow_record, *record_ptr;
 master_record_t		*master_record;
 nffile_t			*nffile_w, *nffile_r;
+flow_batch_t		*batch;
 stat_record_t 		stat_record;
 int 				done, write_file;
 
@@ -379,6 +1198,11 @@ int 				done, write_file;
 	nffile_r = NULL;
 	nffile_w = NULL;
 
+	// records written to a file and the -c limit need the sequential order
+	if ( QueryWorkers && !write_file && !limitRecords ) 
+		return process_data_parallel(element_stat, flow_stat, sort_flows, print_record, 
+			twin_start, twin_end, outputParams);
+
 	// Get the first file handle
 	nffile_r = GetNextFile(NULL, twin_start, twin_end);
 	if ( !nffile_r ) {
@@ -390,6 +1214,9 @@ int 				done, write_file;
 		return stat_record;
 	}
 
+	// ident filters compare the ident of the current file
+	Engine->ident = nffile_r->file_header->ident;
+
 	// preset time window of all processed flows to the stat record in first flow file
 	t_first_flow = nffile_r->stat_record->first_seen;
 	t_last_flow  = nffile_r->stat_record->last_seen;
@@ -413,9 +1240,8 @@ int 				done, write_file;
 		}
 	}
 
-	// setup Filter Engine to point to master_record, as any record read from file
-	// is expanded into this record
-	// Engine->nfrecord = (uint64_t *)master_record;
+	// flows are expanded into the batch and filtered per batch
+	batch = NewFlowBatch();
 
 	done = 0;
 	while ( !done ) {
@@ -432,13 +1258,17 @@ int 				done, write_file;
 					LogError("Read error in file '%s': %s\n",GetCurrentFilename(), strerror(errno) );
 				// fall through - get next file in chain
 			case NF_EOF: {
-				nffile_t *next = GetNextFile(nffile_r, twin_start, twin_end);
+				nffile_t *next;
+				// blocks skipped by the block index
+				skipped_blocks += nffile_r->blocks_skipped;
+				next = GetNextFile(nffile_r, twin_start, twin_end);
 				if ( next == EMPTY_LIST ) {
 					done = 1;
 				} else if ( next == NULL ) {
 					done = 1;
 					LogError("Unexpected end of file list\n");
 				} else {
+					Engine->ident = next->file_header->ident;
 					// Update global time span window
 					if ( next->stat_record->first_seen < t_first_flow )
 						t_first_flow = next->stat_record->first_seen;
@@ -473,12 +1303,20 @@ int 				done, write_file;
 				exit(255);
 			}
 			sumSize += record_ptr->size;
+
+			// any other record is processed after the pending flows
+			if ( record_ptr->type != CommonRecordType && batch->num ) {
+				done = ProcessFlowBatch(batch, &stat_record, element_stat, flow_stat, sort_flows, 
+					nffile_w, print_record, outputParams, limitRecords);
+				if ( done ) 
+					break;
+			}
+
 			switch ( record_ptr->type ) {
 				case CommonRecordV0Type: 
 					LogError("Old common v0 records no longer supported - skipped");
 					break;
 				case CommonRecordType: {
-					int match;
 					uint32_t map_id;
 					exporter_t *exp_info;
 
@@ -492,69 +1330,22 @@ int 				done, write_file;
 					}
 					if ( extension_map_list->slot[map_id] == NULL ) {
 						LogError("Corrupt data file. Missing extension map %u. Skip record.\n", flow_record->ext_map);
-						record_ptr = (common_record_t *)((pointer_addr_t)record_ptr + record_ptr->size);	
-						continue;
+						break;
 					} 
 
-					master_record = &(extension_map_list->slot[map_id]->master_record);
-					Engine->nfrecord = (uint64_t *)master_record;
-					ExpandRecord_v2( flow_record, extension_map_list->slot[map_id], 
-						exp_info ? &(exp_info->info) : NULL, master_record);
+					master_record = BatchExpandRecord(batch, flow_record, extension_map_list->slot[map_id], 
+						exp_info ? &(exp_info->info) : NULL);
 
 					// Time based filter
 					// if no time filter is given, the result is always true
-					match  = twin_start && (master_record->first < twin_start || master_record->last > twin_end) ? 0 : 1;
-					match &= limitRecords ? stat_record.numflows < limitRecords : 1;
-
-					// filter netflow record with user supplied filter
-					if ( match ) 
-						match = (*Engine->FilterEngine)(Engine);
-	
-					if ( match == 0 ) { // record failed to pass all filters
-						// increment pointer by number of bytes for netflow record
-						record_ptr = (common_record_t *)((pointer_addr_t)record_ptr + record_ptr->size);	
-						// go to next record
-						continue;
-					}
-					recordCount++;
-
-					// Records passed filter -> continue record processing
-					// Update statistics
-					master_record->label = Engine->label;
-#ifdef DEVEL
-					if ( Engine->label )
-						printf("Flow has label: %s\n", Engine->label);
-#endif
-					UpdateStat(&stat_record, master_record);
-
-					// update number of flows matching a given map
-					extension_map_list->slot[map_id]->ref_count++;
-	
-					if ( flow_stat ) {
-						AddFlow(flow_record, master_record, extension_map_list->slot[map_id]);
-						if ( element_stat ) {
-							AddStat(flow_record, master_record);
-						} 
-					} else if ( element_stat ) {
-						AddStat(flow_record, master_record);
-					} else if ( sort_flows ) {
-						InsertFlow(flow_record, master_record, extension_map_list->slot[map_id]);
-					} else {
-						if ( write_file ) {
-							AppendToBuffer(nffile_w, (void *)flow_record, flow_record->size);
-						} else if ( print_record ) {
-							char *string;
-							// if we need to print out this record
-							print_record(master_record, &string, outputParams->doTag);
-							if ( string ) {
-								printf("%s\n", string);
-							}
-						} else { 
-							// mutually exclusive conditions should prevent executing this code
-							// this is buggy!
-							printf("Bug! - this code should never get executed in file %s line %d\n", __FILE__, __LINE__);
-						}
-					} // sort_flows - else
+					if ( twin_start && (master_record->first < twin_start || master_record->last > twin_end) ) 
+						break;
+
+					// the user supplied filter is applied to the full batch
+					batch->num++;
+					if ( batch->num == FILTER_BATCH ) 
+						done = ProcessFlowBatch(batch, &stat_record, element_stat, flow_stat, sort_flows, 
+							nffile_w, print_record, outputParams, limitRecords);
 					} break; 
 				case ExtensionMapType: {
 					extension_map_t *map = (extension_map_t *)record_ptr;
@@ -611,9 +1402,13 @@ int 				done, write_file;
 
 		} // for all records
 
+		if ( !done ) 
+			done = ProcessFlowBatch(batch, &stat_record, element_stat, flow_stat, sort_flows, 
+				nffile_w, print_record, outputParams, limitRecords);
 
 	} // while
 
+	free(batch);
 	CloseFile(nffile_r);
 
 	// flush output file
@@ -657,6 +1452,7 @@ int 		c, ffd, ret, element_stat, fdump;
 int 		i, flow_stat, aggregate, aggregate_mask, bidir;
 int 		print_stat, syntax_only, date_sorted, compress;
 int			GuessDir, ModifyCompress;
+char		*TrainDict;
 time_t 		t_start, t_end;
 uint32_t	limitRecords;
 char 		Ident[IDENTLEN];
@@ -676,6 +1472,8 @@ char 		Ident[IDENTLEN];
 	total_bytes		= 0;
 	recordCount		= 0;
 	skipped_blocks	= 0;
+	QueryWorkers	= 0;
+	FlowTableLimit	= 0;
 	compress		= NOT_COMPRESSED;
 	is_anonymized	= 0;
 	GuessDir		= 0;
@@ -688,6 +1486,7 @@ char 		Ident[IDENTLEN];
 	print_order  	= NULL;
 	query_file		= NULL;
 	ModifyCompress	= -1;
+	TrainDict		= NULL;
 	aggr_fmt		= NULL;
 
 	outputParams	= calloc(1, sizeof(outputParams_t));
@@ -699,7 +1498,7 @@ char 		Ident[IDENTLEN];
 
 	Ident[0] = '\0';
 
-	while ((c = getopt(argc, argv, "6aA:Bbc:D:E:s:hn:i:jf:qyzr:v:w:J:K:M:NImO:R:XZt:TVv:x:l:L:o:")) != EOF) {
+	while ((c = getopt(argc, argv, "6aA:Bbc:C:D:e:E:s:hn:i:jkf:g:G:qyzr:v:w:W:J:K:M:NImO:P:Q:R:UXYZt:TVv:x:l:L:o:")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(argv[0]);
@@ -741,6 +1540,15 @@ char 		Ident[IDENTLEN];
 			case 'X':
 				fdump = 1;
 				break;
+			case 'Y':
+				SetMmapReader(1);
+				break;
+			case 'k':
+				SetBlockIndex(1);
+				break;
+			case 'U':
+				SetRawBlocks(1);
+				break;
 			case 'Z':
 				syntax_only = 1;
 				break;
@@ -749,25 +1557,42 @@ char 		Ident[IDENTLEN];
 				break;
 			case 'j':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = BZ2_COMPRESSED;
 				break;
 			case 'y':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = LZ4_COMPRESSED;
 				break;
 			case 'z':
 				if ( compress ) {
-					LogError("Use one compression: -z for LZO, -j for BZ2 or -y for LZ4 compression\n");
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
 					exit(255);
 				}
 				compress = LZO_COMPRESSED;
 				break;
+			case 'G': {
+				char *dict;
+				if ( compress ) {
+					LogError("Use one compression: -z for LZO, -j for BZ2, -y for LZ4 or -G for zstd compression\n");
+					exit(255);
+				}
+				// <level>[:<dictfile>]
+				dict = strchr(optarg, ':');
+				if ( dict ) 
+					*dict++ = '\0';
+				if ( !SetZstdCompression(atoi(optarg), dict) ) 
+					exit(255);
+				compress = ZSTD_COMPRESSED;
+				} break;
+			case 'g':
+				TrainDict = optarg;
+				break;
 			case 'c':	
 				limitRecords = atoi(optarg);
 				if ( !limitRecords ) {
@@ -775,12 +1600,46 @@ char 		Ident[IDENTLEN];
 					exit(255);
 				}
 				break;
+			case 'C': {
+				char *s;
+				FlowTableLimit = strtoull(optarg, &s, 10);
+				switch (*s) {
+					case 'k':
+					case 'K':
+						FlowTableLimit <<= 10;
+						s++;
+						break;
+					case 'm':
+					case 'M':
+						FlowTableLimit <<= 20;
+						s++;
+						break;
+					case 'g':
+					case 'G':
+						FlowTableLimit <<= 30;
+						s++;
+						break;
+				}
+				if ( *s != '\0' || FlowTableLimit == 0 ) {
+					LogError("Invalid memory limit '%s'\n", optarg);
+					exit(255);
+				}
+				SetFlowTableLimit(FlowTableLimit);
+				} break;
 			case 's':
 				stat_type = optarg;
                 if ( !SetStat(stat_type, &element_stat, &flow_stat) ) {
                     exit(255);
                 } 
 				break;
+			case 'e': {
+				int counters = atoi(optarg);
+				if ( counters <= 0 ) {
+					LogError("Option -e needs a number > 0\n");
+					exit(255);
+				}
+				SetStatApprox(counters);
+				} break;
 			case 'V': {
 				char *e1, *e2;
 				e1 = "";
@@ -845,12 +1704,36 @@ char 		Ident[IDENTLEN];
 				}
 				date_sorted = ret == 17;		// index into order_mode
 				} break;
+			case 'P': {
+				int num_workers = atoi(optarg);
+				if ( num_workers < 0 || num_workers > MAX_QUERY_WORKERS ) {
+					LogError("Number of query workers %i out of range 0..%i\n", num_workers, MAX_QUERY_WORKERS);
+					exit(255);
+				}
+				QueryWorkers = num_workers;
+				} break;
+			case 'Q': {
+				int num_blocks = atoi(optarg);
+				if ( num_blocks < 0 || num_blocks > MAX_READAHEAD ) {
+					LogError("Read ahead blocks %i out of range 0..%i\n", num_blocks, MAX_READAHEAD);
+					exit(255);
+				}
+				SetReadAhead(num_blocks);
+				} break;
 			case 'R':
 				Rfile = optarg;
 				break;
 			case 'w':
 				wfile = optarg;
 				break;
+			case 'W': {
+				int num_workers = atoi(optarg);
+				if ( num_workers < 0 || num_workers > MAX_COMPRESS_WORKERS ) {
+					LogError("Number of compression workers %i out of range 0..%i\n", num_workers, MAX_COMPRESS_WORKERS);
+					exit(255);
+				}
+				SetCompressWorkers(num_workers);
+				} break;
 			case 'n':
 				outputParams->topN = atoi(optarg);
 				if ( outputParams->topN < 0 ) {
@@ -871,8 +1754,8 @@ char 		Ident[IDENTLEN];
 				break;
 			case 'J':
 				ModifyCompress = atoi(optarg);
-				if ( (ModifyCompress < 0) || (ModifyCompress > 3) ) {
-					LogError("Expected -J <num>, 0: uncompressed, 1: LZO, 2: BZ2, 3: LZ4 compressed.\n");
+				if ( (ModifyCompress < 0) || (ModifyCompress > 4) ) {
+					LogError("Expected -J <num>, 0: uncompressed, 1: LZO, 2: BZ2, 3: LZ4, 4: zstd compressed.\n");
 					exit(255);
 				}
 				break;
@@ -914,6 +1797,15 @@ char 		Ident[IDENTLEN];
 		exit(0);
 	}
 
+	// Train zstd dictionary
+	if ( TrainDict ) {
+		if ( !rfile && !Rfile ) {
+			LogError("Expected -r <file> or -R <dir> to train a zstd dictionary\n");
+			exit(255);
+		}
+		exit(TrainZstdDictionary(rfile, Rfile, TrainDict) ? 0 : 255);
+	}
+
 	// Change Ident only
 	if ( rfile && strlen(Ident) > 0 ) {
 		ChangeIdent(rfile, Ident);
@@ -1062,6 +1954,10 @@ char 		Ident[IDENTLEN];
 		LogError("Command line switch -s overwrites -a\n");
 	}
 
+	// keep only the common record of the aggregated flows, if the output does not need more
+	if ( aggregate || flow_stat ) 
+		SetCompactFlowTable(print_record == format_special && !(aggregate && wfile) && FormatCommonOnly());
+
 	if ( !filter && ffile ) {
 		if ( stat(ffile, &stat_buff) ) {
 			LogError("Can't stat filter file '%s': %s\n", ffile, strerror(errno));
@@ -1101,12 +1997,29 @@ char 		Ident[IDENTLEN];
 	if ( fdump ) {
 		printf("StartNode: %i Engine: %s\n", Engine->StartNode, Engine->Extended ? "Extended" : "Fast");
 		DumpEngine(Engine);
+		DumpCode(Engine);
 		exit(0);
 	}
 
 	if ( syntax_only )
 		exit(0);
 
+	/*
+	 * expand the fields of the filter before filtering and the fields, the statistics and the
+	 * aggregation need, for the matched flows only. Printed flows need all fields
+	 */
+	if ( aggregate || flow_stat || element_stat || print_order || wfile ) {
+		// counters of UpdateStat(), AddFlow() and AddStat()
+		uint64_t process_fields = FieldBit(OffsetOutPackets) | FieldBit(OffsetOutBytes) | FieldBit(OffsetAggrFlows);
+		if ( aggregate || flow_stat )
+			process_fields |= FlowTableFields();
+		if ( element_stat )
+			process_fields |= StatFields();
+		SetExpandProjection(FilterEngineFields(Engine), process_fields);
+	} else {
+		SetExpandProjection(FilterEngineFields(Engine), FIELD_ALL);
+	}
+
 	if ( print_order && flow_stat ) {
 		printf("-s record and -O (-m) are mutually exclusive options\n");
 		exit(255);
@@ -1115,7 +2028,7 @@ char 		Ident[IDENTLEN];
 	if ((aggregate || flow_stat || print_order)  && !Init_FlowTable() )
 			exit(250);
 
-	if (element_stat && !Init_StatTable(HashBits, NumPrealloc) )
+	if (element_stat && !Init_StatTable(StatTableBits, NumPrealloc) )
 			exit(250);
 
 	SetLimits(element_stat || aggregate || flow_stat, packet_limit_string, byte_limit_string);
@@ -1126,6 +2039,13 @@ char 		Ident[IDENTLEN];
 	}
 
 
+	// skip blocks by their index, if the file has one
+	if ( tstring || strcmp(filter, "any") != 0 ) {
+		twin_first = t_start;
+		twin_last  = t_end;
+		SetBlockFilter(BlockFilter);
+	}
+
 	if ( !(flow_stat || element_stat || wfile || outputParams->quiet ) && print_prolog ) {
 		print_prolog();
 	}
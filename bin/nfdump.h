@@ -765,6 +765,13 @@ typedef struct master_record_s {
 	char	*label;
 } master_record_t;
 
+/*
+ * Set of master record fields - see SetExpandProjection(). Bit n stands for the 64bit word n
+ * of master_record_t as addressed by the Offset* defines, bit 63 for all words from 63 on.
+ */
+#define FIELD_ALL			0xffffffffffffffffLL
+#define FieldBit(offset)	((uint64_t)1 << ((offset) < 63 ? (offset) : 63))
+
 // convenience type conversion record 
 typedef struct type_mask_s {
 	union {
@@ -41,19 +41,27 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <bzlib.h>
+#include <pthread.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
 #include "util.h"
 #include "nfdump.h"
+#include "nfx.h"
 #include "minilzo.h"
 #include "lz4.h"
 #include "flist.h"
@@ -75,6 +83,143 @@ static int lzo_initialized = 0;
 static int lz4_initialized = 0;
 static int bz2_initialized = 0;
 
+#ifdef HAVE_ZSTD
+static int zstd_initialized = 0;
+
+// compression context of the calling thread - workers use their own
+static ZSTD_CCtx *zstd_cctx = NULL;
+
+// decompression context of each reading thread - see ThreadZstdDCtx()
+static pthread_key_t	zstd_dctx_key;
+static pthread_once_t	zstd_dctx_once = PTHREAD_ONCE_INIT;
+
+// zstd level and dictionary for new files - see SetZstdCompression()
+static int ZstdLevel = 0;
+static void *ZstdDict = NULL;
+static uint32_t ZstdDictSize = 0;
+
+// dictionary size and amount of sample records to train a dictionary
+#define ZSTD_DICT_SIZE		(112*1024)
+#define ZSTD_SAMPLE_SIZE	(100*ZSTD_DICT_SIZE)
+#endif
+
+/*
+ * Read ahead ring
+ * A worker thread reads and decompresses the next data blocks of a file 
+ * into a ring of buffers, while the caller processes the current block.
+ * The block handed out by ReadBlock() stays valid until the next call of ReadBlock()
+ */
+typedef struct readahead_s {
+	pthread_t			tid;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond_ready;		// signalled by worker: new block in ring
+	pthread_cond_t		cond_free;		// signalled by reader: slot released
+
+	int					fd;
+	uint32_t			compression;
+	size_t				buff_size;
+	void				*zstd_ddict;	// zstd dictionary - owned by nffile
+
+	uint32_t			num_buffs;		// size of ring
+	void				**ring;			// decompressed data blocks
+	int					*status;		// ReadBlock() return value for each slot
+	void				*raw_buff;		// worker buffer for compressed block
+
+	uint32_t			head;			// next slot to process
+	uint32_t			tail;			// next slot to fill
+	uint32_t			count;			// number of filled slots
+	int					in_use;			// head slot is handed out to the reader
+	int					terminate;		// reader requests the worker to stop
+	int					running;
+
+	// block index of the file, if loaded - owned by nffile
+	block_index_t		*block_index;
+	uint32_t			index_entries;
+	uint32_t			block_num;		// number of next data block to read
+	uint64_t			index_offset;
+	uint32_t			blocks_skipped;	// published with each block - protected by mutex
+} readahead_t;
+
+static uint32_t ReadAheadBlocks = 0;
+
+// mmap input files by default in OpenFile()
+static int MmapReader = 0;
+
+// advise the kernel to page in this range ahead of the mmap read cursor
+#define MMAP_WILLNEED	(4*BUFFSIZE)
+
+// append a block index to new files
+static int BlockIndex = 0;
+
+// store blocks uncompressed, which do not compress - see SetRawBlocks()
+static int RawBlocks = 0;
+
+// initial number of index entries - doubled as required
+#define BLOCK_INDEX_ENTRIES	64
+
+// reader callback to skip blocks by their index entry
+static block_filter_t BlockFilter = NULL;
+
+/*
+ * Compression workers
+ * WriteBlock() queues the filled block and continues with an empty buffer.
+ * The workers compress queued blocks in parallel and a writer thread writes 
+ * them to the file in the same order, they were queued.
+ */
+typedef struct compress_job_s {
+	data_block_header_t	*in_block;		// block to compress
+	data_block_header_t	*out_block;		// compressed block
+	int					state;
+#define JOB_FREE		0
+#define JOB_QUEUED		1
+#define JOB_RUNNING		2
+#define JOB_DONE		3
+	int					ret;			// Compress_Block() return value
+	int					indexed;		// index entry is valid
+	block_index_t		index;			// index entry of in_block
+} compress_job_t;
+
+typedef struct writequeue_s {
+	pthread_t			*workers;
+	pthread_t			writer;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+
+	int					fd;
+	uint32_t			compression;
+	size_t				buff_size;
+	void				*zstd_cdict;	// zstd dictionary - owned by nffile
+	file_header_t		*file_header;	// NumBlocks is updated by the writer thread
+	nffile_t			*nffile;		// block index and file offset are updated by the writer thread
+	int					indexed;		// block index is built for this file
+
+	uint32_t			num_workers;
+	uint32_t			running;		// number of workers alive
+	uint32_t			num_jobs;		// size of job ring
+	compress_job_t		*jobs;
+
+	uint64_t			queued;			// number of blocks queued
+	uint64_t			claimed;		// number of blocks picked up by a worker
+	uint64_t			written;		// number of blocks written
+	int					error;			// compression or write error
+	int					active;
+	int					terminate;
+} writequeue_t;
+
+static uint32_t CompressWorkers = 0;
+
+/*
+ * Compression context of a thread, which writes its own files with WriteBlock() - 
+ * see InitThreadCompression(). Any other thread uses the static context.
+ */
+typedef struct compress_ctx_s {
+	void	*lzo_wrkmem;
+	void	*zstd_cctx;
+} compress_ctx_t;
+
+static pthread_key_t	compress_key;
+static pthread_once_t	compress_once = PTHREAD_ONCE_INIT;
+
 static int LZO_initialize(void);
 
 static int LZ4_initialize(void);
@@ -83,8 +228,66 @@ static int BZ2_initialize(void);
 
 static void BZ2_prep_stream (bz_stream*);
 
+#ifdef HAVE_ZSTD
+static int ZSTD_initialize(void);
+#endif
+
+static int ReadZstdDict(nffile_t *nffile);
+
+static void FreeZstdDict(nffile_t *nffile);
+
+static int SameZstdDict(int fd1, int fd2);
+
 static int OpenRaw(char *filename, stat_record_t *stat_record, int *compressed);
 
+static int ReadRawBlock(int fd, data_block_header_t *block_header);
+
+static int StartReadAhead(nffile_t *nffile);
+
+static void StopReadAhead(nffile_t *nffile);
+
+static int StartWriteQueue(nffile_t *nffile);
+
+static int QueueBlock(nffile_t *nffile);
+
+static int FlushWriteQueue(nffile_t *nffile);
+
+static void FreeWriteQueue(nffile_t *nffile);
+
+static void WorkerExit(writequeue_t *writequeue);
+
+static int ReadAheadBlock(nffile_t *nffile);
+
+static nffile_t *OpenFileStatic(char *filename, nffile_t *nffile, int use_mmap);
+
+static int MapFile(nffile_t *nffile, struct stat *stat_buf);
+
+static void UnmapFile(nffile_t *nffile);
+
+static int ReadMappedBlock(nffile_t *nffile);
+
+static void IndexBlock(data_block_header_t *block_header, block_index_t *entry);
+
+static void AppendBlockIndex(nffile_t *nffile, block_index_t *entry);
+
+static int CopyRawBlock(nffile_t *nffile, data_block_header_t *block_header, data_block_header_t *raw_block);
+
+static int WriteBlockIndex(nffile_t *nffile);
+
+static uint64_t FirstBlockOffset(int fd, file_header_t *file_header);
+
+static int SameBlockCompression(int fd, file_header_t *file_header, uint32_t compression);
+
+static uint64_t FindBlockIndex(int fd, file_header_t *file_header);
+
+static void LoadBlockIndex(nffile_t *nffile);
+
+static int DropBlockIndex(int fd, file_header_t *file_header);
+
+static int SkipBlocks(block_index_t *block_index, uint32_t index_entries, uint64_t index_offset, uint32_t *block_num, uint64_t *offset);
+
+static int StripBlock(block_index_t *block_index, uint32_t index_entries, uint32_t block_num, data_block_header_t *block_header);
+
 extern char *nf_error;
 
 /* function prototypes */
@@ -172,17 +375,67 @@ static void BZ2_prep_stream (bz_stream* bs)
    bs->opaque = NULL;
 } // End of BZ2_prep_stream
 
-static int Compress_Block_LZO(nffile_t *nffile) {
+#ifdef HAVE_ZSTD
+static int ZSTD_initialize(void) {
+
+	zstd_cctx = ZSTD_createCCtx();
+	if ( !zstd_cctx ) {
+		LogError("ZSTD_createCCtx() error in %s line %d\n", __FILE__, __LINE__);
+		return 0;
+	}
+	zstd_initialized = 1;
+
+	return 1;
+
+} // End of ZSTD_initialize
+
+static void FreeZstdDCtx(void *arg) {
+
+	ZSTD_freeDCtx((ZSTD_DCtx *)arg);
+
+} // End of FreeZstdDCtx
+
+static void CreateZstdDCtxKey(void) {
+
+	pthread_key_create(&zstd_dctx_key, FreeZstdDCtx);
+
+} // End of CreateZstdDCtxKey
+
+/*
+ * Blocks are decompressed by the reader, the read ahead and the query worker threads.
+ * Each thread creates its context with the first block and keeps it until it exits.
+ */
+static ZSTD_DCtx *ThreadZstdDCtx(void) {
+ZSTD_DCtx *dctx;
+
+	pthread_once(&zstd_dctx_once, CreateZstdDCtxKey);
+	dctx = (ZSTD_DCtx *)pthread_getspecific(zstd_dctx_key);
+	if ( dctx ) 
+		return dctx;
+
+	dctx = ZSTD_createDCtx();
+	if ( !dctx ) {
+		LogError("ZSTD_createDCtx() error in %s line %d\n", __FILE__, __LINE__);
+		return NULL;
+	}
+	pthread_setspecific(zstd_dctx_key, dctx);
+
+	return dctx;
+
+} // End of ThreadZstdDCtx
+#endif
+
+static int Compress_Block_LZO(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size, void *lzo_wrkmem) {
 unsigned char __LZO_MMODEL *in;
 unsigned char __LZO_MMODEL *out;
 lzo_uint in_len;
 lzo_uint out_len;
 int r;
 
-	in  = (unsigned char __LZO_MMODEL *)(nffile->buff_pool[0] + sizeof(data_block_header_t));	
-	out = (unsigned char __LZO_MMODEL *)(nffile->buff_pool[1] + sizeof(data_block_header_t));	
-	in_len = nffile->block_header->size;
-	r = lzo1x_1_compress(in,in_len,out,&out_len,wrkmem);
+	in  = (unsigned char __LZO_MMODEL *)((void *)in_block  + sizeof(data_block_header_t));	
+	out = (unsigned char __LZO_MMODEL *)((void *)out_block + sizeof(data_block_header_t));	
+	in_len = in_block->size;
+	r = lzo1x_1_compress(in,in_len,out,&out_len,lzo_wrkmem);
 
 	if (r != LZO_E_OK) {
 		LogError("Compress_Block_LZO() error compression failed in %s line %d: LZ4 : %d\n", __FILE__, __LINE__, r);
@@ -190,31 +443,24 @@ int r;
 	}
 	
 	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = out_len;
-
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
-
-	nffile->block_header = nffile->buff_pool[0];
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
 
 	return 1;
 
 } // End of Compress_Block_LZO
 
-static int Uncompress_Block_LZO(nffile_t *nffile) {
+static int Uncompress_Block_LZO(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size) {
 unsigned char __LZO_MMODEL *in;
 unsigned char __LZO_MMODEL *out;
 lzo_uint in_len;
 lzo_uint out_len;
 int r;
 
-	in  = (unsigned char __LZO_MMODEL *)(nffile->buff_pool[0] + sizeof(data_block_header_t));	
-	out = (unsigned char __LZO_MMODEL *)(nffile->buff_pool[1] + sizeof(data_block_header_t));	
-	in_len  = nffile->block_header->size;
-	out_len = nffile->buff_size;
+	in  = (unsigned char __LZO_MMODEL *)((void *)in_block  + sizeof(data_block_header_t));	
+	out = (unsigned char __LZO_MMODEL *)((void *)out_block + sizeof(data_block_header_t));	
+	in_len  = in_block->size;
+	out_len = block_size - sizeof(data_block_header_t);
 
 	if ( in_len == 0 ) {
 		LogError("Uncompress_Block_LZO() header length error in %s line %d\n", __FILE__, __LINE__);
@@ -228,28 +474,20 @@ int r;
 	}
 
 	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = out_len;
-
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
-
-	nffile->block_header = nffile->buff_pool[0];
-	nffile->buff_ptr 	 = nffile->buff_pool[0] + sizeof(data_block_header_t);
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
 
 	return 1;
 
 } // End of Uncompress_Block_LZO
 
-static int Compress_Block_LZ4(nffile_t *nffile) {
+static int Compress_Block_LZ4(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size) {
 
-	const char *in  = (const char *)(nffile->buff_pool[0] + sizeof(data_block_header_t));
-	char *out 		= (char *)(nffile->buff_pool[1] + sizeof(data_block_header_t));
-	int in_len 		= nffile->block_header->size;
+	const char *in  = (const char *)((void *)in_block + sizeof(data_block_header_t));
+	char *out 		= (char *)((void *)out_block + sizeof(data_block_header_t));
+	int in_len 		= in_block->size;
 
-	int out_len = LZ4_compress_default(in, out, in_len, nffile->buff_size);
+	int out_len = LZ4_compress_default(in, out, in_len, block_size - sizeof(data_block_header_t));
 	if (out_len == 0 ) {
 		LogError("Compress_Block_LZ4() error compression aborted in %s line %d: LZ4 : buffer too small\n", __FILE__, __LINE__);
    		return -1;
@@ -260,27 +498,20 @@ static int Compress_Block_LZ4(nffile_t *nffile) {
    	}
 
 	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = out_len;
-
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
-
-	nffile->block_header = nffile->buff_pool[0];
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
 
 	return 1;
 
 } // End of Compress_Block_LZ4
 
-static int Uncompress_Block_LZ4(nffile_t *nffile) {
+static int Uncompress_Block_LZ4(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size) {
 
-	const char *in  = (const char *)(nffile->buff_pool[0] + sizeof(data_block_header_t));
-	char *out 		= (char *)(nffile->buff_pool[1] + sizeof(data_block_header_t));
-	int in_len 		= nffile->block_header->size;
+	const char *in  = (const char *)((void *)in_block + sizeof(data_block_header_t));
+	char *out 		= (char *)((void *)out_block + sizeof(data_block_header_t));
+	int in_len 		= in_block->size;
 
-	int out_len = LZ4_decompress_safe(in, out, in_len, nffile->buff_size);
+	int out_len = LZ4_decompress_safe(in, out, in_len, block_size - sizeof(data_block_header_t));
 	if (out_len == 0 ) {
 		LogError("LZ4_decompress_safe() error compression aborted in %s line %d: LZ4 : buffer too small\n", __FILE__, __LINE__);
    		return -1;
@@ -291,52 +522,38 @@ static int Uncompress_Block_LZ4(nffile_t *nffile) {
    	}
 
 	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = out_len;
-
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
-
-	nffile->block_header = nffile->buff_pool[0];
-	nffile->buff_ptr 	 = nffile->buff_pool[0] + sizeof(data_block_header_t);
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
 
 	return 1;
 
 } // End of Uncompress_Block_LZ4
 
-static int Compress_Block_BZ2(nffile_t *nffile) {
+static int Compress_Block_BZ2(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size) {
 bz_stream bs;
 
 	BZ2_prep_stream (&bs);
 	BZ2_bzCompressInit (&bs, 9, 0, 0);
 
-	bs.next_in   = (char*)(nffile->buff_pool[0] + sizeof(data_block_header_t));
-	bs.next_out  = (char*)(nffile->buff_pool[1] + sizeof(data_block_header_t));
-	bs.avail_in  = nffile->block_header->size;
-	bs.avail_out = nffile->buff_size;
+	bs.next_in   = (char*)((void *)in_block  + sizeof(data_block_header_t));
+	bs.next_out  = (char*)((void *)out_block + sizeof(data_block_header_t));
+	bs.avail_in  = in_block->size;
+	bs.avail_out = block_size - sizeof(data_block_header_t);
  
 	for (;;) {
 		int r = BZ2_bzCompress (&bs, BZ_FINISH);
 		if (r == BZ_FINISH_OK) continue;
 		if (r != BZ_STREAM_END) {
 			LogError("Compress_Block_BZ2() error compression failed in %s line %d: LZ4 : %d\n", __FILE__, __LINE__, r);
+			BZ2_bzCompressEnd (&bs);
 			return -1;
 		}
 		break;
 	}
 
  	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = bs.total_out_lo32;
-
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
-
-	nffile->block_header = nffile->buff_pool[0];
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = bs.total_out_lo32;
 
 	BZ2_bzCompressEnd (&bs);
 	
@@ -344,16 +561,118 @@ bz_stream bs;
 
 } // End of Compress_Block_BZ2
 
-static int Uncompress_Block_BZ2(nffile_t *nffile) {
+#ifdef HAVE_ZSTD
+static int Compress_Block_ZSTD(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size, ZSTD_CCtx *cctx, ZSTD_CDict *cdict) {
+size_t out_len;
+
+	const void *in  = (const void *)((void *)in_block + sizeof(data_block_header_t));
+	void *out 		= (void *)((void *)out_block + sizeof(data_block_header_t));
+
+	// no context given - calling thread
+	if ( !cctx ) 
+		cctx = zstd_cctx;
+
+	if ( cdict ) 
+		out_len = ZSTD_compress_usingCDict(cctx, out, block_size - sizeof(data_block_header_t), in, in_block->size, cdict);
+	else
+		out_len = ZSTD_compressCCtx(cctx, out, block_size - sizeof(data_block_header_t), in, in_block->size, ZstdLevel);
+	if ( ZSTD_isError(out_len) ) {
+		LogError("Compress_Block_ZSTD() error compression failed in %s line %d: zstd : %s\n", __FILE__, __LINE__, ZSTD_getErrorName(out_len));
+		return -1;
+	}
+
+	// copy header
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
+
+	return 1;
+
+} // End of Compress_Block_ZSTD
+
+static int Uncompress_Block_ZSTD(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size, ZSTD_DDict *ddict) {
+ZSTD_DCtx *dctx;
+size_t out_len;
+
+	const void *in  = (const void *)((void *)in_block + sizeof(data_block_header_t));
+	void *out 		= (void *)((void *)out_block + sizeof(data_block_header_t));
+
+	dctx = ThreadZstdDCtx();
+	if ( !dctx ) 
+		return -1;
+
+	if ( ddict ) 
+		out_len = ZSTD_decompress_usingDDict(dctx, out, block_size - sizeof(data_block_header_t), in, in_block->size, ddict);
+	else
+		out_len = ZSTD_decompressDCtx(dctx, out, block_size - sizeof(data_block_header_t), in, in_block->size);
+
+	if ( ZSTD_isError(out_len) ) {
+		LogError("Uncompress_Block_ZSTD() error decompression failed in %s line %d: zstd : %s\n", __FILE__, __LINE__, ZSTD_getErrorName(out_len));
+		return -1;
+	}
+
+	// copy header
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = out_len;
+
+	return 1;
+
+} // End of Uncompress_Block_ZSTD
+#endif
+
+/*
+ * Compress in_block into out_block and record the codec in the block header.
+ * With RawBlocks, a block, which does not compress, is copied uncompressed into out_block.
+ */
+static int Compress_Block(uint32_t compression, data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size, void *lzo_wrkmem, void *zstd_cctx, void *zstd_cdict) {
+int ret;
+
+	switch (compression) {
+		case LZO_COMPRESSED: 
+			ret = Compress_Block_LZO(in_block, out_block, block_size, lzo_wrkmem);
+			break;
+		case LZ4_COMPRESSED: 
+			ret = Compress_Block_LZ4(in_block, out_block, block_size);
+			break;
+		case BZ2_COMPRESSED: 
+			ret = Compress_Block_BZ2(in_block, out_block, block_size);
+			break;
+		case ZSTD_COMPRESSED: 
+#ifdef HAVE_ZSTD
+			ret = Compress_Block_ZSTD(in_block, out_block, block_size, zstd_cctx, zstd_cdict);
+#else
+			LogError("zstd compression not supported\n");
+			ret = -1;
+#endif
+			break;
+		default:
+			// not compressed
+			return 1;
+	}
+
+	if ( ret < 0 ) 
+		return ret;
+
+	if ( RawBlocks && out_block->size >= in_block->size ) {
+		memcpy((void *)out_block, (void *)in_block, sizeof(data_block_header_t) + in_block->size);
+		out_block->flags = BLOCK_FLAG_RAW;
+	} else {
+		SetBlockCodec(out_block, compression);
+	}
+
+	return 1;
+
+} // End of Compress_Block
+
+static int Uncompress_Block_BZ2(data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size) {
 bz_stream bs;
 
 	BZ2_prep_stream (&bs);
 	BZ2_bzDecompressInit (&bs, 0, 0);
 
-	bs.next_in   = (char*)(nffile->buff_pool[0] + sizeof(data_block_header_t));
-	bs.next_out  = (char*)(nffile->buff_pool[1] + sizeof(data_block_header_t));
-	bs.avail_in  = nffile->block_header->size;
-	bs.avail_out = nffile->buff_size;
+	bs.next_in   = (char*)((void *)in_block  + sizeof(data_block_header_t));
+	bs.next_out  = (char*)((void *)out_block + sizeof(data_block_header_t));
+	bs.avail_in  = in_block->size;
+	bs.avail_out = block_size - sizeof(data_block_header_t);
  
 	for (;;) {
 		int r = BZ2_bzDecompress (&bs);
@@ -367,25 +686,1389 @@ bz_stream bs;
 		}
 	}
 
- 	// copy header
-	memcpy(nffile->buff_pool[1], nffile->buff_pool[0], sizeof(data_block_header_t));
-	((data_block_header_t *)nffile->buff_pool[1])->size = bs.total_out_lo32;
+ 	// copy header
+	memcpy(out_block, in_block, sizeof(data_block_header_t));
+	out_block->size = bs.total_out_lo32;
+
+	BZ2_bzDecompressEnd (&bs);
+	
+	return 1;
+
+} // End of Uncompress_Block_BZ2
+
+/*
+ * Codec of a block - blocks without a recorded codec use the file compression
+ */
+static uint32_t BlockCompression(data_block_header_t *block_header, uint32_t file_compression) {
+
+	if ( TestFlag(block_header->flags, BLOCK_FLAG_CODEC) ) 
+		return BLOCK_CODEC(block_header);
+	if ( block_header->flags == BLOCK_FLAG_RAW ) 
+		return NOT_COMPRESSED;
+	return file_compression;
+
+} // End of BlockCompression
+
+/*
+ * LAYOUT_VERSION_1 readers decompress all blocks with the file compression.
+ * Mark the file as LAYOUT_VERSION_1_CODEC, if a block is written with an other codec.
+ */
+static void CheckBlockCodec(file_header_t *file_header, uint32_t compression, data_block_header_t *block_header) {
+
+	if ( BlockCompression(block_header, compression) != compression ) 
+		file_header->version = LAYOUT_VERSION_1_CODEC;
+
+} // End of CheckBlockCodec
+
+static int Uncompress_Block(uint32_t compression, data_block_header_t *in_block, data_block_header_t *out_block, size_t block_size, void *zstd_ddict) {
+int ret;
+
+	switch (compression) {
+		case LZO_COMPRESSED: 
+			ret = Uncompress_Block_LZO(in_block, out_block, block_size);
+			break;
+		case LZ4_COMPRESSED: 
+			ret = Uncompress_Block_LZ4(in_block, out_block, block_size);
+			break;
+		case BZ2_COMPRESSED: 
+			ret = Uncompress_Block_BZ2(in_block, out_block, block_size);
+			break;
+		case ZSTD_COMPRESSED: 
+#ifdef HAVE_ZSTD
+			ret = Uncompress_Block_ZSTD(in_block, out_block, block_size, zstd_ddict);
+#else
+			LogError("zstd compression not supported\n");
+			ret = -1;
+#endif
+			break;
+		default:
+			LogError("Uncompress_Block() unknown block compression %u\n", compression);
+			ret = -1;
+	}
+
+	// the block is uncompressed now
+	if ( ret > 0 ) 
+		out_block->flags = BLOCK_FLAG_RAW;
+
+	return ret;
+
+} // End of Uncompress_Block
+
+static void *ReadAheadThread(void *arg) {
+readahead_t *readahead = (readahead_t *)arg;
+data_block_header_t *block_header;
+uint32_t slot, blocks_skipped;
+int ret;
+
+	blocks_skipped = readahead->blocks_skipped;
+
+	for (;;) {
+		pthread_mutex_lock(&readahead->mutex);
+		while ( readahead->count == readahead->num_buffs && !readahead->terminate ) 
+			pthread_cond_wait(&readahead->cond_free, &readahead->mutex);
+		if ( readahead->terminate ) {
+			pthread_mutex_unlock(&readahead->mutex);
+			break;
+		}
+		slot = readahead->tail;
+		pthread_mutex_unlock(&readahead->mutex);
+
+		ret = 1;
+		if ( readahead->index_entries ) {
+			uint64_t offset;
+			uint32_t skipped = SkipBlocks(readahead->block_index, readahead->index_entries, readahead->index_offset, &readahead->block_num, &offset);
+			if ( skipped ) {
+				blocks_skipped += skipped;
+				if ( lseek(readahead->fd, offset, SEEK_SET) < 0 ) {
+					LogError("lseek() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+					ret = NF_ERROR;
+				}
+			}
+		}
+
+		// read blocks directly into the ring - uncompressed blocks stay in place
+		block_header = readahead->ring[slot];
+		if ( ret > 0 ) {
+			ret = ReadRawBlock(readahead->fd, block_header);
+			if ( ret > 0 && block_header->id == DATA_BLOCK_TYPE_INDEX ) 
+				ret = NF_EOF;
+		}
+		if ( ret > 0 ) {
+			uint32_t compression = BlockCompression(block_header, readahead->compression);
+			if ( compression != NOT_COMPRESSED ) {
+				if ( Uncompress_Block(compression, block_header, readahead->raw_buff, readahead->buff_size, readahead->zstd_ddict) < 0 ) {
+					ret = NF_CORRUPT;
+				} else {
+					// swap buffers
+					readahead->ring[slot] = readahead->raw_buff;
+					readahead->raw_buff	  = block_header;
+					block_header		  = readahead->ring[slot];
+					ret = sizeof(data_block_header_t) + block_header->size;
+				}
+			}
+		}
+		if ( ret > 0 ) {
+			if ( readahead->index_entries && StripBlock(readahead->block_index, readahead->index_entries, readahead->block_num, block_header) ) 
+				blocks_skipped++;
+			readahead->block_num++;
+		}
+
+		pthread_mutex_lock(&readahead->mutex);
+		readahead->status[slot] = ret;
+		readahead->blocks_skipped = blocks_skipped;
+		readahead->tail = (readahead->tail + 1) % readahead->num_buffs;
+		readahead->count++;
+		pthread_cond_signal(&readahead->cond_ready);
+		pthread_mutex_unlock(&readahead->mutex);
+
+		// EOF or error - the status remains in the ring for the reader
+		if ( ret <= 0 ) 
+			break;
+	}
+
+	return NULL;
+
+} // End of ReadAheadThread
+
+static int StartReadAhead(nffile_t *nffile) {
+readahead_t *readahead;
+int i, err;
+
+	readahead = nffile->readahead;
+	if ( !readahead ) {
+		readahead = calloc(1, sizeof(readahead_t));
+		if ( !readahead ) {
+			LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			return 0;
+		}
+		readahead->num_buffs = ReadAheadBlocks;
+		readahead->buff_size = nffile->buff_size;
+		readahead->ring 	 = calloc(readahead->num_buffs, sizeof(void *));
+		readahead->status 	 = calloc(readahead->num_buffs, sizeof(int));
+		readahead->raw_buff  = malloc(readahead->buff_size);
+		if ( !readahead->ring || !readahead->status || !readahead->raw_buff ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			free(readahead->ring);
+			free(readahead->status);
+			free(readahead->raw_buff);
+			free(readahead);
+			return 0;
+		}
+		for (i=0; i<readahead->num_buffs; i++ ) {
+			readahead->ring[i] = malloc(readahead->buff_size);
+			if ( !readahead->ring[i] ) {
+				LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+				while ( --i >= 0 ) 
+					free(readahead->ring[i]);
+				free(readahead->ring);
+				free(readahead->status);
+				free(readahead->raw_buff);
+				free(readahead);
+				return 0;
+			}
+		}
+		pthread_mutex_init(&readahead->mutex, NULL);
+		pthread_cond_init(&readahead->cond_ready, NULL);
+		pthread_cond_init(&readahead->cond_free, NULL);
+		nffile->readahead = readahead;
+	}
+
+	readahead->fd 		   = nffile->fd;
+	readahead->compression = FILE_COMPRESSION(nffile);
+	readahead->zstd_ddict  = nffile->zstd_ddict;
+	readahead->head 	   = 0;
+	readahead->tail 	   = 0;
+	readahead->count 	   = 0;
+	readahead->in_use 	   = 0;
+	readahead->terminate   = 0;
+
+	readahead->block_index	 = nffile->block_index;
+	readahead->index_entries = nffile->index_entries;
+	readahead->index_offset	 = nffile->index_offset;
+	readahead->block_num	 = nffile->block_num;
+	readahead->blocks_skipped = nffile->blocks_skipped;
+
+	err = pthread_create(&readahead->tid, NULL, ReadAheadThread, (void *)readahead);
+	if ( err ) {
+		LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+		return 0;
+	}
+	readahead->running = 1;
+
+	return 1;
+
+} // End of StartReadAhead
+
+static void StopReadAhead(nffile_t *nffile) {
+readahead_t *readahead = nffile->readahead;
+
+	if ( !readahead || !readahead->running )
+		return;
+
+	pthread_mutex_lock(&readahead->mutex);
+	readahead->terminate = 1;
+	pthread_cond_signal(&readahead->cond_free);
+	pthread_mutex_unlock(&readahead->mutex);
+
+	pthread_join(readahead->tid, NULL);
+	readahead->running = 0;
+
+	// the block buffer belongs to the file again
+	nffile->block_header = nffile->buff_pool[0];
+	nffile->buff_ptr 	 = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
+
+} // End of StopReadAhead
+
+static void FreeReadAhead(nffile_t *nffile) {
+readahead_t *readahead = nffile->readahead;
+int i;
+
+	if ( !readahead )
+		return;
+
+	StopReadAhead(nffile);
+
+	for (i=0; i<readahead->num_buffs; i++ ) 
+		free(readahead->ring[i]);
+	free(readahead->ring);
+	free(readahead->status);
+	free(readahead->raw_buff);
+	pthread_mutex_destroy(&readahead->mutex);
+	pthread_cond_destroy(&readahead->cond_ready);
+	pthread_cond_destroy(&readahead->cond_free);
+	free(readahead);
+	nffile->readahead = NULL;
+
+} // End of FreeReadAhead
+
+static int ReadAheadBlock(nffile_t *nffile) {
+readahead_t *readahead = nffile->readahead;
+int ret;
+
+	pthread_mutex_lock(&readahead->mutex);
+
+	// release the block, handed out by the previous call
+	if ( readahead->in_use ) {
+		readahead->head = (readahead->head + 1) % readahead->num_buffs;
+		readahead->count--;
+		readahead->in_use = 0;
+		pthread_cond_signal(&readahead->cond_free);
+	}
+
+	while ( readahead->count == 0 ) 
+		pthread_cond_wait(&readahead->cond_ready, &readahead->mutex);
+
+	// EOF or error status is not released and returned again on subsequent calls
+	ret = readahead->status[readahead->head];
+	nffile->blocks_skipped = readahead->blocks_skipped;
+	if ( ret > 0 ) {
+		readahead->in_use 	 = 1;
+		nffile->block_header = readahead->ring[readahead->head];
+		nffile->buff_ptr 	 = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
+	}
+
+	pthread_mutex_unlock(&readahead->mutex);
+
+	return ret;
+
+} // End of ReadAheadBlock
+
+void SetReadAhead(int num_blocks) {
+
+	if ( num_blocks < 0 ) 
+		num_blocks = 0;
+	if ( num_blocks > MAX_READAHEAD ) 
+		num_blocks = MAX_READAHEAD;
+	// the block handed out to the reader holds a slot - one slot would not read ahead
+	if ( num_blocks == 1 ) 
+		num_blocks = 2;
+	ReadAheadBlocks = num_blocks;
+
+} // End of SetReadAhead
+
+int GetReadAhead(void) {
+	return ReadAheadBlocks;
+} // End of GetReadAhead
+
+/*
+ * A worker leaves the queue. If no worker is left, the queued blocks never get compressed.
+ * Flag the error and wake up all waiting threads.
+ */
+static void WorkerExit(writequeue_t *writequeue) {
+
+	pthread_mutex_lock(&writequeue->mutex);
+	writequeue->running--;
+	if ( writequeue->running == 0 && !writequeue->terminate ) 
+		writequeue->error = 1;
+	pthread_cond_broadcast(&writequeue->cond);
+	pthread_mutex_unlock(&writequeue->mutex);
+
+} // End of WorkerExit
+
+static void *CompressWorker(void *arg) {
+writequeue_t *writequeue = (writequeue_t *)arg;
+compress_job_t *job;
+void *lzo_wrkmem, *zstd_wrkctx;
+
+	// each worker needs its own LZO work memory and zstd context
+	lzo_wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+	if ( !lzo_wrkmem ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		WorkerExit(writequeue);
+		return NULL;
+	}
+	zstd_wrkctx = NULL;
+#ifdef HAVE_ZSTD
+	zstd_wrkctx = ZSTD_createCCtx();
+	if ( !zstd_wrkctx ) {
+		LogError("ZSTD_createCCtx() error in %s line %d\n", __FILE__, __LINE__);
+		free(lzo_wrkmem);
+		WorkerExit(writequeue);
+		return NULL;
+	}
+#endif
+
+	for (;;) {
+		pthread_mutex_lock(&writequeue->mutex);
+		while ( writequeue->claimed == writequeue->queued && !writequeue->terminate ) 
+			pthread_cond_wait(&writequeue->cond, &writequeue->mutex);
+		if ( writequeue->claimed == writequeue->queued ) {
+			// terminate and nothing left to compress
+			pthread_mutex_unlock(&writequeue->mutex);
+			break;
+		}
+		job = &writequeue->jobs[writequeue->claimed % writequeue->num_jobs];
+		writequeue->claimed++;
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&writequeue->mutex);
+
+		int ret = Compress_Block(writequeue->compression, job->in_block, job->out_block, writequeue->buff_size, 
+			lzo_wrkmem, zstd_wrkctx, writequeue->zstd_cdict);
+
+		pthread_mutex_lock(&writequeue->mutex);
+		job->ret   = ret;
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&writequeue->cond);
+		pthread_mutex_unlock(&writequeue->mutex);
+	}
+
+	free(lzo_wrkmem);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(zstd_wrkctx);
+#endif
+	WorkerExit(writequeue);
+	return NULL;
+
+} // End of CompressWorker
+
+static void *BlockWriter(void *arg) {
+writequeue_t *writequeue = (writequeue_t *)arg;
+compress_job_t *job;
+ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&writequeue->mutex);
+		job = &writequeue->jobs[writequeue->written % writequeue->num_jobs];
+		while ( !(writequeue->written < writequeue->queued && job->state == JOB_DONE) && 
+				!(writequeue->terminate && (writequeue->written == writequeue->queued || writequeue->running == 0)) )
+			pthread_cond_wait(&writequeue->cond, &writequeue->mutex);
+		if ( writequeue->written == writequeue->queued || job->state != JOB_DONE ) {
+			// terminate and nothing left to write or no worker left to compress the rest
+			pthread_mutex_unlock(&writequeue->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&writequeue->mutex);
+
+		// blocks are written strictly in queue order
+		if ( job->ret < 0 ) {
+			ret = -1;
+		} else {
+			ret = write(writequeue->fd, (void *)job->out_block, sizeof(data_block_header_t) + job->out_block->size);
+			if ( ret < 0 )
+				LogError("write() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		}
+
+		pthread_mutex_lock(&writequeue->mutex);
+		if ( ret > 0 ) {
+			nffile_t *nffile = writequeue->nffile;
+			CheckBlockCodec(writequeue->file_header, writequeue->compression, job->out_block);
+			if ( job->indexed ) {
+				job->index.offset = nffile->file_offset;
+				AppendBlockIndex(nffile, &job->index);
+			}
+			nffile->file_offset += ret;
+			writequeue->file_header->NumBlocks++;
+		} else
+			writequeue->error = 1;
+		job->state = JOB_FREE;
+		writequeue->written++;
+		pthread_cond_broadcast(&writequeue->cond);
+		pthread_mutex_unlock(&writequeue->mutex);
+	}
+
+	return NULL;
+
+} // End of BlockWriter
+
+static int StartWriteQueue(nffile_t *nffile) {
+writequeue_t *writequeue;
+int i, err;
+
+	writequeue = nffile->writequeue;
+	if ( writequeue && writequeue->running == 0 ) {
+		// all workers died with the previous file
+		FreeWriteQueue(nffile);
+		return 0;
+	}
+	if ( writequeue ) {
+		// threads are still running from the previous file - all blocks are flushed
+		writequeue->fd			= nffile->fd;
+		writequeue->compression	= FILE_COMPRESSION(nffile);
+		writequeue->zstd_cdict	= nffile->zstd_cdict;
+		writequeue->file_header	= nffile->file_header;
+		writequeue->nffile		= nffile;
+		writequeue->indexed		= nffile->block_index != NULL;
+		writequeue->error		= 0;
+		writequeue->active		= 1;
+		return 1;
+	}
+
+	writequeue = calloc(1, sizeof(writequeue_t));
+	if ( !writequeue ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+	writequeue->fd			= nffile->fd;
+	writequeue->compression	= FILE_COMPRESSION(nffile);
+	writequeue->zstd_cdict	= nffile->zstd_cdict;
+	writequeue->file_header	= nffile->file_header;
+	writequeue->nffile		= nffile;
+	writequeue->indexed		= nffile->block_index != NULL;
+	writequeue->buff_size	= nffile->buff_size;
+	writequeue->num_workers	= CompressWorkers;
+	writequeue->num_jobs	= 2 * CompressWorkers;
+	writequeue->workers		= calloc(writequeue->num_workers, sizeof(pthread_t));
+	writequeue->jobs		= calloc(writequeue->num_jobs, sizeof(compress_job_t));
+	if ( !writequeue->workers || !writequeue->jobs ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		free(writequeue->workers);
+		free(writequeue->jobs);
+		free(writequeue);
+		return 0;
+	}
+
+	for (i=0; i<writequeue->num_jobs; i++ ) {
+		writequeue->jobs[i].in_block  = malloc(writequeue->buff_size);
+		writequeue->jobs[i].out_block = malloc(writequeue->buff_size);
+		if ( !writequeue->jobs[i].in_block || !writequeue->jobs[i].out_block ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			for ( ; i>=0; i-- ) {
+				free(writequeue->jobs[i].in_block);
+				free(writequeue->jobs[i].out_block);
+			}
+			free(writequeue->workers);
+			free(writequeue->jobs);
+			free(writequeue);
+			return 0;
+		}
+		writequeue->jobs[i].state = JOB_FREE;
+	}
+
+	pthread_mutex_init(&writequeue->mutex, NULL);
+	pthread_cond_init(&writequeue->cond, NULL);
+
+	err = pthread_create(&writequeue->writer, NULL, BlockWriter, (void *)writequeue);
+	if ( err ) {
+		LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+		for (i=0; i<writequeue->num_jobs; i++ ) {
+			free(writequeue->jobs[i].in_block);
+			free(writequeue->jobs[i].out_block);
+		}
+		free(writequeue->workers);
+		free(writequeue->jobs);
+		free(writequeue);
+		return 0;
+	}
+	nffile->writequeue = writequeue;
+
+	writequeue->running = writequeue->num_workers;
+	for (i=0; i<writequeue->num_workers; i++ ) {
+		err = pthread_create(&writequeue->workers[i], NULL, CompressWorker, (void *)writequeue);
+		if ( err ) {
+			LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+			pthread_mutex_lock(&writequeue->mutex);
+			writequeue->running -= writequeue->num_workers - i;
+			writequeue->num_workers = i;
+			pthread_mutex_unlock(&writequeue->mutex);
+			break;
+		}
+	}
+	if ( writequeue->num_workers == 0 ) {
+		// stop the writer thread
+		FreeWriteQueue(nffile);
+		return 0;
+	}
+
+	writequeue->active = 1;
+
+	return 1;
+
+} // End of StartWriteQueue
+
+static int QueueBlock(nffile_t *nffile) {
+writequeue_t *writequeue = nffile->writequeue;
+compress_job_t *job;
+block_index_t entry;
+void *_tmp;
+int ret;
+
+	// the index itself is only accessed by the writer thread, while the queue is active
+	if ( writequeue->indexed ) 
+		IndexBlock(nffile->block_header, &entry);
+
+	pthread_mutex_lock(&writequeue->mutex);
+	job = &writequeue->jobs[writequeue->queued % writequeue->num_jobs];
+	while ( job->state != JOB_FREE && !writequeue->error ) 
+		pthread_cond_wait(&writequeue->cond, &writequeue->mutex);
+
+	if ( writequeue->error ) {
+		pthread_mutex_unlock(&writequeue->mutex);
+		return -1;
+	}
+
+	// hand over the filled block to the job and continue with the job's empty buffer
+	ret = sizeof(data_block_header_t) + nffile->block_header->size;
+	_tmp = job->in_block;
+	job->in_block		 = nffile->block_header;
+	nffile->buff_pool[0] = _tmp;
+	job->indexed = writequeue->indexed;
+	if ( job->indexed ) 
+		job->index = entry;
+	job->state = JOB_QUEUED;
+	writequeue->queued++;
+	pthread_cond_broadcast(&writequeue->cond);
+	pthread_mutex_unlock(&writequeue->mutex);
+
+	nffile->block_header = nffile->buff_pool[0];
+	nffile->block_header->size 		 = 0;
+	nffile->block_header->NumRecords = 0;
+	nffile->block_header->id		 = DATA_BLOCK_TYPE_2;
+	nffile->block_header->flags		 = 0;
+	nffile->buff_ptr = (void *)((pointer_addr_t) nffile->block_header + sizeof (data_block_header_t));
+
+	return ret;
+
+} // End of QueueBlock
+
+static int FlushWriteQueue(nffile_t *nffile) {
+writequeue_t *writequeue = nffile->writequeue;
+int error;
+
+	if ( !writequeue || !writequeue->active )
+		return 1;
+
+	// without workers the queued blocks never get written
+	pthread_mutex_lock(&writequeue->mutex);
+	while ( writequeue->written < writequeue->queued && writequeue->running ) 
+		pthread_cond_wait(&writequeue->cond, &writequeue->mutex);
+	error = writequeue->error;
+	writequeue->active = 0;
+	pthread_mutex_unlock(&writequeue->mutex);
+
+	return error ? 0 : 1;
+
+} // End of FlushWriteQueue
+
+static void FreeWriteQueue(nffile_t *nffile) {
+writequeue_t *writequeue = nffile->writequeue;
+int i;
+
+	if ( !writequeue ) 
+		return;
+
+	FlushWriteQueue(nffile);
+
+	pthread_mutex_lock(&writequeue->mutex);
+	writequeue->terminate = 1;
+	pthread_cond_broadcast(&writequeue->cond);
+	pthread_mutex_unlock(&writequeue->mutex);
+
+	pthread_join(writequeue->writer, NULL);
+	for (i=0; i<writequeue->num_workers; i++ ) 
+		pthread_join(writequeue->workers[i], NULL);
+
+	for (i=0; i<writequeue->num_jobs; i++ ) {
+		free(writequeue->jobs[i].in_block);
+		free(writequeue->jobs[i].out_block);
+	}
+	free(writequeue->workers);
+	free(writequeue->jobs);
+	pthread_mutex_destroy(&writequeue->mutex);
+	pthread_cond_destroy(&writequeue->cond);
+	free(writequeue);
+	nffile->writequeue = NULL;
+
+} // End of FreeWriteQueue
+
+void SetCompressWorkers(int num_workers) {
+
+	if ( num_workers < 0 ) 
+		num_workers = 0;
+	if ( num_workers > MAX_COMPRESS_WORKERS ) 
+		num_workers = MAX_COMPRESS_WORKERS;
+	CompressWorkers = num_workers;
+
+} // End of SetCompressWorkers
+
+static void FreeCompressCtx(void *arg) {
+compress_ctx_t *ctx = (compress_ctx_t *)arg;
+
+	free(ctx->lzo_wrkmem);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(ctx->zstd_cctx);
+#endif
+	free(ctx);
+
+} // End of FreeCompressCtx
+
+static void CreateCompressKey(void) {
+
+	pthread_key_create(&compress_key, FreeCompressCtx);
+
+} // End of CreateCompressKey
+
+int InitThreadCompression(void) {
+compress_ctx_t *ctx;
+
+	pthread_once(&compress_once, CreateCompressKey);
+	if ( pthread_getspecific(compress_key) ) 
+		return 1;
+
+	ctx = (compress_ctx_t *)calloc(1, sizeof(compress_ctx_t));
+	if ( !ctx ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+	ctx->lzo_wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+	if ( !ctx->lzo_wrkmem ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		free(ctx);
+		return 0;
+	}
+#ifdef HAVE_ZSTD
+	ctx->zstd_cctx = ZSTD_createCCtx();
+	if ( !ctx->zstd_cctx ) {
+		LogError("ZSTD_createCCtx() error in %s line %d\n", __FILE__, __LINE__);
+		free(ctx->lzo_wrkmem);
+		free(ctx);
+		return 0;
+	}
+#endif
+	pthread_setspecific(compress_key, ctx);
+
+	return 1;
+
+} // End of InitThreadCompression
+
+/* compress a block with the context of the calling thread */
+static int CompressThreadBlock(uint32_t compression, data_block_header_t *in_block, data_block_header_t *out_block, 
+	size_t block_size, void *zstd_cdict) {
+compress_ctx_t *ctx;
+
+	pthread_once(&compress_once, CreateCompressKey);
+	ctx = (compress_ctx_t *)pthread_getspecific(compress_key);
+	if ( ctx ) 
+		return Compress_Block(compression, in_block, out_block, block_size, ctx->lzo_wrkmem, ctx->zstd_cctx, zstd_cdict);
+	else
+		return Compress_Block(compression, in_block, out_block, block_size, wrkmem, NULL, zstd_cdict);
+
+} // End of CompressThreadBlock
+
+static int MapFile(nffile_t *nffile, struct stat *stat_buf) {
+off_t offset;
+void *p;
+
+	// first data block - the header and a dictionary block are read already
+	offset = lseek(nffile->fd, 0, SEEK_CUR);
+	if ( offset < 0 || stat_buf->st_size < offset ) 
+		return 0;
+
+	// private writable mapping: records may be modified in place while processed
+	p = mmap(NULL, stat_buf->st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, nffile->fd, 0);
+	if ( p == MAP_FAILED ) {
+		LogError("mmap() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	madvise(p, stat_buf->st_size, MADV_SEQUENTIAL);
+#endif
+
+	nffile->map_base	= p;
+	nffile->map_size	= stat_buf->st_size;
+	nffile->map_offset	= offset;
+	nffile->map_advised	= 0;
+
+	return 1;
+
+} // End of MapFile
+
+static void UnmapFile(nffile_t *nffile) {
+
+	if ( !nffile->map_base ) 
+		return;
+
+	munmap(nffile->map_base, nffile->map_size);
+	nffile->map_base	= NULL;
+	nffile->map_size	= 0;
+	nffile->map_offset	= 0;
+	nffile->map_advised	= 0;
+
+	// a mapped block may have been handed out
+	nffile->block_header = nffile->buff_pool[0];
+	nffile->buff_ptr 	 = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
+
+} // End of UnmapFile
+
+static int ReadMappedBlock(nffile_t *nffile) {
+data_block_header_t *block_header;
+uint32_t compression;
+size_t remain;
+int ret;
+
+	if ( nffile->index_entries ) {
+		uint64_t offset;
+		uint32_t skipped = SkipBlocks(nffile->block_index, nffile->index_entries, nffile->index_offset, &nffile->block_num, &offset);
+		if ( skipped ) {
+			nffile->blocks_skipped += skipped;
+			nffile->map_offset = offset;
+		}
+	}
+
+	remain = nffile->map_size - nffile->map_offset;
+	if ( remain == 0 )	// EOF
+		return NF_EOF;
+
+	if ( remain < sizeof(data_block_header_t) ) {
+		// this is most likely a corrupt file
+		LogError("Corrupt data file: Read %zu bytes, requested %u\n", remain, sizeof(data_block_header_t));
+		return NF_CORRUPT;
+	}
+
+	block_header = (data_block_header_t *)((pointer_addr_t)nffile->map_base + nffile->map_offset);
+
+	// Check for sane buffer size
+	if ( block_header->size > BUFFSIZE ||
+	     block_header->size == 0 || block_header->NumRecords == 0) {
+		// this is most likely a corrupt file
+		LogError("Corrupt data file: Requested buffer size %u exceeds max. buffer size", block_header->size);
+		return NF_CORRUPT;
+	}
+
+	if ( (sizeof(data_block_header_t) + block_header->size) > remain ) {
+		LogError("ReadBlock() Corrupt data file: Unexpected EOF while reading data block.\n");
+		return NF_CORRUPT;
+	}
+
+	// the index block follows the last data block
+	if ( block_header->id == DATA_BLOCK_TYPE_INDEX ) 
+		return NF_EOF;
+
+	nffile->map_offset += sizeof(data_block_header_t) + block_header->size;
+	nffile->block_num++;
+
+#ifdef MADV_WILLNEED
+	// page in the next range ahead of the cursor
+	if ( (nffile->map_offset + MMAP_WILLNEED) > nffile->map_advised && nffile->map_advised < nffile->map_size ) {
+		size_t pagesize = getpagesize();
+		size_t start 	= nffile->map_offset & ~(pagesize - 1);
+		size_t len 		= nffile->map_size - start;
+		if ( len > 2*MMAP_WILLNEED ) 
+			len = 2*MMAP_WILLNEED;
+		madvise((void *)((pointer_addr_t)nffile->map_base + start), len, MADV_WILLNEED);
+		nffile->map_advised = start + len;
+	}
+#endif
+
+	compression = BlockCompression(block_header, FILE_COMPRESSION(nffile));
+	if ( compression == NOT_COMPRESSED ) {
+		// zero copy - hand out the block in the mapping
+		nffile->block_header = block_header;
+	} else {
+		// decompress straight from the mapping
+		if ( Uncompress_Block(compression, block_header, nffile->buff_pool[0], nffile->buff_size, nffile->zstd_ddict) < 0 ) 
+			return NF_CORRUPT;
+		nffile->block_header = nffile->buff_pool[0];
+	}
+	ret = sizeof(data_block_header_t) + nffile->block_header->size;
+
+	// the mapping is private - a block in the mapping may be modified
+	if ( nffile->index_entries && StripBlock(nffile->block_index, nffile->index_entries, nffile->block_num - 1, nffile->block_header) ) 
+		nffile->blocks_skipped++;
+
+	nffile->buff_ptr = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
+	return ret;
+
+} // End of ReadMappedBlock
+
+void SetMmapReader(int enable) {
+	MmapReader = enable;
+} // End of SetMmapReader
+
+void SetBlockIndex(int enable) {
+	BlockIndex = enable;
+} // End of SetBlockIndex
+
+void SetRawBlocks(int enable) {
+	RawBlocks = enable;
+} // End of SetRawBlocks
+
+void SetBlockFilter(block_filter_t filter) {
+	BlockFilter = filter;
+} // End of SetBlockFilter
+
+/*
+ * Set zstd level and optional dictionary for new files.
+ * level 0 selects the zstd default level
+ */
+int SetZstdCompression(int level, char *dictfile) {
+#ifdef HAVE_ZSTD
+struct stat stat_buf;
+void *dict;
+int fd;
+
+	if ( level < ZSTD_minCLevel() || level > ZSTD_maxCLevel() ) {
+		LogError("zstd compression level %i out of range %i..%i\n", level, ZSTD_minCLevel(), ZSTD_maxCLevel());
+		return 0;
+	}
+	ZstdLevel = level;
+
+	if ( !dictfile ) 
+		return 1;
+
+	if ( stat(dictfile, &stat_buf) ) {
+		LogError("Can't stat '%s': %s\n", dictfile, strerror(errno));
+		return 0;
+	}
+	if ( stat_buf.st_size == 0 || stat_buf.st_size > MAX_ZSTD_DICT ) {
+		LogError("zstd dictionary '%s': size %lld out of range\n", dictfile, (long long)stat_buf.st_size);
+		return 0;
+	}
+
+	fd = open(dictfile, O_RDONLY);
+	if ( fd < 0 ) {
+		LogError("Error open file: %s\n", strerror(errno));
+		return 0;
+	}
+	dict = malloc(stat_buf.st_size);
+	if ( !dict ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		close(fd);
+		return 0;
+	}
+	if ( read(fd, dict, stat_buf.st_size) != stat_buf.st_size ) {
+		LogError("read() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		free(dict);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	free(ZstdDict);
+	ZstdDict	 = dict;
+	ZstdDictSize = stat_buf.st_size;
+
+	return 1;
+#else
+	LogError("zstd compression not supported\n");
+	return 0;
+#endif
+
+} // End of SetZstdCompression
+
+/*
+ * Read the dictionary block of a file opened for reading
+ */
+static int ReadZstdDict(nffile_t *nffile) {
+data_block_header_t *block_header;
+
+	// no block is read yet - the block buffers are free
+	block_header = nffile->buff_pool[1];
+	if ( ReadRawBlock(nffile->fd, block_header) <= 0 || block_header->id != DATA_BLOCK_TYPE_DICT ||
+		 block_header->size > MAX_ZSTD_DICT ) {
+		LogError("Failed to read zstd dictionary\n");
+		return 0;
+	}
+
+	nffile->zstd_dict = malloc(block_header->size);
+	if ( !nffile->zstd_dict ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+	memcpy(nffile->zstd_dict, (void *)((pointer_addr_t)block_header + sizeof(data_block_header_t)), block_header->size);
+	nffile->zstd_dict_size = block_header->size;
+
+#ifdef HAVE_ZSTD
+	nffile->zstd_ddict = ZSTD_createDDict(nffile->zstd_dict, nffile->zstd_dict_size);
+	if ( !nffile->zstd_ddict ) {
+		LogError("ZSTD_createDDict() error in %s line %d\n", __FILE__, __LINE__);
+		return 0;
+	}
+#endif
+
+	return 1;
+
+} // End of ReadZstdDict
+
+static void FreeZstdDict(nffile_t *nffile) {
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCDict(nffile->zstd_cdict);
+	ZSTD_freeDDict(nffile->zstd_ddict);
+#endif
+	free(nffile->zstd_dict);
+	nffile->zstd_dict		= NULL;
+	nffile->zstd_dict_size	= 0;
+	nffile->zstd_cdict		= NULL;
+	nffile->zstd_ddict		= NULL;
+
+} // End of FreeZstdDict
+
+/*
+ * Compare the dictionary blocks of two files.
+ * Returns 1, if both files hold the same dictionary
+ */
+static int SameZstdDict(int fd1, int fd2) {
+file_header_t file_header;
+data_block_header_t dict_header[2];
+void *dict[2];
+int i, fd[2], same;
+
+	fd[0] = fd1;
+	fd[1] = fd2;
+	for ( i=0; i<2; i++ ) {
+		if ( pread(fd[i], (void *)&file_header, sizeof(file_header_t), 0) != sizeof(file_header_t) || 
+			 !TestFlag(file_header.flags, FLAG_ZSTD_DICT) ||
+			 pread(fd[i], (void *)&dict_header[i], sizeof(data_block_header_t), sizeof(file_header_t) + sizeof(stat_record_t)) != 
+				sizeof(data_block_header_t) ||
+			 dict_header[i].id != DATA_BLOCK_TYPE_DICT || dict_header[i].size > MAX_ZSTD_DICT ) 
+			return 0;
+	}
+	if ( dict_header[0].size != dict_header[1].size ) 
+		return 0;
+
+	same = 0;
+	dict[0] = malloc(dict_header[0].size);
+	dict[1] = malloc(dict_header[1].size);
+	if ( dict[0] && dict[1] ) {
+		same = 1;
+		for ( i=0; i<2; i++ ) {
+			if ( pread(fd[i], dict[i], dict_header[i].size, sizeof(file_header_t) + sizeof(stat_record_t) + sizeof(data_block_header_t)) != 
+				 dict_header[i].size ) 
+				same = 0;
+		}
+		if ( same ) 
+			same = memcmp(dict[0], dict[1], dict_header[0].size) == 0;
+	} else {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+	}
+	free(dict[0]);
+	free(dict[1]);
+
+	return same;
+
+} // End of SameZstdDict
+
+/*
+ * Calculate the index entry of an uncompressed data block.
+ * The offset is set, when the block gets written.
+ */
+static void IndexBlock(data_block_header_t *block_header, block_index_t *entry) {
+master_record_t	master_record;
+record_header_t	*record_ptr;
+common_record_t	*flow_record;
+uint64_t		*addr;
+uint32_t		i, j, sumSize, *u;
+
+	memset((void *)entry, 0, sizeof(block_index_t));
+	entry->NumRecords  = block_header->NumRecords;
+	entry->first_min   = 0xffffffff;
+	entry->last_min	   = 0xffffffff;
+	entry->srcport_min = 0xffff;
+	entry->dstport_min = 0xffff;
+	for ( j=0; j<4; j++ ) 
+		entry->addr_min[j] = 0xffffffffffffffffLL;
+
+	// addresses are indexed as the filter engine sees them in the master record
+	addr = master_record.ip_union._ip_64.addr;
+
+	sumSize = 0;
+	record_ptr = (record_header_t *)((pointer_addr_t)block_header + sizeof(data_block_header_t));
+	for ( i=0; i < block_header->NumRecords; i++ ) {
+		if ( (sumSize + sizeof(record_header_t)) > block_header->size || record_ptr->size < sizeof(record_header_t) ||
+			 (sumSize + record_ptr->size) > block_header->size ) {
+			// inconsistent block - leave it to the reader
+			entry->flags |= BLOCK_INDEX_NOSKIP;
+			return;
+		}
+		sumSize += record_ptr->size;
+
+		if ( record_ptr->type != CommonRecordType ) {
+			// extension maps, exporter and sampler records are required by the following blocks
+			entry->flags |= BLOCK_INDEX_META;
+			record_ptr = (record_header_t *)((pointer_addr_t)record_ptr + record_ptr->size);
+			continue;
+		}
+
+		flow_record = (common_record_t *)record_ptr;
+		if ( (flow_record->flags & FLAG_IPV6_ADDR) != 0 ) {
+			if ( record_ptr->size < (COMMON_RECORD_DATA_SIZE + 4 * sizeof(uint64_t)) ) {
+				entry->flags |= BLOCK_INDEX_NOSKIP;
+				return;
+			}
+			memcpy((void *)addr, (void *)flow_record->data, 4 * sizeof(uint64_t));
+		} else {
+			if ( record_ptr->size < (COMMON_RECORD_DATA_SIZE + 2 * sizeof(uint32_t)) ) {
+				entry->flags |= BLOCK_INDEX_NOSKIP;
+				return;
+			}
+			u = (uint32_t *)flow_record->data;
+			master_record.V6.srcaddr[0] = 0;
+			master_record.V6.srcaddr[1] = 0;
+			master_record.V4.srcaddr 	= u[0];
+			master_record.V6.dstaddr[0] = 0;
+			master_record.V6.dstaddr[1] = 0;
+			master_record.V4.dstaddr 	= u[1];
+		}
+		for ( j=0; j<4; j++ ) {
+			if ( addr[j] < entry->addr_min[j] ) 
+				entry->addr_min[j] = addr[j];
+			if ( addr[j] > entry->addr_max[j] ) 
+				entry->addr_max[j] = addr[j];
+		}
+
+		if ( flow_record->first < entry->first_min )
+			entry->first_min = flow_record->first;
+		if ( flow_record->first > entry->first_max )
+			entry->first_max = flow_record->first;
+		if ( flow_record->last < entry->last_min )
+			entry->last_min = flow_record->last;
+		if ( flow_record->last > entry->last_max )
+			entry->last_max = flow_record->last;
+
+		if ( flow_record->srcport < entry->srcport_min )
+			entry->srcport_min = flow_record->srcport;
+		if ( flow_record->srcport > entry->srcport_max )
+			entry->srcport_max = flow_record->srcport;
+		if ( flow_record->dstport < entry->dstport_min )
+			entry->dstport_min = flow_record->dstport;
+		if ( flow_record->dstport > entry->dstport_max )
+			entry->dstport_max = flow_record->dstport;
+
+		entry->proto_map[flow_record->prot >> 3] |= 1 << (flow_record->prot & 0x7);
+
+		record_ptr = (record_header_t *)((pointer_addr_t)record_ptr + record_ptr->size);
+	}
+
+} // End of IndexBlock
+
+static void AppendBlockIndex(nffile_t *nffile, block_index_t *entry) {
+block_index_t *block_index;
+
+	// index dropped after an error
+	if ( nffile->index_max == 0 ) 
+		return;
+
+	if ( nffile->index_entries == nffile->index_max ) {
+		block_index = realloc(nffile->block_index, 2 * nffile->index_max * sizeof(block_index_t));
+		if ( !block_index ) {
+			LogError("realloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			nffile->index_max = 0;
+			return;
+		}
+		nffile->block_index = block_index;
+		nffile->index_max	= 2 * nffile->index_max;
+	}
+	nffile->block_index[nffile->index_entries++] = *entry;
+
+} // End of AppendBlockIndex
+
+static int WriteBlockIndex(nffile_t *nffile) {
+data_block_header_t *in_block, *out_block;
+size_t size;
+ssize_t ret;
+int compression;
+
+	if ( nffile->index_max == 0 || nffile->index_entries == 0 ) 
+		return 1;
+
+	size = nffile->index_entries * sizeof(block_index_t);
+	if ( size > BUFFSIZE ) {
+		LogError("Block index of %u blocks exceeds max. buffer size - skipped\n", nffile->index_entries);
+		return 0;
+	}
+
+	// all data blocks are written - use the empty block buffer
+	in_block = nffile->block_header;
+	in_block->NumRecords = nffile->index_entries;
+	in_block->size		 = size;
+	in_block->id		 = DATA_BLOCK_TYPE_INDEX;
+	in_block->flags		 = 0;
+	memcpy((void *)((pointer_addr_t)in_block + sizeof(data_block_header_t)), (void *)nffile->block_index, size);
+
+	// compress the index as any other block
+	compression = FILE_COMPRESSION(nffile);
+	out_block	= in_block;
+	ret = 1;
+	if ( compression != NOT_COMPRESSED ) {
+		out_block = nffile->buff_pool[1];
+		if ( CompressThreadBlock(compression, in_block, out_block, nffile->buff_size, nffile->zstd_cdict) < 0 ) 
+			ret = -1;
+		else
+			CheckBlockCodec(nffile->file_header, compression, out_block);
+	}
+
+	if ( ret > 0 ) {
+		ret = write(nffile->fd, (void *)out_block, sizeof(data_block_header_t) + out_block->size);
+		if ( ret < 0 )
+			LogError("write() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+	}
+
+	in_block->NumRecords = 0;
+	in_block->size		 = 0;
+	in_block->id		 = DATA_BLOCK_TYPE_2;
+	if ( ret <= 0 ) 
+		return 0;
+
+	SetFlag(nffile->file_header->flags, FLAG_BLOCK_INDEX);
+
+	return 1;
+
+} // End of WriteBlockIndex
+
+/*
+ * File offset of the first data block after the stat record and the dictionary block.
+ * Returns 0 if the dictionary block is not found.
+ */
+static uint64_t FirstBlockOffset(int fd, file_header_t *file_header) {
+data_block_header_t block_header;
+uint64_t offset;
+
+	offset = sizeof(file_header_t) + sizeof(stat_record_t);
+	if ( TestFlag(file_header->flags, FLAG_ZSTD_DICT) ) {
+		if ( pread(fd, (void *)&block_header, sizeof(data_block_header_t), offset) != sizeof(data_block_header_t) ||
+			 block_header.id != DATA_BLOCK_TYPE_DICT ) 
+			return 0;
+		offset += sizeof(data_block_header_t) + block_header.size;
+	}
+
+	return offset;
+
+} // End of FirstBlockOffset
+
+/*
+ * Walk the data block headers to find the index block.
+ * Returns the file offset of the index block or 0 if not found.
+ */
+static uint64_t FindBlockIndex(int fd, file_header_t *file_header) {
+data_block_header_t block_header;
+uint64_t offset;
+uint32_t i;
+
+	offset = FirstBlockOffset(fd, file_header);
+	if ( offset == 0 ) 
+		return 0;
+
+	for ( i=0; i < file_header->NumBlocks; i++ ) {
+		if ( pread(fd, (void *)&block_header, sizeof(data_block_header_t), offset) != sizeof(data_block_header_t) ||
+			 block_header.size > BUFFSIZE ) 
+			return 0;
+		offset += sizeof(data_block_header_t) + block_header.size;
+	}
+
+	if ( pread(fd, (void *)&block_header, sizeof(data_block_header_t), offset) != sizeof(data_block_header_t) ||
+		 block_header.id != DATA_BLOCK_TYPE_INDEX ) 
+		return 0;
+
+	return offset;
+
+} // End of FindBlockIndex
+
+/*
+ * Load the block index of a file opened for reading, if a block filter is set.
+ */
+static void LoadBlockIndex(nffile_t *nffile) {
+data_block_header_t *block_header;
+block_index_t *block_index;
+uint64_t offset, next;
+uint32_t i, compression;
+
+	nffile->index_entries  = 0;
+	nffile->index_offset   = 0;
+	nffile->block_num	   = 0;
+	nffile->blocks_skipped = 0;
+
+	if ( !BlockFilter || !TestFlag(nffile->file_header->flags, FLAG_BLOCK_INDEX) || nffile->fd == STDIN_FILENO ) 
+		return;
+
+	offset = FindBlockIndex(nffile->fd, nffile->file_header);
+	if ( offset == 0 ) {
+		LogError("Block index not found - read all blocks\n");
+		return;
+	}
+
+	// no block is read yet - the block buffers are free
+	block_header = nffile->buff_pool[1];
+	if ( pread(nffile->fd, (void *)block_header, sizeof(data_block_header_t), offset) != sizeof(data_block_header_t) ||
+		 block_header->size > BUFFSIZE ||
+		 pread(nffile->fd, (void *)((pointer_addr_t)block_header + sizeof(data_block_header_t)), block_header->size, 
+			 offset + sizeof(data_block_header_t)) != block_header->size ) {
+		LogError("Failed to read block index - read all blocks\n");
+		return;
+	}
+
+	compression = BlockCompression(block_header, FILE_COMPRESSION(nffile));
+	if ( compression != NOT_COMPRESSED ) {
+		if ( Uncompress_Block(compression, nffile->buff_pool[1], nffile->buff_pool[0], nffile->buff_size, nffile->zstd_ddict) < 0 ) 
+			return;
+		block_header = nffile->buff_pool[0];
+	}
+
+	if ( block_header->NumRecords != nffile->file_header->NumBlocks ||
+		 block_header->size != (block_header->NumRecords * sizeof(block_index_t)) ) {
+		LogError("Corrupt block index - read all blocks\n");
+		return;
+	}
+
+	// blocks must be in file order
+	block_index = (block_index_t *)((pointer_addr_t)block_header + sizeof(data_block_header_t));
+	next = lseek(nffile->fd, 0, SEEK_CUR);
+	for ( i=0; i < block_header->NumRecords; i++ ) {
+		if ( block_index[i].offset < next || block_index[i].offset >= offset ) {
+			LogError("Corrupt block index - read all blocks\n");
+			return;
+		}
+		next = block_index[i].offset + sizeof(data_block_header_t);
+	}
+
+	if ( nffile->index_max < block_header->NumRecords ) {
+		block_index = realloc(nffile->block_index, block_header->NumRecords * sizeof(block_index_t));
+		if ( !block_index ) {
+			LogError("realloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			return;
+		}
+		nffile->block_index = block_index;
+		nffile->index_max	= block_header->NumRecords;
+	}
+	memcpy((void *)nffile->block_index, (void *)((pointer_addr_t)block_header + sizeof(data_block_header_t)), block_header->size);
+	nffile->index_entries = block_header->NumRecords;
+	nffile->index_offset  = offset;
+
+} // End of LoadBlockIndex
+
+/*
+ * Data blocks appended to a file are not covered by its index.
+ * Truncate the index block and clear the index flag
+ */
+static int DropBlockIndex(int fd, file_header_t *file_header) {
+uint64_t offset;
+
+	offset = FindBlockIndex(fd, file_header);
+	if ( offset && ftruncate(fd, offset) < 0 ) {
+		LogError("ftruncate() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+
+	ClearFlag(file_header->flags, FLAG_BLOCK_INDEX);
+	if ( pwrite(fd, (void *)file_header, sizeof(file_header_t), 0) != sizeof(file_header_t) ) {
+		LogError("pwrite() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return 0;
+	}
+
+	return 1;
+
+} // End of DropBlockIndex
+
+/*
+ * Advance block_num past all blocks, which the block filter rejects.
+ * Returns the number of skipped blocks and the file offset of the next block to read in offset.
+ */
+static int SkipBlocks(block_index_t *block_index, uint32_t index_entries, uint64_t index_offset, uint32_t *block_num, uint64_t *offset) {
+uint32_t num, skipped;
+
+	skipped = 0;
+	num		= *block_num;
+	while ( num < index_entries && (block_index[num].flags & (BLOCK_INDEX_NOSKIP | BLOCK_INDEX_META)) == 0 && 
+			!BlockFilter(&block_index[num]) ) {
+		num++;
+		skipped++;
+	}
+
+	if ( skipped ) {
+		// past the last data block, the index block is read as EOF
+		*offset 	= num < index_entries ? block_index[num].offset : index_offset;
+		*block_num	= num;
+	}
+
+	return skipped;
+
+} // End of SkipBlocks
+
+/*
+ * A block with extension maps or exporter records is read, even if the block filter
+ * rejects its flows. Remove the flow records from the uncompressed block, so only the
+ * other records get processed. Returns 1, if the flows were removed.
+ */
+static int StripBlock(block_index_t *block_index, uint32_t index_entries, uint32_t block_num, data_block_header_t *block_header) {
+record_header_t *record_ptr, *out_ptr;
+uint32_t i, sumSize, numRecords;
 
-	// swap buffers
-	void *_tmp = nffile->buff_pool[1];
-	nffile->buff_pool[1] = nffile->buff_pool[0];
-	nffile->buff_pool[0] = _tmp;
+	if ( block_num >= index_entries || !TestFlag(block_index[block_num].flags, BLOCK_INDEX_META) || 
+		 TestFlag(block_index[block_num].flags, BLOCK_INDEX_NOSKIP) || BlockFilter(&block_index[block_num]) ) 
+		return 0;
 
-	nffile->block_header = nffile->buff_pool[0];
-	nffile->buff_ptr 	 = nffile->buff_pool[0] + sizeof(data_block_header_t);
+	// check the block first - an inconsistent block is left to the reader
+	sumSize = 0;
+	record_ptr = (record_header_t *)((pointer_addr_t)block_header + sizeof(data_block_header_t));
+	for ( i=0; i < block_header->NumRecords; i++ ) {
+		if ( (sumSize + sizeof(record_header_t)) > block_header->size || record_ptr->size < sizeof(record_header_t) ||
+			 (sumSize + record_ptr->size) > block_header->size ) 
+			return 0;
+		sumSize += record_ptr->size;
+		record_ptr = (record_header_t *)((pointer_addr_t)record_ptr + record_ptr->size);
+	}
+
+	sumSize 	= 0;
+	numRecords	= 0;
+	record_ptr 	= (record_header_t *)((pointer_addr_t)block_header + sizeof(data_block_header_t));
+	out_ptr 	= record_ptr;
+	for ( i=0; i < block_header->NumRecords; i++ ) {
+		uint16_t size = record_ptr->size;
+		if ( record_ptr->type != CommonRecordType ) {
+			if ( out_ptr != record_ptr ) 
+				memmove((void *)out_ptr, (void *)record_ptr, size);
+			out_ptr = (record_header_t *)((pointer_addr_t)out_ptr + size);
+			sumSize += size;
+			numRecords++;
+		}
+		record_ptr = (record_header_t *)((pointer_addr_t)record_ptr + size);
+	}
+	block_header->NumRecords = numRecords;
+	block_header->size		 = sumSize;
 
-	BZ2_bzDecompressEnd (&bs);
-	
 	return 1;
 
-} // End of Uncompress_Block_BZ2
+} // End of StripBlock
 
-nffile_t *OpenFile(char *filename, nffile_t *nffile){
+nffile_t *OpenFile(char *filename, nffile_t *nffile) {
+	return OpenFileStatic(filename, nffile, MmapReader);
+} // End of OpenFile
+
+nffile_t *OpenFileMap(char *filename, nffile_t *nffile) {
+	return OpenFileStatic(filename, nffile, 1);
+} // End of OpenFileMap
+
+static nffile_t *OpenFileStatic(char *filename, nffile_t *nffile, int use_mmap) {
 struct stat stat_buf;
 int ret, allocated;
 
@@ -398,6 +2081,8 @@ int ret, allocated;
 	} else 
 		allocated = 0;
 
+	// dictionary of a previous file
+	FreeZstdDict(nffile);
 
 	if ( filename == NULL ) {
 		// stdin
@@ -443,7 +2128,7 @@ int ret, allocated;
 		}
 	}
 
-	if ( nffile->file_header->version != LAYOUT_VERSION_1 ) {
+	if ( nffile->file_header->version != LAYOUT_VERSION_1 && nffile->file_header->version != LAYOUT_VERSION_1_CODEC ) {
 		LogError("Open file %s: bad version: %u\n", filename, nffile->file_header->version );
 		CloseFile(nffile);
 		if ( allocated ) {
@@ -486,17 +2171,51 @@ int ret, allocated;
 				return NULL;
 			}
 			break;
+		case ZSTD_COMPRESSED: 
+#ifndef HAVE_ZSTD
+			LogError("Open file %s: zstd compression not supported\n", filename ? filename : "<stdin>");
+			CloseFile(nffile);
+			if ( allocated ) {
+				DisposeFile(nffile);
+				return NULL;
+			}
+#endif
+			break;
+	}
+
+	// the dictionary block follows the stat record
+	if ( TestFlag(nffile->file_header->flags, FLAG_ZSTD_DICT) && !ReadZstdDict(nffile) ) {
+		CloseFile(nffile);
+		if ( allocated ) {
+			DisposeFile(nffile);
+			return NULL;
+		}
 	}
 
+	LoadBlockIndex(nffile);
+
+	// uncompressed and LZ4 files may be mapped - other files are read
+	if ( use_mmap && filename && (compression == NOT_COMPRESSED || compression == LZ4_COMPRESSED) && 
+		 MapFile(nffile, &stat_buf) ) 
+		return nffile;
+
+	// stdin is always read synchronously
+	if ( ReadAheadBlocks && nffile->fd != STDIN_FILENO && !StartReadAhead(nffile) ) 
+		LogError("Failed to start read ahead - continue without\n");
+
 	return nffile;
 
-} // End of OpenFile
+} // End of OpenFileStatic
 
 void CloseFile(nffile_t *nffile){
 
 	if ( !nffile ) 
 		return;
 
+	StopReadAhead(nffile);
+	UnmapFile(nffile);
+	FlushWriteQueue(nffile);
+
 	// do not close stdout
 	if ( nffile->fd )
 		close(nffile->fd);
@@ -537,7 +2256,7 @@ int fd;
 		close(fd);
 		return -1;
 	}
-	if ( FileHeader.version != LAYOUT_VERSION_1 ) {
+	if ( FileHeader.version != LAYOUT_VERSION_1 && FileHeader.version != LAYOUT_VERSION_1_CODEC ) {
 		LogError("Open file %s: bad version: %u\n", filename, FileHeader.version );
 		close(fd);
 		return -1;
@@ -652,6 +2371,11 @@ int i;
 nffile_t *DisposeFile(nffile_t *nffile) {
 int i;
 
+	FreeReadAhead(nffile);
+	FreeWriteQueue(nffile);
+	UnmapFile(nffile);
+	FreeZstdDict(nffile);
+	free(nffile->block_index);
 	free(nffile->file_header);
 	free(nffile->stat_record);
 
@@ -691,6 +2415,17 @@ int 			fd, flags;
 				return NULL;
 			}
 			break;
+#ifdef HAVE_ZSTD
+		case ZSTD_COMPRESSED:
+			flags = FLAG_ZSTD_COMPRESSED;
+			if ( !zstd_initialized && !ZSTD_initialize() ) {
+				LogError("Failed to initialize zstd compression");
+				return NULL;
+			}
+			if ( ZstdDict ) 
+				SetFlag(flags, FLAG_ZSTD_DICT);
+			break;
+#endif
 		default:
 			LogError("Unknown compression ID: %i\n", compress);
 			return NULL;
@@ -717,6 +2452,23 @@ int 			fd, flags;
 
 	nffile->fd = fd;
 
+	FreeZstdDict(nffile);
+#ifdef HAVE_ZSTD
+	if ( TestFlag(flags, FLAG_ZSTD_DICT) ) {
+		nffile->zstd_dict  = malloc(ZstdDictSize);
+		nffile->zstd_cdict = ZSTD_createCDict(ZstdDict, ZstdDictSize, ZstdLevel);
+		if ( !nffile->zstd_dict || !nffile->zstd_cdict ) {
+			LogError("Failed to load zstd dictionary in %s line %d\n", __FILE__, __LINE__);
+			FreeZstdDict(nffile);
+			close(nffile->fd);
+			nffile->fd = 0;
+			return NULL;
+		}
+		memcpy(nffile->zstd_dict, ZstdDict, ZstdDictSize);
+		nffile->zstd_dict_size = ZstdDictSize;
+	}
+#endif
+
 	if ( anonymized ) 
 		SetFlag(flags, FLAG_ANONYMIZED);
 
@@ -733,6 +2485,21 @@ int 			fd, flags;
 		nffile->file_header->ident[IDENTLEN - 1] = 0;
 	} 
 
+	// stdout is not seekable - no index
+	nffile->index_entries = 0;
+	nffile->file_offset	  = sizeof(file_header_t) + sizeof(stat_record_t);
+	if ( BlockIndex && nffile->fd != STDOUT_FILENO ) {
+		if ( nffile->index_max == 0 ) {
+			free(nffile->block_index);
+			nffile->block_index = malloc(BLOCK_INDEX_ENTRIES * sizeof(block_index_t));
+			nffile->index_max	= nffile->block_index ? BLOCK_INDEX_ENTRIES : 0;
+		}
+	} else {
+		free(nffile->block_index);
+		nffile->block_index = NULL;
+		nffile->index_max	= 0;
+	}
+
 	nffile->file_header->NumBlocks = 0;
 	len = sizeof(file_header_t);
 	if ( write(nffile->fd, (void *)nffile->file_header, len) < len ) {
@@ -751,6 +2518,31 @@ int 			fd, flags;
 		return NULL;
 	}
 
+	// the dictionary is stored uncompressed ahead of the data blocks
+	if ( nffile->zstd_dict ) {
+		data_block_header_t dict_header;
+		struct iovec iov[2];
+		dict_header.NumRecords = 1;
+		dict_header.size	   = nffile->zstd_dict_size;
+		dict_header.id		   = DATA_BLOCK_TYPE_DICT;
+		dict_header.flags	   = 0;
+		iov[0].iov_base = (void *)&dict_header;
+		iov[0].iov_len	= sizeof(data_block_header_t);
+		iov[1].iov_base = nffile->zstd_dict;
+		iov[1].iov_len	= nffile->zstd_dict_size;
+		len = sizeof(data_block_header_t) + nffile->zstd_dict_size;
+		if ( writev(nffile->fd, iov, 2) != (ssize_t)len ) {
+			LogError("writev() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			close(nffile->fd);
+			nffile->fd = 0;
+			return NULL;
+		}
+		nffile->file_offset += len;
+	}
+
+	if ( CompressWorkers && compress != NOT_COMPRESSED && !StartWriteQueue(nffile) ) 
+		LogError("Failed to start compression workers - continue without\n");
+
 	return nffile;
 
 } /* End of OpenNewFile */
@@ -764,7 +2556,26 @@ nffile_t		*nffile;
 		return NULL;
 
 	// file is valid - re-open the file mode RDWR
+	StopReadAhead(nffile);
+	UnmapFile(nffile);
 	close(nffile->fd);
+
+	// appended blocks are not indexed
+	free(nffile->block_index);
+	nffile->block_index	  = NULL;
+	nffile->index_entries = 0;
+	nffile->index_max	  = 0;
+	if ( TestFlag(nffile->file_header->flags, FLAG_BLOCK_INDEX) ) {
+		int fd = open(filename, O_RDWR);
+		if ( fd < 0 || !DropBlockIndex(fd, nffile->file_header) ) {
+			LogError("Failed to remove block index of file %s\n", filename);
+			if ( fd >= 0 ) 
+				close(fd);
+			DisposeFile(nffile);
+			return NULL;
+		}
+		close(fd);
+	}
 	nffile->fd = open(filename, O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
 	if ( nffile->fd < 0 ) {
 		LogError("Failed to open file %s: '%s'" , filename, strerror(errno));
@@ -814,16 +2625,55 @@ nffile_t		*nffile;
 				return NULL;
 			}
 			break;
+#ifdef HAVE_ZSTD
+		case ZSTD_COMPRESSED: 
+			if ( !zstd_initialized && !ZSTD_initialize() ) {
+				LogError("Failed to initialize zstd compression");
+				close(nffile->fd);
+				DisposeFile(nffile);
+				return NULL;
+			}
+			// appended blocks are compressed with the dictionary of the file
+			if ( nffile->zstd_dict ) {
+				nffile->zstd_cdict = ZSTD_createCDict(nffile->zstd_dict, nffile->zstd_dict_size, ZstdLevel);
+				if ( !nffile->zstd_cdict ) {
+					LogError("Failed to load zstd dictionary in %s line %d\n", __FILE__, __LINE__);
+					close(nffile->fd);
+					DisposeFile(nffile);
+					return NULL;
+				}
+			}
+			break;
+#endif
 	}
 
 	return nffile;
 
 } /* End of AppendFile */
 
+// compression of the file compression flags, returned by OpenRaw()
+static uint32_t FlagCompression(int compressed) {
+
+	switch (compressed) {
+		case FLAG_LZO_COMPRESSED:
+			return LZO_COMPRESSED;
+		case FLAG_BZ2_COMPRESSED:
+			return BZ2_COMPRESSED;
+		case FLAG_LZ4_COMPRESSED:
+			return LZ4_COMPRESSED;
+		case FLAG_ZSTD_COMPRESSED:
+			return ZSTD_COMPRESSED;
+	}
+	return NOT_COMPRESSED;
+
+} // End of FlagCompression
+
 int RenameAppend(char *from, char *to) {
 int fd_to, fd_from, ret;
-int compressed_to, compressed_from;
+int compressed_to, compressed_from, other_codec;
+uint32_t compression, compression_from, compression_to, num_blocks;
 stat_record_t stat_record_to, stat_record_from;
+file_header_t file_header_to;
 data_block_header_t *block_header;
 void *p;
 
@@ -840,6 +2690,29 @@ void *p;
 		return 0;
 	}
 
+	// zstd blocks can only be decompressed with the dictionary, they are compressed with
+	if ( compressed_from == FLAG_ZSTD_COMPRESSED ) {
+		file_header_t file_header;
+		if ( pread(fd_from, (void *)&file_header, sizeof(file_header_t), 0) == sizeof(file_header_t) &&
+			 TestFlag(file_header.flags, FLAG_ZSTD_DICT) && !SameZstdDict(fd_from, fd_to) ) {
+			LogError("Can not append '%s' to '%s': zstd dictionary differs\n", from, to);
+			close(fd_from);
+			close(fd_to);
+			return 0;
+		}
+	}
+
+	// the index of the existing file does not cover the appended blocks
+	if ( fd_to > 0 ) {
+		file_header_t file_header;
+		if ( pread(fd_to, (void *)&file_header, sizeof(file_header_t), 0) == sizeof(file_header_t) &&
+			 TestFlag(file_header.flags, FLAG_BLOCK_INDEX) && !DropBlockIndex(fd_to, &file_header) ) {
+			close(fd_from);
+			close(fd_to);
+			return 0;
+		}
+	}
+
 	// both files open - append data
 	ret = lseek(fd_to, 0, SEEK_END);
 	if ( ret < 0 ) {
@@ -858,6 +2731,11 @@ void *p;
 	}
 	p = (void *)((void *)block_header + sizeof(data_block_header_t));
 
+	compression_from = FlagCompression(compressed_from);
+	compression_to	 = FlagCompression(compressed_to);
+
+	num_blocks = 0;
+	other_codec = 0;
 	while (1) {
 		ret = read(fd_from, (void *)block_header, sizeof(data_block_header_t));
 		if ( ret == 0 ) 
@@ -870,6 +2748,10 @@ void *p;
 			break;
 		}
 
+		// index block follows the last data block - not appended
+		if ( block_header->id == DATA_BLOCK_TYPE_INDEX ) 
+			break;
+
 		// read data block
 		ret = read(fd_from, p, block_header->size);
 		if ( ret != block_header->size ) {
@@ -877,6 +2759,20 @@ void *p;
 			LogError("read() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 			break;
 		}
+
+		// the dictionary is already checked - not appended
+		if ( block_header->id == DATA_BLOCK_TYPE_DICT ) 
+			continue;
+
+		// the target file may have another compression - record the codec in the block
+		compression = BlockCompression(block_header, compression_from);
+		if ( compression == NOT_COMPRESSED ) 
+			block_header->flags = BLOCK_FLAG_RAW;
+		else
+			SetBlockCodec(block_header, compression);
+		if ( compression != compression_to ) 
+			other_codec = 1;
+
 		// append data block
 		ret = write(fd_to, block_header, sizeof(data_block_header_t) + block_header->size);
 		if ( ret < 0 ) {
@@ -884,6 +2780,25 @@ void *p;
 			LogError("write() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 			break;
 		}
+		num_blocks++;
+	}
+	free(block_header);
+
+	// update number of blocks
+	if ( pread(fd_to, (void *)&file_header_to, sizeof(file_header_t), 0) != sizeof(file_header_t) ) {
+		LogError("pread() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		close(fd_from);
+		close(fd_to);
+		return 0;
+	}
+	file_header_to.NumBlocks += num_blocks;
+	if ( other_codec ) 
+		file_header_to.version = LAYOUT_VERSION_1_CODEC;
+	if ( pwrite(fd_to, (void *)&file_header_to, sizeof(file_header_t), 0) != sizeof(file_header_t) ) {
+		LogError("pwrite() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		close(fd_from);
+		close(fd_to);
+		return 0;
 	}
 
 	SumStatRecords(&stat_record_to, &stat_record_from);
@@ -947,7 +2862,7 @@ int fd, ret;
 		return -1;
 	}
 
-	if ( file_header.version != LAYOUT_VERSION_1 ) {
+	if ( file_header.version != LAYOUT_VERSION_1 && file_header.version != LAYOUT_VERSION_1_CODEC ) {
 		LogError("Open file %s: bad version: %u\n", filename, file_header.version );
 		close(fd);
 		return -1;
@@ -966,6 +2881,8 @@ int fd, ret;
 		*compressed = FLAG_LZ4_COMPRESSED;
 	else if ( file_header.flags & FLAG_BZ2_COMPRESSED )
 		*compressed = FLAG_BZ2_COMPRESSED;
+	else if ( file_header.flags & FLAG_ZSTD_COMPRESSED )
+		*compressed = FLAG_ZSTD_COMPRESSED;
 	else
 		*compressed = 0;
 
@@ -983,6 +2900,18 @@ int CloseUpdateFile(nffile_t *nffile, char *ident) {
 		}
 	}
 
+	// wait for all queued blocks to be compressed and written, before NumBlocks is final
+	if ( !FlushWriteQueue(nffile) ) {
+		LogError("Failed to flush output buffer");
+		return 0;
+	}
+
+	// the index is appended after the last data block
+	if ( nffile->block_index ) {
+		WriteBlockIndex(nffile);
+		nffile->index_entries = 0;
+	}
+
 	if ( lseek(nffile->fd, 0, SEEK_SET) < 0 ) {
 		// lseek on stdout works if output redirected:
 		// e.g. -w - > outfile
@@ -1021,12 +2950,11 @@ int CloseUpdateFile(nffile_t *nffile, char *ident) {
 
 } /* End of CloseUpdateFile */
 
-int ReadBlock(nffile_t *nffile) {
+static int ReadRawBlock(int fd, data_block_header_t *block_header) {
 ssize_t ret, read_bytes, buff_bytes, request_size;
 void 	*read_ptr;
-uint32_t compression;
 
-	ret = read(nffile->fd, nffile->block_header, sizeof(data_block_header_t));
+	ret = read(fd, block_header, sizeof(data_block_header_t));
 	if ( ret == 0 )		// EOF
 		return NF_EOF;
 		
@@ -1044,60 +2972,20 @@ uint32_t compression;
 	read_bytes = ret;
 
 	// Check for sane buffer size
-	if ( nffile->block_header->size > BUFFSIZE ||
-	     nffile->block_header->size == 0 || nffile->block_header->NumRecords == 0) {
+	if ( block_header->size > BUFFSIZE ||
+	     block_header->size == 0 || block_header->NumRecords == 0) {
 		// this is most likely a corrupt file
-		LogError("Corrupt data file: Requested buffer size %u exceeds max. buffer size", nffile->block_header->size);
-		return NF_CORRUPT;
-	}
-
-	// check block compression - defaults to file compression setting
-
-	compression = FILE_COMPRESSION(nffile);
-	ret = read(nffile->fd, nffile->buff_ptr, nffile->block_header->size);
-	if ( ret == nffile->block_header->size ) {
-		// we have the whole record and are done for now
-		switch (compression) {
-			case NOT_COMPRESSED:
-				break;
-			case LZO_COMPRESSED: 
-				if ( Uncompress_Block_LZO(nffile) < 0 ) 
-					return NF_CORRUPT;
-				break;
-			case LZ4_COMPRESSED: 
-				if ( Uncompress_Block_LZ4(nffile) < 0 ) 
-					return NF_CORRUPT;
-				break;
-			case BZ2_COMPRESSED: 
-				if ( Uncompress_Block_BZ2(nffile) < 0 )
-					return NF_CORRUPT;
-			break;
-		}
-		nffile->buff_ptr = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
-		return read_bytes + nffile->block_header->size;
-	} 
-			
-	if ( ret == 0 ) {
-		// EOF not expected here - this should never happen, file may be corrupt
-		LogError("ReadBlock() Corrupt data file: Unexpected EOF while reading data block.\n");
+		LogError("Corrupt data file: Requested buffer size %u exceeds max. buffer size", block_header->size);
 		return NF_CORRUPT;
 	}
 
-	if ( ret == -1 ) {	// ERROR
-		LogError("read() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
-		return NF_ERROR;
-	}
-
-	// Ups! - ret is != block_header->size
-	// this was a short read - most likely reading from the stdin pipe
 	// loop until we have requested size
-
-	buff_bytes 	 = ret;								// already in buffer
-	request_size = nffile->block_header->size - buff_bytes;	// still to go for this amount of data
-
-	read_ptr 	 = (void *)((pointer_addr_t)nffile->buff_ptr + buff_bytes);	
+	// a short read is most likely reading from the stdin pipe
+	buff_bytes 	 = 0;
+	request_size = block_header->size;
+	read_ptr 	 = (void *)((pointer_addr_t)block_header + sizeof(data_block_header_t));
 	do {
-		ret = read(nffile->fd, read_ptr, request_size);
+		ret = read(fd, read_ptr, request_size);
 		if ( ret < 0 ) {
 			// -1: Error - not expected
 			LogError("read() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
@@ -1106,65 +2994,104 @@ uint32_t compression;
 
 		if ( ret == 0 ) {
 			//  0: EOF   - not expected
-			LogError("read() corrupt data file: Unexpected EOF in %s line %d: %s\n", __FILE__, __LINE__);
+			LogError("ReadBlock() Corrupt data file: Unexpected EOF while reading data block.\n");
 			return NF_CORRUPT;
 		} 
 		
 		buff_bytes 	 += ret;
-		request_size = nffile->block_header->size - buff_bytes;
+		request_size = block_header->size - buff_bytes;
+		read_ptr 	 = (void *)((pointer_addr_t)read_ptr + ret);
+	} while ( request_size > 0 );
+
+	return read_bytes + block_header->size;
+
+} // End of ReadRawBlock
+
+int ReadBlock(nffile_t *nffile) {
+int ret;
+uint32_t compression;
+
+	if ( nffile->map_base ) 
+		return ReadMappedBlock(nffile);
+
+	if ( nffile->readahead && nffile->readahead->running ) 
+		return ReadAheadBlock(nffile);
 
-		if ( request_size > 0 ) {
-			// still a short read - continue in read loop
-			read_ptr = (void *)((pointer_addr_t)nffile->buff_ptr + buff_bytes);
+	if ( nffile->index_entries ) {
+		uint64_t offset;
+		uint32_t skipped = SkipBlocks(nffile->block_index, nffile->index_entries, nffile->index_offset, &nffile->block_num, &offset);
+		if ( skipped ) {
+			nffile->blocks_skipped += skipped;
+			if ( lseek(nffile->fd, offset, SEEK_SET) < 0 ) {
+				LogError("lseek() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+				return NF_ERROR;
+			}
 		}
-	} while ( request_size > 0 );
+	}
 
-	switch (compression) {
-		case NOT_COMPRESSED:
-			break;
-		case LZO_COMPRESSED: 
-			if ( Uncompress_Block_LZO(nffile) < 0 ) 
-				return NF_CORRUPT;
-			break;
-		case LZ4_COMPRESSED: 
-			if ( Uncompress_Block_LZ4(nffile) < 0 ) 
-				return NF_CORRUPT;
-			break;
-		case BZ2_COMPRESSED: 
-			if ( Uncompress_Block_BZ2(nffile) < 0 )
-				return NF_CORRUPT;
-		break;
+	ret = ReadRawBlock(nffile->fd, nffile->block_header);
+	if ( ret <= 0 )
+		return ret;
+
+	// the index block follows the last data block
+	if ( nffile->block_header->id == DATA_BLOCK_TYPE_INDEX ) 
+		return NF_EOF;
+	nffile->block_num++;
+
+	// check block compression - defaults to file compression setting
+	compression = BlockCompression(nffile->block_header, FILE_COMPRESSION(nffile));
+	if ( compression != NOT_COMPRESSED ) {
+		if ( Uncompress_Block(compression, nffile->buff_pool[0], nffile->buff_pool[1], nffile->buff_size, nffile->zstd_ddict) < 0 ) 
+			return NF_CORRUPT;
+
+		// swap buffers
+		void *_tmp = nffile->buff_pool[1];
+		nffile->buff_pool[1] = nffile->buff_pool[0];
+		nffile->buff_pool[0] = _tmp;
+		nffile->block_header = nffile->buff_pool[0];
 	}
+	ret = sizeof(data_block_header_t) + nffile->block_header->size;
+
+	if ( nffile->index_entries && StripBlock(nffile->block_index, nffile->index_entries, nffile->block_num - 1, nffile->block_header) ) 
+		nffile->blocks_skipped++;
 
 	nffile->buff_ptr = (void *)((pointer_addr_t)nffile->block_header + sizeof(data_block_header_t));
-	return read_bytes + nffile->block_header->size;
+	return ret;
 
 } // End of ReadBlock
 
 int WriteBlock(nffile_t *nffile) {
+data_block_header_t *out_block;
+block_index_t entry;
 int ret, compression;
 
 	// empty blocks need not to be stored 
 	if ( nffile->block_header->size == 0 )
 		return 1;
 
+	if ( nffile->writequeue && nffile->writequeue->active ) 
+		return QueueBlock(nffile);
+
+	if ( nffile->block_index ) 
+		IndexBlock(nffile->block_header, &entry);
+
+	// compress into the second buffer - the block buffer remains in place
 	compression = FILE_COMPRESSION(nffile);
-	switch (compression) {
-		case NOT_COMPRESSED:
-			break;
-		case LZO_COMPRESSED: 
-			if ( Compress_Block_LZO(nffile) < 0 ) return -1;
-			break;
-		case LZ4_COMPRESSED:
-			if ( Compress_Block_LZ4(nffile) < 0 ) return -1;
-			break;
-		case BZ2_COMPRESSED:
-			if ( Compress_Block_BZ2(nffile) < 0 ) return -1;
-		break;
+	out_block	= nffile->block_header;
+	if ( compression != NOT_COMPRESSED ) {
+		out_block = nffile->buff_pool[1];
+		if ( CompressThreadBlock(compression, nffile->block_header, out_block, nffile->buff_size, nffile->zstd_cdict) < 0 ) 
+			return -1;
+		CheckBlockCodec(nffile->file_header, compression, out_block);
 	}
 
-	ret = write(nffile->fd, (void *)nffile->block_header, sizeof(data_block_header_t) + nffile->block_header->size);
+	ret = write(nffile->fd, (void *)out_block, sizeof(data_block_header_t) + out_block->size);
 	if (ret > 0) {
+		if ( nffile->block_index ) {
+			entry.offset = nffile->file_offset;
+			AppendBlockIndex(nffile, &entry);
+		}
+		nffile->file_offset += ret;
 		nffile->block_header->size = 0;
 		nffile->block_header->NumRecords = 0;
 		nffile->buff_ptr = (void *)((pointer_addr_t) nffile->block_header + sizeof (data_block_header_t));
@@ -1175,13 +3102,78 @@ int ret, compression;
 
 } // End of WriteBlock
 
+/*
+ * Check the codec of all data blocks of a file with file compression compression.
+ * Returns 1, if all blocks are compressed with compression
+ */
+static int SameBlockCompression(int fd, file_header_t *file_header, uint32_t compression) {
+data_block_header_t block_header;
+uint64_t offset;
+uint32_t i, block_compression;
+
+	offset = FirstBlockOffset(fd, file_header);
+	if ( offset == 0 ) 
+		return 0;
+
+	for ( i=0; i < file_header->NumBlocks; i++ ) {
+		if ( pread(fd, (void *)&block_header, sizeof(data_block_header_t), offset) != sizeof(data_block_header_t) ) 
+			return 0;
+		block_compression = BlockCompression(&block_header, compression);
+		if ( block_compression != compression ) 
+			return 0;
+		offset += sizeof(data_block_header_t) + block_header.size;
+	}
+
+	return 1;
+
+} // End of SameBlockCompression
+
+/*
+ * Write a block, which is already compressed with the codec of nffile, unchanged.
+ * raw_block holds the uncompressed data of the block for the block index.
+ */
+static int CopyRawBlock(nffile_t *nffile, data_block_header_t *block_header, data_block_header_t *raw_block) {
+block_index_t entry;
+ssize_t ret;
+
+	// blocks must be written in order
+	if ( !FlushWriteQueue(nffile) ) 
+		return -1;
+
+	if ( nffile->block_index ) 
+		IndexBlock(raw_block, &entry);
+
+	ret = write(nffile->fd, (void *)block_header, sizeof(data_block_header_t) + block_header->size);
+	if ( ret > 0 ) {
+		if ( nffile->block_index ) {
+			entry.offset = nffile->file_offset;
+			AppendBlockIndex(nffile, &entry);
+		}
+		nffile->file_offset += ret;
+		nffile->file_header->NumBlocks++;
+	}
+
+	return ret;
+
+} // End of CopyRawBlock
+
+/*
+ * Recompress all files of the file sequence with compression compress.
+ * Each file is rewritten into a new file, which replaces the old one.
+ * Blocks already compressed with compress are copied unchanged, all others
+ * get uncompressed and compressed again. The block index of a file is rebuilt.
+ */
 void ModifyCompressFile(char * rfile, char *Rfile, int compress) {
-int 			i, anonymized, compression;
+int 			i, anonymized, compression, block_index, raw_copy, done;
 ssize_t			ret;
 nffile_t		*nffile_r, *nffile_w;
+data_block_header_t *block_header, *raw_block;
 stat_record_t	*_s;
 char 			*filename, outfile[MAXPATHLEN];
 
+	// blocks are read unchanged from the file
+	SetReadAhead(0);
+	SetMmapReader(0);
 	SetupInputFileSequence(NULL, rfile, Rfile);
 
 	nffile_r = NULL;
@@ -1198,8 +3190,9 @@ char 			*filename, outfile[MAXPATHLEN];
 			break;
 		}
 	
+		// blocks may be compressed with other codecs than the file compression
 		compression = FILE_COMPRESSION(nffile_r);
-		if ( compression == compress ) {
+		if ( compression == compress && SameBlockCompression(nffile_r->fd, nffile_r->file_header, compress) ) {
 			printf("File %s is already same compression methode\n", filename);
 			continue;
 		}
@@ -1210,48 +3203,73 @@ char 			*filename, outfile[MAXPATHLEN];
 
 		anonymized = IP_ANONYMIZED(nffile_r);
 
-		// allocate output file
+		// allocate output file - keep the block index of the file
+		block_index = BlockIndex;
+		if ( TestFlag(nffile_r->file_header->flags, FLAG_BLOCK_INDEX) ) 
+			BlockIndex = 1;
 		nffile_w = OpenNewFile(outfile, NULL, compress, anonymized, NULL);
+		BlockIndex = block_index;
 		if ( !nffile_w ) {
 			CloseFile(nffile_r);
 			DisposeFile(nffile_r);
 			break;;
 		}
 
+		// zstd blocks are copied only, if both files use the same dictionary
+		raw_copy = compress != ZSTD_COMPRESSED || 
+			( !TestFlag(nffile_r->file_header->flags, FLAG_ZSTD_DICT) && !TestFlag(nffile_w->file_header->flags, FLAG_ZSTD_DICT) ) ||
+			SameZstdDict(nffile_r->fd, nffile_w->fd);
+
 		// swap stat records :)
 		_s = nffile_r->stat_record;
 		nffile_r->stat_record = nffile_w->stat_record;
 		nffile_w->stat_record = _s;
 	
-		for ( i=0; i < nffile_r->file_header->NumBlocks; i++ ) {
-			ret = ReadBlock(nffile_r);
+		done = 1;
+		for ( i=0; i < nffile_r->file_header->NumBlocks && done; i++ ) {
+			done = 0;
+			block_header = nffile_r->buff_pool[0];
+			ret = ReadRawBlock(nffile_r->fd, block_header);
+			if ( ret == NF_EOF || ( ret > 0 && block_header->id == DATA_BLOCK_TYPE_INDEX ) ) {
+				LogError("Unexpected end of file %s: %u of %u blocks read. Abort.\n", filename, i, nffile_r->file_header->NumBlocks);
+				break;
+			}
 			if ( ret < 0 ) {
-				LogError("Error while reading data block. Abort.\n");
-				CloseFile(nffile_r);
-				DisposeFile(nffile_r);
-				CloseFile(nffile_w);
-				DisposeFile(nffile_w);
-				unlink(outfile);
-				return;
+				LogError("Error while reading data block of file %s. Abort.\n", filename);
+				break;
 			}
 
-			// swap buffers
-			void *_tmp = nffile_r->buff_pool[0];
-			nffile_r->buff_pool[0] = nffile_w->buff_pool[0];
-			nffile_w->buff_pool[0] = _tmp;
-			nffile_w->block_header = nffile_w->buff_pool[0];
-			nffile_r->block_header = nffile_r->buff_pool[0];
-			nffile_r->buff_ptr = (void *)((pointer_addr_t)nffile_r->block_header + sizeof(data_block_header_t));
+			compression = BlockCompression(block_header, FILE_COMPRESSION(nffile_r));
+			raw_block	= block_header;
+			if ( compression != NOT_COMPRESSED ) {
+				raw_block = nffile_r->buff_pool[1];
+				if ( Uncompress_Block(compression, block_header, raw_block, nffile_r->buff_size, nffile_r->zstd_ddict) < 0 ) {
+					LogError("Corrupt data block %u in file %s. Abort.\n", i, filename);
+					break;
+				}
+			}
 
-			if ( WriteBlock(nffile_w) <= 0 ) {
+			if ( compression == compress && raw_copy ) {
+				ret = CopyRawBlock(nffile_w, block_header, raw_block);
+			} else {
+				// copy block - the write queue may have swapped the block buffer
+				memcpy(nffile_w->block_header, raw_block, sizeof(data_block_header_t) + raw_block->size);
+				ret = WriteBlock(nffile_w);
+			}
+			if ( ret <= 0 ) {
 				LogError("Failed to write output buffer to disk: '%s'" , strerror(errno));
-				CloseFile(nffile_r);
-				DisposeFile(nffile_r);
-				CloseFile(nffile_w);
-				DisposeFile(nffile_w);
-				unlink(outfile);
-				return;
+				break;
 			}
+			done = 1;
+		}
+
+		if ( !done ) {
+			CloseFile(nffile_r);
+			DisposeFile(nffile_r);
+			CloseFile(nffile_w);
+			DisposeFile(nffile_w);
+			unlink(outfile);
+			return;
 		}
 
 		printf("File %s compression changed\n", filename);
@@ -1268,10 +3286,126 @@ char 			*filename, outfile[MAXPATHLEN];
 
 } // End of ModifyCompressFile
 
+/*
+ * Train a zstd dictionary with the flow records of the input files and 
+ * save it in dictfile. Each flow record is a sample.
+ */
+int TrainZstdDictionary(char *rfile, char *Rfile, char *dictfile) {
+#ifdef HAVE_ZSTD
+nffile_t		*nffile;
+record_header_t	*record_ptr;
+void			*samples, *dict;
+size_t			*sample_sizes, fill, dict_size;
+uint32_t		i, num_samples, max_samples, sumSize;
+int				fd, ret, done;
+
+	max_samples	 = 64 * 1024;
+	samples		 = malloc(ZSTD_SAMPLE_SIZE);
+	sample_sizes = malloc(max_samples * sizeof(size_t));
+	dict		 = malloc(ZSTD_DICT_SIZE);
+	if ( !samples || !sample_sizes || !dict ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		free(samples);
+		free(sample_sizes);
+		free(dict);
+		return 0;
+	}
+
+	SetupInputFileSequence(NULL, rfile, Rfile);
+
+	fill		= 0;
+	num_samples = 0;
+	done		= 0;
+	nffile = GetNextFile(NULL, 0, 0);
+	while ( nffile && nffile != EMPTY_LIST && !done ) {
+		ret = ReadBlock(nffile);
+		if ( ret <= 0 ) {
+			if ( ret < 0 ) 
+				LogError("Error while reading data block - skip file\n");
+			nffile = GetNextFile(nffile, 0, 0);
+			continue;
+		}
+
+		if ( nffile->block_header->id != DATA_BLOCK_TYPE_2 ) 
+			continue;
+
+		sumSize	   = 0;
+		record_ptr = nffile->buff_ptr;
+		for ( i=0; i < nffile->block_header->NumRecords; i++ ) {
+			if ( record_ptr->size < sizeof(record_header_t) || (sumSize + record_ptr->size) > nffile->block_header->size ) {
+				LogError("Corrupt data block - skip block\n");
+				break;
+			}
+			sumSize += record_ptr->size;
+
+			if ( record_ptr->type == CommonRecordType ) {
+				if ( (fill + record_ptr->size) > ZSTD_SAMPLE_SIZE ) {
+					done = 1;
+					break;
+				}
+				if ( num_samples == max_samples ) {
+					size_t *_tmp = realloc(sample_sizes, 2 * max_samples * sizeof(size_t));
+					if ( !_tmp ) {
+						LogError("realloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+						done = 1;
+						break;
+					}
+					sample_sizes = _tmp;
+					max_samples	 = 2 * max_samples;
+				}
+				memcpy((void *)((pointer_addr_t)samples + fill), (void *)record_ptr, record_ptr->size);
+				sample_sizes[num_samples++] = record_ptr->size;
+				fill += record_ptr->size;
+			}
+			record_ptr = (record_header_t *)((pointer_addr_t)record_ptr + record_ptr->size);
+		}
+	}
+
+	if ( nffile && nffile != EMPTY_LIST ) {
+		CloseFile(nffile);
+		DisposeFile(nffile);
+	}
+
+	dict_size = ZDICT_trainFromBuffer(dict, ZSTD_DICT_SIZE, samples, sample_sizes, num_samples);
+	free(samples);
+	free(sample_sizes);
+	if ( ZDICT_isError(dict_size) ) {
+		LogError("Failed to train zstd dictionary with %u records: %s\n", num_samples, ZDICT_getErrorName(dict_size));
+		free(dict);
+		return 0;
+	}
+
+	fd = open(dictfile, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+	if ( fd < 0 ) {
+		LogError("Failed to open file %s: '%s'" , dictfile, strerror(errno));
+		free(dict);
+		return 0;
+	}
+	if ( write(fd, dict, dict_size) != (ssize_t)dict_size ) {
+		LogError("write() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		close(fd);
+		free(dict);
+		return 0;
+	}
+	close(fd);
+	free(dict);
+
+	printf("zstd dictionary of %zu bytes trained with %u records\n", dict_size, num_samples);
+
+	return 1;
+#else
+	LogError("zstd compression not supported\n");
+	return 0;
+#endif
+
+} // End of TrainZstdDictionary
+
 void QueryFile(char *filename) {
 int i;
 nffile_t	*nffile;
-uint32_t num_records, type1, type2;
+uint32_t num_records, type1, type2, index_entries;
+uint32_t codec_blocks[ZSTD_COMPRESSED+1], compression;
+char *codec_names[ZSTD_COMPRESSED+1] = { "raw", "lzo", "bz2", "lz4", "zstd" };
 struct stat stat_buf;
 ssize_t	ret;
 off_t	fsize;
@@ -1286,18 +3420,37 @@ off_t	fsize;
 		return;
 	}
 
+	// blocks are inspected directly from the file
+	StopReadAhead(nffile);
+	UnmapFile(nffile);
+
 	num_records = 0;
 	// set file size to current position ( file header )
-	fsize = lseek(nffile->fd, 0, SEEK_CUR);
+	fsize = lseek(nffile->fd, sizeof(file_header_t) + sizeof(stat_record_t), SEEK_SET);
 	type1 = 0;
+	memset((void *)codec_blocks, 0, sizeof(codec_blocks));
 	type2 = 0;
 	printf("File    : %s\n", filename);
 	printf ("Version : %u - %s\n", nffile->file_header->version,
 		FILE_IS_LZO_COMPRESSED (nffile) ? "lzo compressed" :
 		FILE_IS_LZ4_COMPRESSED (nffile) ? "lz4 compressed" :
 		FILE_IS_BZ2_COMPRESSED (nffile) ? "bz2 compressed" :
+		FILE_IS_ZSTD_COMPRESSED (nffile) ? "zstd compressed" :
             "not compressed");
 
+	if ( TestFlag(nffile->file_header->flags, FLAG_ZSTD_DICT) ) {
+		ret = read(nffile->fd, (void *)nffile->block_header, sizeof(data_block_header_t));
+		if ( ret != sizeof(data_block_header_t) || nffile->block_header->id != DATA_BLOCK_TYPE_DICT ||
+			 (fsize + sizeof(data_block_header_t) + nffile->block_header->size) > stat_buf.st_size ) {
+			LogError("zstd dictionary not found! File corrupted. Abort.\n");
+			CloseFile(nffile);
+			DisposeFile(nffile);
+			return;
+		}
+		printf("Dict    : %u bytes\n", nffile->block_header->size);
+		fsize = lseek(nffile->fd, nffile->block_header->size, SEEK_CUR);
+	}
+
 	printf("Blocks  : %u\n", nffile->file_header->NumBlocks);
 	for ( i=0; i < nffile->file_header->NumBlocks; i++ ) {
 		if ( (fsize + sizeof(data_block_header_t)) > stat_buf.st_size ) {
@@ -1323,6 +3476,11 @@ off_t	fsize;
 		fsize += sizeof(data_block_header_t);
 
 		num_records += nffile->block_header->NumRecords;
+		compression = BlockCompression(nffile->block_header, FILE_COMPRESSION(nffile));
+		if ( compression <= ZSTD_COMPRESSED ) 
+			codec_blocks[compression]++;
+		else
+			printf("block %i has unknown compression %u\n", i, compression);
 		switch ( nffile->block_header->id) {
 			case DATA_BLOCK_TYPE_1:
 				type1++;
@@ -1351,6 +3509,17 @@ off_t	fsize;
 		}
 	}
 
+	index_entries = 0;
+	if ( TestFlag(nffile->file_header->flags, FLAG_BLOCK_INDEX) && (fsize + sizeof(data_block_header_t)) <= stat_buf.st_size ) {
+		ret = read(nffile->fd, (void *)nffile->block_header, sizeof(data_block_header_t));
+		if ( ret == sizeof(data_block_header_t) && nffile->block_header->id == DATA_BLOCK_TYPE_INDEX ) {
+			index_entries = nffile->block_header->NumRecords;
+			fsize += sizeof(data_block_header_t) + nffile->block_header->size;
+		} else {
+			LogError("Block index not found\n");
+		}
+	}
+
 	if ( fsize < stat_buf.st_size ) {
 		LogError("Extra data detected after regular blocks: %i bytes\n", stat_buf.st_size-fsize);
 	}
@@ -1358,6 +3527,14 @@ off_t	fsize;
 	printf(" Type 1 : %u\n", type1);
 	printf(" Type 2 : %u\n", type2);
 	printf("Records : %u\n", num_records);
+	printf("Codecs  :");
+	for ( i=0; i <= ZSTD_COMPRESSED; i++ ) {
+		if ( codec_blocks[i] ) 
+			printf(" %s %u", codec_names[i], codec_blocks[i]);
+	}
+	printf("\n");
+	if ( TestFlag(nffile->file_header->flags, FLAG_BLOCK_INDEX) ) 
+		printf("Index   : %u blocks\n", index_entries);
 
 	CloseFile(nffile);
 	DisposeFile(nffile);
@@ -1388,7 +3565,7 @@ int fd, ret;
 		return NULL;
 	}
 
-	if ( file_header.version != LAYOUT_VERSION_1 ) {
+	if ( file_header.version != LAYOUT_VERSION_1 && file_header.version != LAYOUT_VERSION_1_CODEC ) {
 		LogError("Open file %s: bad version: %u\n", filename, file_header.version );
 		close(fd);
 		return NULL;
@@ -53,6 +53,7 @@
 #define LZO_COMPRESSED 1
 #define BZ2_COMPRESSED 2
 #define LZ4_COMPRESSED 3
+#define ZSTD_COMPRESSED 4
 
 /* 
  * output buffer max size, before writing data to the file 
@@ -86,6 +87,16 @@
  *   +-----------+-------------+-------------+-------------+-----+-------------+
  *   |Fileheader | stat record | datablock 1 | datablock 2 | ... | datablock n |
  *   +-----------+-------------+-------------+-------------+-----+-------------+
+ *
+ * If FLAG_BLOCK_INDEX is set, an index block follows datablock n. It is not counted 
+ * in NumBlocks and is compressed with the file compression.
+ *
+ * If FLAG_ZSTD_DICT is set, an uncompressed dictionary block follows the stat record,
+ * which is required to decompress the zstd data blocks. It is not counted in NumBlocks.
+ *
+ * A file, which holds blocks with an other codec than the file compression, is recognized
+ * as LAYOUT_VERSION_1_CODEC. The layout is the same, but readers, which take the file 
+ * compression for all blocks, refuse the file instead of failing on these blocks.
  */
 
 
@@ -95,6 +106,7 @@ typedef struct file_header_s {
 
 	uint16_t	version;			// version of binary file layout, incl. magic
 #define LAYOUT_VERSION_1	1
+#define LAYOUT_VERSION_1_CODEC	3	// 2 is the nfdump 1.7 layout - see nffileV2.h
 
 	uint32_t	flags;				
 #define NUM_FLAGS		4
@@ -104,14 +116,18 @@ typedef struct file_header_s {
 #define FLAG_UNUSED			0x4		// unused
 #define FLAG_BZ2_COMPRESSED 0x8		// records are BZ2 compressed
 #define FLAG_LZ4_COMPRESSED 0x10	// records are LZ4 compressed
-#define COMPRESSION_MASK	0x19	// all compression bits
+#define FLAG_BLOCK_INDEX	0x20	// block index appended after the last data block
+#define FLAG_ZSTD_COMPRESSED 0x40	// records are zstd compressed
+#define FLAG_ZSTD_DICT		0x80	// zstd dictionary block follows the stat record
+#define COMPRESSION_MASK	0x59	// all compression bits
 // shortcuts
 
 #define FILE_IS_NOT_COMPRESSED(n) (((n)->file_header->flags & COMPRESSION_MASK) == 0)
 #define FILE_IS_LZO_COMPRESSED(n) ((n)->file_header->flags & FLAG_LZO_COMPRESSED)
 #define FILE_IS_BZ2_COMPRESSED(n) ((n)->file_header->flags & FLAG_BZ2_COMPRESSED)
 #define FILE_IS_LZ4_COMPRESSED(n) ((n)->file_header->flags & FLAG_LZ4_COMPRESSED)
-#define FILE_COMPRESSION(n) (FILE_IS_LZO_COMPRESSED(n) ? LZO_COMPRESSED : (FILE_IS_BZ2_COMPRESSED(n) ? BZ2_COMPRESSED : (FILE_IS_LZ4_COMPRESSED(n) ? LZ4_COMPRESSED : NOT_COMPRESSED)))
+#define FILE_IS_ZSTD_COMPRESSED(n) ((n)->file_header->flags & FLAG_ZSTD_COMPRESSED)
+#define FILE_COMPRESSION(n) (FILE_IS_LZO_COMPRESSED(n) ? LZO_COMPRESSED : (FILE_IS_BZ2_COMPRESSED(n) ? BZ2_COMPRESSED : (FILE_IS_LZ4_COMPRESSED(n) ? LZ4_COMPRESSED : (FILE_IS_ZSTD_COMPRESSED(n) ? ZSTD_COMPRESSED : NOT_COMPRESSED))))
 
 #define BLOCK_IS_COMPRESSED(n) ((n)->flags == 2 )
 #define IP_ANONYMIZED(n) ((n)->file_header->flags & FLAG_ANONYMIZED)
@@ -175,11 +191,90 @@ typedef struct data_block_header_s {
 	uint32_t	NumRecords;		// number of data records in data block
 	uint32_t	size;			// size of this block in bytes without this header
 	uint16_t	id;				// Block ID == DATA_BLOCK_TYPE_2
-	uint16_t	flags;			// 0 - compatibility
-								// 1 - block uncompressed
-								// 2 - block compressed
+	uint16_t	flags;			// 0 - compatibility: file compression
+								// 1 - BLOCK_FLAG_RAW: block uncompressed
+								// 2 - block compressed: file compression
+								// 4 - BLOCK_FLAG_CODEC: compressed with BLOCK_CODEC() in bits 8-15
 } data_block_header_t;
 
+/*
+ * Each block records its codec, so blocks of a file may be compressed with 
+ * different codecs. The file compression flag selects the codec for new blocks.
+ * Blocks, which do not compress, are stored uncompressed only with SetRawBlocks().
+ * LAYOUT_VERSION_1 readers ignore the block flags, so a file with uncompressed
+ * blocks or blocks of an other codec than the file compression is written as
+ * LAYOUT_VERSION_1_CODEC.
+ */
+#define BLOCK_FLAG_RAW		1
+#define BLOCK_FLAG_CODEC	4
+#define BLOCK_CODEC(b) (((b)->flags >> 8) & 0xFF)
+#define SetBlockCodec(b, c) ((b)->flags = BLOCK_FLAG_CODEC | ((c) << 8))
+
+// block index - see block_index_t
+#define DATA_BLOCK_TYPE_INDEX	3
+
+/*
+ * Block index
+ * ===========
+ * The index block holds one entry for each data block of the file. The entry
+ * describes the value range of the flow records in the block, which allows 
+ * a reader to skip blocks, which can not match the time window or filter.
+ * Min/max addresses are calculated for each 64bit word of the expanded 
+ * master record, the same way the filter engine sees them.
+ * Only flow records are indexed. Blocks, which also hold extension maps, exporter 
+ * or sampler records, are read anyway, but their flows are dropped, if the block 
+ * can not match.
+ */
+typedef struct block_index_s {
+	uint64_t	offset;			// file offset of the data block
+	uint32_t	NumRecords;		// number of records in data block
+	uint32_t	flags;
+#define BLOCK_INDEX_NOSKIP	1	// block could not be indexed - never skip
+#define BLOCK_INDEX_META	2	// block contains other records than flows - read it, but skip its flows
+	// time range of flows
+	uint32_t	first_min;
+	uint32_t	first_max;
+	uint32_t	last_min;
+	uint32_t	last_max;
+	// port range
+	uint16_t	srcport_min;
+	uint16_t	srcport_max;
+	uint16_t	dstport_min;
+	uint16_t	dstport_max;
+	// src and dst address range - srcaddr[0-1], dstaddr[0-1] 
+	uint64_t	addr_min[4];
+	uint64_t	addr_max[4];
+	// bitmap of all protocols
+	uint8_t		proto_map[32];
+} block_index_t;
+
+// returns 0, if no record of the block may match
+typedef int (*block_filter_t)(block_index_t *);
+
+// zstd dictionary - the raw dictionary is the payload of the block
+#define DATA_BLOCK_TYPE_DICT	4
+
+// max size of a zstd dictionary
+#define MAX_ZSTD_DICT	(1024*1024)
+
+/*
+ * number of data blocks, which may be read ahead and decompressed
+ * by a background thread. see SetReadAhead()
+ */
+#define MAX_READAHEAD	64
+
+// read ahead ring - private to nffile.c
+struct readahead_s;
+
+/*
+ * max number of threads, which compress data blocks of an output file
+ * see SetCompressWorkers()
+ */
+#define MAX_COMPRESS_WORKERS	32
+
+// compression workers and block queue - private to nffile.c
+struct writequeue_s;
+
 /*
  * Generic file handle for reading/writing files
  * if a file is read only writeto and block_header are NULL
@@ -193,6 +288,23 @@ typedef struct nffile_s {
 	void				*buff_ptr;		// pointer into buffer for read/write blocks/records
 	stat_record_t 		*stat_record;	// flow stat record
 	int					fd;				// file descriptor
+	void				*map_base;		// file mapping, if file is mmapped
+	size_t				map_size;
+	size_t				map_offset;		// offset of next block in mapping
+	size_t				map_advised;	// offset up to which WILLNEED is advised
+	struct readahead_s	*readahead;		// read ahead ring, if enabled
+	struct writequeue_s	*writequeue;	// compression workers, if enabled
+	block_index_t		*block_index;	// block index, when built or loaded
+	uint32_t			index_entries;	// number of entries in block_index
+	uint32_t			index_max;		// allocated entries
+	uint32_t			block_num;		// number of next data block to read
+	uint64_t			index_offset;	// file offset of index block
+	uint64_t			file_offset;	// file offset of next block to write
+	uint32_t			blocks_skipped;	// data blocks, whose flows the block index skipped
+	void				*zstd_dict;		// zstd dictionary of the file, if any
+	uint32_t			zstd_dict_size;
+	void				*zstd_cdict;	// digested dictionary for compression
+	void				*zstd_ddict;	// digested dictionary for decompression
 } nffile_t;
 
 /* 
@@ -244,6 +356,10 @@ void SumStatRecords(stat_record_t *s1, stat_record_t *s2);
 
 nffile_t *OpenFile(char *filename, nffile_t *nffile);
 
+nffile_t *OpenFileMap(char *filename, nffile_t *nffile);
+
+void SetMmapReader(int enable);
+
 nffile_t *OpenNewFile(char *filename, nffile_t *nffile, int compress, int anonymized, char *ident);
 
 nffile_t *AppendFile(char *filename);
@@ -270,6 +386,24 @@ int RenameAppend(char *from, char *to);
 
 void ModifyCompressFile(char * rfile, char *Rfile, int compress);
 
+void SetReadAhead(int num_blocks);
+
+int GetReadAhead(void);
+
+void SetCompressWorkers(int num_workers);
+
+int InitThreadCompression(void);
+
+void SetBlockIndex(int enable);
+
+void SetRawBlocks(int enable);
+
+void SetBlockFilter(block_filter_t filter);
+
+int SetZstdCompression(int level, char *dictfile);
+
+int TrainZstdDictionary(char *rfile, char *Rfile, char *dictfile);
+
 
 #endif //_NFFILE_H
 
@@ -70,6 +70,7 @@ typedef struct fileHeaderV2_s {
 #define LZO_COMPRESSED 1
 #define BZ2_COMPRESSED 2
 #define LZ4_COMPRESSED 3
+#define ZSTD_COMPRESSED 4
 	uint8_t		encryption;
 	uint16_t	flags;
 	uint32_t	unused;				// unused 0	- reserved for futur use
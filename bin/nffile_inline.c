@@ -41,6 +41,31 @@ static inline void ExpandRecord_v2(common_record_t *input_record, extension_info
 static void PackRecord(master_record_t *master_record, nffile_t *nffile);
 #endif
 
+#ifdef NEED_FLOWBATCH
+/*
+ * Flow batch: the flows of a data block are expanded into a batch of master records, 
+ * which is filtered at once by RunFilterBatch(). Any other record of the block is 
+ * processed only after the pending batch, to keep the order of the file.
+ */
+typedef struct flow_batch_s {
+	uint32_t			num;
+	common_record_t		*flow_record[FILTER_BATCH];
+	extension_info_t	*extension_info[FILTER_BATCH];
+	void				*extensions[FILTER_BATCH];	// projection: optional extensions of the flow
+	uint64_t			*nfrecord[FILTER_BATCH];
+	char				*label[FILTER_BATCH];
+	uint64_t			match[BATCH_WORDS];
+	master_record_t		master_record[FILTER_BATCH];
+} flow_batch_t;
+
+static flow_batch_t *NewFlowBatch(void);
+
+static inline master_record_t *BatchExpandRecord(flow_batch_t *batch, common_record_t *flow_record, 
+	extension_info_t *extension_info, exporter_info_record_t *exporter_info);
+
+static inline master_record_t *BatchMatchedRecord(flow_batch_t *batch, uint32_t i);
+#endif
+
 static inline int CheckBufferSpace(nffile_t *nffile, size_t required) {
 
 	dbg_printf("Buffer Size %u\n", nffile->block_header->size);
@@ -70,29 +95,69 @@ static inline void CopyV6IP(uint32_t *dst, uint32_t *src) {
 	dst[3] = src[3];
 } // End of CopyV6IP
 
+// copy the optional extensions into the master record by the plan of the extension map
+static inline void ExpandExtensions(expand_op_t *op, uint8_t *p, master_record_t *output_record) {
+uint8_t *m = (uint8_t *)output_record;
+
+	for ( ; op->op != EXPAND_END; op++ ) {
+		uint8_t *src = p + op->src;
+		uint8_t *dst = m + op->dst;
+		switch (op->op) {
+			case EXPAND_COPY8:
+				*dst = *src;
+				break;
+			case EXPAND_COPY16:
+				memcpy((void *)dst, (void *)src, 2);
+				break;
+			case EXPAND_COPY32:
+				memcpy((void *)dst, (void *)src, 4);
+				break;
+			case EXPAND_COPY64:
+				memcpy((void *)dst, (void *)src, 8);
+				break;
+			case EXPAND_COPY128:
+				memcpy((void *)dst, (void *)src, 16);
+				break;
+			case EXPAND_U16_32: {
+				uint16_t *s16 = (uint16_t *)src;
+				uint32_t *d32 = (uint32_t *)dst;
+				int i;
+				for ( i=0; i<op->arg; i++ )
+					d32[i] = s16[i];
+				} break;
+			case EXPAND_U32_64: {
+				uint32_t *s32 = (uint32_t *)src;
+				uint64_t *d64 = (uint64_t *)dst;
+				int i;
+				for ( i=0; i<op->arg; i++ )
+					d64[i] = s32[i];
+				} break;
+			case EXPAND_IPV4: {
+				ip_addr_t *ip = (ip_addr_t *)dst;
+				ip->V6[0] = 0;
+				ip->V6[1] = 0;
+				ip->V4	  = *((uint32_t *)src);
+				ClearFlag(output_record->flags, op->arg);
+				} break;
+			case EXPAND_IPV6:
+				CopyV6IP((uint32_t *)dst, (uint32_t *)src);
+				SetFlag(output_record->flags, op->arg);
+				break;
+		}
+	}
+
+} // End of ExpandExtensions
+
 /*
- * Expand file record into master record for further processing
- * LP64 CPUs need special 32bit operations as it is not guarateed, that 64bit
- * values are aligned 
+ * Expand the common record and the required extensions into the master record.
+ * Returns the optional extensions of the record
  */
-static inline void ExpandRecord_v2(common_record_t *input_record, extension_info_t *extension_info, exporter_info_record_t *exporter_info, master_record_t *output_record ) {
-extension_map_t *extension_map = extension_info->map;
-uint32_t	i, *u;
-void		*p = (void *)input_record;
-// printf("Byte: %u\n", _b);
-
-#ifdef NSEL
-		// nasty bug work around - compat issues 1.6.10 - 1.6.12 onwards
-		union {
-			uint16_t port[2];
-			uint32_t vrf;
-		} compat_nel_bug;
-		compat_nel_bug.vrf = 0;
-		int compat_nel = 0;
-#endif
+static inline void *ExpandCommonRecord(common_record_t *input_record, extension_info_t *extension_info, exporter_info_record_t *exporter_info, master_record_t *output_record ) {
+uint32_t	*u;
+void		*p;
 
 	// set map ref
-	output_record->map_ref = extension_map;
+	output_record->map_ref = extension_info->map;
 
 	// Copy common data block
 	memcpy((void *)output_record, (void *)input_record, COMMON_RECORD_DATA_SIZE);
@@ -162,7 +227,39 @@ void		*p = (void *)input_record;
 	// preset one single flow
 	output_record->aggr_flows = 1;
 
+	return p;
+
+} // End of ExpandCommonRecord
+
+/*
+ * Expand file record into master record for further processing
+ * LP64 CPUs need special 32bit operations as it is not guarateed, that 64bit
+ * values are aligned 
+ */
+static inline void ExpandRecord_v2(common_record_t *input_record, extension_info_t *extension_info, exporter_info_record_t *exporter_info, master_record_t *output_record ) {
+extension_map_t *extension_map = extension_info->map;
+uint32_t	i;
+void		*p;
+// printf("Byte: %u\n", _b);
+
+#ifdef NSEL
+		// nasty bug work around - compat issues 1.6.10 - 1.6.12 onwards
+		union {
+			uint16_t port[2];
+			uint32_t vrf;
+		} compat_nel_bug;
+		compat_nel_bug.vrf = 0;
+		int compat_nel = 0;
+#endif
+
+	p = ExpandCommonRecord(input_record, extension_info, exporter_info, output_record);
+
 	// Process optional extensions
+	if ( extension_info->expand_plan ) {
+		ExpandExtensions(extension_info->expand_plan, (uint8_t *)p, output_record);
+		return;
+	}
+
 	i=0;
 	while ( extension_map->ex_id[i] ) {
 		switch (extension_map->ex_id[i++]) {
@@ -798,6 +895,66 @@ int		i;
 } // End of PackRecord
 #endif
 
+#ifdef NEED_FLOWBATCH
+static flow_batch_t *NewFlowBatch(void) {
+flow_batch_t *batch;
+int i;
+
+	batch = (flow_batch_t *)calloc(1, sizeof(flow_batch_t));
+	if ( !batch ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	for ( i=0; i<FILTER_BATCH; i++ ) 
+		batch->nfrecord[i] = (uint64_t *)&batch->master_record[i];
+
+	return batch;
+
+} // End of NewFlowBatch
+
+/*
+ * Expand the flow into the next master record of the batch. The flow becomes part of
+ * the batch with batch->num++ only, so the caller may still drop it - e.g. by the time window.
+ */
+static inline master_record_t *BatchExpandRecord(flow_batch_t *batch, common_record_t *flow_record, 
+	extension_info_t *extension_info, exporter_info_record_t *exporter_info) {
+master_record_t *master_record = &batch->master_record[batch->num];
+
+	// elements not in the map are expected to be 0, as in the master record of the map
+	if ( master_record->map_ref != extension_info->map ) 
+		memset((void *)master_record, 0, sizeof(master_record_t));
+
+	// with a projection, only the fields of the filter are expanded first
+	if ( extension_info->filter_plan ) {
+		void *p = ExpandCommonRecord(flow_record, extension_info, exporter_info, master_record);
+		ExpandExtensions(extension_info->filter_plan, (uint8_t *)p, master_record);
+		batch->extensions[batch->num] = p;
+	} else {
+		ExpandRecord_v2(flow_record, extension_info, exporter_info, master_record);
+		batch->extensions[batch->num] = NULL;
+	}
+	batch->flow_record[batch->num]	  = flow_record;
+	batch->extension_info[batch->num] = extension_info;
+
+	return master_record;
+
+} // End of BatchExpandRecord
+
+/*
+ * Returns the master record of the matched flow i of the batch with the remaining fields
+ * of the projection expanded.
+ */
+static inline master_record_t *BatchMatchedRecord(flow_batch_t *batch, uint32_t i) {
+master_record_t *master_record = &batch->master_record[i];
+
+	if ( batch->extensions[i] ) 
+		ExpandExtensions(batch->extension_info[i]->process_plan, (uint8_t *)batch->extensions[i], master_record);
+
+	return master_record;
+
+} // End of BatchMatchedRecord
+#endif
+
 static inline void AppendToBuffer(nffile_t *nffile, void *record, size_t required) {
 
 	// flush current buffer to disc
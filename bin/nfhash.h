@@ -0,0 +1,93 @@
+/*
+ *  Copyright (c) 2026, The nfdump contributors
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without 
+ *  modification, are permitted provided that the following conditions are met:
+ *  
+ *   * Redistributions of source code must retain the above copyright notice, 
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright notice, 
+ *     this list of conditions and the following disclaimer in the documentation 
+ *     and/or other materials provided with the distribution.
+ *   * Neither the name of the author nor the names of its contributors may be 
+ *     used to endorse or promote products derived from this software without 
+ *     specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *  
+ */
+
+#ifndef _NFHASH_H
+#define _NFHASH_H 1
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+/*
+ * Hash of the aggregation and stat keys. The key is processed in 64bit words. Each word 
+ * is mixed in with a multiply/rotate round as in xxHash64, followed by the final avalanche 
+ * of MurmurHash3. Each bit of the key affects all bits of the hash, so any bits of the hash 
+ * may be used as table index. The hash is not stable across platforms of different byte order.
+ */
+#define KEYHASH_PRIME1	0x9E3779B185EBCA87ULL
+#define KEYHASH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define KEYHASH_PRIME4	0x85EBCA77C2B2AE63ULL
+#define KEYHASH_PRIME5	0x27D4EB2F165667C5ULL
+
+#define KeyHashRotl(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t KeyHashRound(uint64_t hash, uint64_t word) {
+
+	word *= KEYHASH_PRIME2;
+	word  = KeyHashRotl(word, 31);
+	word *= KEYHASH_PRIME1;
+	hash ^= word;
+	return KeyHashRotl(hash, 27) * KEYHASH_PRIME1 + KEYHASH_PRIME4;
+
+} // End of KeyHashRound
+
+static inline uint64_t KeyHash(const void *key, uint32_t len) {
+const uint8_t *p = (const uint8_t *)key;
+uint64_t hash, word;
+
+	hash = KEYHASH_PRIME5 + len;
+	while ( len >= 8 ) {
+		memcpy((void *)&word, (void *)p, sizeof(uint64_t));
+		hash = KeyHashRound(hash, word);
+		p   += 8;
+		len -= 8;
+	}
+	if ( len ) {
+		word = 0;
+		memcpy((void *)&word, (void *)p, len);
+		hash = KeyHashRound(hash, word);
+	}
+
+	// final avalanche
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+
+} // End of KeyHash
+
+#endif //_NFHASH_H
@@ -42,6 +42,8 @@
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <sys/param.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -51,7 +53,9 @@
 #include "nfdump.h"
 #include "nffile.h"
 #include "nfx.h"
+#include "exporter.h"
 #include "nflowcache.h"
+#include "nfhash.h"
 
 #define ALIGN_BYTES (offsetof (struct { char x; uint64_t y; }, y) - 1)
 
@@ -66,17 +70,69 @@ static int MemoryHandle_init(MemoryHandle_t *handle);
 
 static inline void *MemoryHandle_get(MemoryHandle_t *handle, uint32_t size);
 
-static inline FlowTableRecord_t *hash_insert_FlowTable(uint32_t index_cache, void *flowkey, common_record_t *flow_record);
+static inline FlowTableRecord_t *hash_insert_FlowTable(hash_FlowTable *table, uint32_t index_cache, void *flowkey, common_record_t *flow_record);
 
-static inline int TimeMsec_CMP(time_t t1, uint16_t offset1, time_t t2, uint16_t offset2 );
+static inline void AppendRecord(hash_FlowTable *table, FlowTableRecord_t *record);
+
+static inline FlowTableRecord_t *hash_lookup_FlowTable(hash_FlowTable *table, uint32_t *index_cache, void *flowkey, master_record_t *flow_record);
+
+static inline uint64_t FlowTableSize(hash_FlowTable *table);
+
+static void SpillFlowTable(hash_FlowTable *table);
+
+static void DisposeSpill(void);
 
-static inline uint32_t SuperFastHash (const char * data, int len);
+static void AddFlowTable(hash_FlowTable *table, common_record_t *raw_record, master_record_t *flow_record, extension_info_t *extension_info);
+
+static inline int TimeMsec_CMP(time_t t1, uint16_t offset1, time_t t2, uint16_t offset2 );
 
 static inline void New_Hash_Key(void *keymem, master_record_t *flow_record, int swap_flow);
 
 /* locals */
 static hash_FlowTable FlowTable;
 static int	initialised = 0;
+
+// partitions of the flow table for the parallel aggregation - see Init_FlowPartitions()
+static hash_FlowTable *FlowPartition;
+static uint32_t	NumPartitions = 0;
+
+// spill to disk - see SpillFlowTable()
+#define SPILL_BUCKETS	32
+
+// spilled flow: the hash key of keylen uint64_t and the flow record follow, 8 byte aligned
+typedef struct spill_record_s {
+	uint32_t				size;
+	uint32_t				fill;
+	uint64_t				seq;
+	uint64_t				counter[5];
+	extension_info_t		*map_info_ref;
+	exporter_info_record_t	*exp_ref;
+} spill_record_t;
+
+#define SpillKey(r)		((void *)&(r)[1])
+#define SpillFlow(r)	((common_record_t *)((uint64_t *)&(r)[1] + FlowTable.keylen))
+
+typedef struct spill_reader_s {
+	nffile_t		*nffile;
+	spill_record_t	*next;			// next record in the current block
+	uint32_t		left;			// records left in the current block
+	spill_record_t	*record;		// current record of the merge
+} spill_reader_t;
+
+static uint64_t	FlowTableLimit = 0;
+
+static struct spill_s {
+	char				*dir;		// directory of the spill files
+	uint32_t			runs;		// number of times, the table was spilled
+	nffile_t			*bucket[SPILL_BUCKETS];
+	void				*key;
+	/* merge of the aggregated buckets */
+	spill_reader_t		reader[SPILL_BUCKETS];
+	spill_reader_t		*heap[SPILL_BUCKETS];
+	uint32_t			NumReaders;
+	FlowTableRecord_t	*record;	// last record returned
+	uint32_t			RecordSize;
+} Spill;
 uint32_t loopcnt = 0;
 
 typedef struct aggregate_param_s {
@@ -169,11 +225,15 @@ static aggregate_param_t *aggregate_stack = NULL;
 static uint32_t	aggregate_key_len 		  = sizeof(Default_key_t);
 static uint32_t	bidir_flows				  = 0;
 
+// the flow table holds compact records - see SetCompactFlowTable()
+static int		CompactRecords			  = 0;
+
 // counter indices
 // The array size of FlowTableRecord_t array counter must match.
 enum CNT_IND { FLOWS = 0, INPACKETS, INBYTES, OUTPACKETS, OUTBYTES };
 
 #include "applybits_inline.c"
+#include "nffile_inline.c"
 
 /* Functions */
 
@@ -274,19 +334,269 @@ hash_FlowTable *GetFlowTable(void) {
 	return &FlowTable;
 } // End of GetFlowTable
 
-int Init_FlowTable(void) {
-uint32_t maxindex;
-
-	maxindex = (1 << HashBits);
-	FlowTable.IndexMask   = maxindex -1;
-	FlowTable.NumBits	  = HashBits;
-	FlowTable.NumRecords  = 0;
-	FlowTable.bucket	  = (FlowTableRecord_t **)calloc(maxindex, sizeof(FlowTableRecord_t *));
-	FlowTable.bucketcache = (FlowTableRecord_t **)calloc(maxindex, sizeof(FlowTableRecord_t *));
-	if ( !FlowTable.bucket || !FlowTable.bucketcache ) {
+/*
+ * Flow hash. A control byte is either the low 7 bits of the hash of the record in the slot,
+ * FLOW_EMPTY or FLOW_MOVED. FLOW_MOVED marks a slot of the previous hash, whose record 
+ * was moved to the current hash. It does not end the probing like FLOW_EMPTY.
+ * The group of a hash is probed first, followed by the groups in triangular order.
+ */
+#define FLOW_EMPTY		0x80
+#define FLOW_MOVED		0xFE
+#define GROUP_LSB		0x0101010101010101ULL
+#define GROUP_MSB		0x8080808080808080ULL
+
+// number of groups moved from the previous hash for each new record
+#define FLOW_MOVE_GROUPS	2
+
+#define FlowHashGroup(hash, mask) ((((hash) >> 7) | ((hash) << 25)) & (mask))
+
+// load the control bytes of a group - byte 0 is the lowest byte
+static inline uint64_t LoadGroup(uint8_t *ctrl) {
+#ifdef WORDS_BIGENDIAN
+uint64_t group;
+int i;
+
+	group = 0;
+	for ( i=FLOW_GROUP-1; i>=0; i-- ) 
+		group = (group << 8) | ctrl[i];
+	return group;
+#else
+uint64_t group;
+
+	memcpy((void *)&group, (void *)ctrl, sizeof(uint64_t));
+	return group;
+#endif
+
+} // End of LoadGroup
+
+// high bit set for each control byte, which equals h2. A byte following a match may be 
+// reported as well, so the control byte needs to be checked
+static inline uint64_t MatchGroup(uint64_t group, uint8_t h2) {
+uint64_t x = group ^ (GROUP_LSB * h2);
+
+	return (x - GROUP_LSB) & ~x & GROUP_MSB;
+
+} // End of MatchGroup
+
+// high bit set for each empty control byte
+static inline uint64_t MatchEmpty(uint64_t group) {
+
+	return group & ~(group << 6) & GROUP_MSB;
+
+} // End of MatchEmpty
+
+// slot of the lowest byte in a match
+static inline uint32_t MatchSlot(uint64_t match) {
+#ifdef __GNUC__
+	return __builtin_ctzll(match) >> 3;
+#else
+uint32_t i = 0;
+
+	while ( (match & 0x80) == 0 ) {
+		match >>= 8;
+		i++;
+	}
+	return i;
+#endif
+
+} // End of MatchSlot
+
+static int FlowHash_init(FlowHash_t *hash, uint32_t NumBits) {
+uint64_t maxindex;
+
+	maxindex = 1ULL << NumBits;
+	hash->ctrl = (uint8_t *)malloc(maxindex);
+	hash->slot = (FlowTableSlot_t *)malloc(maxindex * sizeof(FlowTableSlot_t));
+	if ( !hash->ctrl || !hash->slot ) {
 		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		free((void *)hash->ctrl);
+		free((void *)hash->slot);
+		hash->ctrl = NULL;
+		hash->slot = NULL;
 		return 0;
 	}
+	memset((void *)hash->ctrl, FLOW_EMPTY, maxindex);
+
+	hash->NumBits	= NumBits;
+	hash->GroupMask = (maxindex / FLOW_GROUP) - 1;
+	hash->NumUsed	= 0;
+	// max load 7/8
+	hash->MaxUsed	= maxindex - (maxindex >> 3);
+
+	return 1;
+
+} // End of FlowHash_init
+
+static void FlowHash_free(FlowHash_t *hash) {
+
+	free((void *)hash->ctrl);
+	free((void *)hash->slot);
+	hash->ctrl	  = NULL;
+	hash->slot	  = NULL;
+	hash->NumUsed = 0;
+
+} // End of FlowHash_free
+
+// put a record into the first empty slot - the hash does not contain any moved slots
+static inline void FlowHash_put(FlowHash_t *hash, uint32_t hashval, FlowTableRecord_t *record) {
+uint32_t	group, step, index;
+uint64_t	match;
+
+	group = FlowHashGroup(hashval, hash->GroupMask);
+	step  = 0;
+	while ( (match = (LoadGroup(&hash->ctrl[group * FLOW_GROUP]) & GROUP_MSB)) == 0 ) {
+		step++;
+		group = (group + step) & hash->GroupMask;
+	}
+
+	index = group * FLOW_GROUP + MatchSlot(match);
+	hash->ctrl[index] 		 = hashval & 0x7F;
+	hash->slot[index].hash	 = hashval;
+	hash->slot[index].record = record;
+	hash->NumUsed++;
+
+} // End of FlowHash_put
+
+static inline FlowTableRecord_t *FlowHash_get(FlowHash_t *hash, uint32_t hashval, void *flowkey) {
+uint32_t	group, step, index, i;
+uint64_t	ctrl, match;
+uint8_t		h2 = hashval & 0x7F;
+
+	group = FlowHashGroup(hashval, hash->GroupMask);
+	step  = 0;
+	while ( 1 ) {
+		ctrl  = LoadGroup(&hash->ctrl[group * FLOW_GROUP]);
+		match = MatchGroup(ctrl, h2);
+		while ( match ) {
+			index = group * FLOW_GROUP + MatchSlot(match);
+			match &= match - 1;
+			if ( hash->ctrl[index] != h2 )
+				continue;
+
+			if ( hash->slot[index].hash != hashval ) {
+#ifdef DEVEL
+				hash_skip++;
+#endif
+				continue;
+			} else {
+				uint64_t	*k1 = (uint64_t *)flowkey;
+				uint64_t	*k2 = (uint64_t *)hash->slot[index].record->hash_key;
+		
+				// compare key and break as soon as keys do not match
+				i = 0;
+				while ( i < FlowTable.keylen ) {
+					if ( k1[i] == k2[i] )
+						i++;
+					else
+						break;
+				}
+#ifdef DEVEL
+				loopcnt += i;
+#endif
+
+				if ( i == FlowTable.keylen ) {
+					// hit - record found
+#ifdef DEVEL
+					// some stats for debugging
+					if ( step == 0 )
+						hash_hit++;
+					else
+						hash_miss++;
+#endif
+					return hash->slot[index].record;
+				}
+			}
+		}
+
+		// an empty slot ends the probe sequence
+		if ( MatchEmpty(ctrl) ) 
+			return NULL;
+
+		step++;
+		group = (group + step) & hash->GroupMask;
+	}
+
+	/* not reached */
+
+} // End of FlowHash_get
+
+// move the records of num groups of the previous hash into the current hash
+static void FlowHash_move(hash_FlowTable *table, uint32_t num) {
+FlowHash_t	*old = &table->old;
+uint32_t	i, index;
+
+	while ( num && table->MoveGroup <= old->GroupMask ) {
+		index = table->MoveGroup * FLOW_GROUP;
+		for ( i=0; i<FLOW_GROUP; i++, index++ ) {
+			if ( (old->ctrl[index] & 0x80) == 0 ) {
+				FlowHash_put(&table->hash, old->slot[index].hash, old->slot[index].record);
+				old->ctrl[index] = FLOW_MOVED;
+			}
+		}
+		table->MoveGroup++;
+		num--;
+	}
+
+	if ( table->MoveGroup > old->GroupMask ) {
+		dbg_printf("FlowTable: %u bits hash moved\n", old->NumBits);
+		FlowHash_free(old);
+	}
+
+} // End of FlowHash_move
+
+// double the size of the hash. The records of the previous hash are moved over the next inserts
+static void FlowHash_grow(hash_FlowTable *table) {
+
+	if ( table->hash.NumBits >= FlowTableMaxBits ) {
+		fprintf(stderr, "Flow table full: %u records\n", table->NumRecords);
+		exit(255);
+	}
+
+	// finish the previous resize first
+	if ( table->old.ctrl ) 
+		FlowHash_move(table, table->old.GroupMask + 1);
+
+	table->old = table->hash;
+	if ( !FlowHash_init(&table->hash, table->old.NumBits + 1) ) 
+		exit(255);
+	table->MoveGroup = 0;
+	dbg_printf("FlowTable: grow to %u bits\n", table->hash.NumBits);
+
+} // End of FlowHash_grow
+
+static int FlowTable_init(hash_FlowTable *table) {
+
+	table->NumRecords  = 0;
+	table->first	   = NULL;
+	table->last		   = NULL;
+	table->old.ctrl	   = NULL;
+	table->old.slot	   = NULL;
+	table->MoveGroup   = 0;
+	table->keymem	   = NULL;
+	table->bidirkeymem = NULL;
+	table->seq		   = 0;
+	if ( !FlowHash_init(&table->hash, FlowTableBits) ) 
+		return 0;
+
+	return MemoryHandle_init(&table->mem);
+
+} // End of FlowTable_init
+
+static void FlowTable_free(hash_FlowTable *table) {
+
+	FlowHash_free(&table->hash);
+	FlowHash_free(&table->old);
+	MemoryHandle_free(&table->mem);
+	table->NumRecords = 0;
+	table->first	  = NULL;
+	table->last		  = NULL;
+
+} // End of FlowTable_free
+
+int Init_FlowTable(void) {
+
+	if ( !FlowTable_init(&FlowTable) ) 
+		return 0;
 
 	FlowTable.keysize = aggregate_key_len;
 
@@ -298,9 +608,6 @@ uint32_t maxindex;
 	dbg_printf("FlowTable.keysize %i bytes\n", FlowTable.keysize);
 	dbg_printf("FlowTable.keylen %i uint64_t\n", FlowTable.keylen);
 
-	if ( !MemoryHandle_init(&FlowTable.mem) ) 
-		return 0;
-
 	initialised = 1;
 	return 1;
 
@@ -308,97 +615,197 @@ uint32_t maxindex;
 
 
 void Dispose_FlowTable(void) {
+uint32_t i;
 
 	if ( !initialised )
 		return;
-	free((void *)FlowTable.bucket);
-	free((void *)FlowTable.bucketcache);
-	MemoryHandle_free(&FlowTable.mem);
-	FlowTable.NumRecords  	= 0;
-	FlowTable.bucket 		= NULL;
-	FlowTable.bucketcache 	= NULL;
+	FlowTable_free(&FlowTable);
+	DisposeSpill();
+
+	// the records of the partitions are linked into the flow table
+	for ( i=0; i<NumPartitions; i++ ) 
+		FlowTable_free(&FlowPartition[i]);
+	free((void *)FlowPartition);
+	FlowPartition = NULL;
+	NumPartitions = 0;
 
 } // End of Dispose_FlowTable
 
+/*
+ * Parallel aggregation: the flow table is split into num partitions by the hash of the
+ * aggregation key, so each partition is updated by its own thread without any locking.
+ * For bidir flows, the partition does not depend on the direction of the flow, so a flow
+ * and its reverse flow always end up in the same partition. The records carry a sequence
+ * number, with which MergeFlowPartitions() restores the sequential order of insertion.
+ */
+int Init_FlowPartitions(uint32_t num) {
+uint32_t i;
 
-static inline FlowTableRecord_t *hash_lookup_FlowTable(uint32_t *index_cache, void *flowkey, master_record_t *flow_record) {
-uint32_t			index;
-int bsize;
-FlowTableRecord_t	*record;
+	FlowPartition = (hash_FlowTable *)calloc(num, sizeof(hash_FlowTable));
+	if ( !FlowPartition ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		return 0;
+	}
+	for ( i=0; i<num; i++ ) {
+		if ( !FlowTable_init(&FlowPartition[i]) ) 
+			return 0;
+		NumPartitions++;
+	}
+
+	return 1;
 
-	*index_cache = SuperFastHash((char *)flowkey, FlowTable.keysize);
-	index = *index_cache & FlowTable.IndexMask;
+} // End of Init_FlowPartitions
 
-	if ( FlowTable.bucket[index] == NULL ) {
-		hash_hit++;
-		return NULL;
+// key memory for FlowPartitionKey(). Each thread needs its own
+void *NewFlowKey(void) {
+void *flowkey;
+
+	// the padding of the key must be 0 - see AddFlowTable()
+	flowkey = calloc(FlowTable.keylen, sizeof(uint64_t));
+	if ( !flowkey ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		exit(255);
 	}
+	return flowkey;
 
-	record = FlowTable.bucket[index];
+} // End of NewFlowKey
 
-	// skip records with different hash value ( full 32bit )
-	while ( record )
-		if ( record->hash != *index_cache ) {
-			hash_skip++;
-			record = record->next;
-		} else
-			break;
+uint32_t FlowPartitionKey(void *flowkey, master_record_t *flow_record) {
+uint64_t hash;
 
-	bsize = 0;
-	while ( record ) {
-		uint64_t	*k1 = (uint64_t *)flowkey;
-		uint64_t	*k2 = (uint64_t *)record->hash_key;
-		int i;
-		
-		// compare key and break as soon as keys do not match
-		i = 0;
-		while ( i < FlowTable.keylen ) {
-			if ( k1[i] == k2[i] )
-				i++;
-			else
-				break;
+	New_Hash_Key(flowkey, flow_record, 0);
+	hash = KeyHash(flowkey, FlowTable.keysize) >> 32;
+
+	if ( bidir_flows && ( flow_record->prot == IPPROTO_TCP || flow_record->prot == IPPROTO_UDP) ) {
+		// the sum is the same for both directions of the flow
+		New_Hash_Key(flowkey, flow_record, 1);
+		hash = (uint32_t)(hash + (KeyHash(flowkey, FlowTable.keysize) >> 32));
+	}
+
+	// the flow hash uses the lower 32 bits of the hash
+	return (hash * NumPartitions) >> 32;
+
+} // End of FlowPartitionKey
+
+void AddFlowPartition(uint32_t partition, uint64_t seq, common_record_t *raw_record, 
+	master_record_t *flow_record, extension_info_t *extension_info) {
+hash_FlowTable *table = &FlowPartition[partition];
+
+	table->seq = seq;
+	AddFlowTable(table, raw_record, flow_record, extension_info);
+
+} // End of AddFlowPartition
+
+// link the records of all partitions into the flow table in the order of their sequence numbers
+void MergeFlowPartitions(void) {
+FlowTableRecord_t	**head;
+uint32_t			*heap, num, pos, child, part, i;
+
+	head = (FlowTableRecord_t **)calloc(NumPartitions, sizeof(FlowTableRecord_t *));
+	heap = (uint32_t *)calloc(NumPartitions, sizeof(uint32_t));
+	if ( !head || !heap ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		exit(255);
+	}
+
+	// min heap of the partitions by the sequence number of their next record
+	num = 0;
+	for ( i=0; i<NumPartitions; i++ ) {
+		head[i] = FlowPartition[i].first;
+		if ( head[i] == NULL ) 
+			continue;
+		pos = num++;
+		while ( pos > 0 && head[heap[(pos - 1) >> 1]]->seq > head[i]->seq ) {
+			heap[pos] = heap[(pos - 1) >> 1];
+			pos = (pos - 1) >> 1;
 		}
-		loopcnt += i;
+		heap[pos] = i;
+	}
 
-		if ( i == FlowTable.keylen ) {
-			// hit - record found
-		
-			// some stats for debugging
-			if ( bsize == 0 )
-				hash_hit++;
-			else
-				hash_miss++;
-			return record;
+	while ( num ) {
+		FlowTableRecord_t *record;
+
+		part = heap[0];
+		record = head[part];
+		head[part] = record->next;
+		AppendRecord(&FlowTable, record);
+		if ( head[part] == NULL ) {
+			// partition done - sift down the last partition of the heap
+			part = heap[--num];
+			if ( num == 0 ) 
+				break;
 		}
 
-		record = record->next;
-		bsize++;
+		pos = 0;
+		while ( (child = 2 * pos + 1) < num ) {
+			if ( child + 1 < num && head[heap[child + 1]]->seq < head[heap[child]]->seq ) 
+				child++;
+			if ( head[heap[child]]->seq >= head[part]->seq ) 
+				break;
+			heap[pos] = heap[child];
+			pos = child;
+		}
+		heap[pos] = part;
 	}
-	return NULL;
+
+	free((void *)head);
+	free((void *)heap);
+
+} // End of MergeFlowPartitions
+
+
+static inline FlowTableRecord_t *hash_lookup_FlowTable(hash_FlowTable *table, uint32_t *index_cache, void *flowkey, master_record_t *flow_record) {
+FlowTableRecord_t	*record;
+
+	*index_cache = (uint32_t)KeyHash(flowkey, FlowTable.keysize);
+
+	record = FlowHash_get(&table->hash, *index_cache, flowkey);
+	if ( record == NULL && table->old.ctrl ) 
+		record = FlowHash_get(&table->old, *index_cache, flowkey);
+
+	return record;
 
 } // End of hash_lookup_FlowTable
 
+static inline void AppendRecord(hash_FlowTable *table, FlowTableRecord_t *record) {
+
+	record->next = NULL;
+	if ( table->first == NULL ) 
+		table->first = record;
+	else 
+		table->last->next = record;
+
+	table->last = record;
+  	table->NumRecords++;
 
-inline static FlowTableRecord_t *hash_insert_FlowTable(uint32_t index_cache, void *flowkey, common_record_t *raw_record) {
+} // End of AppendRecord
+
+// size of the flow record of a record in the flow table
+static inline uint32_t FlowRecordSize(common_record_t *flowrecord) {
+	return CompactRecords ? sizeof(common_record_t) : flowrecord->size;
+} // End of FlowRecordSize
+
+inline static FlowTableRecord_t *hash_insert_FlowTable(hash_FlowTable *table, uint32_t index_cache, void *flowkey, common_record_t *raw_record) {
 FlowTableRecord_t	*record;
-uint32_t index = index_cache & FlowTable.IndexMask;
+uint32_t			size;
+
+	if ( table->hash.NumUsed >= table->hash.MaxUsed ) 
+		FlowHash_grow(table);
 
 	// allocate enough memory for the new flow including all additional information in FlowTableRecord_t
 	// MemoryHandle_get always succeeds. If no memory, MemoryHandle_get already exists cleanly
-	record = MemoryHandle_get(&FlowTable.mem, sizeof(FlowTableRecord_t) - sizeof(common_record_t) + raw_record->size);
+	size = FlowRecordSize(raw_record);
+	record = MemoryHandle_get(&table->mem, sizeof(FlowTableRecord_t) - sizeof(common_record_t) + size);
 
-	record->next 	 = NULL;
-	record->hash 	 = index_cache;
 	record->hash_key = flowkey;
+	record->seq		 = table->seq;
 
-	memcpy((void *)&record->flowrecord, (void *)raw_record, raw_record->size);
-	if ( FlowTable.bucket[index] == NULL ) 
-		FlowTable.bucket[index] = record;
-	else 
-		FlowTable.bucketcache[index]->next = record;
+	memcpy((void *)&record->flowrecord, (void *)raw_record, size);
+	FlowHash_put(&table->hash, index_cache, record);
+	AppendRecord(table, record);
 
-	FlowTable.bucketcache[index] = record;
-  	FlowTable.NumRecords++;
+	if ( table->old.ctrl ) 
+		FlowHash_move(table, FLOW_MOVE_GROUPS);
 
 	return record;
 
@@ -411,17 +818,10 @@ FlowTableRecord_t	*record;
 	// MemoryHandle_get always succeeds. If no memory, MemoryHandle_get already exits cleanly
 	record = MemoryHandle_get(&FlowTable.mem, sizeof(FlowTableRecord_t) - sizeof(common_record_t) + raw_record->size);
 
-	record->next 	 = NULL;
-	record->hash 	 = 0;
 	record->hash_key = NULL;
 
 	memcpy((void *)&record->flowrecord, (void *)raw_record, raw_record->size);
-	if ( FlowTable.bucket[0] == NULL ) 
-		FlowTable.bucket[0] = record;
-	else 
-		FlowTable.bucketcache[0]->next = record;
-
-	FlowTable.bucketcache[0] = record;
+	AppendRecord(&FlowTable, record);
 	
 	// safe the extension map and exporter reference
 	record->map_info_ref = extension_info;
@@ -432,31 +832,29 @@ FlowTableRecord_t	*record;
 	record->counter[OUTBYTES]	 = flow_record->out_bytes;
 	record->counter[OUTPACKETS]  = flow_record->out_pkts;
 	record->counter[FLOWS]	 	 = flow_record->aggr_flows ? flow_record->aggr_flows : 1;
-	FlowTable.NumRecords++;
 
 } // End of InsertFlow
 
 
 
-void AddFlow(common_record_t *raw_record, master_record_t *flow_record, extension_info_t *extension_info ) {
-static void			*keymem = NULL, *bidirkeymem = NULL;
+static void AddFlowTable(hash_FlowTable *table, common_record_t *raw_record, master_record_t *flow_record, extension_info_t *extension_info ) {
 FlowTableRecord_t	*FlowTableRecord;
 uint32_t			index_cache; 
+void				*keymem;
 
+	keymem = table->keymem;
 	if ( keymem == NULL ) {
-		keymem = MemoryHandle_get(&FlowTable.mem ,FlowTable.keysize );
-		// the last aligned word may not be fully used. set it to 0 to guarantee
-		// a proper comarison
-
-		// for 64 bit arch int == 8 bytes otherwise 4
-		((int *)keymem)[FlowTable.keylen-1] = 0;
-
+		keymem = MemoryHandle_get(&table->mem ,FlowTable.keysize );
+		// the padding of the key and the last aligned word may not be fully used. set them
+		// to 0 to guarantee a proper comarison. The key is compared as keylen uint64_t
+		memset(keymem, 0, FlowTable.keylen * sizeof(uint64_t));
+		table->keymem = keymem;
 	}
 
 	New_Hash_Key(keymem, flow_record, 0);
 
 	// Update netflow statistics
-	FlowTableRecord = hash_lookup_FlowTable(&index_cache, keymem, flow_record);
+	FlowTableRecord = hash_lookup_FlowTable(table, &index_cache, keymem, flow_record);
 	if ( FlowTableRecord ) {
 		// flow record found - best case! update all fields
 		FlowTableRecord->counter[INBYTES]    += flow_record->dOctets;
@@ -480,7 +878,7 @@ uint32_t			index_cache;
 
 	} else if ( !bidir_flows || ( flow_record->prot != IPPROTO_TCP && flow_record->prot != IPPROTO_UDP) ) {
 		// no flow record found and no TCP/UDP bidir flows. Insert flow record into hash
-		FlowTableRecord = hash_insert_FlowTable(index_cache, keymem, raw_record);
+		FlowTableRecord = hash_insert_FlowTable(table, index_cache, keymem, raw_record);
 
 		FlowTableRecord->counter[INBYTES]	 = flow_record->dOctets;
 		FlowTableRecord->counter[INPACKETS]  = flow_record->dPkts;
@@ -492,25 +890,23 @@ uint32_t			index_cache;
 		FlowTableRecord->exp_ref  	 		 = flow_record->exp_ref;
 
 		// keymen got part of the cache
-		keymem = NULL;
+		table->keymem = NULL;
 	} else {
 		// for bidir flows do
 		uint32_t	bidir_index_cache; 
 
 		// use tmp memory for bidir hash key to search for bidir flow
 		// we need it only to lookup 
-		if ( bidirkeymem == NULL ) {
-			bidirkeymem = MemoryHandle_get(&FlowTable.mem ,FlowTable.keysize );
-			// the last aligned word may not be fully used. set it to 0 to guarantee
-			// a proper comarison
-
-			// for 64 bit arch int == 8 bytes otherwise 4
-			((int *)bidirkeymem)[FlowTable.keylen-1] = 0;
+		if ( table->bidirkeymem == NULL ) {
+			table->bidirkeymem = MemoryHandle_get(&table->mem ,FlowTable.keysize );
+			// the padding of the key and the last aligned word may not be fully used. set them
+			// to 0 to guarantee a proper comarison. The key is compared as keylen uint64_t
+			memset(table->bidirkeymem, 0, FlowTable.keylen * sizeof(uint64_t));
 		}
 
 		// generate the hash key for reverse record (bidir)
-		New_Hash_Key(bidirkeymem, flow_record, 1);
-		FlowTableRecord = hash_lookup_FlowTable(&bidir_index_cache, bidirkeymem, flow_record);
+		New_Hash_Key(table->bidirkeymem, flow_record, 1);
+		FlowTableRecord = hash_lookup_FlowTable(table, &bidir_index_cache, table->bidirkeymem, flow_record);
 		if ( FlowTableRecord ) {
 			// we found a corresponding flow - so update all fields in reverse direction
 			FlowTableRecord->counter[OUTBYTES]   += flow_record->dOctets;
@@ -534,7 +930,7 @@ uint32_t			index_cache;
 		} else {
 			// no bidir flow found 
 			// insert original flow into the cache
-			FlowTableRecord = hash_insert_FlowTable(index_cache, keymem, raw_record);
+			FlowTableRecord = hash_insert_FlowTable(table, index_cache, keymem, raw_record);
 	
 			FlowTableRecord->counter[INBYTES]	 = flow_record->dOctets;
 			FlowTableRecord->counter[INPACKETS]  = flow_record->dPkts;
@@ -544,69 +940,535 @@ uint32_t			index_cache;
 			FlowTableRecord->map_info_ref  	 	 = extension_info;
 			FlowTableRecord->exp_ref  	 		 = flow_record->exp_ref;
 
-			keymem = NULL;
+			table->keymem = NULL;
 		}
 
 	} 
 
+} // End of AddFlowTable
+
+void AddFlow(common_record_t *raw_record, master_record_t *flow_record, extension_info_t *extension_info ) {
+static uint64_t seq = 0;
+
+	if ( FlowTableLimit && FlowTable.NumRecords && FlowTableSize(&FlowTable) > FlowTableLimit ) 
+		SpillFlowTable(&FlowTable);
+
+	FlowTable.seq = seq++;
+	AddFlowTable(&FlowTable, raw_record, flow_record, extension_info);
+
 } // End of AddFlow
 
+/*
+ * Spill to disk: with a memory limit set by SetFlowTableLimit(), the flow table is written
+ * to SPILL_BUCKETS temporary files and cleared, whenever it grows beyond the limit. The 
+ * records are distributed over the buckets by the hash of their key, so all partial 
+ * aggregates of a flow - for bidir flows of both directions - end up in the same bucket. 
+ * At the end, each bucket is aggregated on its own in memory and written back in the 
+ * order of insertion. The aggregated flows are then streamed by merging the buckets by 
+ * the sequence number of the records, which results in the same flows in the same order
+ * as an aggregation in memory.
+ */
+static inline uint64_t FlowTableSize(hash_FlowTable *table) {
+uint64_t size;
+
+	size = (uint64_t)table->mem.NumBlocks * table->mem.BlockSize;
+	size += (1ULL << table->hash.NumBits) * (sizeof(FlowTableSlot_t) + 1);
+	if ( table->old.ctrl ) 
+		size += (1ULL << table->old.NumBits) * (sizeof(FlowTableSlot_t) + 1);
+
+	return size;
+
+} // End of FlowTableSize
+
+// reverse key of a bidir flow - see New_Hash_Key()
+static inline void SwapHashKey(void *dst, void *src) {
+Default_key_t *key = (Default_key_t *)dst;
+uint64_t tmp[2];
+uint16_t port;
+
+	memcpy(dst, src, FlowTable.keysize);
+	tmp[0] = key->srcaddr[0];
+	tmp[1] = key->srcaddr[1];
+	key->srcaddr[0] = key->dstaddr[0];
+	key->srcaddr[1] = key->dstaddr[1];
+	key->dstaddr[0] = tmp[0];
+	key->dstaddr[1] = tmp[1];
+	port = key->srcport;
+	key->srcport = key->dstport;
+	key->dstport = port;
+
+} // End of SwapHashKey
+
+static inline int BidirKey(void *key) {
+	return bidir_flows && 
+		( ((Default_key_t *)key)->proto == IPPROTO_TCP || ((Default_key_t *)key)->proto == IPPROTO_UDP );
+} // End of BidirKey
+
+static uint32_t SpillBucket(void *key) {
+uint64_t hash;
+
+	hash = KeyHash(key, FlowTable.keysize) >> 32;
+	if ( BidirKey(key) ) {
+		// the same bucket for both directions
+		SwapHashKey(Spill.key, key);
+		hash = (uint32_t)(hash + (KeyHash(Spill.key, FlowTable.keysize) >> 32));
+	}
 
-#undef get16bits
-#if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__) \
-  || defined(_MSC_VER) || defined (__BORLANDC__) || defined (__TURBOC__)
-#define get16bits(d) (*((const uint16_t *) (d)))
-#endif
+	return (hash * SPILL_BUCKETS) >> 32;
 
-#if !defined (get16bits)
-#define get16bits(d) ((((uint32_t)(((const uint8_t *)(d))[1])) << 8)\
-					   +(uint32_t)(((const uint8_t *)(d))[0]) )
-#endif
+} // End of SpillBucket
 
-static inline uint32_t SuperFastHash (const char * data, int len) {
-uint32_t hash = len, tmp;
-int rem;
+static nffile_t *OpenSpillFile(char *type, uint32_t bucket, int read) {
+nffile_t *nffile;
+char filename[MAXPATHLEN];
 
-	if (len <= 0 || data == NULL) return 0;
+	snprintf(filename, MAXPATHLEN, "%s/%s.%u", Spill.dir, type, bucket);
+	filename[MAXPATHLEN-1] = '\0';
+	nffile = read ? OpenFile(filename, NULL) : OpenNewFile(filename, NULL, LZ4_COMPRESSED, 0, NULL);
+	if ( !nffile ) {
+		LogError("Failed to open spill file %s\n", filename);
+		exit(255);
+	}
+
+	return nffile;
+
+} // End of OpenSpillFile
 
-	rem = len & 3;
-	len >>= 2;
+static void CloseSpillFile(nffile_t *nffile, char *type, uint32_t bucket, int read) {
+char filename[MAXPATHLEN];
 
-	/* Main loop */
-	for (;len > 0; len--) {
-		hash  += get16bits (data);
-		tmp	= (get16bits (data+2) << 11) ^ hash;
-		hash   = (hash << 16) ^ tmp;
-		data  += 2*sizeof (uint16_t);
-		hash  += hash >> 11;
+	if ( read ) {
+		// the spill file is no longer needed
+		CloseFile(nffile);
+		snprintf(filename, MAXPATHLEN, "%s/%s.%u", Spill.dir, type, bucket);
+		filename[MAXPATHLEN-1] = '\0';
+		unlink(filename);
+	} else if ( !CloseUpdateFile(nffile, NULL) ) {
+		LogError("Failed to close spill file: %s\n", strerror(errno));
+		exit(255);
 	}
+	DisposeFile(nffile);
 
-	/* Handle end cases */
-	switch (rem) {
-		case 3: hash += get16bits (data);
-				hash ^= hash << 16;
-				hash ^= data[sizeof (uint16_t)] << 18;
-				hash += hash >> 11;
-				break;
-		case 2: hash += get16bits (data);
-				hash ^= hash << 11;
-				hash += hash >> 17;
-				break;
-		case 1: hash += *data;
-				hash ^= hash << 10;
-				hash += hash >> 1;
+} // End of CloseSpillFile
+
+static void WriteSpillRecord(nffile_t *nffile, FlowTableRecord_t *record) {
+spill_record_t *spill_record;
+uint32_t size;
+
+	size = sizeof(spill_record_t) + FlowTable.keylen * sizeof(uint64_t) + FlowRecordSize(&record->flowrecord);
+	size = (size + 7) & ~7;
+	if ( !CheckBufferSpace(nffile, size) ) {
+		LogError("Failed to write spill file: %s\n", strerror(errno));
+		exit(255);
+	}
+
+	spill_record = (spill_record_t *)nffile->buff_ptr;
+	spill_record->size		   = size;
+	spill_record->seq		   = record->seq;
+	spill_record->map_info_ref = record->map_info_ref;
+	spill_record->exp_ref	   = record->exp_ref;
+	memcpy((void *)spill_record->counter, (void *)record->counter, sizeof(record->counter));
+	memcpy(SpillKey(spill_record), record->hash_key, FlowTable.keylen * sizeof(uint64_t));
+	memcpy(SpillFlow(spill_record), (void *)&record->flowrecord, FlowRecordSize(&record->flowrecord));
+
+	nffile->block_header->NumRecords++;
+	nffile->block_header->size += size;
+	nffile->buff_ptr = (void *)((pointer_addr_t)nffile->buff_ptr + size);
+
+} // End of WriteSpillRecord
+
+// next record of a spill file, NULL at the end of the file
+static spill_record_t *ReadSpillRecord(spill_reader_t *reader) {
+spill_record_t *spill_record;
+
+	while ( reader->left == 0 ) {
+		int ret = ReadBlock(reader->nffile);
+		if ( ret == NF_EOF ) 
+			return NULL;
+		if ( ret < 0 ) {
+			LogError("Failed to read spill file: %s\n", strerror(errno));
+			exit(255);
+		}
+		reader->next = (spill_record_t *)reader->nffile->buff_ptr;
+		reader->left = reader->nffile->block_header->NumRecords;
+	}
+
+	spill_record = reader->next;
+	reader->next = (spill_record_t *)((pointer_addr_t)spill_record + spill_record->size);
+	reader->left--;
+
+	return spill_record;
+
+} // End of ReadSpillRecord
+
+// write all records of the table into the buckets and clear the table
+static void SpillFlowTable(hash_FlowTable *table) {
+FlowTableRecord_t *record;
+uint32_t i;
+
+	if ( Spill.dir == NULL ) {
+		char *tmpdir = getenv("TMPDIR");
+		char dir[MAXPATHLEN];
+
+		snprintf(dir, MAXPATHLEN, "%s/nfdump.XXXXXX", tmpdir ? tmpdir : "/tmp");
+		dir[MAXPATHLEN-1] = '\0';
+		if ( mkdtemp(dir) == NULL ) {
+			LogError("mkdtemp() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		Spill.dir = strdup(dir);
+		Spill.key = NewFlowKey();
+		if ( !Spill.dir ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		for ( i=0; i<SPILL_BUCKETS; i++ ) 
+			Spill.bucket[i] = OpenSpillFile("bucket", i, 0);
+	}
+
+	for ( record = table->first; record; record = record->next ) 
+		WriteSpillRecord(Spill.bucket[SpillBucket(record->hash_key)], record);
+	Spill.runs++;
+	dbg_printf("FlowTable: spill run %u: %u records\n", Spill.runs, table->NumRecords);
+
+	FlowTable_free(table);
+	if ( !FlowTable_init(table) ) 
+		exit(255);
+
+} // End of SpillFlowTable
+
+// add the partial aggregate of a spilled flow to the table
+static void AddSpillRecord(hash_FlowTable *table, spill_record_t *spill_record) {
+FlowTableRecord_t	*record;
+common_record_t		*flow_record = SpillFlow(spill_record);
+uint64_t			*counter = spill_record->counter;
+uint32_t			index_cache, bidir_index_cache;
+void				*keymem;
+
+	record = hash_lookup_FlowTable(table, &index_cache, SpillKey(spill_record), NULL);
+	if ( record ) {
+		record->counter[INBYTES]	+= counter[INBYTES];
+		record->counter[INPACKETS]	+= counter[INPACKETS];
+		record->counter[OUTBYTES]	+= counter[OUTBYTES];
+		record->counter[OUTPACKETS] += counter[OUTPACKETS];
+	} else if ( BidirKey(SpillKey(spill_record)) ) {
+		SwapHashKey(Spill.key, SpillKey(spill_record));
+		record = hash_lookup_FlowTable(table, &bidir_index_cache, Spill.key, NULL);
+		if ( record ) {
+			// partial aggregate of the reverse flow
+			record->counter[OUTBYTES]	+= counter[INBYTES];
+			record->counter[OUTPACKETS] += counter[INPACKETS];
+			record->counter[INBYTES]	+= counter[OUTBYTES];
+			record->counter[INPACKETS]	+= counter[OUTPACKETS];
+		}
+	}
+
+	if ( record ) {
+		if ( TimeMsec_CMP(flow_record->first, flow_record->msec_first, 
+				record->flowrecord.first, record->flowrecord.msec_first) == 2) {
+			record->flowrecord.first = flow_record->first;
+			record->flowrecord.msec_first = flow_record->msec_first;
+		}
+		if ( TimeMsec_CMP(flow_record->last, flow_record->msec_last, 
+				record->flowrecord.last, record->flowrecord.msec_last) == 1) {
+			record->flowrecord.last = flow_record->last;
+			record->flowrecord.msec_last = flow_record->msec_last;
+		}
+		record->counter[FLOWS]		  += counter[FLOWS];
+		record->flowrecord.tcp_flags  |= flow_record->tcp_flags;
+		return;
+	}
+
+	// the records are spilled in the order of insertion, so the first one is the oldest
+	// the key is compared as keylen uint64_t - copy the zero padding as well
+	keymem = MemoryHandle_get(&table->mem, FlowTable.keylen * sizeof(uint64_t));
+	memcpy(keymem, SpillKey(spill_record), FlowTable.keylen * sizeof(uint64_t));
+	table->seq = spill_record->seq;
+	record = hash_insert_FlowTable(table, index_cache, keymem, flow_record);
+	memcpy((void *)record->counter, (void *)counter, sizeof(record->counter));
+	record->map_info_ref = spill_record->map_info_ref;
+	record->exp_ref		 = spill_record->exp_ref;
+
+} // End of AddSpillRecord
+
+static inline int SpillBefore(spill_reader_t *r1, spill_reader_t *r2) {
+	return r1->record->seq < r2->record->seq;
+} // End of SpillBefore
+
+static void SpillSiftDown(uint32_t pos) {
+spill_reader_t *reader = Spill.heap[pos];
+uint32_t child;
+
+	while ( (child = 2 * pos + 1) < Spill.NumReaders ) {
+		if ( child + 1 < Spill.NumReaders && SpillBefore(Spill.heap[child + 1], Spill.heap[child]) ) 
+			child++;
+		if ( !SpillBefore(Spill.heap[child], reader) ) 
+			break;
+		Spill.heap[pos] = Spill.heap[child];
+		pos = child;
+	}
+	Spill.heap[pos] = reader;
+
+} // End of SpillSiftDown
+
+// aggregate each bucket and prepare the merge of the aggregated buckets
+static void MergeSpill(void) {
+spill_record_t *spill_record;
+FlowTableRecord_t *record;
+int i;
+
+	if ( FlowTable.NumRecords ) 
+		SpillFlowTable(&FlowTable);
+
+	for ( i=0; i<SPILL_BUCKETS; i++ ) {
+		spill_reader_t reader;
+		nffile_t *nffile;
+
+		CloseSpillFile(Spill.bucket[i], "bucket", i, 0);
+		Spill.bucket[i] = NULL;
+
+		memset((void *)&reader, 0, sizeof(reader));
+		reader.nffile = OpenSpillFile("bucket", i, 1);
+		while ( (spill_record = ReadSpillRecord(&reader)) != NULL ) 
+			AddSpillRecord(&FlowTable, spill_record);
+		CloseSpillFile(reader.nffile, "bucket", i, 1);
+
+		nffile = OpenSpillFile("merged", i, 0);
+		for ( record = FlowTable.first; record; record = record->next ) 
+			WriteSpillRecord(nffile, record);
+		CloseSpillFile(nffile, "merged", i, 0);
+
+		FlowTable_free(&FlowTable);
+		if ( !FlowTable_init(&FlowTable) ) 
+			exit(255);
+	}
+
+	// min heap of the aggregated buckets by the sequence number of their next record
+	Spill.NumReaders = 0;
+	for ( i=0; i<SPILL_BUCKETS; i++ ) {
+		spill_reader_t *reader = &Spill.reader[i];
+
+		reader->nffile = OpenSpillFile("merged", i, 1);
+		reader->record = ReadSpillRecord(reader);
+		if ( reader->record == NULL ) {
+			CloseSpillFile(reader->nffile, "merged", i, 1);
+			reader->nffile = NULL;
+			continue;
+		}
+		Spill.heap[Spill.NumReaders++] = reader;
+	}
+	for ( i = (Spill.NumReaders >> 1) - 1; i >= 0; i-- ) 
+		SpillSiftDown(i);
+
+} // End of MergeSpill
+
+// next record of the merged buckets, NULL after the last one
+static FlowTableRecord_t *NextSpillRecord(void) {
+spill_reader_t *reader;
+spill_record_t *spill_record;
+uint32_t size;
+
+	if ( Spill.NumReaders == 0 ) 
+		return NULL;
+
+	reader = Spill.heap[0];
+	spill_record = reader->record;
+
+	// copy the record and its key before the block of the reader is replaced
+	size = sizeof(FlowTableRecord_t) - sizeof(common_record_t) + FlowRecordSize(SpillFlow(spill_record));
+	size = (size + 7) & ~7;
+	if ( size + FlowTable.keylen * sizeof(uint64_t) > Spill.RecordSize ) {
+		free((void *)Spill.record);
+		Spill.RecordSize = size + FlowTable.keylen * sizeof(uint64_t);
+		Spill.record = (FlowTableRecord_t *)malloc(Spill.RecordSize);
+		if ( !Spill.record ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+	}
+	Spill.record->next		   = NULL;
+	Spill.record->hash_key	   = (char *)Spill.record + size;
+	Spill.record->seq		   = spill_record->seq;
+	Spill.record->map_info_ref = spill_record->map_info_ref;
+	Spill.record->exp_ref	   = spill_record->exp_ref;
+	memcpy((void *)Spill.record->counter, (void *)spill_record->counter, sizeof(Spill.record->counter));
+	memcpy((void *)Spill.record->hash_key, SpillKey(spill_record), FlowTable.keylen * sizeof(uint64_t));
+	memcpy((void *)&Spill.record->flowrecord, (void *)SpillFlow(spill_record), FlowRecordSize(SpillFlow(spill_record)));
+
+	reader->record = ReadSpillRecord(reader);
+	if ( reader->record == NULL ) {
+		CloseSpillFile(reader->nffile, "merged", reader - Spill.reader, 1);
+		reader->nffile = NULL;
+		Spill.heap[0] = Spill.heap[--Spill.NumReaders];
+	}
+	if ( Spill.NumReaders ) 
+		SpillSiftDown(0);
+
+	return Spill.record;
+
+} // End of NextSpillRecord
+
+/*
+ * Iterate the aggregated flows in the order of insertion: NULL returns the first record. 
+ * If the table was spilled to disk, the records are streamed from the spill files and 
+ * only the last returned record is valid. The stream can be iterated only once.
+ */
+FlowTableRecord_t *NextFlowTableRecord(FlowTableRecord_t *record) {
+
+	if ( Spill.runs == 0 ) 
+		return record ? record->next : FlowTable.first;
+
+	if ( record == NULL ) 
+		MergeSpill();
+
+	return NextSpillRecord();
+
+} // End of NextFlowTableRecord
+
+// load the spilled records into the flow table, to process them in any order
+void LoadFlowTable(void) {
+FlowTableRecord_t *spill_record;
+
+	if ( Spill.runs == 0 ) 
+		return;
+
+	for ( spill_record = NextFlowTableRecord(NULL); spill_record; spill_record = NextSpillRecord() ) {
+		FlowTableRecord_t *record;
+		uint32_t size = sizeof(FlowTableRecord_t) - sizeof(common_record_t) + FlowRecordSize(&spill_record->flowrecord);
+
+		record = MemoryHandle_get(&FlowTable.mem, size);
+		memcpy((void *)record, (void *)spill_record, size);
+		record->hash_key = MemoryHandle_get(&FlowTable.mem, FlowTable.keylen * sizeof(uint64_t));
+		memcpy((void *)record->hash_key, spill_record->hash_key, FlowTable.keylen * sizeof(uint64_t));
+		AppendRecord(&FlowTable, record);
+	}
+	Spill.runs = 0;
+
+} // End of LoadFlowTable
+
+static void DisposeSpill(void) {
+int i;
+
+	if ( Spill.dir == NULL ) 
+		return;
+
+	for ( i=0; i<SPILL_BUCKETS; i++ ) {
+		if ( Spill.bucket[i] ) 
+			CloseSpillFile(Spill.bucket[i], "bucket", i, 1);
+		if ( Spill.reader[i].nffile ) 
+			CloseSpillFile(Spill.reader[i].nffile, "merged", i, 1);
+	}
+	if ( rmdir(Spill.dir) < 0 ) 
+		LogError("rmdir() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+
+	free((void *)Spill.dir);
+	free(Spill.key);
+	free((void *)Spill.record);
+	memset((void *)&Spill, 0, sizeof(Spill));
+
+} // End of DisposeSpill
+
+void SetFlowTableLimit(uint64_t limit) {
+	FlowTableLimit = limit;
+} // End of SetFlowTableLimit
+
+/*
+ * Compact records: an aggregated flow keeps only the common record of its first flow without
+ * the extensions. The rest of the flow is rebuilt from the hash key by ExpandFlowTableRecord().
+ * This is possible, if the output prints the aggregated fields only, which is the case for any
+ * custom aggregation, or if the output needs nothing else than the common record and the 
+ * IP addresses of the default 5-tuple aggregation. The aggregation by networks prints the 
+ * addresses and netmasks of the first flow, so it needs the full records.
+ * The record is not sized from the aggregation mask: the header of FlowTableRecord_t, the
+ * key and the hash dominate the memory of a compact record, not its 32 byte common record.
+ */
+void SetCompactFlowTable(int common_only) {
+	CompactRecords = !FlowTable.apply_netbits && (aggregate_stack != NULL || common_only);
+} // End of SetCompactFlowTable
+
+// the master record fields of the aggregation key
+uint64_t FlowTableFields(void) {
+uint64_t fields;
+
+	fields = 0;
+	if ( aggregate_stack ) {
+		aggregate_param_t *aggr_param = aggregate_stack;
+		while ( aggr_param->size ) {
+			fields |= FieldBit(aggr_param->offset);
+			aggr_param++;
+		}
+	} else {
+		fields |= FieldBit(OffsetSrcIPv6a) | FieldBit(OffsetSrcIPv6b) | FieldBit(OffsetDstIPv6a) | 
+				  FieldBit(OffsetDstIPv6b) | FieldBit(OffsetPort) | FieldBit(OffsetProto);
+	}
+
+	// the netmasks of srcnet/dstnet
+	if ( FlowTable.apply_netbits ) 
+		fields |= FieldBit(OffsetMask);
+
+	return fields;
+
+} // End of FlowTableFields
+
+// expand a record of the flow table into a master record. The counters are set by the caller
+void ExpandFlowTableRecord(FlowTableRecord_t *record, master_record_t *output_record) {
+exporter_info_record_t *exporter_info = record->exp_ref;
+
+	if ( !CompactRecords ) {
+		ExpandRecord_v2(&record->flowrecord, record->map_info_ref, exporter_info, output_record);
+		return;
+	}
+
+	// same as ExpandRecord_v2() for the common record
+	output_record->map_ref = record->map_info_ref->map;
+	memcpy((void *)output_record, (void *)&record->flowrecord, COMMON_RECORD_DATA_SIZE);
+	if ( exporter_info ) {
+		output_record->exporter_sysid = exporter_info->sysid;
+		output_record->exp_ref 		  = exporter_info;
+	} else {
+		output_record->exp_ref 		  = NULL;
+	}
+	output_record->label = NULL;
+	output_record->icmp  = output_record->dstport;
+	output_record->aggr_flows = 1;
+
+	if ( aggregate_stack ) {
+		// put the aggregated fields back into place - see New_Hash_Key()
+		uint64_t *r = (uint64_t *)output_record;
+		void *keymem = record->hash_key;
+		aggregate_param_t *aggr_param = aggregate_stack;
+		while ( aggr_param->size ) {
+			uint64_t val = 0;
+
+			switch ( aggr_param->size ) {
+				case 8:
+					val = *((uint64_t *)keymem);
+					break;
+				case 4:
+					val = *((uint32_t *)keymem);
+					break;
+				case 2:
+					val = *((uint16_t *)keymem);
+					break;
+				case 1:
+					val = *((uint8_t *)keymem);
+					break;
+			}
+			keymem += aggr_param->size;
+			r[aggr_param->offset] &= ~aggr_param->mask;
+			r[aggr_param->offset] |= (val << aggr_param->shift) & aggr_param->mask;
+			aggr_param++;
+		}
+	} else {
+		Default_key_t *keyptr = (Default_key_t *)record->hash_key;
+		output_record->V6.srcaddr[0] = keyptr->srcaddr[0];
+		output_record->V6.srcaddr[1] = keyptr->srcaddr[1];
+		output_record->V6.dstaddr[0] = keyptr->dstaddr[0];
+		output_record->V6.dstaddr[1] = keyptr->dstaddr[1];
 	}
 
-	/* Force "avalanching" of final 127 bits */
-	hash ^= hash << 3;
-	hash += hash >> 5;
-	hash ^= hash << 4;
-	hash += hash >> 17;
-	hash ^= hash << 25;
-	hash += hash >> 6;
+} // End of ExpandFlowTableRecord
 
-	return hash;
-}
 
 int SetBidirAggregation(void) {
 	
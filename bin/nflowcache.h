@@ -54,11 +54,10 @@
 
 /* Element of the Flow Table ( cache ) */
 typedef struct FlowTableRecord {
-	// record chain - points to next record with same hash in case of a hash collision
+	// record chain - points to the next record inserted into the table
 	struct FlowTableRecord *next;	
 
 	// Hash papameters
-	uint32_t	hash;		// the full 32bit hash value
 	char		*hash_key;	// all keys in sequence to generate the hash 
 
 	// flow counter parameters for FLOWS, INPACKETS, INBYTES, OUTPACKETS, OUTBYTES
@@ -66,9 +65,14 @@ typedef struct FlowTableRecord {
 
 	extension_info_t	   *map_info_ref;
 	exporter_info_record_t *exp_ref;
+
+	// order of insertion, if the flows are aggregated in partitions - see MergeFlowPartitions()
+	uint64_t	seq;
+
 	// flow record follows
 	// flow data size may vary depending on the number of extensions
 	// common_record_t already contains a pointer to more data ( extensions ) at the end
+	// a compact record holds the common record only - see SetCompactFlowTable()
 	common_record_t	flowrecord;
 
 	// no further vars beyond this point! The flow record above has additional data.
@@ -100,23 +104,46 @@ typedef struct MemoryHandle_s {
 # 	define ALIGN_MASK 0xFFFFFFFC
 #endif
 
-// number of bits for hash width for floe table
-// Size: 0 < HashBits < 32
-// typically 20 - tradeoff memory/speed
-#define HashBits 20
+// initial number of bits for the hash width of the flow table. The flow table grows as needed
+// up to FlowTableMaxBits
+#define FlowTableBits 	 16
+#define FlowTableMaxBits 31
 
 // Each pre-allocated memory block is 10M
 #define MemBlockSize 10*1024*1024
 #define MaxMemBlocks	256
 
 
+/* Slot of the flow hash */
+typedef struct FlowTableSlot_s {
+	uint32_t			hash;			/* the full 32bit hash value of the record */
+	FlowTableRecord_t	*record;
+} FlowTableSlot_t;
+
+/*
+ * Open addressing hash of the flow table. The slots are probed in groups of FLOW_GROUP slots.
+ * For each slot a control byte holds the low 7 bits of the hash or marks the slot as empty 
+ * or moved. A group of control bytes is matched at once, so mostly only one slot is compared.
+ */
+#define FLOW_GROUP	8
+
+typedef struct FlowHash_s {
+	uint8_t				*ctrl;			/* control byte of each slot */
+	FlowTableSlot_t		*slot;
+	uint32_t			NumBits;		/* width of the hash */
+	uint32_t			GroupMask;		/* number of groups - 1 */
+	uint32_t			NumUsed;		/* number of used or moved slots */
+	uint32_t			MaxUsed;		/* grow the table, when reached */
+} FlowHash_t;
+
 typedef struct hash_FlowTable {
 	/* hash table data */
-	uint16_t 			NumBits;		/* width of the hash table */
-	uint32_t			IndexMask;		/* Mask which corresponds to NumBits */
+	FlowHash_t			hash;			/* current hash */
+	FlowHash_t			old;			/* previous hash, while its records are moved after a resize */
+	uint32_t			MoveGroup;		/* next group of the previous hash to move */
 	uint32_t			NumRecords;		/* number of records in table */
-	FlowTableRecord_t 	**bucket;		/* Hash entry point: points to elements in the flow block */
-	FlowTableRecord_t 	**bucketcache;	/* in case of index collisions, this array points to the last element with that index */
+	FlowTableRecord_t 	*first;			/* all records in the order of insertion */
+	FlowTableRecord_t 	*last;
 
 	uint32_t			keylen;			/* key length of hash key as number of 4byte ints */
 	uint32_t			keysize;		/* size of key in bytes */
@@ -124,6 +151,11 @@ typedef struct hash_FlowTable {
 	/* use a MemoryHandle for the table */
 	MemoryHandle_t		mem;
 
+	/* key of the next record to insert and key memory for the bidir lookup */
+	void				*keymem;
+	void				*bidirkeymem;
+	uint64_t			seq;			/* sequence number of the next record */
+
 	/* src/dst IP aggr masks - use to properly maks the IP before printing */
 	uint64_t			IPmask[4];		// 0-1 srcIP, 2-3 dstIP
 	int					has_masks;
@@ -145,6 +177,29 @@ void InsertFlow(common_record_t *raw_record, master_record_t *flow_record, exten
 
 void AddFlow(common_record_t *raw_record, master_record_t *flow_record, extension_info_t *extension_info );
 
+int Init_FlowPartitions(uint32_t num);
+
+void *NewFlowKey(void);
+
+uint32_t FlowPartitionKey(void *flowkey, master_record_t *flow_record);
+
+void AddFlowPartition(uint32_t partition, uint64_t seq, common_record_t *raw_record, 
+	master_record_t *flow_record, extension_info_t *extension_info);
+
+void MergeFlowPartitions(void);
+
+void SetFlowTableLimit(uint64_t limit);
+
+FlowTableRecord_t *NextFlowTableRecord(FlowTableRecord_t *record);
+
+void LoadFlowTable(void);
+
+void SetCompactFlowTable(int common_only);
+
+uint64_t FlowTableFields(void);
+
+void ExpandFlowTableRecord(FlowTableRecord_t *record, master_record_t *output_record);
+
 int SetBidirAggregation( void );
 
 int ParseAggregateMask( char *arg, char **aggr_fmt  );
@@ -43,6 +43,7 @@
 #include <sys/param.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -68,6 +69,10 @@ extern exporter_t **exporter_list;
 /* Local Variables */
 static const char *nfdump_version = VERSION;
 
+// number of channel writer threads - see -W
+#define MAX_CHANNEL_WRITERS	64
+static int ChannelWriters = 0;
+
 
 extension_map_list_t *extension_map_list;
 uint32_t is_anonymized;
@@ -86,8 +91,10 @@ static void process_data(profile_channel_info_t *channels, unsigned int num_chan
 
 /* Functions */
 
+#define NEED_FLOWBATCH 1
 #include "nfdump_inline.c"
 #include "nffile_inline.c"
+#undef NEED_FLOWBATCH
 
 static void usage(char *name) {
 		printf("usage %s [options] \n"
@@ -103,6 +110,7 @@ static void usage(char *name) {
 					"-Z\t\tCheck filter syntax and exit.\n"
 					"-S subdir\tSub directory format. see nfcapd(1) for format\n"
 					"-z\t\tCompress flows in output file.\n"
+					"-W <num>\tWrite the channel files with <num> writer threads.\n"
 #ifdef HAVE_INFLUXDB
 					"-i <influxurl>\tInfluxdb url for stats (example: http://localhost:8086/write?db=mydb&u=pippo&p=paperino)\n"
 #endif
@@ -110,10 +118,258 @@ static void usage(char *name) {
 } /* usage */
 
 
+/*
+ * Channel writers:
+ * With -W the matched flows are appended to the channel files by writer threads, which 
+ * also compress and write the blocks and close the files. The channels are distributed
+ * round robin over the writers, so each channel and its file is owned by one writer.
+ * The main thread reads and filters the flows. A filtered batch is handed over to the
+ * writers, while the main thread fills the other batch. The flow records of a batch point
+ * into the data block of the input file, so the main thread waits for the writers, before
+ * it reads the next block or appends any other record to the channel files.
+ */
+enum { WRITER_BATCH = 0, WRITER_CLOSE, WRITER_EXIT };
+
+typedef struct writer_pool_s {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	work_cond;		// writers wait for a new job
+	pthread_cond_t	done_cond;		// main thread waits for the writers to finish the job
+	pthread_t		*tid;
+	uint32_t		num_writers;
+
+	profile_channel_info_t	*channels;
+	uint32_t		num_channels;
+	uint32_t		words;			// channel bitmap words per flow
+
+	// current job
+	uint32_t		job;			// sequence number of the job
+	uint32_t		busy;			// writers still working on the job
+	int				command;
+	flow_batch_t	*batch;
+	uint64_t		*match;
+
+	// the batch, which is filled, and the batch, which is written
+	flow_batch_t	*flow_batch[2];
+	uint64_t		*flow_match[2];
+	int				fill;
+} writer_pool_t;
+
+typedef struct channel_writer_s {
+	writer_pool_t	*pool;
+	uint32_t		id;
+} channel_writer_t;
+
+/* append the matched flows of a batch to the channels j with j % step == first */
+static void WriteFlows(flow_batch_t *batch, uint64_t *match, uint32_t words, 
+	profile_channel_info_t *channels, uint32_t first, uint32_t step) {
+uint32_t i;
+
+	for ( i=0; i < batch->num; i++ ) {
+		common_record_t *flow_record = batch->flow_record[i];
+		master_record_t *master_record = &batch->master_record[i];
+		uint32_t w;
+
+		// for all channels with a successful profile filter
+		for ( w=0; w < words; w++ ) {
+			uint64_t bits = match[i * words + w];
+			uint32_t j = w << 6;
+			for ( ; bits; bits >>= 1, j++ ) {
+				if ( (bits & 1) == 0 || (j % step) != first ) 
+					continue;
+
+				// filter was successful -> continue record processing
+
+				// update statistics
+				UpdateStat(&channels[j].stat_record, master_record);
+				if ( channels[j].nffile ) 
+					UpdateStat(channels[j].nffile->stat_record, master_record);
+
+				// do we need to write data to new file - shadow profiles do not have files.
+				// check if we need to flush the output buffer
+				if ( channels[j].nffile != NULL ) {
+					// write record to output buffer
+					AppendToBuffer(channels[j].nffile, (void *)flow_record, flow_record->size);
+				} 
+			}
+		} // End of for all channels
+	}
+
+} // End of WriteFlows
+
+static void *ChannelWriter(void *arg) {
+channel_writer_t *writer = (channel_writer_t *)arg;
+writer_pool_t *pool = writer->pool;
+uint32_t job, j;
+int command;
+
+	// compress blocks with the context of this thread
+	if ( !InitThreadCompression() ) 
+		exit(255);
+
+	job = 0;
+	do {
+		pthread_mutex_lock(&pool->mutex);
+		while ( pool->job == job ) 
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		job		= pool->job;
+		command = pool->command;
+		pthread_mutex_unlock(&pool->mutex);
+
+		switch (command) {
+			case WRITER_BATCH:
+				WriteFlows(pool->batch, pool->match, pool->words, pool->channels, writer->id, pool->num_writers);
+				break;
+			case WRITER_CLOSE:
+				for ( j=writer->id; j < pool->num_channels; j += pool->num_writers ) 
+					CloseChannelFile(&pool->channels[j]);
+				break;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		if ( --pool->busy == 0 ) 
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mutex);
+	} while ( command != WRITER_EXIT );
+
+	free(writer);
+	return NULL;
+
+} // End of ChannelWriter
+
+/* wait for the writers to finish the current job */
+static void WaitWriters(writer_pool_t *pool) {
+
+	pthread_mutex_lock(&pool->mutex);
+	while ( pool->busy ) 
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+} // End of WaitWriters
+
+static void PostWriters(writer_pool_t *pool, int command, flow_batch_t *batch, uint64_t *match) {
+
+	WaitWriters(pool);
+	pthread_mutex_lock(&pool->mutex);
+	pool->command = command;
+	pool->batch	  = batch;
+	pool->match	  = match;
+	pool->busy	  = pool->num_writers;
+	pool->job++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+} // End of PostWriters
+
+static writer_pool_t *StartWriters(profile_channel_info_t *channels, uint32_t num_channels, uint32_t num_writers) {
+writer_pool_t *pool;
+uint32_t i;
+int err;
+
+	pool = (writer_pool_t *)calloc(1, sizeof(writer_pool_t));
+	if ( !pool ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	pool->channels		= channels;
+	pool->num_channels	= num_channels;
+	pool->num_writers	= num_writers;
+	pool->words			= (num_channels + 63) >> 6;
+	pool->tid = (pthread_t *)calloc(num_writers, sizeof(pthread_t));
+	for ( i=0; i<2; i++ ) {
+		pool->flow_batch[i] = NewFlowBatch();
+		pool->flow_match[i] = (uint64_t *)calloc(FILTER_BATCH * pool->words, sizeof(uint64_t));
+		if ( !pool->flow_match[i] ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+	}
+	if ( !pool->tid ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for ( i=0; i<num_writers; i++ ) {
+		channel_writer_t *writer = (channel_writer_t *)malloc(sizeof(channel_writer_t));
+		if ( !writer ) {
+			LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		writer->pool = pool;
+		writer->id	 = i;
+		err = pthread_create(&pool->tid[i], NULL, ChannelWriter, (void *)writer);
+		if ( err ) {
+			LogError("pthread_create() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(err) );
+			exit(255);
+		}
+	}
+
+	return pool;
+
+} // End of StartWriters
+
+/* close the channel files and terminate the writers */
+static void StopWriters(writer_pool_t *pool) {
+uint32_t i;
+
+	PostWriters(pool, WRITER_CLOSE, NULL, NULL);
+	PostWriters(pool, WRITER_EXIT, NULL, NULL);
+	for ( i=0; i<pool->num_writers; i++ ) 
+		pthread_join(pool->tid[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	for ( i=0; i<2; i++ ) {
+		free(pool->flow_batch[i]);
+		free(pool->flow_match[i]);
+	}
+	free(pool->tid);
+	free(pool);
+
+} // End of StopWriters
+
+/*
+ * Filter the flows of the batch and append the matched flows to the channels. 
+ * Returns the batch to fill next.
+ */
+static flow_batch_t *ProcessFlowBatch(flow_batch_t *batch, FilterSet_t *filter_set, 
+	profile_channel_info_t *channels, writer_pool_t *pool) {
+uint64_t *match;
+
+	if ( batch->num == 0 ) 
+		return batch;
+
+	// apply all profile filters at once
+	RunFilterSet(filter_set, batch->nfrecord, batch->num);
+
+	if ( pool == NULL ) {
+		WriteFlows(batch, filter_set->match, filter_set->words, channels, 0, 1);
+		batch->num = 0;
+		return batch;
+	}
+
+	// hand the batch over to the writers and continue with the other batch
+	match = pool->flow_match[pool->fill];
+	memcpy((void *)match, (void *)filter_set->match, batch->num * filter_set->words * sizeof(uint64_t));
+	PostWriters(pool, WRITER_BATCH, batch, match);
+	pool->fill ^= 1;
+	batch = pool->flow_batch[pool->fill];
+	batch->num = 0;
+
+	return batch;
+
+} // End of ProcessFlowBatch
+
 static void process_data(profile_channel_info_t *channels, unsigned int num_channels, time_t tslot) {
 common_record_t	*flow_record;
 nffile_t		*nffile;
-FilterEngine_t	*engine;
+flow_batch_t	*batch;
+FilterSet_t		*filter_set;
+FilterEngine_t	**engines;
+writer_pool_t	*pool;
 int 		i, j, done, ret ;
 
 	nffile = GetNextFile(NULL, 0, 0);
@@ -133,6 +389,30 @@ int 		i, j, done, ret ;
 	strncpy(Ident, nffile->file_header->ident, IDENTLEN);
 	Ident[IDENTLEN-1] = '\0';
 
+	// ident filters compare the ident of the current file
+	for ( j=0; j < num_channels; j++ ) 
+		channels[j].engine->ident = nffile->file_header->ident;
+
+	// flows are expanded into the batch and filtered per batch
+	pool = NULL;
+	if ( ChannelWriters ) {
+		pool  = StartWriters(channels, num_channels, ChannelWriters);
+		batch = pool->flow_batch[pool->fill];
+	} else {
+		batch = NewFlowBatch();
+	}
+
+	// the channel filters share equal predicates
+	engines = (FilterEngine_t **)malloc(num_channels * sizeof(FilterEngine_t *));
+	if ( !engines ) {
+		LogError("malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	for ( j=0; j < num_channels; j++ ) 
+		engines[j] = channels[j].engine;
+	filter_set = NewFilterSet(engines, num_channels);
+	free(engines);
+
 	done = 0;
 	while ( !done ) {
 
@@ -156,6 +436,10 @@ int 		i, j, done, ret ;
 					done = 1;
 					LogError("Unexpected end of file list\n");
 				}
+				if ( !done ) {
+					for ( j=0; j < num_channels; j++ ) 
+						channels[j].engine->ident = next->file_header->ident;
+				}
 				continue;
 	
 				} break; // not really needed
@@ -175,11 +459,17 @@ int 		i, j, done, ret ;
 			}
 			sumSize += flow_record->size;
 
+			// any other record is processed after the pending flows
+			if ( flow_record->type != CommonRecordType ) {
+				batch = ProcessFlowBatch(batch, filter_set, channels, pool);
+				if ( pool ) 
+					WaitWriters(pool);
+			}
+
 			switch ( flow_record->type ) { 
 					case CommonRecordType: {
 					exporter_t *exp_info = exporter_list[flow_record->exporter_sysid];
 					uint32_t map_id = flow_record->ext_map;
-					master_record_t	*master_record;
 
 					if ( extension_map_list->slot[map_id] == NULL ) {
 						LogError("Corrupt data file. Missing extension map %u. Skip record.\n", flow_record->ext_map);
@@ -187,38 +477,12 @@ int 		i, j, done, ret ;
 						continue;
 					} 
 	
-					master_record = &(extension_map_list->slot[map_id]->master_record);
-					ExpandRecord_v2( flow_record, extension_map_list->slot[flow_record->ext_map], 
-						exp_info ? &(exp_info->info) : NULL, master_record);
+					BatchExpandRecord(batch, flow_record, extension_map_list->slot[map_id], 
+						exp_info ? &(exp_info->info) : NULL);
+					batch->num++;
+					if ( batch->num == FILTER_BATCH ) 
+						batch = ProcessFlowBatch(batch, filter_set, channels, pool);
 
-					for ( j=0; j < num_channels; j++ ) {
-						int match;
-	
-						// apply profile filter
-						(channels[j].engine)->nfrecord 	= (uint64_t *)master_record;
-						engine = channels[j].engine;
-						match = (*engine->FilterEngine)(engine);
-	
-						// if profile filter failed -> next profile
-						if ( !match )
-							continue;
-	
-						// filter was successful -> continue record processing
-	
-						// update statistics
-						UpdateStat(&channels[j].stat_record, master_record);
-						if ( channels[j].nffile ) 
-							UpdateStat(channels[j].nffile->stat_record, master_record);
-	
-						// do we need to write data to new file - shadow profiles do not have files.
-						// check if we need to flush the output buffer
-						if ( channels[j].nffile != NULL ) {
-							// write record to output buffer
-							AppendToBuffer(channels[j].nffile, (void *)flow_record, flow_record->size);
-						} 
-	
-					} // End of for all channels
-	
 					} break;
 				case ExtensionMapType: {
 					extension_map_t *map = (extension_map_t *)flow_record;
@@ -285,8 +549,20 @@ int 		i, j, done, ret ;
 			flow_record = (common_record_t *)((pointer_addr_t)flow_record + flow_record->size);
 
 		} // End of for all umRecords
+
+		// the next block replaces the flow records of the batches
+		batch = ProcessFlowBatch(batch, filter_set, channels, pool);
+		if ( pool ) 
+			WaitWriters(pool);
+
 	} // End of while !done
 
+	if ( pool ) 
+		StopWriters(pool);
+	else
+		free(batch);
+	DisposeFilterSet(filter_set);
+
 	// do we need to write data to new file - shadow profiles do not have files.
 	for ( j=0; j < num_channels; j++ ) {
 		if ( channels[j].nffile != NULL ) {
@@ -498,7 +774,7 @@ time_t tslot;
 	// default file names
 	ffile = "filter.txt";
 	rfile = NULL;
-	while ((c = getopt(argc, argv, "D:HIL:p:P:hi:f:J;r:n:M:S:t:VzZ")) != EOF) {
+	while ((c = getopt(argc, argv, "D:HIL:p:P:hi:f:J;r:n:M:S:t:VW:zZ")) != EOF) {
 		switch (c) {
 			case 'h':
 				usage(argv[0]);
@@ -533,6 +809,13 @@ time_t tslot;
 				printf("%s: Version: %s\n",argv[0], nfdump_version);
 				exit(0);
 				break;
+			case 'W':
+				ChannelWriters = atoi(optarg);
+				if ( ChannelWriters < 0 || ChannelWriters > MAX_CHANNEL_WRITERS ) {
+					LogError("Number of channel writers out of range 0..%d\n", MAX_CHANNEL_WRITERS);
+					exit(255);
+				}
+				break;
 			case 'f':
 				ffile = optarg;
 				break;
@@ -241,6 +241,7 @@ uint32_t		numflows, cnt;
 	// setup Filter Engine to point to master_record, as any record read from file
 	// is expanded into this record
 	Engine->nfrecord = (uint64_t *)&master_record;
+	Engine->ident	 = nffile->file_header->ident;
 
 	cnt = 0;
 	while ( !done ) {
@@ -265,6 +266,8 @@ uint32_t		numflows, cnt;
 					LogError("Unexpected end of file list\n");
 				}
 				// else continue with next file
+				if ( !done ) 
+					Engine->ident = next->file_header->ident;
 				continue;
 	
 				} break; // not really needed
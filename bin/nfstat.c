@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -57,6 +58,7 @@
 #include "output_util.h"
 #include "nflowcache.h"
 #include "nfstat.h"
+#include "nfhash.h"
 
 struct flow_element_s {
 	uint32_t	offset0;
@@ -371,6 +373,7 @@ struct StatRequest_s {
 	int16_t	 StatType;		// index into StatParameters
 	uint8_t	 order_proto;	// protocol separated statistics
 	int	 	 direction;		// ascending or descending
+	int		 weight_order;	// approximate stats: order_mode of the weight
 } StatRequest[MaxStats];	// This number should do it for a single run
 
 /* 
@@ -405,27 +408,28 @@ struct order_mode_s {
 	int	 direction;	// ascending or descending
 	order_proc_record_t  record_function;	// Function to call for record stats
 	order_proc_element_t element_function;	// Function to call for element stats
+	order_proc_element_t weight_function;	// additive weight for approximate element stats
 } order_mode[] = {
-	{ "-",			0,	0, null_record, null_element},	// empty entry 0
-	{ "flows",		IN,	DESCENDING, flows_record, flows_element},
-	{ "packets",		INOUT,	DESCENDING, packets_record, packets_element},
-	{ "ipkg",		IN,	DESCENDING, packets_record, packets_element},
-	{ "opkg",		OUT,	DESCENDING, packets_record, packets_element},
-	{ "bytes",		INOUT,	DESCENDING, bytes_record, bytes_element},
-	{ "ibyte",		IN,	DESCENDING, bytes_record, bytes_element},
-	{ "obyte",		OUT,	DESCENDING, bytes_record, bytes_element},
-	{ "pps",		INOUT,	DESCENDING, pps_record, pps_element},
-	{ "ipps",		IN,	DESCENDING, pps_record, pps_element},
-	{ "opps",		OUT,	DESCENDING, pps_record, pps_element},
-	{ "bps",		INOUT,	DESCENDING, bps_record, bps_element},
-	{ "ibps",		IN,	DESCENDING, bps_record, bps_element},
-	{ "obps",		OUT,	DESCENDING, bps_record, bps_element},
-	{ "bpp",		INOUT,	DESCENDING, bpp_record, bpp_element},
-	{ "ibpp",		IN,	DESCENDING, bpp_record, bpp_element},
-	{ "obpp",		OUT,	DESCENDING, bpp_record, bpp_element},
-	{ "tstart",		0,	ASCENDING,  tstart_record, null_element},
-	{ "tend",		0,	ASCENDING,  tend_record, null_element},
-	{ NULL,			0,		0,	 NULL, NULL}
+	{ "-",			0,	0, null_record, null_element, flows_element},	// empty entry 0
+	{ "flows",		IN,	DESCENDING, flows_record, flows_element, flows_element},
+	{ "packets",		INOUT,	DESCENDING, packets_record, packets_element, packets_element},
+	{ "ipkg",		IN,	DESCENDING, packets_record, packets_element, packets_element},
+	{ "opkg",		OUT,	DESCENDING, packets_record, packets_element, packets_element},
+	{ "bytes",		INOUT,	DESCENDING, bytes_record, bytes_element, bytes_element},
+	{ "ibyte",		IN,	DESCENDING, bytes_record, bytes_element, bytes_element},
+	{ "obyte",		OUT,	DESCENDING, bytes_record, bytes_element, bytes_element},
+	{ "pps",		INOUT,	DESCENDING, pps_record, pps_element, packets_element},
+	{ "ipps",		IN,	DESCENDING, pps_record, pps_element, packets_element},
+	{ "opps",		OUT,	DESCENDING, pps_record, pps_element, packets_element},
+	{ "bps",		INOUT,	DESCENDING, bps_record, bps_element, bytes_element},
+	{ "ibps",		IN,	DESCENDING, bps_record, bps_element, bytes_element},
+	{ "obps",		OUT,	DESCENDING, bps_record, bps_element, bytes_element},
+	{ "bpp",		INOUT,	DESCENDING, bpp_record, bpp_element, bytes_element},
+	{ "ibpp",		IN,	DESCENDING, bpp_record, bpp_element, bytes_element},
+	{ "obpp",		OUT,	DESCENDING, bpp_record, bpp_element, bytes_element},
+	{ "tstart",		0,	ASCENDING,  tstart_record, null_element, flows_element},
+	{ "tend",		0,	ASCENDING,  tend_record, null_element, flows_element},
+	{ NULL,			0,		0,	 NULL, NULL, NULL}
 };
 #define Default_PrintOrder 1		// order_mode[0].val
 static uint32_t	print_order_bits = 0;
@@ -438,17 +442,30 @@ static uint64_t	byte_limit, packet_limit;
 static int byte_mode, packet_mode;
 enum { NONE = 0, LESS, MORE };
 
+// number of counters per stat for approximate element stats, 0 = exact stats
+static uint32_t	ApproxCounters	 = 0;
+
 /* function prototypes */
 static int ParseStatString(char *str, int16_t	*StatType, int *flow_record_stat, uint16_t *order_proto, int *direction);
 
 static int ParseListOrder(char *s, int multiple_orders, int *direction);
 
-static inline StatRecord_t *stat_hash_lookup(uint64_t *value, uint8_t prot, int hash_num);
+static void *StatAlloc(size_t size);
+
+static inline StatRecord_t *stat_hash_lookup(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash);
 
-static inline StatRecord_t *stat_hash_insert(uint64_t *value, uint8_t prot, int hash_num);
+static inline StatRecord_t *stat_hash_insert(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash);
 
 static void Expand_StatTable_Blocks(int hash_num);
 
+static inline StatRecord_t *stat_sketch_replace(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash);
+
+static inline void stat_sketch_sift(hash_StatTable *table, uint32_t pos);
+
+static inline void stat_sketch_update(int hash_num, StatRecord_t *record);
+
+static void PrintStatApprox(int hash_num, SortElement_t *topN_element_list, uint32_t numflows, int topN);
+
 static inline void PrintSortedFlowcache(SortElement_t *SortList, uint32_t maxindex, outputParams_t *outputParams, 
 		int GuessFlowDirection, printer_t print_record, extension_map_list_t *extension_map_list );
 
@@ -463,6 +480,8 @@ static inline int TimeMsec_CMP(time_t t1, uint16_t offset1, time_t t2, uint16_t
 
 static SortElement_t *StatTopN(int topN, uint32_t *count, int hash_num, int order, int direction);
 
+static SortElement_t *FlowTopN(int topN, uint32_t *count, uint32_t *passed, int order, int limit_order, int direction);
+
 /* locals */
 static hash_StatTable *StatTable;
 static SumRecord_t SumRecord;
@@ -756,6 +775,42 @@ uint32_t	len,scale;
 
 } // End of SetLimits
 
+/*
+ * Allocate the large stat blocks and slot arrays aligned to huge pages, and ask
+ * for transparent huge pages, where available. This saves many TLB misses, as 
+ * the records are accessed randomly.
+ */
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+static void *StatAlloc(size_t size) {
+void *p;
+
+	if ( size < HUGE_PAGE_SIZE ) 
+		return malloc(size);
+
+	size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+	if ( posix_memalign(&p, HUGE_PAGE_SIZE, size) != 0 )
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return p;
+
+} // End of StatAlloc
+
+/*
+ * Approximate element stats: each stat keeps a fixed number of counters with the 
+ * Space-Saving algorithm instead of one record per element. An element, which is 
+ * not yet counted, replaces the element with the least weight and inherits its counters.
+ * The weight is the flows, packets or bytes of the first requested order. The number 
+ * of distinct elements is estimated by a HyperLogLog sketch. The memory stays constant.
+ */
+void SetStatApprox(uint32_t counters) {
+
+	ApproxCounters = counters;
+
+} // End of SetStatApprox
+
 int Init_StatTable(uint16_t NumBits, uint32_t Prealloc) {
 uint32_t maxindex;
 int		 hash_num;
@@ -767,6 +822,13 @@ int		 hash_num;
 
 	memset((void *)&SumRecord, 0, sizeof(SumRecord));
 
+	if ( ApproxCounters ) {
+		// all counters in one stat block, the table never grows
+		Prealloc = ApproxCounters;
+		while ( NumBits < 31 && ((1U << NumBits) - (1U << NumBits >> 2)) < ApproxCounters )
+			NumBits++;
+	}
+
 	maxindex = (1 << NumBits);
 
 	StatTable = (hash_StatTable *)calloc(NumStats, sizeof(hash_StatTable));
@@ -779,18 +841,20 @@ int		 hash_num;
 		StatTable[hash_num].IndexMask   = maxindex -1;
 		StatTable[hash_num].NumBits     = NumBits;
 		StatTable[hash_num].Prealloc    = Prealloc;
-		StatTable[hash_num].bucket	  	= (StatRecord_t **)calloc(maxindex, sizeof(StatRecord_t *));
-		StatTable[hash_num].bucketcache = (StatRecord_t **)calloc(maxindex, sizeof(StatRecord_t *));
-		if ( !StatTable[hash_num].bucket || !StatTable[hash_num].bucketcache ) {
+		StatTable[hash_num].NumRecords  = 0;
+		StatTable[hash_num].MaxRecords  = maxindex - (maxindex >> 2);
+		StatTable[hash_num].slot	  	= (StatSlot_t *)StatAlloc(maxindex * sizeof(StatSlot_t));
+		if ( !StatTable[hash_num].slot ) {
 			fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 			return 0;
 		}
+		memset((void *)StatTable[hash_num].slot, 0, maxindex * sizeof(StatSlot_t));
 		StatTable[hash_num].memblock = (StatRecord_t **)calloc(MaxMemBlocks, sizeof(StatRecord_t *));
 		if ( !StatTable[hash_num].memblock ) {
 			fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 			return 0;
 		}
-		StatTable[hash_num].memblock[0] = (StatRecord_t *)calloc(Prealloc, sizeof(StatRecord_t));
+		StatTable[hash_num].memblock[0] = (StatRecord_t *)StatAlloc(Prealloc * sizeof(StatRecord_t));
 		if ( !StatTable[hash_num].memblock[0] ) {
 			fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 			return 0;
@@ -805,6 +869,30 @@ int		 hash_num;
 			int bit = 1 << PrintOrder;
 			StatRequest[hash_num].order_bits = PrintOrder ? bit : Default_PrintOrder;
 		}
+
+		StatTable[hash_num].heap	  = NULL;
+		StatTable[hash_num].HeapValid = 0;
+		if ( ApproxCounters ) {
+			int order = 0, i = 0;
+			while ( !(StatRequest[hash_num].order_bits & (1 << order)) ) 
+				order++;
+			// the additive order of the weight, such as packets for pps
+			while ( order_mode[i].element_function != order_mode[order].weight_function || 
+					order_mode[i].inout != order_mode[order].inout ) 
+				i++;
+			StatRequest[hash_num].weight_order = i;
+
+			StatTable[hash_num].heap	= (uint32_t *)malloc((Prealloc + 1) * sizeof(uint32_t));
+			StatTable[hash_num].heappos = (uint32_t *)malloc((Prealloc + 1) * sizeof(uint32_t));
+			StatTable[hash_num].weight  = (uint64_t *)malloc((Prealloc + 1) * sizeof(uint64_t));
+			StatTable[hash_num].error	= (uint64_t *)calloc(Prealloc + 1, sizeof(uint64_t));
+			StatTable[hash_num].hll		= (uint8_t *)calloc(1 << StatHLLBits, sizeof(uint8_t));
+			if ( !StatTable[hash_num].heap || !StatTable[hash_num].heappos || !StatTable[hash_num].weight ||
+				 !StatTable[hash_num].error || !StatTable[hash_num].hll ) {
+				fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+				return 0;
+			}
+		}
 	}
 
 	initialised = 1;
@@ -819,14 +907,25 @@ unsigned int i, hash_num;
 		return;
 
 	for ( hash_num=0; hash_num<NumStats; hash_num++ ) {
-		free((void *)StatTable[hash_num].bucket);
+		free((void *)StatTable[hash_num].slot);
 		for ( i=0; i<StatTable[hash_num].NumBlocks; i++ ) 
 			free((void *)StatTable[hash_num].memblock[i]);
 		free((void *)StatTable[hash_num].memblock);
+		if ( StatTable[hash_num].heap ) {
+			free((void *)StatTable[hash_num].heap);
+			free((void *)StatTable[hash_num].heappos);
+			free((void *)StatTable[hash_num].weight);
+			free((void *)StatTable[hash_num].error);
+			free((void *)StatTable[hash_num].hll);
+		}
 	}
 
 } // End of Dispose_Tables
 
+hash_StatTable *GetStatTable(int hash_num) {
+	return initialised && hash_num < (int)NumStats ? &StatTable[hash_num] : NULL;
+} // End of GetStatTable
+
 int SetStat(char *str, int *element_stat, int *flow_stat) {
 int			flow_record_stat = 0;
 int			direction 	= 0;
@@ -863,6 +962,25 @@ uint16_t	order_proto = 0;
 
 } // End of SetStat
 
+// the master record fields of the -s stat elements
+uint64_t StatFields(void) {
+uint64_t fields;
+int i, j;
+
+	fields = 0;
+	for ( j=0; j<NumStats; j++ ) {
+		int stat = StatRequest[j].StatType;
+		for ( i=0; i<StatParameters[stat].num_elem; i++ ) {
+			fields |= FieldBit(StatParameters[stat].element[i].offset1);
+			if ( StatParameters[stat].element[i].offset0 ) 
+				fields |= FieldBit(StatParameters[stat].element[i].offset0);
+		}
+	}
+
+	return fields;
+
+} // End of StatFields
+
 static int ParseStatString(char *str, int16_t	*StatType, int *flow_record_stat, uint16_t *order_proto, int *direction) {
 char	*s, *p, *q, *r;
 int i=0;
@@ -1012,26 +1130,24 @@ int Parse_PrintOrder(char *order) {
 
 } // End of Parse_PrintOrder
 
-static inline StatRecord_t *stat_hash_lookup(uint64_t *value, uint8_t prot, int hash_num) {
-uint32_t		index;
+static inline StatRecord_t *stat_hash_lookup(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash) {
+hash_StatTable	*table = &StatTable[hash_num];
 StatRecord_t	*record;
-
-	index = value[1] & StatTable[hash_num].IndexMask;
-
-	if ( StatTable[hash_num].bucket[index] == NULL )
-		return NULL;
-
-	record = StatTable[hash_num].bucket[index];
-	if ( StatRequest[hash_num].order_proto ) {
-		while ( record && ( record->stat_key[1] != value[1] || record->stat_key[0] != value[0] || prot != record->prot ) ) {
-			record = record->next;
-		}
-	} else {
-		while ( record && ( record->stat_key[1] != value[1] || record->stat_key[0] != value[0] ) ) {
-			record = record->next;
+uint32_t		index, tag, ref;
+
+	index = hash & table->IndexMask;
+	tag	  = hash >> 32;
+	while ( (ref = table->slot[index].ref) != 0 ) {
+		if ( table->slot[index].tag == tag ) {
+			record = StatRecordRef(table, ref);
+			if ( record->stat_key[1] == value[1] && record->stat_key[0] == value[0] && 
+				 ( !StatRequest[hash_num].order_proto || record->prot == prot ) )
+				return record;
 		}
+		index = (index + 1) & table->IndexMask;
 	}
-	return record;
+
+	return NULL;
 
 } // End of stat_hash_lookup
 
@@ -1047,10 +1163,10 @@ static void Expand_StatTable_Blocks(int hash_num) {
 		}
 	}
 	StatTable[hash_num].memblock[StatTable[hash_num].NumBlocks] = 
-		(StatRecord_t *)calloc(StatTable[hash_num].Prealloc, sizeof(StatRecord_t));
+		(StatRecord_t *)StatAlloc(StatTable[hash_num].Prealloc * sizeof(StatRecord_t));
 
 	if ( !StatTable[hash_num].memblock[StatTable[hash_num].NumBlocks] ) {
-		fprintf(stderr, "calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
 		exit(250);
 	}
 	StatTable[hash_num].NextBlock = StatTable[hash_num].NumBlocks++;
@@ -1058,34 +1174,237 @@ static void Expand_StatTable_Blocks(int hash_num) {
 
 } // End of Expand_StatTable_Blocks
 
-static inline StatRecord_t *stat_hash_insert(uint64_t *value, uint8_t prot, int hash_num) {
-uint32_t		index;
+static inline void stat_slot_insert(hash_StatTable *table, uint64_t hash, uint32_t ref) {
+uint32_t index;
+
+	index = hash & table->IndexMask;
+	while ( table->slot[index].ref != 0 ) 
+		index = (index + 1) & table->IndexMask;
+
+	table->slot[index].tag = hash >> 32;
+	table->slot[index].ref = ref;
+
+} // End of stat_slot_insert
+
+// double the slots and insert all records again
+static void Grow_StatTable(hash_StatTable *table) {
+uint64_t	maxindex;
+uint32_t	ref;
+
+	if ( table->NumBits >= 31 ) {
+		fprintf(stderr, "Stat table full: %u records\n", table->NumRecords);
+		exit(250);
+	}
+
+	maxindex = 1ULL << (table->NumBits + 1);
+	free((void *)table->slot);
+	table->slot = (StatSlot_t *)StatAlloc(maxindex * sizeof(StatSlot_t));
+	if ( !table->slot ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		exit(250);
+	}
+	memset((void *)table->slot, 0, maxindex * sizeof(StatSlot_t));
+	table->NumBits++;
+	table->IndexMask  = maxindex - 1;
+	table->MaxRecords = maxindex - (maxindex >> 2);
+
+	// the records are visited in the order of the stat blocks
+	for ( ref=1; ref<=table->NumRecords; ref++ ) {
+		StatRecord_t *record = StatRecordRef(table, ref);
+		stat_slot_insert(table, KeyHash(record->stat_key, 2 * sizeof(uint64_t)), ref);
+	}
+
+} // End of Grow_StatTable
+
+static inline StatRecord_t *stat_hash_insert(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash) {
+hash_StatTable	*table = &StatTable[hash_num];
 StatRecord_t	*record;
 
-	if ( StatTable[hash_num].NextElem >= StatTable[hash_num].Prealloc )
+	if ( table->NumRecords >= table->MaxRecords ) 
+		Grow_StatTable(table);
+
+	if ( table->NextElem >= table->Prealloc )
 		Expand_StatTable_Blocks(hash_num);
 
-	record = &(StatTable[hash_num].memblock[StatTable[hash_num].NextBlock][StatTable[hash_num].NextElem]);
-	StatTable[hash_num].NextElem++;
-	record->next     	= NULL;
+	record = &(table->memblock[table->NextBlock][table->NextElem]);
+	table->NextElem++;
 	record->stat_key[0] = value[0];
 	record->stat_key[1] = value[1];
 	record->prot		= prot;
 
-	index = value[1] & StatTable[hash_num].IndexMask;
-	if ( StatTable[hash_num].bucket[index] == NULL ) 
-		StatTable[hash_num].bucket[index] = record;
-	else
-		StatTable[hash_num].bucketcache[index]->next = record;
-	StatTable[hash_num].bucketcache[index] = record;
+	table->NumRecords++;
+	stat_slot_insert(table, hash, table->NumRecords);
+	if ( table->heap ) {
+		// approximate stats: a new record enters the heap at the end
+		table->heap[table->NumRecords - 1] = table->NumRecords;
+		table->heappos[table->NumRecords] = table->NumRecords - 1;
+	}
 	
 	return record;
 
 } // End of stat_hash_insert
 
+static void stat_slot_delete(hash_StatTable *table, uint64_t hash, uint32_t ref) {
+uint32_t index, next, home;
+
+	index = hash & table->IndexMask;
+	while ( table->slot[index].ref != ref ) 
+		index = (index + 1) & table->IndexMask;
+
+	// move the following slots of the probe sequence back into the hole
+	next = index;
+	while ( 1 ) {
+		StatRecord_t *record;
+		next = (next + 1) & table->IndexMask;
+		if ( table->slot[next].ref == 0 ) 
+			break;
+		record = StatRecordRef(table, table->slot[next].ref);
+		home = KeyHash(record->stat_key, 2 * sizeof(uint64_t)) & table->IndexMask;
+		if ( ((next - home) & table->IndexMask) >= ((next - index) & table->IndexMask) ) {
+			table->slot[index] = table->slot[next];
+			index = next;
+		}
+	}
+	table->slot[index].tag = 0;
+	table->slot[index].ref = 0;
+
+} // End of stat_slot_delete
+
+// the record with the least weight is replaced by the new element and keeps its counters
+static inline StatRecord_t *stat_sketch_replace(uint64_t *value, uint8_t prot, int hash_num, uint64_t hash) {
+hash_StatTable	*table = &StatTable[hash_num];
+StatRecord_t	*record;
+uint32_t		ref;
+
+	if ( !table->HeapValid ) {
+		int32_t i;
+		for ( i = (table->NumRecords >> 1) - 1; i >= 0; i-- ) 
+			stat_sketch_sift(table, i);
+		table->HeapValid = 1;
+	}
+
+	ref	   = table->heap[0];
+	record = StatRecordRef(table, ref);
+	stat_slot_delete(table, KeyHash(record->stat_key, 2 * sizeof(uint64_t)), ref);
+
+	table->error[ref]	= table->weight[ref];
+	record->stat_key[0] = value[0];
+	record->stat_key[1] = value[1];
+	record->prot		= prot;
+	stat_slot_insert(table, hash, ref);
+
+	return record;
+
+} // End of stat_sketch_replace
+
+// move the record at pos to its place in the heap
+static inline void stat_sketch_sift(hash_StatTable *table, uint32_t pos) {
+uint32_t	*heap	= table->heap;
+uint64_t	*weight = table->weight;
+uint32_t	ref, child;
+uint64_t	w;
+
+	ref = heap[pos];
+	w	= weight[ref];
+	while ( pos > 0 && weight[heap[(pos - 1) >> 1]] > w ) {
+		heap[pos] = heap[(pos - 1) >> 1];
+		table->heappos[heap[pos]] = pos;
+		pos = (pos - 1) >> 1;
+	}
+	while ( (child = 2 * pos + 1) < table->NumRecords ) {
+		if ( child + 1 < table->NumRecords && weight[heap[child + 1]] < weight[heap[child]] ) 
+			child++;
+		if ( weight[heap[child]] >= w ) 
+			break;
+		heap[pos] = heap[child];
+		table->heappos[heap[pos]] = pos;
+		pos = child;
+	}
+	heap[pos] = ref;
+	table->heappos[ref] = pos;
+
+} // End of stat_sketch_sift
+
+// update the weight of the record and restore the heap
+static inline void stat_sketch_update(int hash_num, StatRecord_t *record) {
+hash_StatTable	*table = &StatTable[hash_num];
+uint32_t		ref;
+int				order = StatRequest[hash_num].weight_order;
+
+	ref = record - table->memblock[0] + 1;
+	table->weight[ref] = order_mode[order].weight_function(record, order_mode[order].inout);
+	if ( table->HeapValid ) 
+		stat_sketch_sift(table, table->heappos[ref]);
+
+} // End of stat_sketch_update
+
+static inline void stat_hll_add(hash_StatTable *table, uint64_t hash) {
+uint64_t	w;
+uint32_t	index;
+uint8_t		rank;
+
+	index = hash >> (64 - StatHLLBits);
+	w	  = (hash << StatHLLBits) | (1ULL << (StatHLLBits - 1));
+	rank  = 1;
+	while ( !(w & 0x8000000000000000ULL) ) {
+		w <<= 1;
+		rank++;
+	}
+	if ( rank > table->hll[index] ) 
+		table->hll[index] = rank;
+
+} // End of stat_hll_add
+
+// natural logarithm for x >= 1 - saves the dependency on libm
+static double hll_log(double x) {
+double	y, y2, term, sum;
+int		k, i;
+
+	k = 0;
+	while ( x >= 2.0 ) {
+		x /= 2.0;
+		k++;
+	}
+	y	 = (x - 1.0) / (x + 1.0);
+	y2	 = y * y;
+	term = y;
+	sum	 = 0.0;
+	for ( i=1; i<40; i+=2 ) {
+		sum  += term / i;
+		term *= y2;
+	}
+	return 0.6931471805599453 * k + 2.0 * sum;
+
+} // End of hll_log
+
+uint64_t StatDistinct(hash_StatTable *table) {
+double		m, sum, estimate;
+uint32_t	i, zeros;
+
+	// as long as no record was replaced, the number of records is exact
+	if ( table->NumRecords < table->Prealloc ) 
+		return table->NumRecords;
+
+	m	  = 1 << StatHLLBits;
+	sum	  = 0.0;
+	zeros = 0;
+	for ( i=0; i<(1 << StatHLLBits); i++ ) {
+		sum += 1.0 / (double)(1ULL << table->hll[i]);
+		if ( table->hll[i] == 0 ) 
+			zeros++;
+	}
+	estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+	// small range correction: linear counting
+	if ( estimate <= 2.5 * m && zeros ) 
+		estimate = m * hll_log(m / zeros);
+
+	return (uint64_t)(estimate + 0.5);
+
+} // End of StatDistinct
+
 void AddStat(common_record_t *raw_record, master_record_t *flow_record ) {
 StatRecord_t		*stat_record;
-uint64_t			value[2][2];
+uint64_t			value[2][2], hash;
 int	j, i;
 
 	SumRecord.ibyte += flow_record->dOctets;
@@ -1114,7 +1433,18 @@ int	j, i;
 			if ( i == 1 && value[0][0] == value[1][0] && value[0][1] == value[1][1] ) {
 				break;
 			}
-			stat_record = stat_hash_lookup(value[i], flow_record->prot, j);
+			hash = KeyHash(value[i], 2 * sizeof(uint64_t));
+			if ( StatTable[j].hll ) 
+				stat_hll_add(&StatTable[j], hash);
+			stat_record = stat_hash_lookup(value[i], flow_record->prot, j, hash);
+			if ( !stat_record && StatTable[j].heap && StatTable[j].NumRecords == StatTable[j].Prealloc ) {
+				// approximate stats: replace the record with the least weight
+				stat_record = stat_sketch_replace(value[i], flow_record->prot, j, hash);
+				stat_record->first		= flow_record->first;
+				stat_record->msec_first = flow_record->msec_first;
+				stat_record->last		= flow_record->last;
+				stat_record->msec_last	= flow_record->msec_last;
+			}
 			if ( stat_record ) {
 				stat_record->counter[INBYTES] 	 += flow_record->dOctets;
 				stat_record->counter[INPACKETS]  += flow_record->dPkts;
@@ -1132,7 +1462,7 @@ int	j, i;
 				stat_record->counter[FLOWS] += flow_record->aggr_flows ? flow_record->aggr_flows : 1;
 
 			} else {
-				stat_record = stat_hash_insert(value[i], flow_record->prot, j);
+				stat_record = stat_hash_insert(value[i], flow_record->prot, j, hash);
 		
 				stat_record->counter[INBYTES]   = flow_record->dOctets;
 				stat_record->counter[INPACKETS]	= flow_record->dPkts;
@@ -1144,6 +1474,8 @@ int	j, i;
 				stat_record->msec_last			= flow_record->msec_last;
 				stat_record->counter[FLOWS]		= flow_record->aggr_flows ? flow_record->aggr_flows : 1;
 			}
+			if ( StatTable[j].heap ) 
+				stat_sketch_update(j, stat_record);
 		} // for the number of elements in this stat type
 	} // for every requested -s stat
 
@@ -1463,7 +1795,6 @@ FlowTableRecord_t	*r;
 master_record_t		*aggr_record_mask;
 SortElement_t 		*SortList;
 uint64_t			value;
-uint32_t 			i;
 uint32_t			maxindex, c;
 char				*string;
 
@@ -1474,141 +1805,82 @@ char				*string;
 	maxindex = FlowTable->NumRecords;
 	if ( PrintOrder ) {
 		// Sort according the requested order
-		SortList = (SortElement_t *)calloc(maxindex, sizeof(SortElement_t));
-
-		if ( !SortList ) {
-			fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		SortList = FlowTopN(outputParams->topN, &maxindex, &c, PrintOrder, PrintOrder, print_direction);
+		if ( !SortList ) 
 			return;
-		}
-
-		// preset SortList table - still unsorted
-		for ( i=0; i<=FlowTable->IndexMask; i++ ) {
-			r = FlowTable->bucket[i];
-			if ( !r ) 
-				continue;
-
-			// foreach elem in this bucket
-			while ( r ) {
-				// we want to sort only those flows which pass the packet or byte limits
-				if ( byte_limit ) {
-				        value = bytes_record(r, order_mode[PrintOrder].inout);
-					if (( byte_mode == LESS && value >= byte_limit ) ||
-						( byte_mode == MORE && value <= byte_limit ) ) {
-						r = r->next;
-						continue;
-					}
-				}
-				if ( packet_limit ) {
-				        value = packets_record(r, order_mode[PrintOrder].inout);
-					if (( packet_mode == LESS && value >= packet_limit ) ||
-						( packet_mode == MORE && value <= packet_limit ) ) {
-						r = r->next;
-						continue;
-					}
-				}
-				
-				SortList[c].count  = order_mode[PrintOrder].record_function(r, order_mode[PrintOrder].inout);
-				SortList[c].record = (void *)r;
-				c++;
-				r = r->next;
-			}
-		}
-
-		maxindex = c;
-
-		if ( c >= 2 )
- 			heapSort(SortList, c, 0, print_direction);
 
 		PrintSortedFlowcache(SortList, maxindex, outputParams, GuessDir, 
 			print_record, extension_map_list);
+		free((void *)SortList);
 
 	} else {
 		// print them as they came
 		c = 0;
-		for ( i=0; i<=FlowTable->IndexMask; i++ ) {
-			r = FlowTable->bucket[i];
-			while ( r ) {
-				master_record_t	*flow_record;
-				common_record_t *raw_record;
-				int map_id;
-
-				if ( outputParams->topN && c >= outputParams->topN )
-					return;
-
-				// we want to print only those flows which pass the packet or byte limits
-				if ( byte_limit ) {
-				        value = bytes_record(r, order_mode[PrintOrder].inout);
-					if (( byte_mode == LESS && value >= byte_limit ) ||
-						( byte_mode == MORE && value <= byte_limit ) ) {
-						r = r->next;
-						continue;
-					}
+		r = NextFlowTableRecord(NULL);
+		while ( r ) {
+			master_record_t	*flow_record;
+			int map_id;
+
+			if ( outputParams->topN && c >= outputParams->topN )
+				return;
+
+			// we want to print only those flows which pass the packet or byte limits
+			if ( byte_limit ) {
+			        value = bytes_record(r, order_mode[PrintOrder].inout);
+				if (( byte_mode == LESS && value >= byte_limit ) ||
+					( byte_mode == MORE && value <= byte_limit ) ) {
+					r = NextFlowTableRecord(r);
+					continue;
 				}
-				if ( packet_limit ) {
-				        value = packets_record(r, order_mode[PrintOrder].inout);
-					if (( packet_mode == LESS && value >= packet_limit ) ||
-						( packet_mode == MORE && value <= packet_limit ) ) {
-						r = r->next;
-						continue;
-					}
+			}
+			if ( packet_limit ) {
+			        value = packets_record(r, order_mode[PrintOrder].inout);
+				if (( packet_mode == LESS && value >= packet_limit ) ||
+					( packet_mode == MORE && value <= packet_limit ) ) {
+					r = NextFlowTableRecord(r);
+					continue;
 				}
+			}
 
-				raw_record = &(r->flowrecord);
-				map_id = r->map_info_ref->map->map_id;
-
-				flow_record = &(extension_map_list->slot[map_id]->master_record);
-				ExpandRecord_v2( raw_record, extension_map_list->slot[map_id], r->exp_ref, flow_record);
-				flow_record->dPkts 		= r->counter[INPACKETS];
-				flow_record->dOctets 	= r->counter[INBYTES];
-				flow_record->out_pkts 	= r->counter[OUTPACKETS];
-				flow_record->out_bytes 	= r->counter[OUTBYTES];
-				flow_record->aggr_flows = r->counter[FLOWS];
-
-				// apply IP mask from aggregation, to provide a pretty output
-				if ( FlowTable->has_masks ) {
-					flow_record->V6.srcaddr[0] &= FlowTable->IPmask[0];
-					flow_record->V6.srcaddr[1] &= FlowTable->IPmask[1];
-					flow_record->V6.dstaddr[0] &= FlowTable->IPmask[2];
-					flow_record->V6.dstaddr[1] &= FlowTable->IPmask[3];
-				}
+			map_id = r->map_info_ref->map->map_id;
+
+			flow_record = &(extension_map_list->slot[map_id]->master_record);
+			ExpandFlowTableRecord(r, flow_record);
+			flow_record->dPkts 		= r->counter[INPACKETS];
+			flow_record->dOctets 	= r->counter[INBYTES];
+			flow_record->out_pkts 	= r->counter[OUTPACKETS];
+			flow_record->out_bytes 	= r->counter[OUTBYTES];
+			flow_record->aggr_flows = r->counter[FLOWS];
+
+			// apply IP mask from aggregation, to provide a pretty output
+			if ( FlowTable->has_masks ) {
+				flow_record->V6.srcaddr[0] &= FlowTable->IPmask[0];
+				flow_record->V6.srcaddr[1] &= FlowTable->IPmask[1];
+				flow_record->V6.dstaddr[0] &= FlowTable->IPmask[2];
+				flow_record->V6.dstaddr[1] &= FlowTable->IPmask[3];
+			}
 
-				if ( aggr_record_mask ) {
-					ApplyAggrMask(flow_record, aggr_record_mask);
-				}
+			if ( aggr_record_mask ) {
+				ApplyAggrMask(flow_record, aggr_record_mask);
+			}
 
-				if (NeedSwap(GuessDir, flow_record))
-					SwapFlow(flow_record);
+			if (NeedSwap(GuessDir, flow_record))
+				SwapFlow(flow_record);
 
-				print_record((void *)flow_record, &string, outputParams->doTag);
-				printf("%s\n", string);
+			print_record((void *)flow_record, &string, outputParams->doTag);
+			printf("%s\n", string);
 
-				c++;
-				r = r->next;
-			}
+			c++;
+			r = NextFlowTableRecord(r);
 		}
 	}
 } // End of PrintFlowTable
 
 void PrintFlowStat(func_prolog_t record_header, printer_t print_record, outputParams_t *outputParams, extension_map_list_t *extension_map_list) {
-hash_FlowTable *FlowTable;
-FlowTableRecord_t	*r;
 SortElement_t 		*SortList;
-unsigned int 		order_index, i;
-uint64_t			value;
+unsigned int 		order_index, first_order;
 uint32_t			maxindex, c;
 
-	FlowTable = GetFlowTable();
-	c = 0;
-	maxindex = FlowTable->NumRecords;
-
-	// Create the sort array
-	SortList = (SortElement_t *)calloc(maxindex, sizeof(SortElement_t));
-
-	if ( !SortList ) {
-		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
-		return;
-	}
-
 	// preset the first stat
 	for ( order_index=0; order_mode[order_index].string != NULL; order_index++ ) {
 		unsigned int order_bit = 1 << order_index;
@@ -1616,48 +1888,14 @@ uint32_t			maxindex, c;
 			break;
 	}
 
-	// preset SortList table - still unsorted
-	for ( i=0; i<=FlowTable->IndexMask; i++ ) {
-		r = FlowTable->bucket[i];
-		if ( !r ) 
-			continue;
-
-		// foreach elem in this bucket
-		while ( r ) {
-			// we want to sort only those flows which pass the packet or byte limits
-			if ( byte_limit ) {
-			        value = bytes_record(r, order_mode[order_index].inout);
-				if (( byte_mode == LESS && value >= byte_limit ) ||
-					( byte_mode == MORE && value <= byte_limit ) ) {
-					r = r->next;
-					continue;
-				}
-			}
-			if ( packet_limit ) {
-			        value = packets_record(r, order_mode[order_index].inout);
-				if (( packet_mode == LESS && value >= packet_limit ) ||
-					( packet_mode == MORE && value <= packet_limit ) ) {
-					r = r->next;
-					continue;
-				}
-			}
-			
-			// As we touch each flow in the list here, fill in the values for the first requested stat
-			// often, no more than one stat is requested anyway. This saves time
-			SortList[c].count  = order_mode[order_index].record_function(r, order_mode[order_index].inout);
-			SortList[c].record = (void *)r;
-			c++;
-			r = r->next;
-		}
-	}
-
-	maxindex = c;
+	first_order = order_index;
+	SortList = FlowTopN(outputParams->topN, &maxindex, &c, order_index, first_order, print_direction);
+	if ( !SortList ) 
+		return;
 
 	if ( !(outputParams->quiet || outputParams->modeCsv) ) 
-		printf("Aggregated flows %u\n", maxindex);
+		printf("Aggregated flows %u\n", c);
 
-	if ( c >= 2 )
- 		heapSort(SortList, c, outputParams->topN, print_direction);
 	if ( !outputParams->quiet ) {
 		if ( !outputParams->modeCsv ) {
 			if ( outputParams->topN != 0 )
@@ -1676,16 +1914,12 @@ uint32_t			maxindex, c;
 		unsigned int order_bit = 1 << order_index;
 		if ( print_order_bits & order_bit ) {
 
-			for ( i = 0; i < maxindex; i++ ) {
-				r = (FlowTableRecord_t *)(SortList[i].record);
-				/* if we have some different sort orders, which are not directly available in the FlowTableRecord_t
-		 		 * we need to calculate this value first - such as bpp, bps etc.
-		 		 */
-				SortList[i].count  = order_mode[order_index].record_function(r, order_mode[order_index].inout);
-			}
+			// the flows are selected by the limits of the first stat
+			free((void *)SortList);
+			SortList = FlowTopN(outputParams->topN, &maxindex, &c, order_index, first_order, print_direction);
+			if ( !SortList ) 
+				return;
 
-			if ( maxindex >= 2 )
- 				heapSort(SortList, maxindex, outputParams->topN, print_direction);
 			if ( !outputParams->quiet ) {
 				if ( !outputParams->modeCsv ) {
 					if ( outputParams->topN != 0 ) 
@@ -1700,7 +1934,7 @@ uint32_t			maxindex, c;
 
 		}
 	}
-
+	free((void *)SortList);
 
 } // End of PrintFlowStat
 
@@ -1719,7 +1953,6 @@ int	i, max;
 
 	for ( i = 0; i < max; i++ ) {
 		master_record_t	*flow_record;
-		common_record_t *raw_record;
 		FlowTableRecord_t	*r;
 		char	*string;
 		int map_id, j;
@@ -1727,11 +1960,10 @@ int	i, max;
 		j = maxindex - 1 - i;
 
 		r = (FlowTableRecord_t *)(SortList[j].record);
-		raw_record = &(r->flowrecord);
 		map_id = r->map_info_ref->map->map_id;
 
 		flow_record = &(extension_map_list->slot[map_id]->master_record);
-		ExpandRecord_v2( raw_record, extension_map_list->slot[map_id], r->exp_ref, flow_record);
+		ExpandFlowTableRecord(r, flow_record);
 		flow_record->dPkts 		= r->counter[INPACKETS];
 		flow_record->dOctets 	= r->counter[INBYTES];
 		flow_record->out_pkts 	= r->counter[OUTPACKETS];
@@ -1791,6 +2023,8 @@ int32_t 		i, j, hash_num, order_index;
 					else
 						printf("Top %s ordered by %s:\n", 
 							StatParameters[stat].HeaderInfo, order_mode[order_index].string);
+					if ( StatTable[hash_num].heap ) 
+						PrintStatApprox(hash_num, topN_element_list, numflows, outputParams->topN);
 					//      2005-07-26 20:08:59.197 1553.730      ss    65255   203435   52.2 M      130   281636   268
 					if ( Getv6Mode() && (type == IS_IPADDR )) 
 						printf("Date first seen          Duration Proto %39s    Flows(%%)     Packets(%%)       Bytes(%%)         pps      bps   bpp\n",
@@ -1835,36 +2069,56 @@ int32_t 		i, j, hash_num, order_index;
 	} // for every requested -s stat do
 } // End of PrintElementStat
 
+static void PrintStatApprox(int hash_num, SortElement_t *topN_element_list, uint32_t numflows, int topN) {
+hash_StatTable	*table = &StatTable[hash_num];
+uint64_t		error;
+uint32_t		i, ref;
+int				stat = StatRequest[hash_num].StatType;
+
+	if ( table->NumRecords < table->Prealloc ) {
+		printf("Approximate stat: %u counters, %u distinct %s, exact counters\n", 
+			table->Prealloc, table->NumRecords, StatParameters[stat].HeaderInfo);
+		return;
+	}
+
+	// the max overestimation of the listed elements
+	error = 0;
+	for ( i=0; i<numflows && (topN == 0 || i<topN); i++ ) {
+		ref = (StatRecord_t *)topN_element_list[numflows - 1 - i].record - table->memblock[0] + 1;
+		if ( table->error[ref] > error ) 
+			error = table->error[ref];
+	}
+
+	printf("Approximate stat: %u counters, ~%llu distinct %s (+/-%.1f%%), listed %s overestimated by at most %llu\n",
+		table->Prealloc, (unsigned long long)StatDistinct(table), StatParameters[stat].HeaderInfo,
+		104.0 / (double)(1 << (StatHLLBits / 2)), order_mode[StatRequest[hash_num].weight_order].string, 
+		(unsigned long long)error);
+
+} // End of PrintStatApprox
+
 static SortElement_t *StatTopN(int topN, uint32_t *count, int hash_num, int order, int direction) {
-SortElement_t 		*topN_list;
+topN_t				topN_list;
 StatRecord_t		*r;
-unsigned int		i;
+unsigned int		i, b, num;
 uint64_t			value;
-uint32_t	   		c, maxindex;
 
-	maxindex  = (StatTable[hash_num].NextBlock * StatTable[hash_num].Prealloc ) + StatTable[hash_num].NextElem;
-	topN_list = (SortElement_t *)calloc(maxindex, sizeof(SortElement_t));
-
-	if ( !topN_list ) {
+	if ( !topNInit(&topN_list, topN, StatTable[hash_num].NumRecords, direction) ) {
 		perror("Can't allocate Top N lists: \n");
 		return NULL;
 	}
 
-	// preset topN_list table - still unsorted
-	c = 0;
-	// Iterate through all buckets
-	for ( i=0; i <= StatTable[hash_num].IndexMask; i++ ) {
-		r = StatTable[hash_num].bucket[i];
-		// foreach elem in this bucket
-		while ( r ) {
-			// next elem in bucket
+	// Iterate through all stat blocks
+	for ( b=0; b <= StatTable[hash_num].NextBlock; b++ ) {
+		num = b == StatTable[hash_num].NextBlock ? StatTable[hash_num].NextElem : StatTable[hash_num].Prealloc;
+		// foreach elem in this block
+		for ( i=0; i<num; i++ ) {
+			r = &(StatTable[hash_num].memblock[b][i]);
 
 			// we want to sort only those flows which pass the packet or byte limits
 			if ( byte_limit ) {
 			        value = bytes_element(r, order_mode[order].inout);
 				if (( byte_mode == LESS && value >= byte_limit ) ||
 					( byte_mode == MORE && value <= byte_limit ) ) {
-					r = r->next;
 					continue;
 				}
 			}
@@ -1872,27 +2126,67 @@ uint32_t	   		c, maxindex;
 			        value = packets_element(r, order_mode[order].inout);
 				if (( packet_mode == LESS && value >= packet_limit ) ||
 					( packet_mode == MORE && value <= packet_limit ) ) {
-					r = r->next;
 					continue;
 				}
 			}
 
-			topN_list[c].count  = order_mode[order].element_function(r, order_mode[order].inout);
-			topN_list[c].record = (void *)r;
-			r = r->next;
-			c++;
+			topNAdd(&topN_list, order_mode[order].element_function(r, order_mode[order].inout), (void *)r);
 		} // foreach element
 	}
-	*count = c;
-	
-	// Sorting makes only sense, when 2 or more flows are left
-	if ( c >= 2 )
- 		heapSort(topN_list, c, topN, direction);
 
-	return topN_list;
+	topNSort(&topN_list);
+	*count = topN_list.num;
+
+	return topN_list.list;
 	
 } // End of StatTopN
 
+static SortElement_t *FlowTopN(int topN, uint32_t *count, uint32_t *passed, int order, int limit_order, int direction) {
+hash_FlowTable 		*FlowTable;
+FlowTableRecord_t	*r;
+topN_t				topN_list;
+uint64_t			value;
+uint32_t			c;
+
+	// the flows are referenced by the list
+	LoadFlowTable();
+	FlowTable = GetFlowTable();
+	if ( !topNInit(&topN_list, topN, FlowTable->NumRecords, direction) ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		return NULL;
+	}
+
+	c = 0;
+	// foreach elem in the table
+	for ( r = FlowTable->first; r; r = r->next ) {
+		// we want to sort only those flows which pass the packet or byte limits
+		if ( byte_limit ) {
+		        value = bytes_record(r, order_mode[limit_order].inout);
+			if (( byte_mode == LESS && value >= byte_limit ) ||
+				( byte_mode == MORE && value <= byte_limit ) ) {
+				continue;
+			}
+		}
+		if ( packet_limit ) {
+		        value = packets_record(r, order_mode[limit_order].inout);
+			if (( packet_mode == LESS && value >= packet_limit ) ||
+				( packet_mode == MORE && value <= packet_limit ) ) {
+				continue;
+			}
+		}
+
+		topNAdd(&topN_list, order_mode[order].record_function(r, order_mode[order].inout), (void *)r);
+		c++;
+	}
+
+	topNSort(&topN_list);
+	*count  = topN_list.num;
+	*passed = c;
+
+	return topN_list.list;
+
+} // End of FlowTopN
+
 
 void SwapFlow(master_record_t *flow_record) {
 uint64_t _tmp_ip[2];
@@ -62,8 +62,6 @@ typedef struct SumRecord_s {
 } SumRecord_t;
 
 typedef struct StatRecord {
-	// record chain
-	struct StatRecord *next;
 	// flow parameters
 	uint64_t	counter[5];	// flows ipkg ibyte opkg obyte
 	uint32_t	first;
@@ -75,12 +73,25 @@ typedef struct StatRecord {
 	uint64_t	stat_key[2];
 } StatRecord_t;
 
+/*
+ * Slot of the stat hash. The stat records are numbered in the order of insertion. 
+ * The slots are probed linearly.
+ */
+typedef struct StatSlot_s {
+	uint32_t			tag;			/* upper 32 bits of the key hash */
+	uint32_t			ref;			/* record number + 1, 0 = empty slot */
+} StatSlot_t;
+
+// initial number of bits for the hash width of the stat tables. A table doubles, when it is 3/4 full.
+#define StatTableBits	16
+
 typedef struct hash_StatTable {
 	/* hash table data */
 	uint16_t 			NumBits;		/* width of the hash table */
 	uint32_t			IndexMask;		/* Mask which corresponds to NumBits */
-	StatRecord_t 		**bucket;		/* Hash entry point: points to elements in the stat block */
-	StatRecord_t 		**bucketcache;	/* in case of index collisions, this array points to the last element with that index */
+	StatSlot_t 			*slot;			/* Hash entry point: refers to elements in the stat block */
+	uint32_t			NumRecords;		/* number of records in the table */
+	uint32_t			MaxRecords;		/* grow the table, when reached */
 
 	/* memory management */
 	/* memory blocks - containing the stat records */
@@ -91,8 +102,23 @@ typedef struct hash_StatTable {
 	uint32_t 			Prealloc;		/* Number of stat records in each stat block */
 	uint32_t			NextBlock;		/* This stat block contains the next free slot for a stat recorrd */
 	uint32_t			NextElem;		/* This element in the current stat block is the next free slot */
+
+	/* approximate stats - see SetStatApprox() */
+	/* Space-Saving: Prealloc records in one stat block. When full, the record with the least weight is replaced */
+	uint32_t			*heap;			/* record numbers in a min heap of their weight */
+	uint32_t			*heappos;		/* heap position of each record number */
+	uint32_t			HeapValid;		/* heap is ordered - built when the first record gets replaced */
+	uint64_t			*weight;		/* weight of each record number */
+	uint64_t			*error;			/* max overestimation of the counters of each record number */
+	uint8_t				*hll;			/* HyperLogLog registers for the number of distinct elements */
 } hash_StatTable;
 
+// record number ref of the stat records in the stat blocks
+#define StatRecordRef(table, ref) (&((table)->memblock[((ref) - 1) / (table)->Prealloc][((ref) - 1) % (table)->Prealloc]))
+
+// number of index bits of the HyperLogLog registers: 2^14 registers, 0.8% standard error
+#define StatHLLBits		14
+
 typedef struct SortElement {
 	void 		*record;
     uint64_t	count;
@@ -115,12 +141,20 @@ typedef struct SortElement {
 /* Function prototypes */
 void SetLimits(int stat, char *packet_limit_string, char *byte_limit_string );
 
+void SetStatApprox(uint32_t counters);
+
 int Init_StatTable(uint16_t NumBits, uint32_t Prealloc);
 
 void Dispose_StatTable(void);
 
+hash_StatTable *GetStatTable(int hash_num);
+
+uint64_t StatDistinct(hash_StatTable *table);
+
 int SetStat(char *str, int *element_stat, int *flow_stat);
 
+uint64_t StatFields(void);
+
 int Parse_PrintOrder(char *order);
 
 void AddStat(common_record_t *raw_record, master_record_t *flow_record );
@@ -68,7 +68,14 @@
 #include "nffile.h"
 #include "nftree.h"
 #include "filter.h"
+#include "iptrie.h"
 #include "nfx.h"
+#include "bookkeeper.h"
+#include "collector.h"
+#include "exporter.h"
+#include "nflowcache.h"
+#include "nfhash.h"
+#include "nfstat.h"
 
 /* Global Variables */
 extern char 	*CurrentIdent;
@@ -76,6 +83,14 @@ extern extension_descriptor_t extension_descriptor[];
 
 FilterEngine_t *Engine;
 
+// hash statistics of the flow table
+int hash_hit = 0; 
+int hash_miss = 0;
+int hash_skip = 0;
+
+// counter indices of a flow table record
+enum CntIndices { FLOWS = 0, INPACKETS, INBYTES, OUTPACKETS, OUTBYTES };
+
 /* exported fuctions */
 int check_filter_block(char *filter, master_record_t *flow_record, int expect);
 
@@ -83,7 +98,29 @@ void check_offset(char *text, pointer_addr_t offset, pointer_addr_t expect);
 
 void CheckCompression(char *filename);
 
+void BenchFilter(void);
+
+void CheckIPList(uint32_t num, uint32_t lookups, int bench);
+
+void CheckFilterSet(uint32_t num, int loops, int bench);
+
+void CheckULList(uint32_t num, uint32_t range, uint32_t shift, uint32_t lookups, int bench);
+
+void CheckFlowTable(uint32_t num, uint32_t loops, int bench);
+
+void CheckKeyHash(int bench);
+
+void CheckTopN(uint32_t num, int bench);
+
+void CheckStatApprox(uint32_t counters, uint32_t num);
+
+void CheckExpandPlan(int bench);
+
+#include "heapsort_inline.c"
+#include "nffile_inline.c"
+
 int check_filter_block(char *filter, master_record_t *flow_record, int expect) {
+FilterEngine_t *clone;
 int ret, i;
 uint64_t	*block = (uint64_t *)flow_record;
 
@@ -93,7 +130,43 @@ uint64_t	*block = (uint64_t *)flow_record;
 	}
 
 	Engine->nfrecord = (uint64_t *)flow_record;
+	Engine->ident	 = CurrentIdent;
 	ret =  (*Engine->FilterEngine)(Engine);
+
+	// the filter code must evaluate the same as the tree
+	if ( Engine->code ) {
+		int code  = RunFilterCode(Engine);
+		char *label = Engine->label;
+		int tree = Engine->Extended ? RunExtendedFilter(Engine) : RunFilter(Engine);
+		if ( tree != ret || code != ret || Engine->label != label ) {
+			printf("**** FAILED **** Filter code evaluates different to tree. Filter: '%s'\n", filter);
+			DumpEngine(Engine);
+			DumpCode(Engine);
+			exit(255);
+		}
+	}
+
+	// a batch of one record must evaluate the same
+	{
+		uint64_t *nfrecord = (uint64_t *)flow_record;
+		uint64_t match[BATCH_WORDS];
+		char *label;
+		RunFilterBatch(Engine, &nfrecord, 1, match, &label);
+		if ( BatchMatch(match, 0) != (ret != 0) || label != Engine->label ) {
+			printf("**** FAILED **** Filter batch evaluates different to engine. Filter: '%s'\n", filter);
+			exit(255);
+		}
+	}
+
+	// a clone shares the filter and must evaluate the same
+	clone = CloneFilterEngine(Engine);
+	clone->nfrecord = (uint64_t *)flow_record;
+	clone->ident	= CurrentIdent;
+	if ( (*clone->FilterEngine)(clone) != ret || clone->label != Engine->label ) {
+		printf("**** FAILED **** Clone evaluates different to engine. Filter: '%s'\n", filter);
+		exit(255);
+	}
+	DisposeFilterEngine(clone);
 	if ( ret == expect ) {
 		printf("Success: Startnode: %i Numblocks: %i Extended: %i Filter: '%s'\n", Engine->StartNode, nblocks(), Engine->Extended, filter);
 	} else {
@@ -204,6 +277,949 @@ uint32_t recsize[4];
 
 } // End of CheckCompression
 
+/*
+ * Micro benchmark of the filter engines: evaluate typical filters over a set of
+ * synthetic records with the tree interpreter, with the filter code and in batches.
+ */
+#define BENCH_RECORDS	4096
+#define BENCH_LOOPS		2000
+
+static double BenchTime(struct timeval *tstart) {
+struct timeval tend;
+
+	gettimeofday(&tend, (struct timezone*)NULL);
+	return (double)(tend.tv_sec - tstart->tv_sec) + ((double)tend.tv_usec - (double)tstart->tv_usec)/1000000;
+
+} // End of BenchTime
+
+/* reproducible pseudo random records */
+static master_record_t *BenchRecords(uint64_t ***nfrecords) {
+master_record_t *records;
+uint32_t i, seed;
+
+	records  = (master_record_t *)calloc(BENCH_RECORDS, sizeof(master_record_t));
+	*nfrecords = (uint64_t **)calloc(BENCH_RECORDS, sizeof(uint64_t *));
+	if ( !records || !*nfrecords ) {
+		perror("calloc() failed");
+		exit(255);
+	}
+
+	seed = 1;
+	for ( i=0; i<BENCH_RECORDS; i++ ) {
+		uint16_t ports[] = { 22, 25, 53, 80, 443, 8080, 1024, 50000 };
+		master_record_t *r = &records[i];
+		seed = seed * 1103515245 + 12345;
+		r->prot 	  = (seed >> 16) & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+		r->srcport	  = ports[(seed >> 8) & 7];
+		r->dstport	  = ports[(seed >> 12) & 7];
+		r->tcp_flags  = (seed >> 20) & 0x3f;
+		seed = seed * 1103515245 + 12345;
+		r->V4.srcaddr = (seed >> 16) & 1 ? 0x0a000000 | (seed & 0x03ffff) : 0xc0a80100 | (seed & 0x0f);
+		r->input	  = (seed >> 4) & 15;
+		r->output	  = (seed >> 8) & 15;
+		seed = seed * 1103515245 + 12345;
+		r->V4.dstaddr = (seed >> 16) & 1 ? 0x0a000000 | (seed & 0x07ffff) : 0xc0a80100 | (seed & 0x0f);
+		r->dPkts	  = (seed >> 4) & 7;
+		r->dOctets	  = (seed >> 8) & 0x3ff;
+		r->srcas	  = 64500 + ((seed >> 20) & 31);
+		r->dstas	  = 64500 + ((seed >> 24) & 31);
+		(*nfrecords)[i] = (uint64_t *)r;
+	}
+
+	return records;
+
+} // End of BenchRecords
+
+void BenchFilter(void) {
+master_record_t *records;
+uint64_t **nfrecords;
+struct timeval tstart;
+int i, j, k;
+char *filters[] = {
+	"proto tcp and dst port 443 and src net 10.0.0.0/8",
+	"port 22 or port 25 or port 53 or port 80 or port 443 or port 8080",
+	"src net 10.0.0.0/8 and not dst net 10.0.0.0/8 and (proto tcp or proto udp)",
+	"proto udp and dst port 53 and bytes > 512",
+	"(host 192.168.1.1 or host 192.168.1.2 or host 192.168.1.3 or host 192.168.1.4 or host 192.168.1.5 or "
+	"host 192.168.1.6 or host 192.168.1.7 or host 192.168.1.8 or host 192.168.1.9 or host 192.168.1.10) "
+	"and proto tcp and not port 22 and not port 23 and packets > 2",
+	"not (dst net 10.1.0.0/16 or dst net 10.2.0.0/16 or dst net 10.3.0.0/16 or dst net 10.4.0.0/16) "
+	"and src port > 1023 and dst port < 1024 and flags S and not flags A",
+	NULL
+};
+
+	records = BenchRecords(&nfrecords);
+
+	printf("Filter benchmark: %u records, %u loops\n", BENCH_RECORDS, BENCH_LOOPS);
+	for ( i=0; filters[i] != NULL; i++ ) {
+		FilterEngine_t *engine = CompileFilter(filters[i]);
+		double wall[2];
+		uint64_t matched[3];
+		if ( !engine ) 
+			exit(254);
+		for ( k=0; k<2; k++ ) {
+			int (*run)(FilterEngine_t *) = k ? RunFilterCode : (engine->Extended ? RunExtendedFilter : RunFilter);
+			matched[k] = 0;
+			gettimeofday(&tstart, (struct timezone*)NULL);
+			for ( j=0; j<BENCH_LOOPS; j++ ) {
+				int n;
+				for ( n=0; n<BENCH_RECORDS; n++ ) {
+					engine->nfrecord = (uint64_t *)&records[n];
+					matched[k] += run(engine);
+				}
+			}
+			wall[k] = BenchTime(&tstart);
+		}
+
+		// batches of FILTER_BATCH records
+		matched[2] = 0;
+		gettimeofday(&tstart, (struct timezone*)NULL);
+		for ( j=0; j<BENCH_LOOPS; j++ ) {
+			int n;
+			for ( n=0; n<BENCH_RECORDS; n+=FILTER_BATCH ) {
+				uint64_t match[BATCH_WORDS];
+				int m;
+				RunFilterBatch(engine, &nfrecords[n], FILTER_BATCH, match, NULL);
+				for ( m=0; m<FILTER_BATCH; m++ ) 
+					matched[2] += BatchMatch(match, m);
+			}
+		}
+		wall[2] = BenchTime(&tstart);
+
+		if ( matched[0] != matched[1] || matched[0] != matched[2] ) {
+			printf("**** FAILED **** Filter code matched %llu, batch %llu, tree %llu: '%s'\n", 
+				(unsigned long long)matched[1], (unsigned long long)matched[2], 
+				(unsigned long long)matched[0], filters[i]);
+			exit(255);
+		}
+		printf("%-3s tree: %7.3fs code: %7.3fs batch: %7.3fs ops: %3u nodes: %3u speedup: %5.2f %5.2f '%s'\n", 
+			engine->Extended ? "ext" : "", wall[0], wall[1], wall[2], engine->NumOps - 1, engine->NumBlocks - 1, 
+			wall[1] > 0 ? wall[0]/wall[1] : 0, wall[2] > 0 ? wall[0]/wall[2] : 0, filters[i]);
+	}
+
+	free(records);
+	free(nfrecords);
+
+} // End of BenchFilter
+
+/*
+ * Evaluate the filters of num profile channels, which share many terms, one by one and as 
+ * a filter set. Both must match the same records.
+ */
+void CheckFilterSet(uint32_t num, int loops, int bench) {
+master_record_t *records;
+uint64_t **nfrecords, matched[2];
+FilterEngine_t **engine;
+FilterSet_t *set;
+struct timeval tstart;
+double wall[2];
+uint32_t i, j, n;
+int l;
+
+	records = BenchRecords(&nfrecords);
+	engine = (FilterEngine_t **)calloc(num, sizeof(FilterEngine_t *));
+	if ( !engine ) {
+		perror("calloc() failed");
+		exit(255);
+	}
+	for ( i=0; i<num; i++ ) {
+		char filter[256];
+		uint32_t k = (i >> 2) & 15;
+		switch (i & 3) {
+			case 0:
+				snprintf(filter, 255, "in if %u and proto tcp", k);
+				break;
+			case 1:
+				snprintf(filter, 255, "src as %u and not dst net 10.0.0.0/8", 64500 + k);
+				break;
+			case 2:
+				snprintf(filter, 255, "(in if %u or out if %u) and net 10.%u.0.0/16", k, (k + 1) & 15, k & 3);
+				break;
+			default:
+				snprintf(filter, 255, "dst as in [ 64500 64501 %u ] and proto udp", 64510 + k);
+		}
+		engine[i] = CompileFilter(filter);
+		if ( !engine[i] ) 
+			exit(254);
+	}
+	set = NewFilterSet(engine, num);
+
+	// one by one
+	matched[0] = 0;
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( l=0; l<loops; l++ ) {
+		for ( n=0; n<BENCH_RECORDS; n+=FILTER_BATCH ) {
+			for ( j=0; j<num; j++ ) {
+				uint64_t match[BATCH_WORDS];
+				RunFilterBatch(engine[j], &nfrecords[n], FILTER_BATCH, match, NULL);
+				for ( i=0; i<FILTER_BATCH; i++ ) 
+					matched[0] += BatchMatch(match, i) << (j & 7);
+			}
+		}
+	}
+	wall[0] = BenchTime(&tstart);
+
+	// filter set
+	matched[1] = 0;
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( l=0; l<loops; l++ ) {
+		for ( n=0; n<BENCH_RECORDS; n+=FILTER_BATCH ) {
+			RunFilterSet(set, &nfrecords[n], FILTER_BATCH);
+			for ( i=0; i<FILTER_BATCH; i++ ) {
+				uint64_t *match = FilterSetMatch(set, i);
+				for ( j=0; j<num; j++ ) 
+					matched[1] += ((match[j >> 6] >> (j & 63)) & 1) << (j & 7);
+			}
+		}
+	}
+	wall[1] = BenchTime(&tstart);
+
+	if ( matched[0] != matched[1] ) {
+		printf("**** FAILED **** Filter set of %u filters matched %llu, filters %llu\n", num, 
+			(unsigned long long)matched[1], (unsigned long long)matched[0]);
+		exit(255);
+	}
+	if ( bench ) 
+		printf("Filter set %4u: filters: %7.3fs set: %7.3fs nodes: %5u predicates: %4u speedup: %5.2f\n", num, 
+			wall[0], wall[1], set->NumNodes, set->NumPreds - 1, wall[1] > 0 ? wall[0]/wall[1] : 0);
+	else 
+		printf("Success: Filter set of %u filters, %u nodes, %u predicates\n", num, set->NumNodes, set->NumPreds - 1);
+
+	DisposeFilterSet(set);
+	for ( i=0; i<num; i++ ) 
+		DisposeFilterEngine(engine[i]);
+	free(engine);
+	free(records);
+	free(nfrecords);
+
+} // End of CheckFilterSet
+
+/*
+ * Compare the IP list trie with the RB tree lookup of a list of num random IPv4 and IPv6
+ * addresses and prefixes. Half of the looked up addresses are taken from the list.
+ */
+void CheckIPList(uint32_t num, uint32_t lookups, int bench) {
+IPlist_t *root;
+struct IPListNode *node;
+iptrie_t *trie;
+uint64_t *ip, *mask, *addr, matched[2];
+struct timeval tstart;
+double wall[2];
+uint32_t i, n, seed;
+
+	root = (IPlist_t *)malloc(sizeof(IPlist_t));
+	addr = (uint64_t *)malloc(2 * lookups * sizeof(uint64_t));
+	if ( !root || !addr ) {
+		perror("malloc() failed");
+		exit(255);
+	}
+	RB_INIT(root);
+
+	// reproducible pseudo random list: 3/4 IPv4, 1/4 IPv6, every 4th one a prefix
+	seed = num;
+	for ( i=0; i<num; i++ ) {
+		uint32_t len;
+		node = (struct IPListNode *)malloc(sizeof(struct IPListNode));
+		if ( !node ) {
+			perror("malloc() failed");
+			exit(255);
+		}
+		seed = seed * 1103515245 + 12345;
+		len  = (seed >> 16) & 3 ? 128 : 104 + ((seed >> 8) & 15);
+		if ( i & 3 ) {
+			seed = seed * 1103515245 + 12345;
+			node->ip[0] = 0;
+			node->ip[1] = (uint64_t)seed;
+		} else {
+			node->ip[0] = 0x20010db800000000ULL | (uint64_t)(seed & 0xffff) << 16;
+			seed = seed * 1103515245 + 12345;
+			node->ip[1] = (uint64_t)seed << 32 | (seed >> 8);
+			len = len == 128 ? 128 : 40 + ((seed >> 4) & 63);
+		}
+		node->mask[0] = len >= 64 ? 0xffffffffffffffffULL : 0xffffffffffffffffULL << ( 64 - len );
+		node->mask[1] = len <= 64 ? 0 : 0xffffffffffffffffULL << ( 128 - len );
+		node->ip[0] &= node->mask[0];
+		node->ip[1] &= node->mask[1];
+		if ( RB_INSERT(IPtree, root, node) != NULL ) 
+			free(node);		// covered by another entry
+	}
+
+	n = 0;
+	RB_FOREACH(node, IPtree, root) 
+		n++;
+	ip	 = (uint64_t *)malloc(2 * (n + 1) * sizeof(uint64_t));
+	mask = (uint64_t *)malloc(2 * (n + 1) * sizeof(uint64_t));
+	if ( !ip || !mask ) {
+		perror("malloc() failed");
+		exit(255);
+	}
+	n = 0;
+	RB_FOREACH(node, IPtree, root) {
+		ip[2*n]   = node->ip[0];
+		ip[2*n+1] = node->ip[1];
+		mask[2*n]	= node->mask[0];
+		mask[2*n+1] = node->mask[1];
+		n++;
+	}
+	trie = NewIPTrie(ip, mask, n);
+
+	for ( i=0; i<lookups; i++ ) {
+		seed = seed * 1103515245 + 12345;
+		if ( i & 1 ) {
+			uint32_t e = seed % n;
+			addr[2*i]	= ip[2*e]	| ((uint64_t)seed & ~mask[2*e]);
+			addr[2*i+1] = ip[2*e+1] | (((uint64_t)seed << 20) & ~mask[2*e+1]);
+		} else if ( i & 2 ) {
+			addr[2*i]	= 0;
+			addr[2*i+1] = seed;
+		} else {
+			addr[2*i]	= 0x20010db800000000ULL | (uint64_t)(seed & 0xffff) << 16;
+			addr[2*i+1] = (uint64_t)seed << 32 | (seed >> 8);
+		}
+	}
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	matched[0] = 0;
+	for ( i=0; i<lookups; i++ ) {
+		struct IPListNode find;
+		find.ip[0] = addr[2*i];
+		find.ip[1] = addr[2*i+1];
+		find.mask[0] = 0xffffffffffffffffULL;
+		find.mask[1] = 0xffffffffffffffffULL;
+		matched[0] += RB_FIND(IPtree, root, &find) != NULL;
+	}
+	wall[0] = BenchTime(&tstart);
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	matched[1] = 0;
+	for ( i=0; i<lookups; i++ ) 
+		matched[1] += IPTrieLookup(trie, &addr[2*i]);
+	wall[1] = BenchTime(&tstart);
+
+	if ( matched[0] != matched[1] ) {
+		printf("**** FAILED **** IP list of %u: trie matched %llu, RB tree %llu\n", n, 
+			(unsigned long long)matched[1], (unsigned long long)matched[0]);
+		exit(255);
+	}
+	if ( bench ) 
+		printf("IP list %7u: RB tree: %7.3fs trie: %7.3fs nodes: %8u speedup: %5.2f matched: %llu/%u\n", n, 
+			wall[0], wall[1], trie->v4.numnodes + trie->v6.numnodes, wall[1] > 0 ? wall[0]/wall[1] : 0, 
+			(unsigned long long)matched[0], lookups);
+	else 
+		printf("Success: IP list trie of %u entries\n", n);
+
+	DisposeIPTrie(trie);
+	while ( (node = RB_MIN(IPtree, root)) != NULL ) {
+		RB_REMOVE(IPtree, root, node);
+		free(node);
+	}
+	free(root);
+	free(addr);
+	free(ip);
+	free(mask);
+
+} // End of CheckIPList
+
+/*
+ * Compare the compiled port/AS list with the RB tree lookup of a list of num random values
+ * in [0..range), shifted into record position as the filter grammar does. Half of the 
+ * looked up values are taken from the list.
+ */
+void CheckULList(uint32_t num, uint32_t range, uint32_t shift, uint32_t lookups, int bench) {
+ULongtree_t *root;
+struct ULongListNode *node;
+ullist_t *list;
+uint64_t *values, *key, mask, matched[2];
+struct timeval tstart;
+double wall[2];
+uint32_t i, n, seed;
+char *backend[] = { "array", "bitmap", "hash" };
+
+	mask = (range > 0x10000 ? 0xFFFFFFFFULL : 0xFFFFULL) << shift;
+	root = (ULongtree_t *)malloc(sizeof(ULongtree_t));
+	key	 = (uint64_t *)malloc(lookups * sizeof(uint64_t));
+	values = (uint64_t *)malloc(num * sizeof(uint64_t));
+	if ( !root || !key || !values ) {
+		perror("malloc() failed");
+		exit(255);
+	}
+	RB_INIT(root);
+
+	seed = num;
+	for ( i=0; i<num; i++ ) {
+		node = (struct ULongListNode *)malloc(sizeof(struct ULongListNode));
+		if ( !node ) {
+			perror("malloc() failed");
+			exit(255);
+		}
+		seed = seed * 1103515245 + 12345;
+		node->value = ((uint64_t)((seed >> 4) % range) << shift) & mask;
+		if ( RB_INSERT(ULongtree, root, node) != NULL ) 
+			free(node);
+	}
+	n = 0;
+	RB_FOREACH(node, ULongtree, root) 
+		values[n++] = node->value;
+	list = NewULList(values, n, mask);
+
+	for ( i=0; i<lookups; i++ ) {
+		seed = seed * 1103515245 + 12345;
+		if ( i & 1 ) 
+			key[i] = values[seed % n];
+		else 
+			key[i] = ((uint64_t)((seed >> 4) % range) << shift) & mask;
+	}
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	matched[0] = 0;
+	for ( i=0; i<lookups; i++ ) {
+		struct ULongListNode find;
+		find.value = key[i];
+		matched[0] += RB_FIND(ULongtree, root, &find) != NULL;
+	}
+	wall[0] = BenchTime(&tstart);
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	matched[1] = 0;
+	for ( i=0; i<lookups; i++ ) 
+		matched[1] += ULListLookup(list, key[i]);
+	wall[1] = BenchTime(&tstart);
+
+	if ( matched[0] != matched[1] || list->num != n ) {
+		printf("**** FAILED **** %s list of %u: matched %llu, RB tree %llu\n", backend[list->type], n, 
+			(unsigned long long)matched[1], (unsigned long long)matched[0]);
+		exit(255);
+	}
+	if ( bench ) 
+		printf("UL list %7u: RB tree: %7.3fs %6s: %7.3fs speedup: %5.2f matched: %llu/%u\n", n, 
+			wall[0], backend[list->type], wall[1], wall[1] > 0 ? wall[0]/wall[1] : 0, 
+			(unsigned long long)matched[0], lookups);
+	else 
+		printf("Success: %s list of %u entries\n", backend[list->type], n);
+
+	free(list->table);
+	free(list);
+	while ( (node = RB_MIN(ULongtree, root)) != NULL ) {
+		RB_REMOVE(ULongtree, root, node);
+		free(node);
+	}
+	free(root);
+	free(key);
+	free(values);
+
+} // End of CheckULList
+
+/*
+ * Aggregate num distinct flows loops times in the flow table. Each flow must be found 
+ * again, also while the table grows, and the records must be in the order of insertion.
+ */
+void CheckFlowTable(uint32_t num, uint32_t loops, int bench) {
+master_record_t flow_record;
+common_record_t raw_record;
+hash_FlowTable *FlowTable;
+FlowTableRecord_t *r;
+struct timeval tstart;
+double wall;
+uint32_t i, l, seed;
+
+	if ( !Init_FlowTable() ) 
+		exit(255);
+	FlowTable = GetFlowTable();
+
+	memset((void *)&flow_record, 0, sizeof(master_record_t));
+	memset((void *)&raw_record, 0, sizeof(common_record_t));
+	raw_record.size  = sizeof(common_record_t);
+	flow_record.prot  = IPPROTO_TCP;
+	flow_record.dPkts = 1;
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( l=0; l<loops; l++ ) {
+		seed = num;
+		for ( i=0; i<num; i++ ) {
+			seed = seed * 1103515245 + 12345;
+			flow_record.V6.srcaddr[1] = i;
+			flow_record.V6.dstaddr[1] = seed;
+			flow_record.srcport	= seed >> 16;
+			flow_record.dstport	= 80;
+			flow_record.dOctets	= i + 1;
+			AddFlow(&raw_record, &flow_record, NULL);
+		}
+	}
+	wall = BenchTime(&tstart);
+
+	i = 0;
+	for ( r = FlowTable->first; r; r = r->next ) {
+		if ( r->counter[FLOWS] != loops || r->counter[INBYTES] != (uint64_t)loops * (i + 1) ) {
+			printf("**** FAILED **** Flow table record %u: flows %llu, bytes %llu\n", i, 
+				(unsigned long long)r->counter[FLOWS], (unsigned long long)r->counter[INBYTES]);
+			exit(255);
+		}
+		i++;
+	}
+	if ( i != num || FlowTable->NumRecords != num ) {
+		printf("**** FAILED **** Flow table has %u records, %u listed, expected %u\n", 
+			FlowTable->NumRecords, i, num);
+		exit(255);
+	}
+
+	if ( bench ) 
+		printf("Flow table %8u: %u flows in %7.3fs: %6.2f Mflows/s, %u hash bits\n", num, num * loops, 
+			wall, wall > 0 ? (double)num * loops / wall / 1000000 : 0, FlowTable->hash.NumBits);
+	else 
+		printf("Success: Flow table of %u records, %u hash bits\n", num, FlowTable->hash.NumBits);
+
+	Dispose_FlowTable();
+
+} // End of CheckFlowTable
+
+/*
+ * Distribution of typical stat and aggregation keys over HASH_KEYS buckets with the key hash
+ * and with the low bits of the key as index. Random keys result in HASH_KEYS/e collisions.
+ */
+#define HASH_KEYS	65536
+#define HASH_LOOPS	200
+
+static void HashKey(int set, uint32_t i, uint64_t *key) {
+
+	switch (set) {
+		case 0:	// IPv4 addresses of one /16
+			key[0] = 0;
+			key[1] = 0xC0A80000 + i;
+			break;
+		case 1:	// the .1 address of IPv4 /24 networks
+			key[0] = 0;
+			key[1] = 0x0A000001 + (i << 8);
+			break;
+		case 2:	// the ::1 address of IPv6 /48 networks
+			key[0] = 0x20010DB800000000ULL | ((uint64_t)i << 16);
+			key[1] = 1;
+			break;
+		case 3:	// ports
+			key[0] = 0;
+			key[1] = i;
+			break;
+		default: // AS numbers of a 32bit AS range 
+			key[0] = 0;
+			key[1] = 4200000000U + 7 * i;
+	}
+
+} // End of HashKey
+
+void CheckKeyHash(int bench) {
+char *keyset[] = { "IPv4 /16", "IPv4 /24 .1", "IPv6 /48 ::1", "ports", "AS numbers" };
+uint32_t *bucket, i, l, mask, max[2], used[2];
+uint64_t key[6], sum;
+struct timeval tstart;
+double wall[3];
+int set, m;
+
+	bucket = (uint32_t *)malloc(HASH_KEYS * sizeof(uint32_t));
+	if ( !bucket ) {
+		perror("malloc() failed");
+		exit(255);
+	}
+	mask = HASH_KEYS - 1;
+
+	for ( set=0; set<5; set++ ) {
+		// m = 0: low key bits, m = 1: key hash
+		for ( m=0; m<2; m++ ) {
+			memset((void *)bucket, 0, HASH_KEYS * sizeof(uint32_t));
+			max[m] = used[m] = 0;
+			for ( i=0; i<HASH_KEYS; i++ ) {
+				uint32_t index;
+				HashKey(set, i, key);
+				index = m == 0 ? key[1] & mask : KeyHash(key, 2 * sizeof(uint64_t)) & mask;
+				if ( bucket[index] == 0 ) 
+					used[m]++;
+				bucket[index]++;
+				if ( bucket[index] > max[m] ) 
+					max[m] = bucket[index];
+			}
+		}
+		if ( bench ) 
+			printf("Key hash %-12s: key bits: collisions %6u, max chain %5u - hash: collisions %6u, max chain %2u\n",
+				keyset[set], HASH_KEYS - used[0], max[0], HASH_KEYS - used[1], max[1]);
+
+		if ( (HASH_KEYS - used[1]) > (HASH_KEYS * 2 / 5) || max[1] > 16 ) {
+			printf("**** FAILED **** Key hash of %s: %u collisions, max chain %u\n", 
+				keyset[set], HASH_KEYS - used[1], max[1]);
+			exit(255);
+		}
+	}
+	free(bucket);
+
+	if ( !bench ) {
+		printf("Success: Key hash distribution\n");
+		return;
+	}
+
+	// throughput of stat keys and aggregation keys with the size of the default flow key
+	memset((void *)key, 0, sizeof(key));
+	sum = 0;
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( l=0; l<HASH_LOOPS; l++ ) {
+		for ( i=0; i<HASH_KEYS; i++ ) {
+			key[1] = 0xC0A80000 + i;
+			sum += KeyHash(key, 2 * sizeof(uint64_t)) & mask;
+		}
+	}
+	wall[0] = BenchTime(&tstart);
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( l=0; l<HASH_LOOPS; l++ ) {
+		for ( i=0; i<HASH_KEYS; i++ ) {
+			key[0] = (uint64_t)i << 16 | 443;
+			key[2] = 0xC0A80000 + i;
+			key[4] = 0x0A000001;
+			sum += KeyHash(key, 6 * sizeof(uint64_t)) & mask;
+		}
+	}
+	wall[1] = BenchTime(&tstart);
+
+#define MKEYS(t) ((t) > 0 ? (double)HASH_KEYS * HASH_LOOPS / (t) / 1000000 : 0)
+	printf("Key hash throughput: 16 byte keys: %7.1f Mkeys/s, 48 byte keys: %7.1f Mkeys/s (%llu)\n",
+		MKEYS(wall[0]), MKEYS(wall[1]), (unsigned long long)(sum & 0xF));
+
+} // End of CheckKeyHash
+
+/*
+ * The streaming top N selection must select the same counts as the full heap sort
+ */
+void CheckTopN(uint32_t num, int bench) {
+SortElement_t	*list;
+topN_t			topN;
+uint64_t		*count;
+uint32_t		sizes[] = { 1, 10, 1000, num, num + 5, 0 };
+uint32_t		i, s, size;
+int				direction;
+struct timeval	tstart;
+double			wall[2];
+
+	count = (uint64_t *)malloc(num * sizeof(uint64_t));
+	list  = (SortElement_t *)malloc(num * sizeof(SortElement_t));
+	if ( !count || !list ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		exit(255);
+	}
+	srandom(num);
+	for ( i=0; i<num; i++ ) 
+		count[i] = random() % (num / 4);
+
+	for ( direction=0; direction<2; direction++ ) {
+		int dir = direction ? ASCENDING : DESCENDING;
+		for ( i=0; i<num; i++ ) {
+			list[i].count  = count[i];
+			list[i].record = &count[i];
+		}
+		heapSort(list, num, 0, dir);
+
+		for ( s=0; s<sizeof(sizes)/sizeof(uint32_t); s++ ) {
+			if ( !topNInit(&topN, sizes[s], num, dir) ) {
+				fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+				exit(255);
+			}
+			for ( i=0; i<num; i++ ) 
+				topNAdd(&topN, count[i], &count[i]);
+			topNSort(&topN);
+
+			size = sizes[s] == 0 || sizes[s] > num ? num : sizes[s];
+			if ( topN.num != size ) {
+				printf("**** FAILED **** Top %u: %u elements selected\n", sizes[s], topN.num);
+				exit(255);
+			}
+			// both lists are printed from the end
+			for ( i=1; i<=size; i++ ) {
+				if ( topN.list[size - i].count != list[num - i].count ) {
+					printf("**** FAILED **** Top %u %s: element %u: %llu, expected %llu\n", 
+						sizes[s], dir == DESCENDING ? "descending" : "ascending", i, 
+						(unsigned long long)topN.list[size - i].count, (unsigned long long)list[num - i].count);
+					exit(255);
+				}
+			}
+			free(topN.list);
+		}
+	}
+
+	if ( !bench ) {
+		printf("Success: Top N selection\n");
+		free(list);
+		free(count);
+		return;
+	}
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	for ( i=0; i<num; i++ ) {
+		list[i].count  = count[i];
+		list[i].record = &count[i];
+	}
+	heapSort(list, num, 10, DESCENDING);
+	wall[0] = BenchTime(&tstart);
+
+	gettimeofday(&tstart, (struct timezone*)NULL);
+	topNInit(&topN, 10, num, DESCENDING);
+	for ( i=0; i<num; i++ ) 
+		topNAdd(&topN, count[i], &count[i]);
+	topNSort(&topN);
+	wall[1] = BenchTime(&tstart);
+	free(topN.list);
+
+	printf("Top 10 of %u elements: heap sort: %7.3fs, top N selection: %7.3fs\n", num, wall[0], wall[1]);
+	free(list);
+	free(count);
+
+} // End of CheckTopN
+
+/*
+ * Approximate element stats: num distinct src IPs, of which 10 heavy hitters, and num/40 distinct
+ * dst IPs are counted with counters records. Each record must still be found in its probe sequence, 
+ * after records got replaced, the flows must add up, the heavy hitters must be listed within their
+ * error bound and the distinct elements must be estimated within 5%.
+ */
+void CheckStatApprox(uint32_t counters, uint32_t num) {
+master_record_t flow_record;
+common_record_t raw_record;
+hash_StatTable *table;
+StatRecord_t *record;
+uint64_t hitter[10], flows, sum, distinct, expect;
+uint32_t i, k, ref, used, index;
+int element_stat, flow_stat, t;
+
+	element_stat = flow_stat = 0;
+	SetStatApprox(counters);
+	if ( !SetStat("srcip", &element_stat, &flow_stat) || !SetStat("dstip", &element_stat, &flow_stat) ||
+		 !Init_StatTable(StatTableBits, counters) ) 
+		exit(255);
+
+	memset((void *)&flow_record, 0, sizeof(master_record_t));
+	memset((void *)&raw_record, 0, sizeof(common_record_t));
+	raw_record.size   = sizeof(common_record_t);
+	flow_record.prot  = IPPROTO_TCP;
+	flow_record.dPkts = 1;
+	flow_record.dOctets = 100;
+
+	memset((void *)hitter, 0, sizeof(hitter));
+	flows = 0;
+	for ( k=0; k<num; k++ ) {
+		flow_record.V6.srcaddr[1] = 0x0A000000 + k;
+		flow_record.V6.dstaddr[1] = 0xC0A80000 + k % (num / 40);
+		AddStat(&raw_record, &flow_record);
+		flows++;
+		if ( k < 10 ) 
+			hitter[k]++;
+		if ( (k & 3) == 0 ) {
+			flow_record.V6.srcaddr[1] = 0x0A000000 + (k >> 2) % 10;
+			AddStat(&raw_record, &flow_record);
+			hitter[(k >> 2) % 10]++;
+			flows++;
+		}
+	}
+
+	for ( t=0; t<2; t++ ) {
+		table = GetStatTable(t);
+		if ( table->NumRecords != counters ) {
+			printf("**** FAILED **** Approx stat %d: %u records, expected %u\n", t, table->NumRecords, counters);
+			exit(255);
+		}
+
+		// all records in their probe sequence, no other slot used
+		used = 0;
+		for ( i=0; i<=table->IndexMask; i++ ) 
+			if ( table->slot[i].ref ) 
+				used++;
+		sum = 0;
+		for ( ref=1; ref<=table->NumRecords; ref++ ) {
+			uint64_t hash;
+			record = StatRecordRef(table, ref);
+			hash   = KeyHash(record->stat_key, 2 * sizeof(uint64_t));
+			index  = hash & table->IndexMask;
+			while ( table->slot[index].ref != ref ) {
+				if ( table->slot[index].ref == 0 ) {
+					printf("**** FAILED **** Approx stat %d: record %u not found in its probe sequence\n", t, ref);
+					exit(255);
+				}
+				index = (index + 1) & table->IndexMask;
+			}
+			if ( table->slot[index].tag != (uint32_t)(hash >> 32) ) {
+				printf("**** FAILED **** Approx stat %d: record %u has a wrong tag\n", t, ref);
+				exit(255);
+			}
+			sum += record->counter[FLOWS];
+		}
+		if ( used != table->NumRecords || sum != flows ) {
+			printf("**** FAILED **** Approx stat %d: %u slots used, %llu flows, expected %u slots, %llu flows\n", 
+				t, used, (unsigned long long)sum, table->NumRecords, (unsigned long long)flows);
+			exit(255);
+		}
+
+		distinct = StatDistinct(table);
+		expect	 = t == 0 ? num : num / 40;
+		if ( distinct < expect - expect / 20 || distinct > expect + expect / 20 ) {
+			printf("**** FAILED **** Approx stat %d: %llu distinct elements estimated, expected %llu\n", 
+				t, (unsigned long long)distinct, (unsigned long long)expect);
+			exit(255);
+		}
+	}
+
+	// the heavy hitters are counted within their error bound
+	table = GetStatTable(0);
+	for ( i=0; i<10; i++ ) {
+		for ( ref=1; ref<=table->NumRecords; ref++ ) {
+			record = StatRecordRef(table, ref);
+			if ( record->stat_key[1] == 0x0A000000 + i ) 
+				break;
+		}
+		if ( ref > table->NumRecords || record->counter[FLOWS] < hitter[i] || 
+			 record->counter[FLOWS] - table->error[ref] > hitter[i] ) {
+			printf("**** FAILED **** Approx stat: heavy hitter %u with %llu flows not counted\n", 
+				i, (unsigned long long)hitter[i]);
+			exit(255);
+		}
+	}
+
+	printf("Success: Approximate stat of %u elements with %u counters\n", num, counters);
+
+	Dispose_StatTable();
+
+} // End of CheckStatApprox
+
+/*
+ * The expansion plan of an extension map must expand the same master record as the switch
+ * over the extensions of the map, for IPv4 records with 32bit counters and IPv6 records 
+ * with 64bit counters. UseExpandPlan() must choose the faster path for each map. With -b
+ * the faster path is measured, and the choice must not be slower by more than 10%.
+ */
+#define EXPAND_MAPS		5
+#define EXPAND_LOOPS	2000000
+#define EXPAND_RUNS		5
+
+static uint16_t ExpandMaps[EXPAND_MAPS][16] = {
+	// nfgen
+	{ EX_IO_SNMP_2, EX_AS_2, EX_MULIPLE, EX_NEXT_HOP_v4, EX_NEXT_HOP_BGP_v4, EX_VLAN, EX_OUT_PKG_4, EX_OUT_BYTES_4, 
+	  EX_AGGR_FLOWS_4, EX_MAC_1, EX_MAC_2, EX_MPLS, EX_ROUTER_IP_v4, EX_ROUTER_ID, EX_BGPADJ, 0 },
+	// v9/ipfix with 4 byte interfaces and AS numbers
+	{ EX_IO_SNMP_4, EX_AS_4, EX_MULIPLE, EX_NEXT_HOP_v4, EX_NEXT_HOP_BGP_v4, EX_OUT_PKG_8, EX_OUT_BYTES_8, 
+	  EX_ROUTER_IP_v4, EX_ROUTER_ID, EX_RECEIVED, 0 },
+	// small 2 byte map
+	{ EX_IO_SNMP_2, EX_AS_2, EX_MULIPLE, EX_NEXT_HOP_v4, EX_ROUTER_IP_v4, EX_ROUTER_ID, EX_RECEIVED, 0 },
+	// IPv6 map
+	{ EX_IO_SNMP_4, EX_AS_4, EX_NEXT_HOP_v6, EX_NEXT_HOP_BGP_v6, EX_VLAN, EX_OUT_PKG_8, EX_OUT_BYTES_8, EX_AGGR_FLOWS_8,
+	  EX_MAC_1, EX_MAC_2, EX_MPLS, EX_ROUTER_IP_v6, EX_BGPADJ, EX_LATENCY, EX_RECEIVED, 0 },
+	// interfaces and AS numbers only
+	{ EX_IO_SNMP_4, EX_AS_4, 0 }
+};
+
+// measured ns per record switch/plan: 33/53, 22/28, 16/25.5, 29/45, 7/5.3
+static int ExpandPlanFaster[EXPAND_MAPS] = { 0, 0, 0, 0, 1 };
+
+void CheckExpandPlan(int bench) {
+extension_map_t *map;
+extension_info_t extension_info[2];
+common_record_t *record;
+master_record_t master_record[2];
+expand_op_t *plan;
+struct timeval tstart;
+double wall[2];
+uint64_t sum;
+uint32_t i, l, m, num, seed;
+int v, p, r, use_plan;
+
+	map	   = (extension_map_t *)malloc(sizeof(extension_map_t) + 16 * sizeof(uint16_t));
+	record = (common_record_t *)malloc(sizeof(common_record_t) + 4096);
+	if ( !map || !record ) {
+		fprintf(stderr, "malloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror (errno));
+		exit(255);
+	}
+
+	for ( m=0; m<EXPAND_MAPS; m++ ) {
+		map->type	= ExtensionMapType;
+		map->map_id = 0;
+		map->extension_size = 0;
+		i = 0;
+		while ( ExpandMaps[m][i] ) {
+			map->ex_id[i] = ExpandMaps[m][i];
+			map->extension_size += extension_descriptor[map->ex_id[i]].size;
+			i++;
+		}
+		map->ex_id[i] = 0;
+		map->size = sizeof(extension_map_t) + i * sizeof(uint16_t);
+		num = i;
+
+		plan = CompileExpandPlan(map);
+		if ( !plan ) {
+			printf("**** FAILED **** Expansion plan of map %u not compiled\n", m);
+			exit(255);
+		}
+		memset((void *)extension_info, 0, sizeof(extension_info));
+		extension_info[0].map = map;
+		extension_info[1].map = map;
+		extension_info[1].expand_plan = plan;
+
+		for ( v=0; v<2; v++ ) {
+			seed = m * 2 + v + 1;
+			for ( i=0; i<(sizeof(common_record_t) + 4096) / sizeof(uint32_t); i++ ) {
+				seed = seed * 1103515245 + 12345;
+				((uint32_t *)record)[i] = seed;
+			}
+			record->type  = CommonRecordType;
+			record->flags = v ? FLAG_IPV6_ADDR | FLAG_PKG_64 | FLAG_BYTES_64 : 0;
+			for ( p=0; p<2; p++ ) {
+				memset((void *)&master_record[p], 0, sizeof(master_record_t));
+				ExpandRecord_v2(record, &extension_info[p], NULL, &master_record[p]);
+			}
+			if ( memcmp((void *)&master_record[0], (void *)&master_record[1], sizeof(master_record_t)) != 0 ) {
+				printf("**** FAILED **** Expansion plan of map %u: master record differs from the switch\n", m);
+				exit(255);
+			}
+		}
+
+		use_plan = UseExpandPlan(map, plan);
+		if ( use_plan != ExpandPlanFaster[m] ) {
+			printf("**** FAILED **** Expansion of map %u: %s chosen, but the %s is faster\n", m, 
+				use_plan ? "plan" : "switch", use_plan ? "switch" : "plan");
+			exit(255);
+		}
+
+		if ( bench ) {
+			// best of a few alternating runs. The extension info is passed through a volatile
+			// pointer, so the compiler can not specialise the loop for a known plan as it can not
+			// in the record loop of nfdump.
+			sum = 0;
+			for ( r=0; r<EXPAND_RUNS; r++ ) {
+				for ( p=0; p<2; p++ ) {
+					extension_info_t *volatile info = &extension_info[p];
+					extension_info_t *e = info;
+					double t;
+					gettimeofday(&tstart, (struct timezone*)NULL);
+					for ( l=0; l<EXPAND_LOOPS; l++ ) {
+						ExpandRecord_v2(record, e, NULL, &master_record[p]);
+						sum += master_record[p].srcas;
+					}
+					t = BenchTime(&tstart);
+					if ( r == 0 || t < wall[p] ) 
+						wall[p] = t;
+				}
+			}
+			i = 0;
+			while ( plan[i].op != EXPAND_END ) 
+				i++;
+			printf("Expand map %u: %2u extensions, %2u ops: switch %5.1fns, plan %5.1fns per record, %s chosen (%llu)\n", m, 
+				num, i, wall[0] * 1e9 / EXPAND_LOOPS, wall[1] * 1e9 / EXPAND_LOOPS, use_plan ? "plan" : "switch", 
+				(unsigned long long)(sum & 0xF));
+			if ( wall[use_plan] > 1.1 * wall[1 - use_plan] ) {
+				printf("**** FAILED **** Expansion of map %u: the %s chosen is slower\n", m, use_plan ? "plan" : "switch");
+				exit(255);
+			}
+		}
+		free(plan);
+	}
+
+	if ( !bench ) 
+		printf("Success: Expansion plans of %u maps\n", EXPAND_MAPS);
+	free(record);
+	free(map);
+
+} // End of CheckExpandPlan
+
 int main(int argc, char **argv) {
 master_record_t flow_record;
 common_record_t c_record;
@@ -253,6 +1269,24 @@ void *p;
 		exit(255);
 	}
 
+	if ( argc == 2 && strcmp(argv[1], "-b") == 0 ) {
+		BenchFilter();
+		CheckFilterSet(12, 200, 1);
+		CheckFilterSet(120, 20, 1);
+		CheckIPList(100, 4000000, 1);
+		CheckIPList(50000, 4000000, 1);
+		CheckIPList(500000, 4000000, 1);
+		CheckULList(12, 65536, ShiftSrcPort, 4000000, 1);
+		CheckULList(1000, 65536, ShiftSrcPort, 4000000, 1);
+		CheckULList(50, 400000, ShiftSrcAS, 4000000, 1);
+		CheckULList(50000, 400000, ShiftSrcAS, 4000000, 1);
+		CheckFlowTable(2000000, 4, 1);
+		CheckKeyHash(1);
+		CheckTopN(10000000, 1);
+		CheckExpandPlan(1);
+		exit(0);
+	}
+
 	if ( argc == 2 ) {
 		CheckCompression(argv[1]);
 		exit(0);
@@ -392,6 +1426,10 @@ void *p;
 
 	ret = check_filter_block("src ip in [fe80::2110:abcd:1234:5678]", &flow_record, 1);
 	ret = check_filter_block("src ip in [fe80::2110:abcd:1234:5679]", &flow_record, 0);
+	ret = check_filter_block("src ip in [fe80::/16]", &flow_record, 1);
+	ret = check_filter_block("src ip in [fe80::2110:abcd:1234:5600/120 10.0.0.0/8]", &flow_record, 1);
+	ret = check_filter_block("src ip in [fe80::2110:abcd:1234:5700/120 10.0.0.0/8]", &flow_record, 0);
+	ret = check_filter_block("src ip in [fe81::/16 ::/64]", &flow_record, 0);
 
 	inet_pton(PF_INET6, "fe80::2110:abcd:1234:0", flow_record.V6.srcaddr);
 	flow_record.V6.srcaddr[0] = ntohll(flow_record.V6.srcaddr[0]);
@@ -483,6 +1521,34 @@ void *p;
 	ret = check_filter_block("src ip in [10.10.10.11 172.32.7.0/24]", &flow_record, 1);
 	ret = check_filter_block("src ip in [172.32.7.16 172.32.6.0/24]", &flow_record, 1);
 	ret = check_filter_block("src ip in [10.10.10.11 172.32.6.0/24]", &flow_record, 0);
+	ret = check_filter_block("src ip in [10.0.0.0/8 172.32.0.0/12]", &flow_record, 1);
+	ret = check_filter_block("src ip in [10.0.0.0/8 172.32.7.17/32]", &flow_record, 0);
+	ret = check_filter_block("src ip in [172.32.7.16/31 fe80::/16]", &flow_record, 1);
+	ret = check_filter_block("src ip in [172.32.7.18/31 fe80::/16]", &flow_record, 0);
+	ret = check_filter_block("src ip in [::/64]", &flow_record, 1);
+	ret = check_filter_block("dst ip in [10.10.10.8/30 fe80::/16]", &flow_record, 1);
+	{
+		// a list long enough for the trie
+		char *filter = malloc(64 * 512);
+		int len;
+		if ( !filter ) {
+			perror("malloc() failed");
+			exit(255);
+		}
+		len = sprintf(filter, "src ip in [");
+		for ( i=0; i<500; i++ ) 
+			len += sprintf(filter + len, "10.%i.%i.0/24 fe80:%x::/32 ", i & 0xff, i >> 8, i);
+		sprintf(filter + len, "]");
+		ret = check_filter_block(filter, &flow_record, 0);
+		sprintf(filter + len, "172.32.7.16/30 ]");
+		ret = check_filter_block(filter, &flow_record, 1);
+		sprintf(filter + len, "172.32.0.0/16 ]");
+		ret = check_filter_block(filter, &flow_record, 1);
+		free(filter);
+	}
+	CheckFilterSet(120, 1, 0);
+	CheckIPList(500, 100000, 0);
+	CheckIPList(5000, 100000, 0);
 
 	flow_record.srcport = 63;
 	flow_record.dstport = 255;
@@ -525,6 +1591,21 @@ void *p;
 	ret = check_filter_block("port in [ 62 63 64 254 256 ]", &flow_record, 1);
 	ret = check_filter_block("port in [ 62 64 254 256 ]", &flow_record, 0);
 	ret = check_filter_block("not port in [ 62 64 254 256 ]", &flow_record, 1);
+	ret = check_filter_block("src port in [ 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 63 ]", &flow_record, 1);
+	ret = check_filter_block("src port in [ 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 255 ]", &flow_record, 0);
+	ret = check_filter_block("port in [ 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 255 ]", &flow_record, 1);
+
+	// the terms of a chain are reordered - the label must stay the same
+	ret = check_filter_block("%ICMP ( proto icmp ) and dst port 255 and src port 63", &flow_record, 1);
+	if ( Engine->label == NULL || strcmp(Engine->label, "ICMP") != 0 ) {
+		printf("**** FAILED **** Label of AND chain: %s\n", Engine->label ? Engine->label : "<none>");
+		exit(255);
+	}
+	ret = check_filter_block("%ICMP ( proto icmp ) and ( src port 1000 or dst port 255 )", &flow_record, 1);
+	if ( Engine->label != NULL ) {
+		printf("**** FAILED **** Label of OR chain: %s\n", Engine->label);
+		exit(255);
+	}
 
 	flow_record.srcas = 123;
 	flow_record.dstas = 456;
@@ -564,6 +1645,17 @@ void *p;
 	ret = check_filter_block("as in [ 122 124 455 456 457]", &flow_record, 1);
 	ret = check_filter_block("as in [ 122 124 455 457]", &flow_record, 0);
 	ret = check_filter_block("not as in [ 122 124 455 457]", &flow_record, 1);
+	ret = check_filter_block("src as in [ 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 70000 123 ]", &flow_record, 1);
+	ret = check_filter_block("src as in [ 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 70000 456 ]", &flow_record, 0);
+	ret = check_filter_block("as in [ 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 70000 456 ]", &flow_record, 1);
+	CheckULList(5, 65536, ShiftDstPort, 100000, 0);
+	CheckULList(1000, 65536, ShiftSrcPort, 100000, 0);
+	CheckULList(5000, 400000, ShiftDstAS, 100000, 0);
+	CheckFlowTable(200000, 3, 0);
+	CheckKeyHash(0);
+	CheckTopN(100000, 0);
+	CheckStatApprox(1000, 200000);
+	CheckExpandPlan(0);
 
 	ret = check_filter_block("src net 172.32/16", &flow_record, 1);
 	ret = check_filter_block("src net 172.32.7/24", &flow_record, 1);
@@ -46,6 +46,7 @@
 #include "nfdump.h"
 #include "nffile.h"
 #include "ipconv.h"
+#include "iptrie.h"
 #include "nftree.h"
 
 // #include "grammar.h"
@@ -55,8 +56,6 @@
  *
  */
 
-extern char 	*CurrentIdent;
-
 #define MAXBLOCKS 1024
 
 static FilterBlock_t *FilterTree;
@@ -71,6 +70,12 @@ static char		**IdentList;
 
 static void UpdateList(uint32_t a, uint32_t b);
 
+static void CompileLists(void);
+
+static void OrderChains(FilterEngine_t *engine);
+
+static void CompileCode(FilterEngine_t *engine);
+
 /* flow processing functions */
 static inline void pps_function(uint64_t *record_data, uint64_t *comp_values);
 static inline void bps_function(uint64_t *record_data, uint64_t *comp_values);
@@ -186,14 +191,20 @@ int	ret;
 	lex_cleanup();
 	free(IPstack);
 
+	CompileLists();
+
 	engine = malloc(sizeof(FilterEngine_t));
 	if ( !engine ) {
 		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
 		exit(255);
 	}
 	engine->nfrecord  = NULL;
+	engine->ident	  = NULL;
+	engine->label	  = NULL;
 	engine->StartNode = StartNode;
 	engine->Extended  = Extended;
+	engine->NumBlocks = NumBlocks;
+	engine->NumIdents = NumIdents;
 	engine->IdentList = IdentList;
 	engine->filter 	  = FilterTree;
 	if ( Extended ) 
@@ -201,10 +212,261 @@ int	ret;
 	else
 		engine->FilterEngine = RunFilter;
 
+	// test the most selective terms of a chain first
+	OrderChains(engine);
+
+	// evaluate the filter code instead of the tree
+	CompileCode(engine);
+
 	return (FilterEngine_t *)engine;
 
 } // End of GetTree
 
+/*
+ * Compile a port/AS list into a flat lookup table. The backend is chosen from the list size 
+ * and the value range given by the block mask:
+ *   ULLIST_ARRAY:  up to ULLIST_ARRAY_MAX values - sorted array, branchless binary search
+ *   ULLIST_BITMAP: values fit into 16 bits - 64k bitmap ( ports, protocols etc. )
+ *   ULLIST_HASH:   else - open addressing hash set with linear probing, load <= 0.5
+ * Values outside the mask can never match a masked record value and are dropped.
+ */
+#define ULLIST_HASH(key, bits)	(uint32_t)(((key) * 0x9E3779B97F4A7C15ULL) >> (64 - (bits)))
+
+static int ULValueCMP(const void *p1, const void *p2) {
+uint64_t v1 = *(uint64_t *)p1;
+uint64_t v2 = *(uint64_t *)p2;
+
+	return v1 == v2 ? 0 : ( v1 < v2 ? -1 : 1 );
+
+} // End of ULValueCMP
+
+ullist_t *NewULList(uint64_t *values, uint32_t num, uint64_t mask) {
+ullist_t *list;
+uint64_t key;
+uint32_t i, n, shift;
+
+	shift = 0;
+	if ( mask ) {
+		while ( ((mask >> shift) & 1) == 0 )
+			shift++;
+	}
+
+	list = (ullist_t *)calloc(1, sizeof(ullist_t));
+	if ( !list ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	list->shift = shift;
+
+	if ( num <= ULLIST_ARRAY_MAX ) {
+		list->type  = ULLIST_ARRAY;
+		list->table = (uint64_t *)malloc((num + 1) * sizeof(uint64_t));
+	} else if ( (mask >> shift) <= 0xFFFF ) {
+		list->type  = ULLIST_BITMAP;
+		list->table = (uint64_t *)calloc(65536 / 64, sizeof(uint64_t));
+	} else {
+		list->type  = ULLIST_HASH;
+		list->bits  = 4;
+		while ( (1U << list->bits) < 2 * num ) 
+			list->bits++;
+		list->table = (uint64_t *)calloc(1U << list->bits, sizeof(uint64_t));
+	}
+	if ( !list->table ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	n = 0;
+	for ( i=0; i<num; i++ ) {
+		if ( values[i] & ~mask ) 
+			continue;
+		key = values[i] >> shift;
+		switch (list->type) {
+			case ULLIST_ARRAY:
+				list->table[n++] = key;
+				break;
+			case ULLIST_BITMAP:
+				if ( (list->table[key >> 6] & (1ULL << (key & 63))) == 0 )
+					n++;
+				list->table[key >> 6] |= 1ULL << (key & 63);
+				break;
+			case ULLIST_HASH: {
+				uint32_t slot = ULLIST_HASH(key, list->bits);
+				uint32_t slotmask = (1U << list->bits) - 1;
+				if ( key == 0 ) {
+					n += list->has_zero == 0;
+					list->has_zero = 1;
+					break;
+				}
+				while ( list->table[slot] && list->table[slot] != key ) 
+					slot = (slot + 1) & slotmask;
+				n += list->table[slot] == 0;
+				list->table[slot] = key;
+				} break;
+		}
+	}
+
+	if ( list->type == ULLIST_ARRAY && n ) {
+		qsort(list->table, n, sizeof(uint64_t), ULValueCMP);
+		// drop duplicates
+		for ( i=1, num=1; i<n; i++ ) {
+			if ( list->table[i] != list->table[num-1] )
+				list->table[num++] = list->table[i];
+		}
+		n = num;
+	}
+	list->num = n;
+
+	return list;
+
+} // End of NewULList
+
+int ULListLookup(ullist_t *list, uint64_t value) {
+uint64_t key = value >> list->shift;
+
+	switch (list->type) {
+		case ULLIST_ARRAY: {
+			uint64_t *base = list->table;
+			uint32_t n = list->num;
+			if ( n == 0 ) 
+				return 0;
+			while ( n > 1 ) {
+				uint32_t half = n >> 1;
+				base = base[half] <= key ? base + half : base;
+				n -= half;
+			}
+			return *base == key;
+			} break;
+		case ULLIST_BITMAP:
+			return (list->table[key >> 6] >> (key & 63)) & 1;
+			break;
+		case ULLIST_HASH: {
+			uint32_t slot = ULLIST_HASH(key, list->bits);
+			uint32_t slotmask = (1U << list->bits) - 1;
+			if ( key == 0 ) 
+				return list->has_zero;
+			while ( list->table[slot] ) {
+				if ( list->table[slot] == key ) 
+					return 1;
+				slot = (slot + 1) & slotmask;
+			}
+			} break;
+	}
+
+	return 0;
+
+} // End of ULListLookup
+
+/*
+ * Compile the lists of the filter for the lookup. Large IP lists are compiled into a trie,
+ * a short IP list is looked up as fast in the RB tree, which is kept for dumping the filter 
+ * anyway. Port/AS lists are compiled by NewULList(). Blocks of the same list share the lookup.
+ */
+#define IPLIST_TRIE_MIN	256
+
+static void CompileLists(void) {
+uint32_t i, j;
+
+	for ( i=1; i<NumBlocks; i++ ) {
+		struct IPListNode *node;
+		uint64_t *ip, *mask;
+		uint32_t num;
+
+		if ( FilterTree[i].comp == CMP_ULLIST ) {
+			struct ULongListNode *ulnode;
+			uint64_t *values;
+
+			for ( j=1; j<i; j++ ) {
+				if ( FilterTree[j].comp == CMP_ULLIST && FilterTree[j].data == FilterTree[i].data &&
+					 FilterTree[j].mask == FilterTree[i].mask ) {
+					FilterTree[i].lookup = FilterTree[j].lookup;
+					break;
+				}
+			}
+			if ( FilterTree[i].lookup ) 
+				continue;
+
+			num = 0;
+			RB_FOREACH(ulnode, ULongtree, FilterTree[i].data) 
+				num++;
+			values = (uint64_t *)malloc((num + 1) * sizeof(uint64_t));
+			if ( !values ) {
+				fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+				exit(255);
+			}
+			num = 0;
+			RB_FOREACH(ulnode, ULongtree, FilterTree[i].data) 
+				values[num++] = ulnode->value;
+			FilterTree[i].lookup = NewULList(values, num, FilterTree[i].mask);
+			free(values);
+			continue;
+		}
+
+		if ( FilterTree[i].comp != CMP_IPLIST ) 
+			continue;
+
+		for ( j=1; j<i; j++ ) {
+			if ( FilterTree[j].comp == CMP_IPLIST && FilterTree[j].data == FilterTree[i].data ) {
+				FilterTree[i].lookup = FilterTree[j].lookup;
+				break;
+			}
+		}
+		if ( FilterTree[i].lookup ) 
+			continue;
+
+		num = 0;
+		RB_FOREACH(node, IPtree, FilterTree[i].data) 
+			num++;
+		if ( num < IPLIST_TRIE_MIN ) 
+			continue;
+
+		ip	 = (uint64_t *)malloc((num + 1) * 2 * sizeof(uint64_t));
+		mask = (uint64_t *)malloc((num + 1) * 2 * sizeof(uint64_t));
+		if ( !ip || !mask ) {
+			fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		num = 0;
+		RB_FOREACH(node, IPtree, FilterTree[i].data) {
+			ip[2*num]	  = node->ip[0];
+			ip[2*num+1]	  = node->ip[1];
+			mask[2*num]	  = node->mask[0];
+			mask[2*num+1] = node->mask[1];
+			num++;
+		}
+		FilterTree[i].lookup = NewIPTrie(ip, mask, num);
+		free(ip);
+		free(mask);
+	}
+
+} // End of CompileLists
+
+FilterEngine_t *CloneFilterEngine(FilterEngine_t *engine) {
+FilterEngine_t	*clone;
+
+	clone = malloc(sizeof(FilterEngine_t));
+	if ( !clone ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	// share the compiled filter - start with a fresh evaluation state
+	*clone = *engine;
+	clone->nfrecord = NULL;
+	clone->ident	= NULL;
+	clone->label	= NULL;
+
+	return clone;
+
+} // End of CloneFilterEngine
+
+void DisposeFilterEngine(FilterEngine_t *engine) {
+
+	// the compiled filter may be shared with other engines and is kept
+	free(engine);
+
+} // End of DisposeFilterEngine
+
 /*
  * For testing purpose only
  */
@@ -238,6 +500,7 @@ uint32_t	NewBlock(uint32_t offset, uint64_t mask, uint64_t value, uint16_t comp,
 	FilterTree[n].fname 	= flow_procs_map[function].name;
 	FilterTree[n].label 	= NULL;
 	FilterTree[n].data 		= data;
+	FilterTree[n].lookup 	= NULL;
 	if ( comp > 0 || function > 0 )
 		Extended = 1;
 
@@ -374,7 +637,7 @@ static void UpdateList(uint32_t a, uint32_t b) {
 void DumpEngine(FilterEngine_t *engine) {
 uint32_t i, j;
 
-	for (i=1; i<NumBlocks; i++ ) {
+	for (i=1; i<engine->NumBlocks; i++ ) {
 		if ( engine->filter[i].invert )
 			printf("Index: %u, Offset: %u, Mask: %.16llx, Value: %.16llx, Superblock: %u, Numblocks: %u, !OnTrue: %u, !OnFalse: %u Comp: %u Function: %s, Label: %s\n",
 				i, engine->filter[i].offset, (unsigned long long)engine->filter[i].mask, 
@@ -387,13 +650,18 @@ uint32_t i, j;
 				(unsigned long long)engine->filter[i].value, engine->filter[i].superblock, 
 				engine->filter[i].numblocks, engine->filter[i].OnTrue, engine->filter[i].OnFalse, 
 				engine->filter[i].comp, engine->filter[i].fname, engine->filter[i].label ? engine->filter[i].label : "<none>");
-		if ( engine->filter[i].OnTrue > (memblocks * MAXBLOCKS) || engine->filter[i].OnFalse > (memblocks * MAXBLOCKS) ) {
+		if ( engine->filter[i].OnTrue >= engine->NumBlocks || engine->filter[i].OnFalse >= engine->NumBlocks ) {
 			fprintf(stderr, "Tree pointer out of range for index %u. *** ABORT ***\n", i);
 			exit(255);
 		}
 		if ( engine->filter[i].data ) {
 			if ( engine->filter[i].comp == CMP_IPLIST ) {
 				struct IPListNode *node;
+				if ( engine->filter[i].lookup ) {
+					iptrie_t *trie = (iptrie_t *)engine->filter[i].lookup;
+					printf("trie: IPv4 %u prefixes %u nodes, IPv6 %u prefixes %u nodes\n", 
+						trie->v4.numprefixes, trie->v4.numnodes, trie->v6.numprefixes, trie->v6.numnodes);
+				}
 				RB_FOREACH(node, IPtree, engine->filter[i].data) {
 					printf("value: %.16llx %.16llx mask: %.16llx %.16llx\n", 
 						(unsigned long long)node->ip[0], (unsigned long long)node->ip[1], 
@@ -401,6 +669,11 @@ uint32_t i, j;
 				} 
 			} else if ( engine->filter[i].comp == CMP_ULLIST ) {
 				struct ULongListNode *node;
+				if ( engine->filter[i].lookup ) {
+					ullist_t *list = (ullist_t *)engine->filter[i].lookup;
+					char *backend[] = { "sorted array", "bitmap", "hash set" };
+					printf("list: %s, %u values, shift %u\n", backend[list->type], list->num, list->shift);
+				}
 				RB_FOREACH(node, ULongtree, engine->filter[i].data) {
 					printf("%.16llx \n", (unsigned long long)node->value);
 				}
@@ -412,9 +685,9 @@ uint32_t i, j;
 			printf("%i ", engine->filter[i].blocklist[j]);
 		printf("\n");
 	}
-	printf("NumBlocks: %i\n", NumBlocks - 1);
-	for ( i=0; i<NumIdents; i++ ) {
-		printf("Ident %i: %s\n", i, IdentList[i]);
+	printf("NumBlocks: %i\n", engine->NumBlocks - 1);
+	for ( i=0; i<engine->NumIdents; i++ ) {
+		printf("Ident %i: %s\n", i, engine->IdentList[i]);
 	}
 } /* End of DumpList */
 
@@ -437,65 +710,85 @@ int	evaluate, invert;
 
 } /* End of RunFilter */
 
-/* extended filter engine */
-int RunExtendedFilter(FilterEngine_t *engine) {
-uint32_t	index, offset; 
+/* evaluate a single node of the extended filter engine */
+static inline int EvalNode(FilterEngine_t *engine, uint32_t index) {
+uint32_t	offset; 
 uint64_t	comp_value[2];
-int	evaluate, invert;
+int	evaluate;
 
-	engine->label = NULL;
-	index = engine->StartNode;
-	evaluate = 0;
-	invert = 0;
-	while ( index ) {
-		offset   = engine->filter[index].offset;
-		invert   = engine->filter[index].invert;
+	offset   = engine->filter[index].offset;
 
-		comp_value[0] = engine->nfrecord[offset] & engine->filter[index].mask;
-		comp_value[1] = engine->filter[index].value;
+	comp_value[0] = engine->nfrecord[offset] & engine->filter[index].mask;
+	comp_value[1] = engine->filter[index].value;
 
-		if (engine->filter[index].function != NULL)
-			engine->filter[index].function(engine->nfrecord, comp_value);
+	if (engine->filter[index].function != NULL)
+		engine->filter[index].function(engine->nfrecord, comp_value);
 
-		switch (engine->filter[index].comp) {
-			case CMP_EQ:
+	evaluate = 0;
+	switch (engine->filter[index].comp) {
+		case CMP_EQ:
+			evaluate = comp_value[0] == comp_value[1];
+			break;
+		case CMP_GT:
+			evaluate = comp_value[0] > comp_value[1];
+			break;
+		case CMP_LT:
+			evaluate = comp_value[0] < comp_value[1];
+			break;
+		case CMP_GE:
+			evaluate = comp_value[0] >= comp_value[1];
+			break;
+		case CMP_LE:
+			evaluate = comp_value[0] <= comp_value[1];
+			break;
+		case CMP_IDENT:
+			evaluate = engine->ident && strncmp(engine->ident, engine->IdentList[comp_value[1]], IDENTLEN) == 0 ;
+			break;
+		case CMP_FLAGS:
+			if ( engine->filter[index].invert )
+				evaluate = comp_value[0] > 0;
+			else
 				evaluate = comp_value[0] == comp_value[1];
-				break;
-			case CMP_GT:
-				evaluate = comp_value[0] > comp_value[1];
-				break;
-			case CMP_LT:
-				evaluate = comp_value[0] < comp_value[1];
-				break;
-			case CMP_GE:
-				evaluate = comp_value[0] >= comp_value[1];
-				break;
-			case CMP_LE:
-				evaluate = comp_value[0] <= comp_value[1];
-				break;
-			case CMP_IDENT:
-				evaluate = strncmp(CurrentIdent, engine->IdentList[comp_value[1]], IDENTLEN) == 0 ;
-				break;
-			case CMP_FLAGS:
-				if ( invert )
-					evaluate = comp_value[0] > 0;
-				else
-					evaluate = comp_value[0] == comp_value[1];
-				break;
-			case CMP_IPLIST: {
+			break;
+		case CMP_IPLIST: 
+			if ( engine->filter[index].lookup ) {
+				evaluate = IPTrieLookup(engine->filter[index].lookup, &engine->nfrecord[offset]);
+			} else {
 				struct IPListNode find;
 				find.ip[0] = engine->nfrecord[offset];
 				find.ip[1] = engine->nfrecord[offset+1];
 				find.mask[0] = 0xffffffffffffffffLL;
 				find.mask[1] = 0xffffffffffffffffLL;
-				evaluate = RB_FIND(IPtree, engine->filter[index].data, &find) != NULL; }
-				break;
-			case CMP_ULLIST: {
+				evaluate = RB_FIND(IPtree, engine->filter[index].data, &find) != NULL; 
+			}
+			break;
+		case CMP_ULLIST: 
+			if ( engine->filter[index].lookup ) {
+				evaluate = ULListLookup(engine->filter[index].lookup, comp_value[0]);
+			} else {
 				struct ULongListNode find;
 				find.value = comp_value[0];
-				evaluate = RB_FIND(ULongtree, engine->filter[index].data, &find ) != NULL; }
-				break;
-		}
+				evaluate = RB_FIND(ULongtree, engine->filter[index].data, &find ) != NULL; 
+			}
+			break;
+	}
+
+	return evaluate;
+
+} // End of EvalNode
+
+/* extended filter engine */
+int RunExtendedFilter(FilterEngine_t *engine) {
+uint32_t	index; 
+int	evaluate, invert;
+
+	engine->label = NULL;
+	index = engine->StartNode;
+	evaluate = 0;
+	invert = 0;
+	while ( index ) {
+		invert   = engine->filter[index].invert;
+		evaluate = EvalNode(engine, index);
 
 		/*
 		 * Label evaluation:
@@ -523,6 +816,898 @@ int	evaluate, invert;
 
 } /* End of RunExtendedFilter */
 
+/*
+ * Filter code:
+ * The filter tree is compiled into a flat array of ops. A chain of nodes, each of them
+ * continuing with the next node on true and sharing the same node on false, is an AND
+ * chain - on false instead of true an OR chain. Chains of plain mask/value nodes without
+ * label are fused into one op, which tests its terms in a tight loop. The terms follow
+ * the op in the code array, so an op and its terms share the same cache lines. Any other 
+ * node becomes a single op, evaluated as by RunExtendedFilter(). Slot 0 is the end.
+ */
+#define SimpleNode(n) ((n)->comp == CMP_EQ && (n)->function == NULL && (n)->label == NULL)
+
+static uint32_t ChainLength(FilterEngine_t *engine, uint32_t index, uint32_t *pred, int op) {
+FilterBlock_t *node = &engine->filter[index];
+uint32_t num, next;
+
+	num = 1;
+	next = op == FOP_AND ? node->OnTrue : node->OnFalse;
+	while ( next ) {
+		FilterBlock_t *n = &engine->filter[next];
+		// no other node may jump into the chain
+		if ( !SimpleNode(n) || pred[next] != 1 || n->invert != node->invert )
+			break;
+		if ( op == FOP_AND ? n->OnFalse != node->OnFalse : n->OnTrue != node->OnTrue )
+			break;
+		num++;
+		next = op == FOP_AND ? n->OnTrue : n->OnFalse;
+	}
+
+	return num;
+
+} // End of ChainLength
+
+/* count the predecessors of each node reachable from the start node */
+static void CountPred(FilterEngine_t *engine, uint32_t *pred, uint32_t *stack) {
+FilterBlock_t *filter = engine->filter;
+uint32_t i, sp;
+
+	sp = 0;
+	stack[sp++] = engine->StartNode;
+	pred[engine->StartNode] = 1;
+	while ( sp ) {
+		uint32_t next[2];
+		int j;
+		i = stack[--sp];
+		next[0] = filter[i].OnTrue;
+		next[1] = filter[i].OnFalse;
+		for ( j=0; j<2; j++ ) {
+			if ( next[j] == 0 ) 
+				continue;
+			if ( pred[next[j]]++ == 0 ) 
+				stack[sp++] = next[j];
+		}
+	}
+
+} // End of CountPred
+
+/*
+ * Static estimate of the selectivity of a plain term: the more bits a term compares, 
+ * the fewer records match. Zero is the common value - the upper words of an IPv4 address,
+ * unset flags, the high byte of a well known port etc. - so only the bits of the non zero
+ * bytes of the value are counted.
+ */
+static uint32_t TermWeight(FilterBlock_t *node) {
+uint64_t mask, value;
+uint32_t bits;
+
+	bits = 0;
+	for ( mask = node->mask, value = node->value; mask; mask >>= 8, value >>= 8 ) {
+		uint32_t m = value & 0xFF ? mask & 0xFF : 0;
+		while ( m ) {
+			m &= m - 1;
+			bits++;
+		}
+	}
+	return bits;
+
+} // End of TermWeight
+
+/*
+ * The terms of a chain of plain nodes commute: the nodes are side effect free and only
+ * the first node of a chain is entered. The terms are swapped between the nodes of the
+ * chain, the jumps of the tree stay as they are. An AND chain tests the most selective 
+ * term first, an OR chain the term most likely to match. Terms of equal weight keep 
+ * the order of the filter. 
+ * Any false node clears the label, which does not depend on the order of an AND chain. 
+ * The label of an OR chain depends on its first node, so OR chains are only ordered,
+ * if the filter has no label.
+ */
+static void OrderChains(FilterEngine_t *engine) {
+FilterBlock_t *filter = engine->filter;
+uint32_t *pred, *stack, *chain, *done;
+uint32_t i, sp, numblocks = engine->NumBlocks;
+int has_label;
+
+	if ( engine->StartNode == 0 ) 
+		return;
+
+	pred  = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	stack = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	chain = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	done  = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	if ( !pred || !stack || !chain || !done ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	has_label = 0;
+	for ( i=1; i<numblocks; i++ ) {
+		if ( filter[i].label ) 
+			has_label = 1;
+	}
+
+	CountPred(engine, pred, stack);
+
+	// walk the chains the same way as CompileCode()
+	sp = 0;
+	stack[sp++] = engine->StartNode;
+	done[engine->StartNode] = 1;
+	while ( sp ) {
+		uint32_t index, num, k, next[2];
+		int j;
+
+		index = stack[--sp];
+		if ( SimpleNode(&filter[index]) ) {
+			uint32_t num_and = ChainLength(engine, index, pred, FOP_AND);
+			uint32_t num_or  = ChainLength(engine, index, pred, FOP_OR);
+			int op = num_and >= num_or ? FOP_AND : FOP_OR;
+
+			num = op == FOP_AND ? num_and : num_or;
+			for ( k=0; k<num; k++ ) {
+				chain[k] = index;
+				if ( k < (num-1) ) 
+					index = op == FOP_AND ? filter[index].OnTrue : filter[index].OnFalse;
+			}
+
+			// stable insertion sort of the terms by weight
+			if ( op == FOP_AND || !has_label ) {
+				for ( k=1; k<num; k++ ) {
+					FilterBlock_t *n = &filter[chain[k]];
+					uint64_t mask = n->mask, value = n->value;
+					uint32_t offset = n->offset, weight = TermWeight(n);
+					int l = k - 1;
+					while ( l >= 0 && (op == FOP_AND ? TermWeight(&filter[chain[l]]) < weight :
+											  TermWeight(&filter[chain[l]]) > weight) ) {
+						filter[chain[l+1]].offset = filter[chain[l]].offset;
+						filter[chain[l+1]].mask	  = filter[chain[l]].mask;
+						filter[chain[l+1]].value  = filter[chain[l]].value;
+						l--;
+					}
+					filter[chain[l+1]].offset = offset;
+					filter[chain[l+1]].mask	  = mask;
+					filter[chain[l+1]].value  = value;
+				}
+			}
+			// index is now the last node of the chain
+		}
+		next[0] = filter[index].OnTrue;
+		next[1] = filter[index].OnFalse;
+		for ( j=0; j<2; j++ ) {
+			if ( next[j] && !done[next[j]] ) {
+				done[next[j]] = 1;
+				stack[sp++] = next[j];
+			}
+		}
+	}
+
+	free(pred);
+	free(stack);
+	free(chain);
+	free(done);
+
+} // End of OrderChains
+
+static void CompileCode(FilterEngine_t *engine) {
+FilterBlock_t *filter = engine->filter;
+FilterOp_t *ops;
+FilterTerm_t *terms;
+FilterCode_t *code;
+uint32_t *pred, *oplist, *stack, *slot;
+uint32_t i, sp, numops, numterms, numslots, numblocks = engine->NumBlocks;
+int fused_or;
+
+	engine->code   = NULL;
+	engine->NumOps = 0;
+	if ( engine->StartNode == 0 ) 
+		return;
+
+	pred   = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	oplist = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	stack  = (uint32_t *)calloc(numblocks, sizeof(uint32_t));
+	slot   = (uint32_t *)calloc(numblocks + 1, sizeof(uint32_t));
+	ops    = (FilterOp_t *)calloc(numblocks + 1, sizeof(FilterOp_t));
+	terms  = (FilterTerm_t *)calloc(2 * numblocks, sizeof(FilterTerm_t));
+	if ( !pred || !oplist || !stack || !slot || !ops || !terms ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	CountPred(engine, pred, stack);
+
+	// build the ops - oplist maps the first node of an op to the op
+	numops	 = 1;
+	numterms = 0;
+	sp = 0;
+	stack[sp++] = engine->StartNode;
+	oplist[engine->StartNode] = numops++;
+	while ( sp ) {
+		FilterOp_t *op;
+		uint32_t index, num, k, next[2];
+		int j;
+
+		index = stack[--sp];
+		op = &ops[oplist[index]];
+		op->invert = filter[index].invert;
+		op->node   = index;
+		op->numterms = 0;
+		op->op = FOP_NODE;
+
+		if ( SimpleNode(&filter[index]) ) {
+			uint32_t num_and = ChainLength(engine, index, pred, FOP_AND);
+			uint32_t num_or  = ChainLength(engine, index, pred, FOP_OR);
+			op->op = num_and >= num_or ? FOP_AND : FOP_OR;
+			op->numterms = num_and >= num_or ? num_and : num_or;
+		}
+
+		num = op->numterms;
+		if ( op->op != FOP_NODE ) {
+			// collect the terms of the chain
+			op->node = numterms;
+			for ( k=0; k<num; k++ ) {
+				terms[numterms].offset = filter[index].offset;
+				terms[numterms].mask   = filter[index].mask;
+				terms[numterms].value  = filter[index].value;
+				numterms++;
+				if ( k < (num-1) ) 
+					index = op->op == FOP_AND ? filter[index].OnTrue : filter[index].OnFalse;
+			}
+			// terms are tested in pairs - pad with a neutral term: true for AND, false for OR
+			if ( num & 1 ) {
+				terms[numterms].offset = 0;
+				terms[numterms].mask   = 0;
+				terms[numterms].value  = op->op == FOP_AND ? 0 : 1;
+				numterms++;
+				op->numterms++;
+			}
+			// index is now the last node of the chain
+		}
+		next[0] = filter[index].OnTrue;
+		next[1] = filter[index].OnFalse;
+
+		// targets of the op become ops
+		for ( j=0; j<2; j++ ) {
+			if ( next[j] == 0 ) 
+				continue;
+			if ( oplist[next[j]] == 0 ) {
+				oplist[next[j]] = numops++;
+				stack[sp++] = next[j];
+			}
+		}
+		op->OnTrue	= next[0] ? oplist[next[0]] : 0;
+		op->OnFalse	= next[1] ? oplist[next[1]] : 0;
+	}
+
+	fused_or = 0;
+	for ( i=1; i<numops; i++ ) {
+		if ( ops[i].op == FOP_OR && ops[i].numterms > 2 ) 
+			fused_or = 1;
+	}
+
+	// lay out the code: each op is followed by its terms, slot 0 is the end
+	numslots = 1;
+	for ( i=1; i<numops; i++ ) {
+		slot[i] = numslots;
+		numslots += 1 + ops[i].numterms;
+	}
+	code = (FilterCode_t *)calloc(numslots, sizeof(FilterCode_t));
+	if ( !code ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	for ( i=1; i<numops; i++ ) {
+		FilterOp_t *op = &code[slot[i]].op;
+		*op = ops[i];
+		op->OnTrue  = slot[ops[i].OnTrue];
+		op->OnFalse = slot[ops[i].OnFalse];
+		if ( op->op != FOP_NODE ) {
+			uint32_t k;
+			for ( k=0; k<op->numterms; k++ ) 
+				code[slot[i] + 1 + k].term = terms[ops[i].node + k];
+			op->node = 0;
+		}
+	}
+
+	free(pred);
+	free(oplist);
+	free(stack);
+	free(slot);
+	free(ops);
+	free(terms);
+
+	engine->code	= code;
+	engine->NumOps	= numops;
+	engine->NumSlots = numslots;
+
+	/*
+	 * A short plain filter is already evaluated fast enough by RunFilter(). The code
+	 * pays off for extended filters and for OR chains, which test many terms per op.
+	 */
+	if ( engine->Extended || fused_or ) 
+		engine->FilterEngine = RunFilterCode;
+
+} // End of CompileCode
+
+/* run the filter code from op index on */
+static inline int RunCode(FilterEngine_t *engine, uint32_t index) {
+FilterCode_t *code = engine->code;
+uint64_t	*nfrecord = engine->nfrecord;
+int	evaluate, invert;
+
+	engine->label = NULL;
+	evaluate = 0;
+	invert = 0;
+	while ( index ) {
+		FilterOp_t *op = &code[index].op;
+		switch (op->op) {
+			case FOP_AND: {
+				FilterTerm_t *term = &code[index+1].term;
+				uint32_t i;
+				int failed;
+				i = 0;
+				do {
+					failed = (nfrecord[term[i].offset] & term[i].mask) != term[i].value;
+					i++;
+				} while ( !failed && i < op->numterms );
+				evaluate = !failed;
+				// any false node clears the label
+				if ( failed ) 
+					engine->label = NULL;
+				} break;
+			case FOP_OR: {
+				FilterTerm_t *term = &code[index+1].term;
+				uint32_t i;
+				int first, matched;
+				first = (nfrecord[term[0].offset] & term[0].mask) == term[0].value;
+				matched = first | ((nfrecord[term[1].offset] & term[1].mask) == term[1].value);
+				// test two terms at a time without branching
+				for ( i=2; i<op->numterms && !matched; i+=2 ) {
+					matched = ((nfrecord[term[i].offset] & term[i].mask) == term[i].value) | 
+							  ((nfrecord[term[i+1].offset] & term[i+1].mask) == term[i+1].value);
+				}
+				evaluate = matched;
+				// a false node before the matching one clears the label
+				if ( !first ) 
+					engine->label = NULL;
+				} break;
+			default:
+				evaluate = EvalNode(engine, op->node);
+				if ( evaluate ) {
+					if ( engine->filter[op->node].label ) 
+						engine->label = engine->filter[op->node].label;
+				} else {
+					engine->label = NULL;
+				}
+		}
+		invert = op->invert;
+		index  = evaluate ? op->OnTrue : op->OnFalse;
+	}
+	return invert ? !evaluate : evaluate;
+
+} // End of RunCode
+
+/* filter code engine */
+int RunFilterCode(FilterEngine_t *engine) {
+
+	return RunCode(engine, 1);
+
+} // End of RunFilterCode
+
+/*
+ * Batch evaluation:
+ * Most filters start with an AND chain of plain terms - e.g. proto, port and net. 
+ * The terms of this first op are tested column-wise: one term over all records of the 
+ * batch, before the next term is tested. The loop has no branches and no dependency 
+ * between the records, so the loads of the records overlap. The loads are a gather 
+ * over the records and are not vectorised. Only records which need more than the 
+ * first op continue with the filter code one by one.
+ */
+void RunFilterBatch(FilterEngine_t *engine, uint64_t **nfrecord, uint32_t num, uint64_t *match, char **label) {
+uint8_t		sel[FILTER_BATCH];
+uint32_t	i;
+
+	if ( num > FILTER_BATCH ) 
+		num = FILTER_BATCH;
+	memset((void *)match, 0, BATCH_WORDS * sizeof(uint64_t));
+
+	if ( engine->code && engine->code[1].op.op == FOP_AND ) {
+		FilterOp_t *op = &engine->code[1].op;
+		FilterTerm_t *term = &engine->code[2].term;
+		uint32_t k;
+
+		memset((void *)sel, 1, num);
+		for ( k=0; k<op->numterms; k++ ) {
+			uint32_t offset = term[k].offset;
+			uint64_t mask	= term[k].mask;
+			uint64_t value	= term[k].value;
+			uint8_t	 any	= 0;
+			for ( i=0; i<num; i++ ) {
+				sel[i] &= (nfrecord[i][offset] & mask) == value;
+				any |= sel[i];
+			}
+			// no record left in the batch
+			if ( !any ) 
+				break;
+		}
+
+		if ( op->OnTrue == 0 && op->OnFalse == 0 ) {
+			// the filter is this AND chain only
+			uint8_t invert = op->invert ? 1 : 0;
+			for ( i=0; i<num; i++ ) 
+				match[i >> 6] |= (uint64_t)(sel[i] ^ invert) << (i & 63);
+			if ( label ) 
+				memset((void *)label, 0, num * sizeof(char *));
+			return;
+		}
+
+		for ( i=0; i<num; i++ ) {
+			uint32_t next = sel[i] ? op->OnTrue : op->OnFalse;
+			int evaluate;
+			if ( next ) {
+				engine->nfrecord = nfrecord[i];
+				evaluate = RunCode(engine, next);
+			} else {
+				engine->label = NULL;
+				evaluate = op->invert ? !sel[i] : sel[i];
+			}
+			match[i >> 6] |= (uint64_t)(evaluate != 0) << (i & 63);
+			if ( label ) 
+				label[i] = engine->label;
+		}
+	} else {
+		for ( i=0; i<num; i++ ) {
+			int evaluate;
+			engine->nfrecord = nfrecord[i];
+			evaluate = (*engine->FilterEngine)(engine);
+			match[i >> 6] |= (uint64_t)(evaluate != 0) << (i & 63);
+			if ( label ) 
+				label[i] = engine->label;
+		}
+	}
+
+} // End of RunFilterBatch
+
+/*
+ * Filter set:
+ * Profile channels often test the same terms - the same interface, AS or network.
+ * The nodes of all engines are mapped to distinct predicates: nodes with the same test 
+ * share one predicate. A batch is evaluated in two steps:
+ * Each predicate is evaluated over all records of the batch into a bitmap. Then the records
+ * are pushed through the tree of each engine in topological order: the records reaching 
+ * a node are split by the bitmap of its predicate into the records reaching the OnTrue and
+ * the OnFalse node. This evaluates the predicates without short cut, but each of them only 
+ * once and the trees with a few bit operations per node. Labels are not evaluated.
+ */
+static int SameList(uint16_t comp, void *data1, void *data2) {
+
+	if ( data1 == data2 ) 
+		return 1;
+
+	if ( comp == CMP_IPLIST ) {
+		struct IPListNode *n1 = RB_MIN(IPtree, (IPlist_t *)data1);
+		struct IPListNode *n2 = RB_MIN(IPtree, (IPlist_t *)data2);
+		while ( n1 && n2 ) {
+			if ( n1->ip[0] != n2->ip[0] || n1->ip[1] != n2->ip[1] || 
+				 n1->mask[0] != n2->mask[0] || n1->mask[1] != n2->mask[1] ) 
+				return 0;
+			n1 = RB_NEXT(IPtree, (IPlist_t *)data1, n1);
+			n2 = RB_NEXT(IPtree, (IPlist_t *)data2, n2);
+		}
+		return n1 == NULL && n2 == NULL;
+	} else {
+		struct ULongListNode *n1 = RB_MIN(ULongtree, (ULongtree_t *)data1);
+		struct ULongListNode *n2 = RB_MIN(ULongtree, (ULongtree_t *)data2);
+		while ( n1 && n2 ) {
+			if ( n1->value != n2->value ) 
+				return 0;
+			n1 = RB_NEXT(ULongtree, (ULongtree_t *)data1, n1);
+			n2 = RB_NEXT(ULongtree, (ULongtree_t *)data2, n2);
+		}
+		return n1 == NULL && n2 == NULL;
+	}
+
+} // End of SameList
+
+static int SamePredicate(FilterEngine_t *e1, uint32_t i1, FilterEngine_t *e2, uint32_t i2) {
+FilterBlock_t *b1 = &e1->filter[i1];
+FilterBlock_t *b2 = &e2->filter[i2];
+
+	if ( b1->comp != b2->comp || b1->offset != b2->offset || b1->mask != b2->mask || 
+		 b1->function != b2->function ) 
+		return 0;
+
+	switch (b1->comp) {
+		case CMP_IDENT:
+			return strncmp(e1->IdentList[b1->value], e2->IdentList[b2->value], IDENTLEN) == 0;
+		case CMP_FLAGS:
+			// the test depends on the invert of the node
+			return b1->value == b2->value && (b1->invert != 0) == (b2->invert != 0);
+		case CMP_IPLIST:
+		case CMP_ULLIST:
+			return b1->mask == b2->mask && SameList(b1->comp, b1->data, b2->data);
+		default:
+			return b1->value == b2->value;
+	}
+
+} // End of SamePredicate
+
+FilterSet_t *NewFilterSet(FilterEngine_t **engine, uint32_t num) {
+FilterSet_t *set;
+uint32_t *pred, *stack;
+uint32_t i, j, k, maxpreds, maxblocks;
+
+	set = (FilterSet_t *)calloc(1, sizeof(FilterSet_t));
+	if ( !set ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	maxpreds  = 1;
+	maxblocks = 1;
+	for ( i=0; i<num; i++ ) {
+		maxpreds += engine[i]->NumBlocks;
+		if ( engine[i]->NumBlocks > maxblocks ) 
+			maxblocks = engine[i]->NumBlocks;
+	}
+
+	set->engine		= (FilterEngine_t **)calloc(num + 1, sizeof(FilterEngine_t *));
+	set->pred		= (uint32_t **)calloc(num + 1, sizeof(uint32_t *));
+	set->order		= (uint32_t **)calloc(num + 1, sizeof(uint32_t *));
+	set->NumOrder	= (uint32_t *)calloc(num + 1, sizeof(uint32_t));
+	set->PredEngine = (FilterEngine_t **)calloc(maxpreds, sizeof(FilterEngine_t *));
+	set->PredNode	= (uint32_t *)calloc(maxpreds, sizeof(uint32_t));
+	set->reach		= (uint64_t *)calloc(maxblocks * BATCH_WORDS, sizeof(uint64_t));
+	set->words		= (num + 63) >> 6;
+	set->match		= (uint64_t *)calloc(FILTER_BATCH * (set->words + 1), sizeof(uint64_t));
+	pred  = (uint32_t *)malloc(maxblocks * sizeof(uint32_t));
+	stack = (uint32_t *)malloc(maxblocks * sizeof(uint32_t));
+	if ( !set->engine || !set->pred || !set->order || !set->NumOrder || !set->PredEngine || 
+		 !set->PredNode || !set->reach || !set->match || !pred || !stack ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+	set->NumEngines = num;
+
+	// predicate 0 is unused
+	set->NumPreds = 1;
+	for ( i=0; i<num; i++ ) {
+		FilterEngine_t *e = engine[i];
+		uint32_t sp, n;
+
+		set->engine[i] = e;
+		set->pred[i]  = (uint32_t *)calloc(e->NumBlocks, sizeof(uint32_t));
+		set->order[i] = (uint32_t *)calloc(e->NumBlocks, sizeof(uint32_t));
+		if ( !set->pred[i] || !set->order[i] ) {
+			fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+			exit(255);
+		}
+		if ( e->StartNode == 0 ) 
+			continue;
+
+		// the nodes reachable from the start node in topological order
+		memset((void *)pred, 0, e->NumBlocks * sizeof(uint32_t));
+		CountPred(e, pred, stack);
+		n  = 0;
+		sp = 0;
+		stack[sp++] = e->StartNode;
+		while ( sp ) {
+			uint32_t index = stack[--sp];
+			uint32_t next[2];
+			int l;
+			set->order[i][n++] = index;
+			next[0] = e->filter[index].OnTrue;
+			next[1] = e->filter[index].OnFalse;
+			for ( l=0; l<2; l++ ) {
+				if ( next[l] && --pred[next[l]] == 0 ) 
+					stack[sp++] = next[l];
+			}
+		}
+		set->NumOrder[i] = n;
+
+		for ( j=0; j<n; j++ ) {
+			uint32_t index = set->order[i][j];
+			for ( k=1; k<set->NumPreds; k++ ) {
+				if ( SamePredicate(set->PredEngine[k], set->PredNode[k], e, index) ) 
+					break;
+			}
+			if ( k == set->NumPreds ) {
+				set->PredEngine[k] = e;
+				set->PredNode[k]   = index;
+				set->NumPreds++;
+			}
+			set->pred[i][index] = k;
+			set->NumNodes++;
+		}
+	}
+	free(pred);
+	free(stack);
+
+	set->PredBits = (uint64_t *)calloc(set->NumPreds * BATCH_WORDS, sizeof(uint64_t));
+	if ( !set->PredBits ) {
+		fprintf(stderr, "Memory allocation error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		exit(255);
+	}
+
+	return set;
+
+} // End of NewFilterSet
+
+void RunFilterSet(FilterSet_t *set, uint64_t **nfrecord, uint32_t num) {
+uint64_t valid[BATCH_WORDS];
+uint32_t i, j, p, w;
+
+	if ( num > FILTER_BATCH ) 
+		num = FILTER_BATCH;
+	memset((void *)set->match, 0, num * set->words * sizeof(uint64_t));
+
+	memset((void *)valid, 0, sizeof(valid));
+	for ( i=0; i<num; i++ ) 
+		valid[i >> 6] |= 1ULL << (i & 63);
+
+	// evaluate each predicate over the batch
+	for ( p=1; p<set->NumPreds; p++ ) {
+		FilterEngine_t *e = set->PredEngine[p];
+		FilterBlock_t *node = &e->filter[set->PredNode[p]];
+		uint64_t *bits = &set->PredBits[p * BATCH_WORDS];
+
+		memset((void *)bits, 0, BATCH_WORDS * sizeof(uint64_t));
+		if ( node->comp == CMP_EQ && node->function == NULL ) {
+			uint32_t offset = node->offset;
+			uint64_t mask	= node->mask;
+			uint64_t value	= node->value;
+			for ( i=0; i<num; i++ ) 
+				bits[i >> 6] |= (uint64_t)((nfrecord[i][offset] & mask) == value) << (i & 63);
+		} else {
+			for ( i=0; i<num; i++ ) {
+				e->nfrecord = nfrecord[i];
+				bits[i >> 6] |= (uint64_t)(EvalNode(e, set->PredNode[p]) != 0) << (i & 63);
+			}
+		}
+	}
+
+	// push the records through the tree of each engine
+	for ( j=0; j<set->NumEngines; j++ ) {
+		FilterEngine_t *engine = set->engine[j];
+		uint32_t *order = set->order[j];
+		uint32_t *pred	= set->pred[j];
+		uint64_t result[BATCH_WORDS];
+		uint32_t n;
+
+		if ( set->NumOrder[j] == 0 ) 
+			continue;
+
+		for ( n=0; n<set->NumOrder[j]; n++ ) 
+			memset((void *)&set->reach[order[n] * BATCH_WORDS], 0, BATCH_WORDS * sizeof(uint64_t));
+		memcpy((void *)&set->reach[engine->StartNode * BATCH_WORDS], (void *)valid, sizeof(valid));
+		memset((void *)result, 0, sizeof(result));
+
+		for ( n=0; n<set->NumOrder[j]; n++ ) {
+			uint32_t index	 = order[n];
+			FilterBlock_t *b = &engine->filter[index];
+			uint64_t *reach  = &set->reach[index * BATCH_WORDS];
+			uint64_t *bits	 = &set->PredBits[pred[index] * BATCH_WORDS];
+			uint64_t *onTrue  = b->OnTrue  ? &set->reach[b->OnTrue * BATCH_WORDS]  : NULL;
+			uint64_t *onFalse = b->OnFalse ? &set->reach[b->OnFalse * BATCH_WORDS] : NULL;
+
+			for ( w=0; w<BATCH_WORDS; w++ ) {
+				uint64_t t = reach[w] & bits[w];
+				uint64_t f = reach[w] & ~bits[w];
+				// a record ending in this node matches, if evaluate xor invert is true
+				if ( onTrue ) 
+					onTrue[w] |= t;
+				else if ( !b->invert ) 
+					result[w] |= t;
+				if ( onFalse ) 
+					onFalse[w] |= f;
+				else if ( b->invert ) 
+					result[w] |= f;
+			}
+		}
+
+		// set the bit of the engine in the bitmap of each matching record
+		for ( w=0; w<BATCH_WORDS; w++ ) {
+			uint64_t r = result[w];
+			i = w << 6;
+			for ( ; r; r >>= 1, i++ ) {
+				if ( r & 1 ) 
+					set->match[i * set->words + (j >> 6)] |= 1ULL << (j & 63);
+			}
+		}
+	}
+
+} // End of RunFilterSet
+
+void DisposeFilterSet(FilterSet_t *set) {
+uint32_t i;
+
+	for ( i=0; i<set->NumEngines; i++ ) {
+		free(set->pred[i]);
+		free(set->order[i]);
+	}
+	free(set->pred);
+	free(set->order);
+	free(set->NumOrder);
+	free(set->engine);
+	free(set->PredEngine);
+	free(set->PredNode);
+	free(set->PredBits);
+	free(set->reach);
+	free(set->match);
+	free(set);
+
+} // End of DisposeFilterSet
+
+void DumpCode(FilterEngine_t *engine) {
+uint32_t i, j;
+
+	if ( engine->code == NULL ) {
+		printf("No filter code\n");
+		return;
+	}
+
+	i = 1;
+	while ( i < engine->NumSlots ) {
+		FilterOp_t *op = &engine->code[i].op;
+		switch (op->op) {
+			case FOP_AND:
+			case FOP_OR:
+				printf("Op: %u, %s %u terms, %sOnTrue: %u, %sOnFalse: %u\n", i, op->op == FOP_AND ? "AND" : "OR",
+					op->numterms, op->invert ? "!" : "", op->OnTrue, op->invert ? "!" : "", op->OnFalse);
+				for ( j=0; j<op->numterms; j++ ) {
+					FilterTerm_t *term = &engine->code[i + 1 + j].term;
+					printf("\tOffset: %u, Mask: %.16llx, Value: %.16llx\n", term->offset,
+						(unsigned long long)term->mask, (unsigned long long)term->value);
+				}
+				break;
+			default:
+				printf("Op: %u, Node %u, %sOnTrue: %u, %sOnFalse: %u\n", i, op->node, 
+					op->invert ? "!" : "", op->OnTrue, op->invert ? "!" : "", op->OnFalse);
+		}
+		i += 1 + op->numterms;
+	}
+
+} // End of DumpCode
+
+/*
+ * Block index evaluation:
+ * The filter is evaluated against the value ranges of a block index entry.
+ * A node evaluates to true or false for all records of the block or is undecided,
+ * in which case both paths are followed. The block may match, if any path ends in 
+ * a final match. Only nodes without a function on ports, protocol and addresses are 
+ * decided, any other node is undecided.
+ */
+#define EVAL_FALSE	1
+#define EVAL_TRUE	2
+#define EVAL_ANY	(EVAL_FALSE | EVAL_TRUE)
+
+static int IndexRange(block_index_t *entry, uint32_t offset, uint64_t mask, uint64_t *lo, uint64_t *hi) {
+
+	if ( mask == 0 ) {
+		*lo = 0;
+		*hi = 0;
+		return 1;
+	}
+
+	if ( offset == OffsetPort && mask == MaskSrcPort ) {
+		*lo = ((uint64_t)entry->srcport_min << ShiftSrcPort) & MaskSrcPort;
+		*hi = ((uint64_t)entry->srcport_max << ShiftSrcPort) & MaskSrcPort;
+		return 1;
+	}
+
+	if ( offset == OffsetPort && mask == MaskDstPort ) {
+		*lo = ((uint64_t)entry->dstport_min << ShiftDstPort) & MaskDstPort;
+		*hi = ((uint64_t)entry->dstport_max << ShiftDstPort) & MaskDstPort;
+		return 1;
+	}
+
+	// min/max of an address word is preserved by a prefix mask
+	if ( offset >= OffsetSrcIPv6a && offset <= OffsetDstIPv6b && ((~mask & (~mask + 1)) == 0) ) {
+		*lo = entry->addr_min[offset - OffsetSrcIPv6a] & mask;
+		*hi = entry->addr_max[offset - OffsetSrcIPv6a] & mask;
+		return 1;
+	}
+
+	return 0;
+
+} // End of IndexRange
+
+static int IndexNode(FilterBlock_t *node, block_index_t *entry) {
+uint64_t lo, hi;
+
+	if ( node->function != NULL ) 
+		return EVAL_ANY;
+
+	if ( node->comp == CMP_EQ && node->offset == OffsetProto && node->mask == MaskProto ) {
+		uint32_t proto = (node->value & MaskProto) >> ShiftProto;
+		uint8_t bit = 1 << (proto & 0x7);
+		int i;
+		if ( (entry->proto_map[proto >> 3] & bit) == 0 ) 
+			return EVAL_FALSE;
+		for (i=0; i<32; i++ ) {
+			if ( entry->proto_map[i] & ~(i == (proto >> 3) ? bit : 0) ) 
+				return EVAL_ANY;
+		}
+		return EVAL_TRUE;
+	}
+
+	if ( !IndexRange(entry, node->offset, node->mask, &lo, &hi) ) 
+		return EVAL_ANY;
+
+	switch (node->comp) {
+		case CMP_EQ:
+			if ( node->value < lo || node->value > hi ) 
+				return EVAL_FALSE;
+			return lo == hi ? EVAL_TRUE : EVAL_ANY;
+		case CMP_GT:
+			if ( hi <= node->value ) 
+				return EVAL_FALSE;
+			return lo > node->value ? EVAL_TRUE : EVAL_ANY;
+		case CMP_LT:
+			if ( lo >= node->value ) 
+				return EVAL_FALSE;
+			return hi < node->value ? EVAL_TRUE : EVAL_ANY;
+		case CMP_GE:
+			if ( hi < node->value ) 
+				return EVAL_FALSE;
+			return lo >= node->value ? EVAL_TRUE : EVAL_ANY;
+		case CMP_LE:
+			if ( lo > node->value ) 
+				return EVAL_FALSE;
+			return hi <= node->value ? EVAL_TRUE : EVAL_ANY;
+	}
+
+	return EVAL_ANY;
+
+} // End of IndexNode
+
+static int IndexEval(FilterEngine_t *engine, uint32_t index, block_index_t *entry, uint8_t *memo) {
+FilterBlock_t *node;
+int eval, result;
+
+	// the tree is a DAG - evaluate each node only once
+	if ( memo[index] ) 
+		return memo[index];
+
+	node   = &engine->filter[index];
+	eval   = IndexNode(node, entry);
+	result = 0;
+	if ( eval & EVAL_TRUE ) {
+		if ( node->OnTrue ) 
+			result |= IndexEval(engine, node->OnTrue, entry, memo);
+		else
+			result |= node->invert ? EVAL_FALSE : EVAL_TRUE;
+	}
+	if ( eval & EVAL_FALSE ) {
+		if ( node->OnFalse ) 
+			result |= IndexEval(engine, node->OnFalse, entry, memo);
+		else
+			result |= node->invert ? EVAL_TRUE : EVAL_FALSE;
+	}
+	memo[index] = result;
+
+	return result;
+
+} // End of IndexEval
+
+int BlockMayMatch(FilterEngine_t *engine, block_index_t *entry) {
+uint8_t *memo;
+int result;
+
+	if ( engine->StartNode == 0 ) 
+		return 1;
+
+	memo = calloc(engine->NumBlocks, sizeof(uint8_t));
+	if ( !memo ) 
+		return 1;
+
+	result = IndexEval(engine, engine->StartNode, entry, memo);
+	free(memo);
+
+	return (result & EVAL_TRUE) != 0;
+
+} // End of BlockMayMatch
+
 void AddLabel(uint32_t index, char *label) {
 
 	FilterTree[index].label = strdup(label);
@@ -660,3 +1845,27 @@ master_record_t *record = (master_record_t *)record_data;
 
 } // End of pblock_function
 
+/*
+ * Returns the set of master record fields, the filter of the engine may evaluate.
+ */
+uint64_t FilterEngineFields(FilterEngine_t *engine) {
+uint64_t fields;
+uint32_t i;
+
+	fields = 0;
+	for ( i=1; i<engine->NumBlocks; i++ ) {
+		FilterBlock_t *block = &engine->filter[i];
+
+		fields |= FieldBit(block->offset);
+		if ( block->comp == CMP_IPLIST ) 
+			fields |= FieldBit(block->offset + 1);
+
+		// the mpls functions search the label stack
+		if ( block->function == mpls_eos_function || block->function == mpls_any_function ) 
+			fields |= FieldBit(OffsetMPLS12) | FieldBit(OffsetMPLS34) | FieldBit(OffsetMPLS56) | 
+					  FieldBit(OffsetMPLS78) | FieldBit(OffsetMPLS910);
+	}
+
+	return fields;
+
+} // End of FilterEngineFields
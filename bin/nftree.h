@@ -45,6 +45,9 @@
 
 typedef void (*flow_proc_t)(uint64_t *, uint64_t *);
 
+// block index entry - see nffile.h
+struct block_index_s;
+
 typedef struct FilterBlock {
 	/* Filter specific data */
 	uint32_t	offset;
@@ -63,18 +66,105 @@ typedef struct FilterBlock {
 	char		*fname;				/* ascii function name */
 	char		*label;				/* label, if any */
 	void		*data;				/* any additional data for this block */
+	void		*lookup;			/* list compiled for the lookup, if any */
 } FilterBlock_t;
 
+/*
+ * Filter code - see CompileCode()
+ */
+enum { FOP_NODE = 0, FOP_AND, FOP_OR };
+
+typedef struct FilterTerm_s {
+	uint64_t	mask;
+	uint64_t	value;
+	uint32_t	offset;
+} FilterTerm_t;
+
+typedef struct FilterOp_s {
+	uint16_t	op;
+	uint16_t	invert;				/* invert of the node(s) */
+	uint32_t	node;				/* FOP_NODE: filter block */
+	uint32_t	numterms;			/* FOP_AND, FOP_OR: terms following the op */
+	uint32_t	OnTrue, OnFalse;	/* next op, 0 = end */
+} FilterOp_t;
+
+/* the terms of an op follow the op in the code array */
+typedef union FilterCode_u {
+	FilterOp_t		op;
+	FilterTerm_t	term;
+} FilterCode_t;
+
+/*
+ * Compiled port/AS list - see NewULList(). The list values and the looked up value 
+ * are shifted down by the lowest bit of the mask of the filter block.
+ */
+enum { ULLIST_ARRAY = 0, ULLIST_BITMAP, ULLIST_HASH };
+
+#define ULLIST_ARRAY_MAX	16
+
+typedef struct ullist_s {
+	uint32_t	type;
+	uint32_t	num;		// number of values
+	uint32_t	shift;
+	uint32_t	bits;		// ULLIST_HASH: log2 of the table size
+	uint32_t	has_zero;	// ULLIST_HASH: 0 marks an empty slot
+	uint64_t	*table;		// sorted values, bitmap or hash table
+} ullist_t;
+
+/*
+ * Batch evaluation - see RunFilterBatch(). The result is a bitmap with one bit per record.
+ */
+#define FILTER_BATCH	256
+#define BATCH_WORDS		(FILTER_BATCH / 64)
+#define BatchMatch(match, i)	(((match)[(i) >> 6] >> ((i) & 63)) & 1)
+
+/*
+ * A compiled filter is evaluated through a filter engine. The filter blocks and the ident list
+ * are not modified by the evaluation and may be shared by several engines, created with
+ * CloneFilterEngine(). The record, the ident and the label are per engine, so each thread 
+ * evaluates the filter with its own engine.
+ */
 typedef struct FilterEngine_data_s {
 	FilterBlock_t	*filter;
 	uint32_t		StartNode;
 	uint32_t 		Extended;
+	uint32_t		NumBlocks;		// number of filter blocks incl. reserved block 0
+	uint16_t		NumIdents;
 	char			**IdentList;
-	uint64_t		*nfrecord;
-	char			*label;
+	FilterCode_t	*code;
+	uint32_t		NumOps;			// number of ops incl. op 0 = end
+	uint32_t		NumSlots;		// size of the code array
+	/* evaluation state */
+	uint64_t		*nfrecord;		// record to evaluate
+	char			*ident;			// ident of the file the record belongs to
+	char			*label;			// label of the last match
 	int (*FilterEngine)(struct FilterEngine_data_s *);
 } FilterEngine_t;
 
+/*
+ * Filter set - see NewFilterSet(). The filters of several engines are evaluated together:
+ * equal nodes of the engines share one predicate, which is evaluated once per record.
+ * The result is a bitmap of the matching engines for each record of a batch.
+ */
+typedef struct FilterSet_s {
+	FilterEngine_t	**engine;
+	uint32_t		NumEngines;
+	uint32_t		NumNodes;		// number of nodes of all engines
+	uint32_t		NumPreds;		// number of distinct predicates incl. unused predicate 0
+	uint32_t		**pred;			// predicate of each node of each engine
+	uint32_t		**order;		// nodes of each engine in topological order
+	uint32_t		*NumOrder;
+	FilterEngine_t	**PredEngine;	// engine and node, which evaluate the predicate
+	uint32_t		*PredNode;
+	/* evaluation state */
+	uint64_t		*PredBits;		// NumPreds * BATCH_WORDS: result of the predicates
+	uint64_t		*reach;			// BATCH_WORDS per node: records reaching the node
+	uint32_t		words;			// bitmap words per record
+	uint64_t		*match;			// FILTER_BATCH records * words
+} FilterSet_t;
+
+#define FilterSetMatch(set, i)	(&(set)->match[(i) * (set)->words])
+
 /* 
  * Filter Engine Functions
  */
@@ -82,10 +172,30 @@ void InitTree(void);
 
 FilterEngine_t *CompileFilter(char *FilterSyntax);
 
+FilterEngine_t *CloneFilterEngine(FilterEngine_t *engine);
+
+void DisposeFilterEngine(FilterEngine_t *engine);
+
 int RunFilter(FilterEngine_t *engine);
 
 int RunExtendedFilter(FilterEngine_t *engine);
 
+int RunFilterCode(FilterEngine_t *engine);
+
+void RunFilterBatch(FilterEngine_t *engine, uint64_t **nfrecord, uint32_t num, uint64_t *match, char **label);
+
+void DumpCode(FilterEngine_t *engine);
+
+FilterSet_t *NewFilterSet(FilterEngine_t **engine, uint32_t num);
+
+void RunFilterSet(FilterSet_t *set, uint64_t **nfrecord, uint32_t num);
+
+void DisposeFilterSet(FilterSet_t *set);
+
+ullist_t *NewULList(uint64_t *values, uint32_t num, uint64_t mask);
+
+int ULListLookup(ullist_t *list, uint64_t value);
+
 void ClearFilter(void);
 
 void DumpEngine(FilterEngine_t *engine);
@@ -94,4 +204,8 @@ int nblocks(void);
 
 int RunDebugFilter(uint32_t	*block);
 
+int BlockMayMatch(FilterEngine_t *engine, struct block_index_s *entry);
+
+uint64_t FilterEngineFields(FilterEngine_t *engine);
+
 #endif //_NFTREE_H
@@ -33,6 +33,7 @@
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -128,6 +129,13 @@ uint32_t Max_num_extensions;
 
 static int VerifyExtensionMap(extension_map_t *map);
 
+static expand_op_t *SelectExpandOps(expand_op_t *plan, uint64_t fields, uint64_t skip);
+
+// fields of the filter and of the processing of the matched records - see SetExpandProjection()
+static int		Projection	  = 0;
+static uint64_t	FilterFields  = 0;
+static uint64_t	ProcessFields = 0;
+
 extension_map_list_t *InitExtensionMaps(int AllocateList) {
 extension_map_list_t *list = NULL;
 int i;
@@ -173,6 +181,9 @@ extension_info_t *l;
 		extension_info_t *tmp = l;
 		l = l->next;
 		free(tmp->map);
+		free(tmp->expand_plan);
+		free(tmp->filter_plan);
+		free(tmp->process_plan);
 		free(tmp);
 	}
 	free(extension_map_list);
@@ -181,6 +192,7 @@ extension_info_t *l;
 
 int Insert_Extension_Map(extension_map_list_t *extension_map_list, extension_map_t *map) {
 extension_info_t *l;
+expand_op_t *plan;
 uint16_t map_id;
 
 	if ( map->size < sizeof(extension_map_t) ) { // at least 1 extension required
@@ -264,6 +276,22 @@ uint16_t map_id;
 			return -1;
 		}
 		memcpy((void *)l->map, (void *)map, map->size);
+		plan = CompileExpandPlan(l->map);
+		l->expand_plan  = plan && UseExpandPlan(l->map, plan) ? plan : NULL;
+		l->filter_plan  = NULL;
+		l->process_plan = NULL;
+		if ( Projection && plan ) {
+			l->filter_plan  = SelectExpandOps(plan, FilterFields, 0);
+			l->process_plan = SelectExpandOps(plan, ProcessFields, FilterFields);
+			if ( !l->filter_plan || !l->process_plan ) {
+				free(l->filter_plan);
+				free(l->process_plan);
+				l->filter_plan  = NULL;
+				l->process_plan = NULL;
+			}
+		}
+		if ( plan && !l->expand_plan ) 
+			free(plan);
 
 		// append new extension to list
 		*(extension_map_list->last_map) = l;
@@ -593,3 +621,361 @@ uint64_t total_bytes;
 
 } // End of DumpExMaps
 
+static void AddExpandOp(expand_op_t **op, uint16_t type, size_t src, size_t dst, uint16_t arg) {
+
+	(*op)->op  = type;
+	(*op)->src = src;
+	(*op)->dst = dst;
+	(*op)->arg = arg;
+	(*op)++;
+
+} // End of AddExpandOp
+
+// a copy, which continues the previous one in the record and the master record, extends it
+static void AddCopyOp(expand_op_t *plan, expand_op_t **op, size_t src, size_t dst, uint16_t len) {
+expand_op_t *prev = *op - 1;
+
+	if ( *op > plan && prev->op == EXPAND_COPY && 
+		 (prev->src + prev->arg) == src && (prev->dst + prev->arg) == dst ) {
+		prev->arg += len;
+		return;
+	}
+	AddExpandOp(op, EXPAND_COPY, src, dst, len);
+
+} // End of AddCopyOp
+
+// same for the conversion of consecutive 16bit/32bit values into 32bit/64bit values
+static void AddConvertOp(expand_op_t *plan, expand_op_t **op, uint16_t type, size_t src, size_t dst) {
+expand_op_t *prev = *op - 1;
+uint32_t width = type == EXPAND_U16_32 ? 2 : 4;
+
+	if ( *op > plan && prev->op == type && 
+		 (prev->src + prev->arg * width) == src && (prev->dst + prev->arg * 2 * width) == dst ) {
+		prev->arg++;
+		return;
+	}
+	AddExpandOp(op, type, src, dst, 1);
+
+} // End of AddConvertOp
+
+/*
+ * Compile the expansion plan of an extension map: the fields of the optional extensions
+ * are at fixed offsets after the required extensions, so ExpandRecord_v2() copies them
+ * with the list of operations instead of walking the map for each record. Fields, which
+ * follow each other in both records, are merged into one operation and the copies are
+ * split into fixed size copies of at most 16 bytes. Maps with extensions, which need more 
+ * than a copy - NSEL/NEL - get no plan.
+ */
+#define ExtOffset(tpl, field)	(offset + offsetof(tpl, field))
+#define MasterOffset(field)		offsetof(master_record_t, field)
+
+expand_op_t *CompileExpandPlan(extension_map_t *map) {
+expand_op_t *plan, *fixed, *op, *next;
+uint32_t i, offset, num;
+
+	i = 0;
+	while ( map->ex_id[i] ) 
+		i++;
+
+	// at most 3 operations per extension
+	plan = (expand_op_t *)calloc(3 * i + 1, sizeof(expand_op_t));
+	if ( !plan ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return NULL;
+	}
+
+	op = plan;
+	offset = 0;
+	i = 0;
+	while ( map->ex_id[i] ) {
+		switch (map->ex_id[i++]) {
+			// 0 - 3 should never be in an extension table so - ignore it
+			case 0:
+			case 1:
+			case 2:
+			case 3:
+				break;
+			case EX_IO_SNMP_2:
+				AddConvertOp(plan, &op, EXPAND_U16_32, ExtOffset(tpl_ext_4_t, input), MasterOffset(input));
+				AddConvertOp(plan, &op, EXPAND_U16_32, ExtOffset(tpl_ext_4_t, output), MasterOffset(output));
+				offset += offsetof(tpl_ext_4_t, data);
+				break;
+			case EX_IO_SNMP_4:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_5_t, input), MasterOffset(input), 4);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_5_t, output), MasterOffset(output), 4);
+				offset += offsetof(tpl_ext_5_t, data);
+				break;
+			case EX_AS_2:
+				AddConvertOp(plan, &op, EXPAND_U16_32, ExtOffset(tpl_ext_6_t, src_as), MasterOffset(srcas));
+				AddConvertOp(plan, &op, EXPAND_U16_32, ExtOffset(tpl_ext_6_t, dst_as), MasterOffset(dstas));
+				offset += offsetof(tpl_ext_6_t, data);
+				break;
+			case EX_AS_4:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_7_t, src_as), MasterOffset(srcas), 4);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_7_t, dst_as), MasterOffset(dstas), 4);
+				offset += offsetof(tpl_ext_7_t, data);
+				break;
+			case EX_MULIPLE:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_8_t, any), MasterOffset(any), 4);
+				offset += offsetof(tpl_ext_8_t, data);
+				break;
+			case EX_NEXT_HOP_v4:
+				AddExpandOp(&op, EXPAND_IPV4, ExtOffset(tpl_ext_9_t, nexthop), MasterOffset(ip_nexthop), FLAG_IPV6_NH);
+				offset += offsetof(tpl_ext_9_t, data);
+				break;
+			case EX_NEXT_HOP_v6:
+				AddExpandOp(&op, EXPAND_IPV6, ExtOffset(tpl_ext_10_t, nexthop), MasterOffset(ip_nexthop), FLAG_IPV6_NH);
+				offset += offsetof(tpl_ext_10_t, data);
+				break;
+			case EX_NEXT_HOP_BGP_v4:
+				AddExpandOp(&op, EXPAND_IPV4, ExtOffset(tpl_ext_11_t, bgp_nexthop), MasterOffset(bgp_nexthop), FLAG_IPV6_NHB);
+				offset += offsetof(tpl_ext_11_t, data);
+				break;
+			case EX_NEXT_HOP_BGP_v6:
+				AddExpandOp(&op, EXPAND_IPV6, ExtOffset(tpl_ext_12_t, bgp_nexthop), MasterOffset(bgp_nexthop), FLAG_IPV6_NHB);
+				offset += offsetof(tpl_ext_12_t, data);
+				break;
+			case EX_VLAN:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_13_t, src_vlan), MasterOffset(src_vlan), 2);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_13_t, dst_vlan), MasterOffset(dst_vlan), 2);
+				offset += offsetof(tpl_ext_13_t, data);
+				break;
+			case EX_OUT_PKG_4:
+				AddConvertOp(plan, &op, EXPAND_U32_64, ExtOffset(tpl_ext_14_t, out_pkts), MasterOffset(out_pkts));
+				offset += offsetof(tpl_ext_14_t, data);
+				break;
+			case EX_OUT_PKG_8:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_15_t, v), MasterOffset(out_pkts), 8);
+				offset += offsetof(tpl_ext_15_t, data);
+				break;
+			case EX_OUT_BYTES_4:
+				AddConvertOp(plan, &op, EXPAND_U32_64, ExtOffset(tpl_ext_16_t, out_bytes), MasterOffset(out_bytes));
+				offset += offsetof(tpl_ext_16_t, data);
+				break;
+			case EX_OUT_BYTES_8:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_17_t, v), MasterOffset(out_bytes), 8);
+				offset += offsetof(tpl_ext_17_t, data);
+				break;
+			case EX_AGGR_FLOWS_4:
+				AddConvertOp(plan, &op, EXPAND_U32_64, ExtOffset(tpl_ext_18_t, aggr_flows), MasterOffset(aggr_flows));
+				offset += offsetof(tpl_ext_18_t, data);
+				break;
+			case EX_AGGR_FLOWS_8:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_19_t, v), MasterOffset(aggr_flows), 8);
+				offset += offsetof(tpl_ext_19_t, data);
+				break;
+			case EX_MAC_1:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_20_t, v1), MasterOffset(in_src_mac), 8);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_20_t, v2), MasterOffset(out_dst_mac), 8);
+				offset += offsetof(tpl_ext_20_t, data);
+				break;
+			case EX_MAC_2:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_21_t, v1), MasterOffset(in_dst_mac), 8);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_21_t, v2), MasterOffset(out_src_mac), 8);
+				offset += offsetof(tpl_ext_21_t, data);
+				break;
+			case EX_MPLS:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_22_t, mpls_label), MasterOffset(mpls_label), 10 * sizeof(uint32_t));
+				offset += offsetof(tpl_ext_22_t, data);
+				break;
+			case EX_ROUTER_IP_v4:
+				AddExpandOp(&op, EXPAND_IPV4, ExtOffset(tpl_ext_23_t, router_ip), MasterOffset(ip_router), FLAG_IPV6_EXP);
+				offset += offsetof(tpl_ext_23_t, data);
+				break;
+			case EX_ROUTER_IP_v6:
+				AddExpandOp(&op, EXPAND_IPV6, ExtOffset(tpl_ext_24_t, router_ip), MasterOffset(ip_router), FLAG_IPV6_EXP);
+				offset += offsetof(tpl_ext_24_t, data);
+				break;
+			case EX_ROUTER_ID:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_25_t, engine_type), MasterOffset(engine_type), 1);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_25_t, engine_id), MasterOffset(engine_id), 1);
+				offset += offsetof(tpl_ext_25_t, data);
+				break;
+			case EX_BGPADJ:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_26_t, bgpNextAdjacentAS), MasterOffset(bgpNextAdjacentAS), 4);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_26_t, bgpPrevAdjacentAS), MasterOffset(bgpPrevAdjacentAS), 4);
+				offset += offsetof(tpl_ext_26_t, data);
+				break;
+			case EX_LATENCY:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_latency_t, client_nw_delay_usec), MasterOffset(client_nw_delay_usec), 8);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_latency_t, server_nw_delay_usec), MasterOffset(server_nw_delay_usec), 8);
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_latency_t, appl_latency_usec), MasterOffset(appl_latency_usec), 8);
+				offset += offsetof(tpl_ext_latency_t, data);
+				break;
+			case EX_RECEIVED:
+				AddCopyOp(plan, &op, ExtOffset(tpl_ext_27_t, v), MasterOffset(received), 8);
+				offset += offsetof(tpl_ext_27_t, data);
+				break;
+			default:
+				free(plan);
+				return NULL;
+		}
+	}
+
+	// split the copies into fixed size copies
+	num = 1;
+	for ( op = plan; op->op != EXPAND_END; op++ ) 
+		num += op->op == EXPAND_COPY ? op->arg / 16 + 3 : 1;
+
+	fixed = (expand_op_t *)calloc(num, sizeof(expand_op_t));
+	if ( !fixed ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		free(plan);
+		return NULL;
+	}
+
+	next = fixed;
+	for ( op = plan; op->op != EXPAND_END; op++ ) {
+		uint32_t src, dst, len;
+		if ( op->op != EXPAND_COPY ) {
+			*next++ = *op;
+			continue;
+		}
+		src = op->src;
+		dst = op->dst;
+		len = op->arg;
+		while ( len ) {
+			uint32_t size;
+			uint16_t type;
+			if ( len >= 16 ) {
+				size = 16;
+				type = EXPAND_COPY128;
+			} else if ( len >= 8 ) {
+				size = 8;
+				type = EXPAND_COPY64;
+			} else if ( len >= 4 ) {
+				size = 4;
+				type = EXPAND_COPY32;
+			} else if ( len >= 2 ) {
+				size = 2;
+				type = EXPAND_COPY16;
+			} else {
+				size = 1;
+				type = EXPAND_COPY8;
+			}
+			AddExpandOp(&next, type, src, dst, 0);
+			src += size;
+			dst += size;
+			len -= size;
+		}
+	}
+	free(plan);
+
+	return fixed;
+
+} // End of CompileExpandPlan
+
+/*
+ * Cost model of the expansion in units of about 0.5ns, fitted to the maps of CheckExpandPlan()
+ * in nftest -b. A step of the switch over the extensions is cheaper than an operation of the
+ * plan, and the conversions of counters and IPv4 addresses cost more than plain copies.
+ * The plan pays only, if merging saves most of the steps, e.g. for maps with adjacent 
+ * extensions of 64bit fields only.
+ */
+#define EXPAND_COST_SWITCH	4	// setup of the switch and per extension
+#define EXPAND_COST_PLAN	4	// setup of the plan
+#define EXPAND_COST_COPY	6	// copy operation
+#define EXPAND_COST_CONVERT	9	// conversion operation
+
+int UseExpandPlan(extension_map_t *map, expand_op_t *plan) {
+uint32_t extensions, switch_cost, plan_cost;
+
+	extensions = 0;
+	while ( map->ex_id[extensions] ) 
+		extensions++;
+	switch_cost = EXPAND_COST_SWITCH * (extensions + 1);
+
+	plan_cost = EXPAND_COST_PLAN;
+	while ( plan->op != EXPAND_END ) {
+		switch (plan->op) {
+			case EXPAND_U16_32:
+			case EXPAND_U32_64:
+			case EXPAND_IPV4:
+				plan_cost += EXPAND_COST_CONVERT;
+				break;
+			default:
+				plan_cost += EXPAND_COST_COPY;
+		}
+		plan++;
+	}
+
+	return plan_cost < switch_cost;
+
+} // End of UseExpandPlan
+
+// fields of the master record written by an operation of the plan
+static uint64_t ExpandOpFields(expand_op_t *op) {
+uint64_t fields;
+uint32_t size, word;
+
+	switch (op->op) {
+		case EXPAND_COPY8:
+			size = 1;
+			break;
+		case EXPAND_COPY16:
+			size = 2;
+			break;
+		case EXPAND_COPY32:
+			size = 4;
+			break;
+		case EXPAND_COPY64:
+			size = 8;
+			break;
+		case EXPAND_U16_32:
+			size = 4 * op->arg;
+			break;
+		case EXPAND_U32_64:
+			size = 8 * op->arg;
+			break;
+		default:
+			// EXPAND_COPY128, EXPAND_IPV4/6
+			size = 16;
+	}
+
+	fields = 0;
+	for ( word = op->dst / sizeof(uint64_t); word <= (op->dst + size - 1) / sizeof(uint64_t); word++ ) 
+		fields |= FieldBit(word);
+
+	return fields;
+
+} // End of ExpandOpFields
+
+// the operations of the plan, which write any of the fields but none of the skipped fields
+static expand_op_t *SelectExpandOps(expand_op_t *plan, uint64_t fields, uint64_t skip) {
+expand_op_t *selected, *op, *next;
+uint32_t num;
+
+	num = 1;
+	for ( op = plan; op->op != EXPAND_END; op++ ) 
+		num++;
+
+	selected = (expand_op_t *)calloc(num, sizeof(expand_op_t));
+	if ( !selected ) {
+		LogError("calloc() error in %s line %d: %s\n", __FILE__, __LINE__, strerror(errno) );
+		return NULL;
+	}
+
+	next = selected;
+	for ( op = plan; op->op != EXPAND_END; op++ ) {
+		uint64_t op_fields = ExpandOpFields(op);
+		if ( (op_fields & fields) && !(op_fields & skip) ) 
+			*next++ = *op;
+	}
+
+	return selected;
+
+} // End of SelectExpandOps
+
+/*
+ * Expand only the fields needed: the fields of the filter are expanded before filtering, the 
+ * fields of the processing for the matched records only - see BatchExpandRecord(). The 
+ * plans are compiled for the maps inserted after this call. Maps without a plan are still 
+ * fully expanded.
+ */
+void SetExpandProjection(uint64_t filter_fields, uint64_t process_fields) {
+
+	Projection	  = 1;
+	FilterFields  = filter_fields;
+	ProcessFields = process_fields;
+
+} // End of SetExpandProjection
@@ -948,12 +948,30 @@ typedef struct extension_descriptor_s {
 	char		*description;
 } extension_descriptor_t;
 
+/*
+ * Expansion plan of an extension map - see CompileExpandPlan(). The optional extensions of
+ * a record are copied into the master record by a list of operations, terminated by EXPAND_END.
+ */
+enum { EXPAND_END = 0, EXPAND_COPY8, EXPAND_COPY16, EXPAND_COPY32, EXPAND_COPY64, EXPAND_COPY128,
+	   EXPAND_U16_32, EXPAND_U32_64, EXPAND_IPV4, EXPAND_IPV6, 
+	   EXPAND_COPY };	// copy of any size - compile time only
+
+typedef struct expand_op_s {
+	uint16_t	op;
+	uint16_t	src;		// offset in the optional extensions of the record
+	uint16_t	dst;		// offset in the master record
+	uint16_t	arg;		// EXPAND_U16_32/U32_64: number of values, EXPAND_IPV4/6: address flag
+} expand_op_t;
+
 typedef struct extension_info_s {
 	struct extension_info_s *next;
 	extension_map_t	*map;
 	extension_map_t	*exportMap;
 	uint32_t		ref_count;
 	uint32_t		*offset_cache;
+	expand_op_t		*expand_plan;	// NULL: expand the extensions one by one
+	expand_op_t		*filter_plan;	// projection: fields of the filter
+	expand_op_t		*process_plan;	// projection: other fields of the matched records
 	master_record_t	master_record;
 } extension_info_t;
 
@@ -972,6 +990,12 @@ void PackExtensionMapList(extension_map_list_t *extension_map_list);
 
 int Insert_Extension_Map(extension_map_list_t *extension_map_list, extension_map_t *map);
 
+expand_op_t *CompileExpandPlan(extension_map_t *map);
+
+int UseExpandPlan(extension_map_t *map, expand_op_t *plan);
+
+void SetExpandProjection(uint64_t filter_fields, uint64_t process_fields);
+
 void SetupExtensionDescriptors(char *options);
 
 void PrintExtensionMap(extension_map_t *map);
@@ -448,6 +448,33 @@ int	i, index;
 
 } // End of format_special 
 
+/*
+ * Returns 1, if the compiled format prints only fields of the common record, the IP addresses
+ * and the counters of a flow. See SetCompactFlowTable()
+ */
+int FormatCommonOnly(void) {
+static string_function_t common_functions[] = {
+	String_FlowFlags, String_Version, String_FirstSeen, String_FirstSeenRaw, String_LastSeen, 
+	String_LastSeenRaw, String_Duration, String_ExpSysID, String_Protocol, String_SrcAddr,
+	String_DstAddr, String_SrcAddrPort, String_DstAddrPort, String_SrcPort, String_DstPort,
+	String_ICMP_type, String_ICMP_code, String_InPackets, String_OutPackets, String_InBytes,
+	String_OutBytes, String_Flows, String_Flags, String_Tos, String_SrcTos, String_FwdStatus,
+	String_BiFlowDir, String_FlowEndReason, String_bps, String_pps, String_bpp, NULL 
+};
+int i, j;
+
+	for ( i=0; i<token_index; i++ ) {
+		j = 0;
+		while ( common_functions[j] && common_functions[j] != token_list[i].string_function )
+			j++;
+		if ( common_functions[j] == NULL ) 
+			return 0;
+	}
+
+	return 1;
+
+} // End of FormatCommonOnly
+
 void text_prolog(void) {
 	printf("%s\n", header_string);
 } // End of text_prolog
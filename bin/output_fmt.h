@@ -56,6 +56,8 @@ int ParseOutputFormat(char *format, int printPlain, printmap_t *printmap);
 
 void format_special(void *record, char ** s, int tag);
 
+int FormatCommonOnly(void);
+
 #define TAG_CHAR ''
 
 #endif //_OUTPUT_FMT_H
@@ -350,6 +350,22 @@ nffile_t *nffile;
 
 } // End of SetupProfileChannels
 
+/* 
+ * Flush and close the output file of a channel. May be called by the writer thread 
+ * of the channel before CloseChannels().
+ */
+void CloseChannelFile(profile_channel_info_t *channel) {
+
+	if ( channel->nffile == NULL ) 
+		return;
+
+	if ( is_anonymized ) 
+		SetFlag(channel->nffile->file_header->flags, FLAG_ANONYMIZED);
+	CloseUpdateFile(channel->nffile, Ident);
+	channel->nffile = DisposeFile(channel->nffile);
+
+} // End of CloseChannelFile
+
 void CloseChannels (time_t tslot, int compress) {
 dirstat_t	*dirstat;
 struct stat fstat;
@@ -358,10 +374,7 @@ unsigned int num;
 	for ( num = 0; num < num_channels; num++ ) {
 		if ( profile_channels[num].ofile ) {
 
-			if ( is_anonymized ) 
-				SetFlag(profile_channels[num].nffile->file_header->flags, FLAG_ANONYMIZED);
-			CloseUpdateFile(profile_channels[num].nffile, Ident);
-			profile_channels[num].nffile = DisposeFile(profile_channels[num].nffile);
+			CloseChannelFile(&profile_channels[num]);
 
 			stat(profile_channels[num].ofile, &fstat);
 			ReadStatInfo(profile_channels[num].dirstat_path, &dirstat, CREATE_AND_LOCK);
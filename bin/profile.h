@@ -67,6 +67,8 @@ unsigned int InitChannels(char *profile_datadir, char *profile_statdir, profile_
 
 profile_channel_info_t	*GetChannelInfoList(void);
 
+void CloseChannelFile(profile_channel_info_t *channel);
+
 void CloseChannels (time_t tslot, int compress);
 
 void UpdateRRD( time_t tslot, profile_channel_info_t *channel );
@@ -51,6 +51,182 @@ diff -u test3.out nfdump.test.out
 diff test4.out nfdump.test.out > test4.diff || true
 diff test4.diff nfdump.test2.diff
 
+# block index test - same flows with and without skipping blocks
+./nfdump -r test.flows -O tstart -k -z -w test3.flows
+./nfdump -q -r test2.flows -o raw 'proto udp or port 22' > test6.out
+./nfdump -q -r test3.flows -o raw 'proto udp or port 22' > test7.out
+diff -u test6.out test7.out
+./nfdump -q -r test2.flows -o raw -t 2004/07/11.10:31:00-2004/07/11.10:35:00 > test6.out
+./nfdump -q -r test3.flows -o raw -t 2004/07/11.10:31:00-2004/07/11.10:35:00 > test7.out
+diff -u test6.out test7.out
+
+# read ahead test - same flows with blocks read and decompressed in a background thread
+# double the test flows until the file holds several data blocks
+cp test.flows test8.flows
+mkdir -p test.big
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	cp test8.flows test.big/a.flows
+	cp test8.flows test.big/b.flows
+	./nfdump -R test.big -y -w test8.flows
+done
+./nfdump -q -r test8.flows -o raw > test6.out
+./nfdump -q -r test8.flows -Q 4 -o raw > test7.out
+diff -u test6.out test7.out
+./nfdump -q -r test.flows -Q 1 -o raw > test6.out
+diff -u test6.out nfdump.test.out
+./nfdump -q -r test2.flows -o raw 'proto udp or port 22' > test6.out
+./nfdump -q -r test2.flows -Q 2 -o raw 'proto udp or port 22' > test7.out
+diff -u test6.out test7.out
+cp test.flows test.big/a.flows
+cp test2.flows test.big/b.flows
+./nfdump -q -R test.big -o raw > test6.out
+./nfdump -q -R test.big -Q 2 -o raw > test7.out
+diff -u test6.out test7.out
+rm -rf test.big
+
+# compression worker test - same flows with blocks compressed by a pool of threads
+for c in "" -z -y -j; do
+	./nfdump -r test8.flows $c -w test4.flows
+	./nfdump -r test8.flows $c -W 4 -w test5.flows
+	./nfdump -q -r test4.flows -o raw > test6.out
+	./nfdump -q -r test5.flows -o raw > test7.out
+	diff -u test6.out test7.out
+done
+
+# raw block test - without -U files keep layout version 1, layout version 3 files are read as well
+./nfdump -r test8.flows -z -w test4.flows
+./nfdump -v test4.flows | grep -q 'Version : 1 '
+./nfdump -r test8.flows -z -U -w test5.flows
+./nfdump -q -r test5.flows -o raw > test7.out
+diff -u test6.out test7.out
+printf '\003' | dd of=test4.flows bs=1 seek=2 conv=notrunc 2>/dev/null
+./nfdump -v test4.flows | grep -q 'Version : 3 '
+./nfdump -q -r test4.flows -o raw > test7.out
+diff -u test6.out test7.out
+
+# mmap reader test - same flows as read(), bz2 falls back to read()
+for c in "" -j -y; do
+	./nfdump -r test8.flows $c -w test4.flows
+	./nfdump -q -r test4.flows -o raw > test6.out
+	./nfdump -q -r test4.flows -Y -o raw > test7.out
+	diff -u test6.out test7.out
+done
+./nfdump -q -r test4.flows -o raw 'proto udp or port 22' > test6.out
+./nfdump -q -r test4.flows -Y -o raw 'proto udp or port 22' > test7.out
+diff -u test6.out test7.out
+
+# nfprofile channel writer test - same channel files with and without writer threads
+if [ -x ./nfprofile ]; then
+	rm -rf tmp/profiles
+	for ch in tcp udp any none; do
+		mkdir -p tmp/profiles/live/test/$ch
+	done
+	echo 'proto tcp' > tmp/profiles/live/test/tcp-filter.txt
+	echo 'proto udp or port 22' > tmp/profiles/live/test/udp-filter.txt
+	echo 'any' > tmp/profiles/live/test/any-filter.txt
+	echo 'port 1' > tmp/profiles/live/test/none-filter.txt
+	for c in "" -z; do
+		for w in 0 3; do
+			printf 'live#test#0#tcp#\nlive#test#0#udp#\nlive#test#0#any#\nlive#test#0#none#\n' | \
+				./nfprofile -I -p `pwd`/tmp/profiles -W $w $c -r `pwd`/test8.flows -t 1089534600 > /dev/null 2>&1
+			for ch in tcp udp any none; do
+				./nfdump -q -r tmp/profiles/live/test/$ch/test8.flows -o raw > tmp/profiles/$ch.$w.out
+			done
+		done
+		for ch in tcp udp any none; do
+			diff -u tmp/profiles/$ch.0.out tmp/profiles/$ch.3.out
+		done
+	done
+	./nfdump -q -r test8.flows -o raw > test6.out
+	diff -u test6.out tmp/profiles/any.3.out
+	rm -rf tmp/profiles
+fi
+
+# block index test on several blocks - blocks outside the time window are skipped,
+# the first block is read for its extension maps, but its flows are skipped
+./nfdump -r test8.flows -O tstart -w test4.flows
+./nfdump -r test8.flows -O tstart -k -w test9.flows
+./nfdump -q -r test4.flows -o raw -t 2004/07/11.10:31:00-2004/07/11.10:35:00 > test6.out
+for o in "" "-Q 2" -Y "-P 2"; do
+	./nfdump -q -r test9.flows $o -o raw -t 2004/07/11.10:31:00-2004/07/11.10:35:00 > test7.out
+	diff -u test6.out test7.out
+	./nfdump -r test9.flows $o -t 2004/07/11.10:31:00-2004/07/11.10:35:00 | grep -q 'Blocks skipped: 3,'
+done
+
+# recompressed files keep their block index
+for c in 1 3 1 0; do
+	./nfdump -J $c -r test9.flows
+	./nfdump -q -r test9.flows -o raw -t 2004/07/11.10:31:00-2004/07/11.10:35:00 > test7.out
+	diff -u test6.out test7.out
+	./nfdump -r test9.flows -t 2004/07/11.10:31:00-2004/07/11.10:35:00 | grep -q 'Blocks skipped: 3,'
+done
+
+# zstd flow test - only if built with zstd
+if ./nfdump -r test.flows -G 3 -w test4.flows 2>/dev/null; then
+	./nfdump -q -r test4.flows -o raw > test6.out
+	diff -u test6.out nfdump.test.out
+	./nfdump -r test.flows -g test.dict
+	./nfdump -r test.flows -G 3:test.dict -w test4.flows
+	./nfdump -q -r test4.flows -o raw > test6.out
+	diff -u test6.out nfdump.test.out
+	rm -f test.dict
+fi
+
+# parallel query test - same output as processing the files one by one
+mkdir -p test.dir
+cp test.flows test.dir/a.flows
+cp test3.flows test.dir/b.flows
+./nfdump -q -R test.dir -o raw > test6.out
+./nfdump -q -R test.dir -P 2 -o raw > test7.out
+diff -u test6.out test7.out
+./nfdump -q -R test.dir -s srcip -s dstport/bytes > test6.out
+./nfdump -q -R test.dir -P 2 -s srcip -s dstport/bytes > test7.out
+diff -u test6.out test7.out
+./nfdump -q -R test.dir -b -o raw > test6.out
+./nfdump -q -R test.dir -P 2 -b -o raw > test7.out
+diff -u test6.out test7.out
+./nfdump -q -R test.dir -A srcip,dstport -s record/bytes > test6.out
+./nfdump -q -R test.dir -P 3 -A srcip,dstport -s record/bytes > test7.out
+diff -u test6.out test7.out
+rm -rf test.dir
+
+# approximate stat test - exact counters as long as the counters hold all elements
+./nfdump -q -r test.flows -s srcip -s dstport/bytes -s proto/packets > test6.out
+for e in 19 1000; do
+	./nfdump -q -r test.flows -e $e -s srcip -s dstport/bytes -s proto/packets > test7.out
+	diff -u test6.out test7.out
+done
+./nfdump -r test.flows -e 1000 -s srcip | grep -q 'Approximate stat: 1000 counters, 19 distinct Src IP Addr, exact counters'
+./nfdump -r test.flows -e 4 -s srcip | grep -q 'Approximate stat: 4 counters, ~19 distinct Src IP Addr (+/-0.8%), listed flows overestimated by at most [1-9]'
+
+# spill test - same aggregated flows with and without a memory limit
+mkdir -p test.tmp
+./nfdump -q -r test.flows -b -o raw > test6.out
+TMPDIR=test.tmp ./nfdump -q -r test.flows -C 1 -b -o raw > test7.out
+diff -u test6.out test7.out
+./nfdump -q -r test.flows -A srcip,dstport -O bytes > test6.out
+TMPDIR=test.tmp ./nfdump -q -r test.flows -C 1 -A srcip,dstport -O bytes > test7.out
+diff -u test6.out test7.out
+rmdir test.tmp
+
+# compact aggregation records - same flows as the full records, written to a file
+./nfdump -r test.flows -b -w test4.flows
+./nfdump -q -r test4.flows -o extended > test6.out
+./nfdump -q -r test.flows -b -o extended > test7.out
+diff -u test6.out test7.out
+
+# field projection - filter and statistics on extension fields same as on the written flows
+./nfdump -r test.flows -w test5.flows 'src as 775 and in if 12'
+./nfdump -q -r test.flows -A srcas,dstas,inif,outif -o extended 'src as 775 and in if 12' > test6.out
+./nfdump -q -r test5.flows -A srcas,dstas,inif,outif -o extended > test7.out
+diff -u test6.out test7.out
+./nfdump -q -r test.flows -s dstas/bytes -s outif 'src as 775 and in if 12' > test6.out
+./nfdump -q -r test5.flows -s dstas/bytes -s outif > test7.out
+diff -u test6.out test7.out
+./nfdump -q -r test.flows -o raw 'src as 775 and in if 12' > test6.out
+./nfdump -q -r test5.flows -o raw > test7.out
+diff -u test6.out test7.out
+
 
 # uncompressed flow test
 rm -f test.flows test2.out
@@ -95,6 +271,32 @@ fi
 diff test5.out nfdump.test.out > test5.diff || true
 diff test5.diff nfdump.test.diff
 
+# Same replay into nfcapd with compression workers
+mkdir tmp/w
+echo -n Starting nfcapd -W 4 ...
+./nfcapd -p 65530 -T '*' -l tmp/w -z -W 4 -D -P tmp/w/pidfile
+sleep 1
+echo done.
+echo -n Replay flows ...
+./nfreplay -r test.flows -v9 -H 127.0.0.1 -p 65530
+echo done.
+sleep 1 
+
+echo -n Terminate nfcapd ...
+kill -TERM `cat tmp/w/pidfile`;
+sleep 1
+echo done.
+
+if [ -f tmp/w/pidfile ]; then
+	echo nfcapd does not terminate
+	exit
+fi
+
+./nfdump -r tmp/w/nfcapd.* -q -o raw | grep -v 'received at' > test6.out
+diff -u test5.out test6.out
+rm -f tmp/w/nfcapd.*
+rmdir tmp/w
+
 mkdir memck.$$
 # OpenBSD
 export MALLOC_OPTIONS=AFGJS